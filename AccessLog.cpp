@@ -0,0 +1,302 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "AccessLog.h"
+#include "Log.h"
+
+static_assert(sizeof(AccessLog::FileHeader) == AccessLog::RECORD_SIZE, "the header takes one record");
+static_assert(sizeof(AccessLog::Record) == AccessLog::RECORD_SIZE, "the records are fixed size");
+static_assert(sizeof(AccessLog::PathRecord) == AccessLog::RECORD_SIZE, "the records are fixed size");
+
+// the paths cached by a thread before the cache is cleared
+static const size_t THREAD_PATHS = 4096;
+
+size_t AccessLog::file_size_ = 64 << 20;
+unsigned AccessLog::keep_files_ = 4;
+atomic<bool> AccessLog::enabled_(false);
+thread_local AccessLog::ThreadBuffer* AccessLog::buffer_ = nullptr;
+MutexLock AccessLog::buffers_lock_;
+vector<AccessLog::ThreadBuffer*> AccessLog::buffers_;
+MutexLock AccessLog::paths_lock_;
+unordered_map<string, uint32_t> AccessLog::path_ids_;
+vector<string> AccessLog::paths_;
+MutexLock AccessLog::file_lock_;
+string AccessLog::path_;
+int AccessLog::fd_ = -1;
+char* AccessLog::map_ = nullptr;
+AccessLog::FileHeader* AccessLog::header_ = nullptr;
+uint32_t AccessLog::generation_ = 0;
+vector<uint32_t> AccessLog::defined_in_;
+
+int64_t AccessLog::toWallClock(int64_t monotonic_us)
+{
+    timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t mono_us = static_cast<int64_t>(mono.tv_sec) * 1000000 + mono.tv_nsec / 1000;
+    int64_t real_us = static_cast<int64_t>(real.tv_sec) * 1000000 + real.tv_nsec / 1000;
+    return real_us - (mono_us - monotonic_us);
+}
+
+bool AccessLog::open(const string& path)
+{
+    MutexLockGuard guard(file_lock_);
+    path_ = path;
+    // The records of the last run are kept as a rotated file
+    if(access(path_.c_str(), F_OK) == 0)
+        rotate();
+    else if(!openFile())
+        return false;
+    if(!map_)
+        return false;
+    {
+        MutexLockGuard paths_guard(paths_lock_);
+        if(paths_.empty())
+            paths_.emplace_back();      // PATH_NONE
+    }
+    enabled_ = true;
+    INFO("Access log %s, %ld MB per file, %u rotated files kept", path_.c_str(), file_size_ >> 20, keep_files_);
+    return true;
+}
+
+void AccessLog::close()
+{
+    // The requests finished from now on are not logged, the buffered ones are written
+    if(!enabled_.exchange(false))
+        return;
+    flush();
+    MutexLockGuard guard(file_lock_);
+    finishFile();
+}
+
+/**
+ * @brief Create the file of path_ and map it, the file lock is held
+ */
+bool AccessLog::openFile()
+{
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd_ == -1)
+    {
+        ERROR("Open access log %s failed! (%s)", path_.c_str(), strerror(errno));
+        return false;
+    }
+    if(ftruncate(fd_, static_cast<off_t>(file_size_)) == -1)
+    {
+        ERROR("Resize access log %s failed! (%s)", path_.c_str(), strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    void* addr = mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if(addr == MAP_FAILED)
+    {
+        ERROR("Map access log %s failed! (%s)", path_.c_str(), strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    map_ = static_cast<char*>(addr);
+    header_ = reinterpret_cast<FileHeader*>(map_);
+    memcpy(header_->magic, magic(), sizeof(header_->magic));
+    header_->version = VERSION;
+    header_->record_size = RECORD_SIZE;
+    header_->used = 0;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header_->created_us = static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+    header_->pid = getpid();
+    // The paths are defined again in the new file
+    ++generation_;
+    return true;
+}
+
+/**
+ * @brief Unmap the file and cut off its unused end, the file lock is held
+ */
+void AccessLog::finishFile()
+{
+    if(!map_)
+        return;
+    off_t end = static_cast<off_t>(sizeof(FileHeader) + header_->used);
+    munmap(map_, file_size_);
+    map_ = nullptr;
+    header_ = nullptr;
+    if(ftruncate(fd_, end) == -1)
+        WARN("Truncate access log %s failed! (%s)", path_.c_str(), strerror(errno));
+    ::close(fd_);
+    fd_ = -1;
+}
+
+/**
+ * @brief <path> -> <path>.1 -> <path>.2 ..., and start a new file, the file lock is held
+ */
+void AccessLog::rotate()
+{
+    finishFile();
+    if(keep_files_ > 0)
+    {
+        for(unsigned i = keep_files_ - 1; i > 0; i--)
+            rename((path_ + "." + to_string(i)).c_str(), (path_ + "." + to_string(i + 1)).c_str());
+        if(rename(path_.c_str(), (path_ + ".1").c_str()) == -1)
+            WARN("Rotate access log %s failed! (%s)", path_.c_str(), strerror(errno));
+    }
+    if(openFile())
+        INFO("Access log %s rotated", path_.c_str());
+}
+
+void AccessLog::fillPeer(const sockaddr* addr, Record* record)
+{
+    memset(record->addr, 0, sizeof(record->addr));
+    record->port = 0;
+    if(addr->sa_family == AF_INET)
+    {
+        const sockaddr_in* addr4 = reinterpret_cast<const sockaddr_in*>(addr);
+        memcpy(record->addr, &addr4->sin_addr, 4);
+        record->port = ntohs(addr4->sin_port);
+    }
+    else if(addr->sa_family == AF_INET6)
+    {
+        const sockaddr_in6* addr6 = reinterpret_cast<const sockaddr_in6*>(addr);
+        if(IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+            memcpy(record->addr, addr6->sin6_addr.s6_addr + 12, 4);
+        else
+        {
+            memcpy(record->addr, addr6->sin6_addr.s6_addr, 16);
+            record->flags |= FLAG_IPV6;
+        }
+        record->port = ntohs(addr6->sin6_port);
+    }
+}
+
+AccessLog::ThreadBuffer* AccessLog::getBuffer()
+{
+    if(buffer_)
+        return buffer_;
+    ThreadBuffer* buffer = new ThreadBuffer;
+    buffer->size = 0;
+    {
+        MutexLockGuard guard(buffers_lock_);
+        buffers_.push_back(buffer);
+    }
+    buffer_ = buffer;
+    return buffer;
+}
+
+uint32_t AccessLog::intern(ThreadBuffer* buffer, const char* path, size_t len)
+{
+    if(len == 0)
+        return PATH_NONE;
+    string key(path, min(len, static_cast<size_t>(MAX_PATH_LEN)));
+    auto iter = buffer->paths.find(key);
+    if(iter != buffer->paths.end())
+        return iter->second;
+
+    uint32_t id;
+    {
+        MutexLockGuard guard(paths_lock_);
+        auto global = path_ids_.find(key);
+        if(global != path_ids_.end())
+            id = global->second;
+        else if(paths_.size() >= MAX_PATHS)
+            id = PATH_OTHER;
+        else
+        {
+            id = static_cast<uint32_t>(paths_.size());
+            paths_.push_back(key);
+            path_ids_.emplace(key, id);
+        }
+    }
+    if(buffer->paths.size() >= THREAD_PATHS)
+        buffer->paths.clear();
+    buffer->paths.emplace(move(key), id);
+    return id;
+}
+
+void AccessLog::append(Record* record, const char* path, size_t path_len)
+{
+    ThreadBuffer* buffer = getBuffer();
+    record->type = RECORD_REQUEST;
+    record->reserved = 0;
+    MutexLockGuard guard(buffer->lock);
+    record->path_id = intern(buffer, path, path_len);
+    buffer->records[buffer->size++] = *record;
+    if(buffer->size == BUFFER_RECORDS)
+        flushBuffer(buffer);
+}
+
+void AccessLog::flush()
+{
+    vector<ThreadBuffer*> buffers;
+    {
+        MutexLockGuard guard(buffers_lock_);
+        buffers = buffers_;
+    }
+    for(ThreadBuffer* buffer : buffers)
+    {
+        MutexLockGuard guard(buffer->lock);
+        flushBuffer(buffer);
+    }
+}
+
+/**
+ * @brief Copy the records of the buffer into the file, the lock of the buffer is held
+ */
+void AccessLog::flushBuffer(ThreadBuffer* buffer)
+{
+    if(buffer->size == 0)
+        return;
+    MutexLockGuard guard(file_lock_);
+    // A batch always fits in a new file, so it is rotated at most once
+    string defs;
+    for(int round = 0; map_ && round < 2; round++)
+    {
+        // The paths new to this file are defined before the records
+        defs.clear();
+        {
+            MutexLockGuard paths_guard(paths_lock_);
+            for(size_t i = 0; i < buffer->size; i++)
+            {
+                uint32_t id = buffer->records[i].path_id;
+                if(id == PATH_NONE || id == PATH_OTHER)
+                    continue;
+                if(defined_in_.size() <= id)
+                    defined_in_.resize(paths_.size(), 0);
+                if(defined_in_[id] == generation_)
+                    continue;
+                defined_in_[id] = generation_;
+
+                const string& path = paths_[id];
+                PathRecord def;
+                memset(&def, 0, sizeof(def));
+                def.type = RECORD_PATH;
+                def.len = static_cast<uint16_t>(path.size());
+                def.path_id = id;
+                defs.append(reinterpret_cast<const char*>(&def), sizeof(def));
+                defs.append(path);
+                defs.append((RECORD_SIZE - path.size() % RECORD_SIZE) % RECORD_SIZE, '\0');
+            }
+        }
+        size_t need = defs.size() + buffer->size * RECORD_SIZE;
+        if(header_->used + need <= file_size_ - sizeof(FileHeader))
+        {
+            char* pos = map_ + sizeof(FileHeader) + header_->used;
+            memcpy(pos, defs.data(), defs.size());
+            memcpy(pos + defs.size(), buffer->records, buffer->size * RECORD_SIZE);
+            header_->used += need;
+            break;
+        }
+        rotate();
+    }
+    // The records are dropped if no file could be created
+    buffer->size = 0;
+}
@@ -0,0 +1,175 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_ACCESSLOG_H
+#define WEBSERVER_ACCESSLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The binary access log, one fixed size record of every request, decoded by tools/AccessLogDump
+ *
+ * The records are collected in a buffer of every thread and copied into the log file in batches, the
+ * file is mapped and written in place. When it is full, it is truncated to its records and rotated as
+ * <path>.1, <path>.2 ..., a new file of the same size is started. The buffers are also flushed by the
+ * event loop every second, so a quiet server still writes its records.
+ *
+ * The request paths are interned, a record holds the id of its path. A path is defined in every file
+ * before the first record using it, so every file can be decoded alone.
+ *
+ * The workers write their own files, <path>.w<slot>.
+ */
+class AccessLog
+{
+public:
+    static const char* magic() { return "WSACCLOG"; }
+    static const uint32_t VERSION = 1;
+    static const size_t RECORD_SIZE = 64;
+    // the records of a thread buffer
+    static const size_t BUFFER_RECORDS = 64;
+    // the longer paths are truncated
+    static const size_t MAX_PATH_LEN = 1024;
+    // the distinct paths interned, the others are logged as PATH_OTHER
+    static const size_t MAX_PATHS = 65536;
+    // the request ended before its request line
+    static const uint32_t PATH_NONE = 0;
+    static const uint32_t PATH_OTHER = 0xffffffff;
+
+    enum RECORD_TYPE
+    {
+        RECORD_EMPTY    = 0,        // the unwritten end of a file
+        RECORD_REQUEST  = 1,
+        RECORD_PATH     = 2,        // a PathRecord, the path follows in the next records
+    };
+
+    enum RECORD_FLAG
+    {
+        FLAG_HTTP10     = 1 << 0,
+        FLAG_HTTP2      = 1 << 1,
+        FLAG_TLS        = 1 << 2,
+        FLAG_KEEPALIVE  = 1 << 3,   // the connection was kept for the next request
+        FLAG_IPV6       = 1 << 4,
+        FLAG_ABORTED    = 1 << 5,   // the connection was closed before the response was done
+    };
+
+    // the methods are the METHOD_TYPE of HttpHandler
+    enum RECORD_METHOD { RECORD_GET = 0, RECORD_POST, RECORD_HEAD, RECORD_OTHER };
+
+    struct FileHeader
+    {
+        char magic[8];              // "WSACCLOG"
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t used;              // the bytes of the records after the header
+        int64_t created_us;         // CLOCK_REALTIME
+        int32_t pid;
+        char reserved[28];
+    };
+
+    struct Record
+    {
+        uint8_t type;
+        uint8_t method;             // RECORD_METHOD
+        uint8_t flags;              // RECORD_FLAG
+        uint8_t reserved;
+        uint16_t status;            // 0 if no response was started
+        uint16_t port;              // the peer port
+        uint32_t path_id;
+        uint32_t total_us;          // from the first byte of the request to the last byte of the response
+        int64_t time_us;            // the first byte of the request, CLOCK_REALTIME
+        uint8_t addr[16];           // IPv4 in the first 4 bytes
+        uint64_t bytes_in;          // read from the client
+        uint64_t bytes_out;         // written to the client, the headers included
+        uint32_t read_us;           // the request line and the headers
+        uint32_t handle_us;         // from the headers to the response headers, the body and the CGI included
+    };
+
+    struct PathRecord
+    {
+        uint8_t type;
+        uint8_t reserved;
+        uint16_t len;               // the path takes (len + RECORD_SIZE - 1) / RECORD_SIZE records after it
+        uint32_t path_id;
+        char reserved2[56];
+    };
+
+    // the size of every file, and the rotated files kept, 0 keeps none
+    static void setFileSize(size_t size)    { file_size_ = size; }
+    static void setKeepFiles(unsigned keep) { keep_files_ = keep; }
+
+    /**
+     * @brief Start the log of this process, an existing file is rotated first
+     * @return false if the file can not be created
+     */
+    static bool open(const string& path);
+    // flush every thread and finish the file
+    static void close();
+    static bool isEnabled() { return enabled_.load(memory_order_relaxed); }
+
+    // the CLOCK_REALTIME of a time of Trace::now(), in microseconds
+    static int64_t toWallClock(int64_t monotonic_us);
+
+    /**
+     * @brief Fill the address and the port of the record from the peer, sets FLAG_IPV6
+     */
+    static void fillPeer(const sockaddr* addr, Record* record);
+
+    /**
+     * @brief Queue a finished request into the buffer of this thread
+     * @param path  the request path, without the query
+     */
+    static void append(Record* record, const char* path, size_t path_len);
+
+    // copy the buffers of all the threads into the file, called by the event loop every second
+    static void flush();
+
+private:
+    struct ThreadBuffer
+    {
+        MutexLock lock;             // only taken against flush()
+        Record records[BUFFER_RECORDS];
+        size_t size;
+        unordered_map<string, uint32_t> paths;  // a cache of the interned paths
+    };
+
+    static uint32_t intern(ThreadBuffer* buffer, const char* path, size_t len);
+    static ThreadBuffer* getBuffer();
+    static void flushBuffer(ThreadBuffer* buffer);
+    static bool openFile();
+    static void finishFile();
+    static void rotate();
+
+    static size_t file_size_;
+    static unsigned keep_files_;
+    static atomic<bool> enabled_;       // read by the connection threads, cleared by close()
+    static thread_local ThreadBuffer* buffer_;
+    static MutexLock buffers_lock_;
+    static vector<ThreadBuffer*> buffers_;
+
+    // the interned paths, the index is the id
+    static MutexLock paths_lock_;
+    static unordered_map<string, uint32_t> path_ids_;
+    static vector<string> paths_;
+
+    // the file, guarded by file_lock_
+    static MutexLock file_lock_;
+    static string path_;
+    static int fd_;
+    static char* map_;
+    static FileHeader* header_;
+    static uint32_t generation_;            // counts the files
+    static vector<uint32_t> defined_in_;    // the generation a path was last defined in
+};
+
+#endif //WEBSERVER_ACCESSLOG_H
@@ -0,0 +1,134 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Bundle.h"
+#include "Log.h"
+
+const char* Bundle::base_ = nullptr;
+size_t Bundle::size_ = 0;
+int Bundle::fd_ = -1;
+const Bundle::Entry* Bundle::slots_ = nullptr;
+uint32_t Bundle::slot_num_ = 0;
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/**
+ * @brief Copy the file into an anonymous shared mapping of huge pages,
+ *        use the transparent huge pages if no page is reserved for MAP_HUGETLB
+ */
+// the huge page copy is mapped in whole huge pages
+static size_t hugePageMapSize(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+static char* loadHugePages(int fd, size_t size)
+{
+    size_t map_size = hugePageMapSize(size);
+    void* addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(addr == MAP_FAILED)
+    {
+        WARN("No reserved huge pages for the bundle (%s), use the transparent huge pages", strerror(errno));
+        addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED)
+            return nullptr;
+        madvise(addr, map_size, MADV_HUGEPAGE);
+    }
+    char* buf = static_cast<char*>(addr);
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t len = pread(fd, buf + done, size - done, static_cast<off_t>(done));
+        if(len <= 0)
+        {
+            if(len == -1 && errno == EINTR)
+                continue;
+            munmap(addr, map_size);
+            return nullptr;
+        }
+        done += static_cast<size_t>(len);
+    }
+    mprotect(addr, map_size, PROT_READ);
+    return buf;
+}
+
+bool Bundle::open(const string& path, bool populate, bool hugepages)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        ERROR("Open bundle %s failed! (%s)", path.c_str(), strerror(errno));
+        if(fd != -1)
+            close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if(size < sizeof(FileHeader))
+    {
+        ERROR("Bundle %s is truncated", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    char* base;
+    if(hugepages)
+        base = loadHugePages(fd, size);
+    else
+    {
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+        base = (addr == MAP_FAILED) ? nullptr : static_cast<char*>(addr);
+    }
+    if(!base)
+    {
+        ERROR("Map bundle %s failed! (%s)", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(base);
+    if(memcmp(header->magic, magic(), sizeof(header->magic)) != 0 || header->version != VERSION
+       || header->file_size != size || header->slot_num == 0 || (header->slot_num & (header->slot_num - 1))
+       || sizeof(FileHeader) + sizeof(Entry) * header->slot_num > size)
+    {
+        ERROR("Bundle %s is invalid", path.c_str());
+        munmap(base, hugepages ? hugePageMapSize(size) : size);
+        close(fd);
+        return false;
+    }
+
+    base_ = base;
+    size_ = size;
+    slots_ = reinterpret_cast<const Entry*>(base + sizeof(FileHeader));
+    slot_num_ = header->slot_num;
+    // The bodies in huge pages are sent from the memory
+    if(hugepages)
+        close(fd);
+    else
+        fd_ = fd;
+    INFO("Bundle %s: %zu bytes, %u slots%s", path.c_str(), size, slot_num_, hugepages ? ", huge pages" : "");
+    return true;
+}
+
+const Bundle::Entry* Bundle::find(const char* path, size_t len)
+{
+    uint64_t hash = hashPath(path, len);
+    uint32_t mask = slot_num_ - 1;
+    for(uint32_t i = 0, pos = hash & mask; i < slot_num_; i++, pos = (pos + 1) & mask)
+    {
+        const Entry* entry = &slots_[pos];
+        if(entry->path_len == 0)
+            return nullptr;
+        if(entry->hash == hash && entry->path_len == len && memcmp(base_ + entry->path_off, path, len) == 0)
+            return entry;
+    }
+    return nullptr;
+}
@@ -0,0 +1,98 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_BUNDLE_H
+#define WEBSERVER_BUNDLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief The packed static asset bundle, built by tools/BundlePack from a www directory
+ *
+ * Layout of the file:
+ *   FileHeader | Entry[slot_num] | strings (paths, header fields, etags) | bodies
+ *
+ * The index is an open addressing hash table of the request paths, a slot with path_len 0 is empty.
+ * Every entry has an identity variant and an optional gzip variant, the header fields of a variant
+ * ("Content-Length", "Content-Type", "ETag"...) are rendered by the packer, and every body starts
+ * at a page boundary, so it can be sent with sendfile from the bundle fd.
+ */
+class Bundle
+{
+public:
+    static const uint32_t VERSION = 1;
+    static const size_t PAGE_SIZE = 4096;
+
+    enum VARIANT_TYPE { VARIANT_IDENTITY = 0, VARIANT_GZIP, VARIANT_NUM };
+
+    struct FileHeader
+    {
+        char magic[8];              // "WSBUNDLE"
+        uint32_t version;
+        uint32_t slot_num;          // power of 2
+        uint64_t file_size;
+    };
+
+    struct Variant
+    {
+        uint64_t body_off;
+        uint64_t body_len;
+        uint32_t fields_off;        // the header fields, every line ends with "\r\n"
+        uint32_t fields_len;        // 0 if the variant does not exist
+        uint32_t etag_off;          // the quoted etag
+        uint32_t etag_len;
+    };
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint32_t path_off;
+        uint32_t path_len;
+        Variant variants[VARIANT_NUM];
+    };
+
+    static const char* magic() { return "WSBUNDLE"; }
+
+    // FNV-1a, shared by the packer and the server
+    static uint64_t hashPath(const char* path, size_t len)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for(size_t i = 0; i < len; i++)
+        {
+            hash ^= static_cast<unsigned char>(path[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    /**
+     * @brief Map the bundle, call it before forking the workers
+     * @param populate   prefault the whole mapping with MAP_POPULATE
+     * @param hugepages  copy the bundle into huge pages, the bodies are sent from the memory instead of sendfile
+     */
+    static bool open(const string& path, bool populate, bool hugepages);
+    static bool isEnabled()     { return base_ != nullptr; }
+
+    /**
+     * @brief Find the path of a request, like "/index.html"
+     */
+    static const Entry* find(const char* path, size_t len);
+
+    static const char* at(uint64_t offset)  { return base_ + offset; }
+    // the fd for sendfile, -1 if the bodies are in huge pages
+    static int getFd()          { return fd_; }
+
+private:
+    static const char* base_;
+    static size_t size_;
+    static int fd_;
+    static const Entry* slots_;
+    static uint32_t slot_num_;
+};
+
+#endif //WEBSERVER_BUNDLE_H
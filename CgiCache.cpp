@@ -0,0 +1,218 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+#include "CgiCache.h"
+#include "Log.h"
+#include "Utils.h"
+
+map<string, int64_t> CgiCache::scripts_;
+size_t CgiCache::max_size_ = 16 * 1024 * 1024;
+MutexLock CgiCache::lock_;
+unordered_multimap<uint64_t, CgiCache::Ticket> CgiCache::table_;
+list<CgiCache::Ticket> CgiCache::lru_;
+size_t CgiCache::bytes_ = 0;
+atomic<uint64_t> CgiCache::hits_(0);
+atomic<uint64_t> CgiCache::misses_(0);
+atomic<uint64_t> CgiCache::coalesced_(0);
+
+bool CgiCache::addScript(const char* spec)
+{
+    const char* eq = strrchr(spec, '=');
+    if(!eq || eq == spec || spec[0] != '/' || !eq[1] || !isNumericStr(eq + 1))
+        return false;
+    int64_t seconds = atol(eq + 1);
+    if(seconds <= 0)
+        return false;
+    scripts_[string(spec, static_cast<size_t>(eq - spec))] = seconds * 1000;
+    return true;
+}
+
+int64_t CgiCache::getTtl(const char* script, size_t len)
+{
+    auto iter = scripts_.find(string(script, len));
+    return (iter != scripts_.end()) ? iter->second : 0;
+}
+
+uint64_t CgiCache::hashOf(const char* script, size_t script_len, const char* body, size_t body_len)
+{
+    hash<string_view> hasher;
+    uint64_t value = hasher(string_view(script, script_len));
+    return value ^ (hasher(string_view(body, body_len)) + 0x9e3779b97f4a7c15ULL + (value << 6) + (value >> 2));
+}
+
+CgiCache::LOOKUP CgiCache::lookup(const char* script, size_t script_len, int64_t ttl, const char* body,
+                                  size_t body_len, void* waiter, WakeFunc wake, Ticket* ticket)
+{
+    uint64_t hash = hashOf(script, script_len, body, body_len);
+    int64_t now = monotonicMs();
+    MutexLockGuard guard(lock_);
+    auto range = table_.equal_range(hash);
+    for(auto iter = range.first; iter != range.second; ++iter)
+    {
+        Ticket entry = iter->second;
+        if(entry->script.compare(0, string::npos, script, script_len) != 0
+           || entry->body.compare(0, string::npos, body, body_len) != 0)
+            continue;
+        if(entry->state.load() == Entry::STATE_RUNNING)
+        {
+            entry->waiters.emplace_back(waiter, wake);
+            coalesced_.fetch_add(1, memory_order_relaxed);
+            *ticket = entry;
+            return LOOKUP_WAIT;
+        }
+        if(entry->expires > now)
+        {
+            lru_.splice(lru_.begin(), lru_, entry->lru);
+            hits_.fetch_add(1, memory_order_relaxed);
+            *ticket = entry;
+            return LOOKUP_HIT;
+        }
+        // Expired, it is run again
+        remove(entry);
+        break;
+    }
+
+    misses_.fetch_add(1, memory_order_relaxed);
+    Ticket entry = make_shared<Entry>();
+    entry->script.assign(script, script_len);
+    entry->body.assign(body, body_len);
+    entry->hash = hash;
+    entry->output = make_shared<string>();
+    entry->expires = ttl;
+    entry->leader = waiter;
+    entry->cached = true;
+    table_.emplace(hash, entry);
+    *ticket = entry;
+    return LOOKUP_RUN;
+}
+
+CgiCache::LOOKUP CgiCache::check(Ticket* ticket)
+{
+    int state = (*ticket)->state.load();
+    if(state == Entry::STATE_READY)
+        return LOOKUP_HIT;
+    if(state == Entry::STATE_RUNNING)
+        return LOOKUP_WAIT;
+    ticket->reset();
+    return LOOKUP_RUN;
+}
+
+shared_ptr<const string> CgiCache::getOutput(const Ticket& ticket)
+{
+    return ticket->output;
+}
+
+bool CgiCache::isSettled(const Ticket& ticket)
+{
+    return ticket->state.load() != Entry::STATE_RUNNING;
+}
+
+bool CgiCache::capture(Ticket* ticket, const char* data, size_t len)
+{
+    Entry* entry = ticket->get();
+    if(entry->output->size() + len > max_size_ / 16)
+    {
+        release(ticket, entry->leader);
+        return false;
+    }
+    entry->output->append(data, len);
+    return true;
+}
+
+void CgiCache::complete(Ticket* ticket)
+{
+    Ticket entry;
+    entry.swap(*ticket);
+    int64_t now = monotonicMs();
+    MutexLockGuard guard(lock_);
+    // the TTL was kept in expires until the output is ready
+    entry->expires += now;
+    entry->output->shrink_to_fit();
+    if(entry->cached)
+    {
+        lru_.push_front(entry);
+        entry->lru = lru_.begin();
+        bytes_ += entry->bytes();
+        // Make room from the least recently used
+        while(bytes_ > max_size_ && !lru_.empty())
+            remove(lru_.back());
+    }
+    settle(entry, Entry::STATE_READY);
+}
+
+void CgiCache::release(Ticket* ticket, void* waiter)
+{
+    if(!*ticket)
+        return;
+    Ticket entry;
+    entry.swap(*ticket);
+    MutexLockGuard guard(lock_);
+    if(entry->state.load() != Entry::STATE_RUNNING)
+        return;
+    if(entry->leader == waiter)
+    {
+        remove(entry);
+        settle(entry, Entry::STATE_FAILED);
+        return;
+    }
+    auto& waiters = entry->waiters;
+    for(size_t i = 0; i < waiters.size(); i++)
+    {
+        if(waiters[i].first == waiter)
+        {
+            waiters.erase(waiters.begin() + static_cast<ptrdiff_t>(i));
+            break;
+        }
+    }
+}
+
+void CgiCache::remove(const Ticket& ticket)
+{
+    Entry* entry = ticket.get();
+    if(!entry->cached)
+        return;
+    entry->cached = false;
+    auto range = table_.equal_range(entry->hash);
+    for(auto iter = range.first; iter != range.second; ++iter)
+    {
+        if(iter->second.get() == entry)
+        {
+            table_.erase(iter);
+            break;
+        }
+    }
+    if(entry->state.load() == Entry::STATE_READY)
+    {
+        bytes_ -= entry->bytes();
+        lru_.erase(entry->lru);
+    }
+}
+
+/**
+ * The state is stored before the wakeups, a waiter reads it after arming its events
+ */
+void CgiCache::settle(const Ticket& ticket, Entry::STATE state)
+{
+    ticket->state.store(state);
+    for(auto& waiter : ticket->waiters)
+        waiter.second(waiter.first);
+    ticket->waiters.clear();
+}
+
+size_t CgiCache::getEntries()
+{
+    MutexLockGuard guard(lock_);
+    return lru_.size();
+}
+
+size_t CgiCache::getBytes()
+{
+    MutexLockGuard guard(lock_);
+    return bytes_;
+}
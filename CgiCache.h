@@ -0,0 +1,130 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_CGICACHE_H
+#define WEBSERVER_CGICACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The outputs of the CGI scripts given by --cgi-cache, by the script and the request body
+ *
+ * The first request of a key runs the CGI as the leader, and its output is copied here while it is
+ * relayed. The same requests coming meanwhile wait for the leader instead of forking, and are answered
+ * from the output when it finishes. If the leader fails, like a timeout, an output too large or an
+ * aborted client, the waiters run the CGI by themselves.
+ *
+ * An output is kept for the TTL of its script, the least recently used ones are dropped beyond the max
+ * size. The cache is per process, a body with chunked framing or over MAX_BODY_SIZE is never cached.
+ */
+class CgiCache
+{
+public:
+    // the max request body of a cached request, the body is part of the key
+    static const size_t MAX_BODY_SIZE = 64 * 1024;
+
+    enum LOOKUP
+    {
+        LOOKUP_HIT,         // the output is ready
+        LOOKUP_WAIT,        // another request is running the CGI, wait for the wakeup
+        LOOKUP_RUN          // run the CGI, as the leader if the ticket is set
+    };
+
+    struct Entry;
+    // a request holds its entry until it is answered, even if the entry is dropped meanwhile
+    typedef shared_ptr<Entry> Ticket;
+    // called once the leader finished, under the lock of the cache, it must not block
+    typedef void (*WakeFunc)(void* waiter);
+
+    /**
+     * @param spec  "<path>=<seconds>", the path of the script under www_dir like "/report.sh"
+     * @return false if the spec is invalid
+     */
+    static bool addScript(const char* spec);
+    static bool isEnabled()                     { return !scripts_.empty(); }
+    // the max bytes of the outputs, an output over 1/16 of it is not cached
+    static void setMaxSize(size_t size)         { max_size_ = size; }
+    // the TTL of the script in ms, 0 if its outputs are not cached
+    static int64_t getTtl(const char* script, size_t len);
+
+    /**
+     * @brief Find the output of the request, or join the leader running it, or become the leader
+     * @param ticket    the entry of LOOKUP_WAIT and of the leader of LOOKUP_RUN
+     */
+    static LOOKUP lookup(const char* script, size_t script_len, int64_t ttl, const char* body, size_t body_len,
+                         void* waiter, WakeFunc wake, Ticket* ticket);
+    // the state of a waited ticket: LOOKUP_RUN without ticket if the leader failed
+    static LOOKUP check(Ticket* ticket);
+    // the output of a LOOKUP_HIT, not changed any more
+    static shared_ptr<const string> getOutput(const Ticket& ticket);
+    // a waited entry is ready or failed, read without the lock, see HttpHandler::rearmEvents()
+    static bool isSettled(const Ticket& ticket);
+
+    /**
+     * @brief Copy a part of the output of the leader
+     * @return false if the output is too large, the entry failed and the ticket is released
+     */
+    static bool capture(Ticket* ticket, const char* data, size_t len);
+    // the leader finished the output, the waiters are woken
+    static void complete(Ticket* ticket);
+    // the request is done with the ticket, a leader before complete() fails the entry
+    static void release(Ticket* ticket, void* waiter);
+
+    static uint64_t getHits()       { return hits_.load(memory_order_relaxed); }
+    static uint64_t getMisses()     { return misses_.load(memory_order_relaxed); }
+    static uint64_t getCoalesced()  { return coalesced_.load(memory_order_relaxed); }
+    static size_t getEntries();
+    static size_t getBytes();
+
+    struct Entry
+    {
+        enum STATE { STATE_RUNNING, STATE_READY, STATE_FAILED };
+
+        string script;
+        string body;
+        uint64_t hash;
+        atomic<int> state;
+        shared_ptr<string> output;      // written by the leader only until it is ready
+        int64_t expires;                // by monotonicMs()
+        void* leader;
+        vector<pair<void*, WakeFunc>> waiters;
+        bool cached;                    // in the table
+        list<Ticket>::iterator lru;     // of a ready entry
+
+        Entry() : hash(0), state(STATE_RUNNING), expires(0), leader(nullptr), cached(false) {}
+        size_t bytes() const            { return script.size() + body.size() + output->size(); }
+    };
+
+private:
+    static map<string, int64_t> scripts_;
+    static size_t max_size_;
+
+    static MutexLock lock_;
+    static unordered_multimap<uint64_t, Ticket> table_;
+    static list<Ticket> lru_;           // the ready entries, the most recent first
+    static size_t bytes_;
+
+    static atomic<uint64_t> hits_;
+    static atomic<uint64_t> misses_;
+    static atomic<uint64_t> coalesced_;
+
+    static uint64_t hashOf(const char* script, size_t script_len, const char* body, size_t body_len);
+    // the lock is held
+    static void remove(const Ticket& ticket);
+    static void settle(const Ticket& ticket, Entry::STATE state);
+};
+
+#endif //WEBSERVER_CGICACHE_H
@@ -0,0 +1,93 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cstdlib>
+#include <new>
+
+#include "Coroutine.h"
+
+atomic<size_t> FramePool::live_frames_(0);
+atomic<size_t> FramePool::pooled_bytes_(0);
+thread_local FramePool::LocalPool FramePool::local_pool_;
+MutexLock FramePool::pool_lock_;
+vector<void*> FramePool::pool_[FramePool::CLASSES];
+
+FramePool::LocalPool::~LocalPool()
+{
+    MutexLockGuard guard(pool_lock_);
+    for(size_t index = 0; index < CLASSES; index++)
+    {
+        for(size_t i = 0; i < size[index]; i++)
+        {
+            if(pool_[index].size() < MAX_POOL_FRAMES)
+                pool_[index].push_back(frames[index][i]);
+            else
+            {
+                ::operator delete(frames[index][i]);
+                pooled_bytes_.fetch_sub(MIN_CLASS << index, memory_order_relaxed);
+            }
+        }
+        size[index] = 0;
+    }
+}
+
+size_t FramePool::classOf(size_t size)
+{
+    size_t index = 0;
+    for(size_t class_size = MIN_CLASS; class_size < size && index < CLASSES; class_size <<= 1)
+        ++index;
+    return index;
+}
+
+void* FramePool::allocate(size_t size)
+{
+    live_frames_.fetch_add(1, memory_order_relaxed);
+    size_t index = classOf(size);
+    if(index == CLASSES)
+        return ::operator new(size);
+
+    size_t class_size = MIN_CLASS << index;
+    void* frame = nullptr;
+    if(local_pool_.size[index] > 0)
+        frame = local_pool_.frames[index][--local_pool_.size[index]];
+    else
+    {
+        MutexLockGuard guard(pool_lock_);
+        if(!pool_[index].empty())
+        {
+            frame = pool_[index].back();
+            pool_[index].pop_back();
+        }
+    }
+    if(!frame)
+        return ::operator new(class_size);
+    pooled_bytes_.fetch_sub(class_size, memory_order_relaxed);
+    return frame;
+}
+
+void FramePool::release(void* frame, size_t size)
+{
+    live_frames_.fetch_sub(1, memory_order_relaxed);
+    size_t index = classOf(size);
+    if(index == CLASSES)
+    {
+        ::operator delete(frame);
+        return;
+    }
+
+    size_t class_size = MIN_CLASS << index;
+    if(local_pool_.size[index] < LOCAL_FRAMES)
+        local_pool_.frames[index][local_pool_.size[index]++] = frame;
+    else
+    {
+        MutexLockGuard guard(pool_lock_);
+        if(pool_[index].size() >= MAX_POOL_FRAMES)
+        {
+            ::operator delete(frame);
+            return;
+        }
+        pool_[index].push_back(frame);
+    }
+    pooled_bytes_.fetch_add(class_size, memory_order_relaxed);
+}
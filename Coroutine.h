@@ -0,0 +1,170 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_COROUTINE_H
+#define WEBSERVER_COROUTINE_H
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The frames of the coroutines, by size class
+ *
+ * A freed frame is kept for the next coroutine of its class, in a small cache of the thread first and
+ * then in a pool shared by all the threads, so a connection does not allocate in the steady state.
+ * The cache of a thread is moved to the shared pool when the thread exits.
+ * A frame larger than the largest class comes from the heap.
+ */
+class FramePool
+{
+public:
+    // the classes are MIN_CLASS, 2 * MIN_CLASS ... MAX_CLASS
+    static const size_t MIN_CLASS = 256;
+    static const size_t MAX_CLASS = 4096;
+    static const size_t CLASSES = 5;
+    // the free frames of every class kept by a thread and by the shared pool, the others are freed
+    static const size_t LOCAL_FRAMES = 16;
+    static const size_t MAX_POOL_FRAMES = 1024;
+
+    static void* allocate(size_t size);
+    static void release(void* frame, size_t size);
+
+    static size_t getLiveFrames()   { return live_frames_.load(memory_order_relaxed); }
+    static size_t getPooledBytes()  { return pooled_bytes_.load(memory_order_relaxed); }
+
+private:
+    struct LocalPool
+    {
+        void* frames[CLASSES][LOCAL_FRAMES];
+        size_t size[CLASSES];
+
+        // the frames go back to the shared pool when the thread exits
+        ~LocalPool();
+    };
+
+    // CLASSES if the size has no class
+    static size_t classOf(size_t size);
+
+    static atomic<size_t> live_frames_;
+    static atomic<size_t> pooled_bytes_;
+    static thread_local LocalPool local_pool_;
+    static MutexLock pool_lock_;
+    static vector<void*> pool_[CLASSES];
+};
+
+/**
+ * @brief An asynchronous step of a connection as a coroutine, like the CGI or the proxy relay
+ *
+ * The coroutine runs inside RunEventLoop of its connection only, so it is serialized with the rest of
+ * the connection and scheduled by the thread pool like it. "co_await waitEvents(events)" suspends it
+ * until one of the EVENT_TYPE of the connection comes, the connection arms its fds by waiting() before
+ * sleeping, and calls wake() with the events of the next wakeup. The wakeup may be spurious, so the
+ * coroutine tries the operation again after every co_await.
+ *
+ * It starts at the first wake(), and the result is kept until the Task is destroyed. A suspended
+ * coroutine is destroyed with its Task, it must not destroy its own Task.
+ */
+template<typename T>
+class Task
+{
+public:
+    struct promise_type
+    {
+        T value{};
+        unsigned waiting = 0;
+
+        Task get_return_object()                    { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept   { return {}; }
+        suspend_always final_suspend() noexcept     { return {}; }
+        void return_value(T result)                 { value = result; }
+        // the server does not throw
+        void unhandled_exception()                  { terminate(); }
+
+        static void* operator new(size_t size)              { return FramePool::allocate(size); }
+        static void operator delete(void* frame, size_t size) { FramePool::release(frame, size); }
+    };
+
+    Task() : handle_(nullptr), started_(false) {}
+    Task(Task&& other) noexcept : handle_(other.handle_), started_(other.started_)    { other.handle_ = nullptr; }
+    Task& operator=(Task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(handle_)
+                handle_.destroy();
+            handle_ = other.handle_;
+            started_ = other.started_;
+            other.handle_ = nullptr;
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if(handle_)
+            handle_.destroy();
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool isRunning() const  { return handle_ && !handle_.done(); }
+    // the EVENT_TYPE the suspended coroutine waits for, 0 if it is finished or not started
+    unsigned waiting() const
+    {
+        return (started_ && isRunning()) ? handle_.promise().waiting : 0;
+    }
+
+    /**
+     * @brief Resume the coroutine if it is not started yet or one of the events it waits for came
+     * @return true if it finished in this call, the result is ready
+     */
+    bool wake(unsigned events)
+    {
+        if(!isRunning() || (started_ && !(handle_.promise().waiting & events)))
+            return false;
+        started_ = true;
+        handle_.promise().waiting = 0;
+        handle_.resume();
+        return handle_.done();
+    }
+
+    T result() const        { return handle_.promise().value; }
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : handle_(handle), started_(false) {}
+
+    coroutine_handle<promise_type> handle_;
+    bool started_;
+};
+
+/**
+ * @brief The awaitable of waitEvents()
+ */
+struct EventWait
+{
+    unsigned events;
+
+    bool await_ready() const noexcept   { return false; }
+    template<typename Promise>
+    void await_suspend(coroutine_handle<Promise> handle) const noexcept
+    {
+        handle.promise().waiting = events;
+    }
+    void await_resume() const noexcept  {}
+};
+
+// suspend the Task until one of the events comes
+inline EventWait waitEvents(unsigned events)
+{
+    return EventWait{ events };
+}
+
+#endif //WEBSERVER_COROUTINE_H
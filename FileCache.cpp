@@ -0,0 +1,317 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "FileCache.h"
+#include "Log.h"
+
+FileCache::Header* FileCache::header_ = nullptr;
+FileCache::Entry* FileCache::entries_ = nullptr;
+char* FileCache::arena_ = nullptr;
+int FileCache::slot_ = 0;
+
+// the expected average size of the cached files, decides the number of entries
+static const size_t AVG_FILE_SIZE = 16 * 1024;
+// the metadata is trusted for this seconds without stat
+static const int64_t REVALIDATE_INTERVAL = 1;
+
+static uint64_t hashPath(const string& path)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < path.size(); i++)
+    {
+        hash ^= static_cast<unsigned char>(path[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool FileCache::create(size_t size)
+{
+    if(size == 0)
+        return true;
+
+    uint32_t entry_num = 64;
+    while(entry_num < size / AVG_FILE_SIZE)
+        entry_num <<= 1;
+    size_t meta_size = sizeof(Header) + sizeof(Entry) * entry_num;
+    if(size <= meta_size * 2)
+        return false;
+
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED)
+    {
+        ERROR("Create file cache (%ld bytes) failed! (%s)", size, strerror(errno));
+        return false;
+    }
+    // The anonymous mapping is zero filled, which is the unlocked and empty state
+    header_ = new (addr) Header;
+    header_->active_half = 0;
+    header_->entry_num = entry_num;
+    header_->half_size = (size - meta_size) / 2;
+    entries_ = reinterpret_cast<Entry*>(static_cast<char*>(addr) + sizeof(Header));
+    arena_ = static_cast<char*>(addr) + meta_size;
+    INFO("File cache: %ld bytes, %u entries", size, entry_num);
+    return true;
+}
+
+void FileCache::lock()
+{
+    int32_t pid = getpid();
+    for(;;)
+    {
+        int32_t expected = 0;
+        if(header_->lock.compare_exchange_weak(expected, pid, memory_order_acquire))
+            return;
+        sched_yield();
+    }
+}
+
+void FileCache::unlock()
+{
+    header_->lock.store(0, memory_order_release);
+}
+
+FileCache::Entry* FileCache::find(const string& path, uint64_t hash)
+{
+    uint32_t mask = header_->entry_num - 1;
+    for(uint32_t i = 0, pos = hash & mask; i < header_->entry_num; i++, pos = (pos + 1) & mask)
+    {
+        Entry* entry = &entries_[pos];
+        if(entry->state == ENTRY_EMPTY)
+            return nullptr;
+        if(entry->state != ENTRY_DELETED && entry->hash == hash && entry->path_len == path.size()
+           && memcmp(arena_ + entry->path_off, path.data(), path.size()) == 0)
+            return entry;
+    }
+    return nullptr;
+}
+
+bool FileCache::lookup(const string& path, Ref* ref)
+{
+    if(!header_)
+        return false;
+    uint64_t hash = hashPath(path);
+    int64_t now = time(nullptr);
+
+    lock();
+    Entry* entry = find(path, hash);
+    if(!entry || entry->state != ENTRY_READY)
+    {
+        unlock();
+        header_->misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    if(now - entry->checked_at >= REVALIDATE_INTERVAL)
+    {
+        // stat without the lock, the entry may be changed meanwhile, so find it again
+        Entry copy = *entry;
+        unlock();
+        struct stat st;
+        bool same = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                    && static_cast<uint64_t>(st.st_size) == copy.size
+                    && st.st_ino == copy.ino
+                    && st.st_mtim.tv_sec == copy.mtime_sec && st.st_mtim.tv_nsec == copy.mtime_nsec;
+        lock();
+        entry = find(path, hash);
+        if(!entry || entry->state != ENTRY_READY || entry->data_off != copy.data_off || entry->half != copy.half)
+        {
+            unlock();
+            header_->misses.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        if(!same)
+        {
+            entry->state = ENTRY_DELETED;
+            unlock();
+            header_->misses.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        entry->checked_at = now;
+    }
+    ref->data = arena_ + entry->data_off;
+    ref->size = entry->size;
+    ref->half = static_cast<int>(entry->half);
+    header_->readers[ref->half][slot_].fetch_add(1, memory_order_relaxed);
+    unlock();
+
+    header_->hits.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+void FileCache::release(const Ref& ref)
+{
+    header_->readers[ref.half][slot_].fetch_sub(1, memory_order_release);
+}
+
+/**
+ * @brief Drop all the entries of the half if nobody reads it, must hold the lock
+ */
+bool FileCache::recycleHalf(uint32_t half)
+{
+    for(int i = 0; i < MAX_SLOTS; i++)
+        if(header_->readers[half][i].load(memory_order_acquire) != 0)
+            return false;
+    // The entries being filled are still written by other processes
+    for(uint32_t i = 0; i < header_->entry_num; i++)
+        if(entries_[i].state == ENTRY_FILLING && entries_[i].half == half)
+            return false;
+
+    for(uint32_t i = 0; i < header_->entry_num; i++)
+        if(entries_[i].state == ENTRY_READY && entries_[i].half == half)
+            entries_[i].state = ENTRY_DELETED;
+    header_->used[half] = 0;
+    rebuild();
+    return true;
+}
+
+/**
+ * @brief Insert the live entries again to clear the deleted ones, must hold the lock
+ */
+void FileCache::rebuild()
+{
+    vector<Entry> live;
+    for(uint32_t i = 0; i < header_->entry_num; i++)
+    {
+        if(entries_[i].state == ENTRY_READY || entries_[i].state == ENTRY_FILLING)
+            live.push_back(entries_[i]);
+        entries_[i].state = ENTRY_EMPTY;
+    }
+    uint32_t mask = header_->entry_num - 1;
+    for(size_t i = 0; i < live.size(); i++)
+    {
+        uint32_t pos = live[i].hash & mask;
+        while(entries_[pos].state != ENTRY_EMPTY)
+            pos = (pos + 1) & mask;
+        entries_[pos] = live[i];
+    }
+}
+
+bool FileCache::allocate(size_t size, uint32_t* half, uint64_t* offset)
+{
+    uint32_t active = header_->active_half;
+    if(header_->used[active] + size > header_->half_size)
+    {
+        uint32_t other = 1 - active;
+        if(!recycleHalf(other))
+            return false;
+        header_->active_half = active = other;
+    }
+    *half = active;
+    *offset = active * header_->half_size + header_->used[active];
+    header_->used[active] += size;
+    return true;
+}
+
+void FileCache::insert(const string& path, const struct stat& st, int fd)
+{
+    if(!header_)
+        return;
+    size_t size = static_cast<size_t>(st.st_size);
+    // a file is cached only if it is small enough to let a half hold several files
+    size_t total = (path.size() + size + 7) & ~static_cast<size_t>(7);
+    if(total > header_->half_size / 8)
+        return;
+    uint64_t hash = hashPath(path);
+
+    lock();
+    Entry* entry = find(path, hash);
+    if(entry && (entry->state == ENTRY_READY || entry->state == ENTRY_FILLING))
+    {
+        unlock();
+        return;
+    }
+    if(entry)
+        entry->state = ENTRY_DELETED;
+
+    uint32_t half;
+    uint64_t offset;
+    // keep one entry empty at least, so that find() always stops
+    size_t live = 0;
+    for(uint32_t i = 0; i < header_->entry_num; i++)
+        live += (entries_[i].state != ENTRY_EMPTY);
+    if(live + 1 >= header_->entry_num)
+        rebuild();
+    if(live + 1 >= header_->entry_num || !allocate(total, &half, &offset))
+    {
+        unlock();
+        return;
+    }
+
+    uint32_t mask = header_->entry_num - 1;
+    uint32_t pos = hash & mask;
+    while(entries_[pos].state == ENTRY_READY || entries_[pos].state == ENTRY_FILLING)
+        pos = (pos + 1) & mask;
+    entry = &entries_[pos];
+    entry->hash = hash;
+    entry->state = ENTRY_FILLING;
+    entry->half = half;
+    entry->path_off = offset;
+    entry->path_len = path.size();
+    entry->data_off = offset + path.size();
+    entry->size = size;
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+    entry->ino = st.st_ino;
+    entry->checked_at = time(nullptr);
+    entry->filler = getpid();
+    unlock();
+
+    // Copy the data without the lock, nobody reads a filling entry
+    memcpy(arena_ + offset, path.data(), path.size());
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t len = pread(fd, arena_ + offset + path.size() + done, size - done, static_cast<off_t>(done));
+        if(len == -1 && errno == EINTR)
+            continue;
+        if(len <= 0)
+            break;
+        done += static_cast<size_t>(len);
+    }
+
+    lock();
+    // The entry may be moved by rebuild() meanwhile
+    entry = find(path, hash);
+    if(entry && entry->state == ENTRY_FILLING && entry->data_off == offset + path.size())
+        entry->state = (done == size) ? ENTRY_READY : ENTRY_DELETED;
+    unlock();
+}
+
+void FileCache::recover(pid_t pid, int slot)
+{
+    if(!header_ || slot < 0 || slot >= MAX_SLOTS)
+        return;
+    int32_t owner = pid;
+    if(header_->lock.compare_exchange_strong(owner, 0))
+        WARN("File cache lock was held by the dead worker %d, released", pid);
+
+    lock();
+    header_->readers[0][slot].store(0);
+    header_->readers[1][slot].store(0);
+    // The files being copied by the dead worker will never be ready, the other workers are still copying theirs
+    for(uint32_t i = 0; i < header_->entry_num; i++)
+        if(entries_[i].state == ENTRY_FILLING && entries_[i].filler == pid)
+            entries_[i].state = ENTRY_DELETED;
+    unlock();
+}
+
+uint64_t FileCache::getHits()
+{
+    return header_ ? header_->hits.load(memory_order_relaxed) : 0;
+}
+
+uint64_t FileCache::getMisses()
+{
+    return header_ ? header_->misses.load(memory_order_relaxed) : 0;
+}
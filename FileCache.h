@@ -0,0 +1,117 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_FILECACHE_H
+#define WEBSERVER_FILECACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace std;
+
+/**
+ * @brief The static file cache in a shared memory mapping
+ *
+ * The mapping is created by the master before forking the workers, so one copy of
+ * the hot files serves all the processes. It also works in the single process mode.
+ *
+ * The data area is split into two halves, new files are appended to the active half.
+ * When it is full, the other half is recycled once no process is reading from it.
+ * The metadata is revalidated with stat at most once per second for every file.
+ */
+class FileCache
+{
+public:
+    // the max worker processes sharing the cache
+    static const int MAX_SLOTS = 64;
+
+    /**
+     * A file being read from the cache, release() it after sending
+     */
+    struct Ref
+    {
+        const char* data;
+        size_t size;
+        int half;
+    };
+
+    /**
+     * @brief Create the shared mapping, call it before forking the workers
+     * @param size the total bytes of the mapping, 0 disables the cache
+     */
+    static bool create(size_t size);
+    static bool isEnabled() { return header_ != nullptr; }
+    // the worker slot of current process, the reader counters are kept per slot
+    static void setSlot(int slot) { slot_ = slot; }
+
+    /**
+     * @brief Find a valid file in the cache
+     * @param path the path of a regular file
+     */
+    static bool lookup(const string& path, Ref* ref);
+    static void release(const Ref& ref);
+
+    /**
+     * @brief Read the file into the cache, it is skipped if the file is too large or no space is free
+     * @param fd the opened file, read with pread so its offset is not changed
+     */
+    static void insert(const string& path, const struct stat& st, int fd);
+
+    /**
+     * @brief Called by the master after the worker of the slot died,
+     *        release the lock, the readers and the entries being filled the worker held
+     */
+    static void recover(pid_t pid, int slot);
+
+    static uint64_t getHits();
+    static uint64_t getMisses();
+
+private:
+    enum ENTRY_STATE { ENTRY_EMPTY = 0, ENTRY_FILLING, ENTRY_READY, ENTRY_DELETED };
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint32_t state;
+        uint32_t half;
+        uint64_t path_off;
+        uint64_t path_len;
+        uint64_t data_off;
+        uint64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        uint64_t ino;
+        int64_t checked_at;
+        int32_t filler;                     // the pid copying the data of a filling entry
+    };
+
+    struct Header
+    {
+        atomic<int32_t> lock;               // the pid of the owner, 0 if unlocked
+        uint32_t active_half;
+        uint32_t entry_num;                 // power of 2
+        uint64_t half_size;
+        uint64_t used[2];
+        atomic<uint32_t> readers[2][MAX_SLOTS];
+        atomic<uint64_t> hits;
+        atomic<uint64_t> misses;
+    };
+
+    static Header* header_;
+    static Entry* entries_;
+    static char* arena_;
+    static int slot_;
+
+    static void lock();
+    static void unlock();
+    static Entry* find(const string& path, uint64_t hash);
+    static bool allocate(size_t size, uint32_t* half, uint64_t* offset);
+    static bool recycleHalf(uint32_t half);
+    static void rebuild();
+};
+
+#endif //WEBSERVER_FILECACHE_H
@@ -0,0 +1,169 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Handoff.h"
+#include "Log.h"
+
+// the new server gives up if the old one does not answer in time
+static const int RECEIVE_TIMEOUT_SEC = 5;
+static const char READY_BYTE = 'R';
+
+static bool fillAddress(const string& path, sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr->sun_path))
+    {
+        ERROR("Handoff socket path is too long: %s", path.c_str());
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+bool Handoff::receive(const string& path, vector<int>* fds, int* conn)
+{
+    sockaddr_un addr;
+    if(!fillAddress(path, &addr))
+        return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return false;
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        // No server is running, or the file is left by a dead one
+        close(fd);
+        return false;
+    }
+    timeval timeout = { RECEIVE_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t count = 0;
+    iovec iov = { &count, sizeof(count) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len;
+    while((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(len != sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || !cmsg
+       || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+       || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count))
+    {
+        ERROR("Receive the listening sockets from %s failed! (%s)", path.c_str(),
+              len == -1 ? strerror(errno) : "bad message");
+        close(fd);
+        return false;
+    }
+    const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+    fds->assign(data, data + count);
+    *conn = fd;
+    INFO("Received %u listening sockets from %s", count, path.c_str());
+    return true;
+}
+
+void Handoff::ready(int conn)
+{
+    if(write(conn, &READY_BYTE, 1) != 1)
+        WARN("Handoff ready write failed! (%s)", strerror(errno));
+    close(conn);
+}
+
+int Handoff::listen(const string& path)
+{
+    string temp = tempPath(path);
+    sockaddr_un addr;
+    if(!fillAddress(temp, &addr))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return -1;
+    // The path still belongs to the old server, a new server failing before ready must not take it
+    unlink(temp.c_str());
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(fd, 1) == -1)
+    {
+        ERROR("Listen on handoff socket %s failed! (%s)", temp.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool Handoff::publish(const string& path)
+{
+    // The old server keeps its fd, only the name is taken over
+    if(rename(tempPath(path).c_str(), path.c_str()) == -1)
+    {
+        ERROR("Rename handoff socket to %s failed! (%s)", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+string Handoff::tempPath(const string& path)
+{
+    return path + "." + to_string(getpid());
+}
+
+int Handoff::accept(int listen_fd, const vector<int>& fds)
+{
+    int conn = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(conn == -1)
+        return -1;
+    if(fds.empty() || fds.size() > MAX_FDS)
+    {
+        close(conn);
+        return -1;
+    }
+
+    uint32_t count = static_cast<uint32_t>(fds.size());
+    iovec iov = { &count, sizeof(count) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * count);
+
+    // The socket buffer is empty, the small message never blocks
+    if(sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(count))
+    {
+        ERROR("Send the listening sockets failed! (%s)", strerror(errno));
+        close(conn);
+        return -1;
+    }
+    INFO("Sent %u listening sockets to the new server", count);
+    return conn;
+}
+
+int Handoff::readReady(int conn)
+{
+    char byte;
+    ssize_t len = read(conn, &byte, 1);
+    if(len == 1 && byte == READY_BYTE)
+        return 1;
+    if(len == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    return -1;
+}
@@ -0,0 +1,61 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_HANDOFF_H
+#define WEBSERVER_HANDOFF_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief Pass the listening sockets to a new binary for the hot upgrade
+ *
+ * The running server listens on a Unix socket. The new binary connects to it and
+ * receives the listening fds with SCM_RIGHTS, so the sockets and their accept queues are
+ * never closed. After the new server is ready, it writes one byte back and the old server
+ * starts draining. If the new server fails before that, the old one keeps serving.
+ *
+ *   old: listen(path) ......... accept() -> sendFds ........ readReady() -> drain
+ *   new:                connect(path) -> recvFds -> start -> listen(temp) -> publish() -> ready()
+ */
+class Handoff
+{
+public:
+    // the max listening sockets passed in one handoff
+    static const size_t MAX_FDS = 64;
+
+    /**
+     * @brief Connect to the running server and receive its listening sockets
+     * @param conn  set to the connection which ready() answers on
+     * @return false if no server is listening on the path
+     */
+    static bool receive(const string& path, vector<int>* fds, int* conn);
+    // tell the old server that the new one is accepting, and close the connection
+    static void ready(int conn);
+
+    /**
+     * @brief Listen for the next upgrade on tempPath(path), the old server keeps the path until publish()
+     * @return the nonblocking listening fd, or -1
+     */
+    static int listen(const string& path);
+    // rename the socket of listen() over the path, once this server is ready
+    static bool publish(const string& path);
+    static string tempPath(const string& path);
+
+    /**
+     * @brief Accept the new server and send the listening sockets to it
+     * @return the nonblocking connection to wait the ready byte on, or -1
+     */
+    static int accept(int listen_fd, const vector<int>& fds);
+
+    /**
+     * @brief Read the ready byte of the new server
+     * @return 1 if the new server is ready, 0 if try again, -1 if the new server failed
+     */
+    static int readReady(int conn);
+};
+
+#endif //WEBSERVER_HANDOFF_H
@@ -0,0 +1,247 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "HeavyHitters.h"
+#include "Utils.h"
+
+size_t HeavyHitters::top_ = 0;
+MutexLock HeavyHitters::lock_;
+unique_ptr<HeavyHitters::ThreadSummaries> HeavyHitters::process_;
+int64_t HeavyHitters::decayed_ = 0;
+thread_local unique_ptr<HeavyHitters::ThreadSummaries> HeavyHitters::thread_;
+
+static const char* const summaryNames[] =
+{
+    "path_requests", "path_bytes", "client_requests", "client_bytes"
+};
+
+/**
+ * The rows are indexed by h1 + row * h2, the two halves of one hash
+ */
+static inline size_t sketchIndex(uint64_t hash, int row, size_t width)
+{
+    uint64_t step = (hash >> 32) | 1;
+    return static_cast<size_t>((hash + static_cast<uint64_t>(row) * step) & (width - 1));
+}
+
+void HeavyHitters::Summary::clear()
+{
+    memset(sketch, 0, sizeof(sketch));
+    total = 0;
+    used = 0;
+}
+
+void HeavyHitters::Summary::count(uint64_t hash, uint64_t weight)
+{
+    for(int row = 0; row < SKETCH_DEPTH; row++)
+        sketch[row][sketchIndex(hash, row, SKETCH_WIDTH)] += weight;
+    total += weight;
+}
+
+uint64_t HeavyHitters::Summary::estimate(uint64_t hash) const
+{
+    uint64_t value = UINT64_MAX;
+    for(int row = 0; row < SKETCH_DEPTH; row++)
+        value = min(value, sketch[row][sketchIndex(hash, row, SKETCH_WIDTH)]);
+    return value;
+}
+
+/**
+ * @brief Space-Saving: a new key takes the slot of the smallest count when all are used, and its count
+ */
+void HeavyHitters::Summary::addSlot(uint64_t hash, const char* key, size_t len, uint64_t weight, uint64_t error)
+{
+    for(size_t i = 0; i < used; i++)
+    {
+        if(hashes[i] == hash && lens[i] == len && memcmp(keys[i], key, len) == 0)
+        {
+            counts[i] += weight;
+            errors[i] += error;
+            return;
+        }
+    }
+    size_t slot = 0;
+    if(used < 4 * top_)
+    {
+        slot = used++;
+        counts[slot] = weight;
+        errors[slot] = error;
+    }
+    else
+    {
+        for(size_t i = 1; i < used; i++)
+        {
+            if(counts[i] < counts[slot])
+                slot = i;
+        }
+        errors[slot] = counts[slot] + error;
+        counts[slot] += weight;
+    }
+    hashes[slot] = hash;
+    lens[slot] = static_cast<uint8_t>(len);
+    memcpy(keys[slot], key, len);
+}
+
+void HeavyHitters::Summary::halve()
+{
+    for(int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        for(size_t i = 0; i < SKETCH_WIDTH; i++)
+            sketch[row][i] >>= 1;
+    }
+    total >>= 1;
+    for(size_t i = 0; i < used; i++)
+    {
+        counts[i] >>= 1;
+        errors[i] >>= 1;
+    }
+}
+
+void HeavyHitters::add(Summary* summary, const char* key, size_t len, uint64_t weight)
+{
+    uint64_t hash = std::hash<string_view>()(string_view(key, len));
+    summary->count(hash, weight);
+    summary->addSlot(hash, key, len, weight, 0);
+}
+
+void HeavyHitters::record(const char* path, size_t path_len, const uint8_t* addr, size_t addr_len, uint64_t bytes)
+{
+    int64_t now = monotonicMs();
+    if(!thread_)
+    {
+        thread_.reset(new ThreadSummaries);
+        for(Summary& summary : thread_->summaries)
+            summary.clear();
+        thread_->merged = now;
+        thread_->dirty = false;
+    }
+    ThreadSummaries* local = thread_.get();
+    if(path)
+    {
+        const char* key = path;
+        size_t len = min(path_len, KEY_SIZE);
+        add(&local->summaries[SUMMARY_PATH_REQUESTS], key, len, 1);
+        if(bytes)
+            add(&local->summaries[SUMMARY_PATH_BYTES], key, len, bytes);
+    }
+    if(addr_len)
+    {
+        const char* key = reinterpret_cast<const char*>(addr);
+        add(&local->summaries[SUMMARY_CLIENT_REQUESTS], key, addr_len, 1);
+        if(bytes)
+            add(&local->summaries[SUMMARY_CLIENT_BYTES], key, addr_len, bytes);
+    }
+    local->dirty = true;
+    if(now - local->merged >= MERGE_INTERVAL_MS)
+        merge(local, now);
+}
+
+/**
+ * @brief Add the summaries of the thread to the ones of the process, and start them again
+ */
+void HeavyHitters::merge(ThreadSummaries* local, int64_t now)
+{
+    local->merged = now;
+    MutexLockGuard guard(lock_);
+    if(!process_)
+    {
+        process_.reset(new ThreadSummaries);
+        for(Summary& summary : process_->summaries)
+            summary.clear();
+        decayed_ = now;
+    }
+    // The minutes without any request are caught up at once
+    if(now - decayed_ >= DECAY_INTERVAL_MS)
+    {
+        int64_t halves = min<int64_t>((now - decayed_) / DECAY_INTERVAL_MS, 64);
+        for(Summary& summary : process_->summaries)
+        {
+            for(int64_t i = 0; i < halves; i++)
+                summary.halve();
+        }
+        decayed_ = now - (now - decayed_) % DECAY_INTERVAL_MS;
+    }
+    if(!local->dirty)
+        return;
+    for(int i = 0; i < SUMMARIES; i++)
+    {
+        Summary& from = local->summaries[i];
+        Summary& to = process_->summaries[i];
+        for(int row = 0; row < SKETCH_DEPTH; row++)
+        {
+            for(size_t col = 0; col < SKETCH_WIDTH; col++)
+                to.sketch[row][col] += from.sketch[row][col];
+        }
+        to.total += from.total;
+        for(size_t slot = 0; slot < from.used; slot++)
+            to.addSlot(from.hashes[slot], from.keys[slot], from.lens[slot], from.counts[slot], from.errors[slot]);
+        from.clear();
+    }
+    local->dirty = false;
+}
+
+static void appendLine(string* out, const char* name, uint64_t value)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", name, value);
+    out->append(line, static_cast<size_t>(len));
+}
+
+/**
+ * heavy_<summary>_<rank> for the top of every summary, by the lower of the Space-Saving count and the
+ * estimate of the sketch, both are never under the true count
+ */
+void HeavyHitters::render(string* out)
+{
+    // The other threads add theirs at their next request
+    if(thread_)
+        merge(thread_.get(), monotonicMs());
+    appendLine(out, "heavy_hitters_top", top_);
+    MutexLockGuard guard(lock_);
+    if(!process_)
+        return;
+    char name[96];
+    for(int i = 0; i < SUMMARIES; i++)
+    {
+        const Summary& summary = process_->summaries[i];
+        snprintf(name, sizeof(name), "heavy_%s_total", summaryNames[i]);
+        appendLine(out, name, summary.total);
+
+        vector<pair<uint64_t, size_t>> order;
+        order.reserve(summary.used);
+        for(size_t slot = 0; slot < summary.used; slot++)
+            order.emplace_back(min(summary.counts[slot], summary.estimate(summary.hashes[slot])), slot);
+        size_t top = min(top_, order.size());
+        partial_sort(order.begin(), order.begin() + static_cast<ptrdiff_t>(top), order.end(),
+                     [](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b) { return a.first > b.first; });
+        for(size_t rank = 0; rank < top; rank++)
+        {
+            size_t slot = order[rank].second;
+            string key;
+            if(i == SUMMARY_PATH_REQUESTS || i == SUMMARY_PATH_BYTES)
+                key = escapeStr(summary.keys[slot], summary.lens[slot], 4 * KEY_SIZE);
+            else
+            {
+                char addr[INET6_ADDRSTRLEN] = "unknown";
+                inet_ntop(summary.lens[slot] == 4 ? AF_INET : AF_INET6, summary.keys[slot], addr, sizeof(addr));
+                key = addr;
+            }
+            char line[128];
+            int len = snprintf(line, sizeof(line), "heavy_%s_%zu %" PRIu64 " ", summaryNames[i], rank + 1,
+                               order[rank].first);
+            out->append(line, static_cast<size_t>(len));
+            out->append(key);
+            out->push_back('\n');
+        }
+    }
+}
@@ -0,0 +1,102 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_HEAVYHITTERS_H
+#define WEBSERVER_HEAVYHITTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The top paths and clients by requests and by bytes served, in a fixed memory
+ *
+ * With --heavy-hitters <k>, every finished or aborted request is counted in four summaries: the paths
+ * and the client addresses, by requests and by bytes written. A summary is a count-min sketch of all the
+ * keys and the Space-Saving counters of the 4k keys seen most, whose k largest are the top.
+ *
+ * Every thread counts into summaries of its own without any lock, and adds them to the summaries of the
+ * process once a second, at its next request; the counts of the process are halved every minute so the
+ * top follows the recent traffic. The workers count their own requests.
+ */
+class HeavyHitters
+{
+public:
+    static const size_t MAX_TOP = 32;
+    // the bytes of a path kept, a longer one is counted by its prefix
+    static constexpr size_t KEY_SIZE = 64;
+
+    // enabled with a top of 1 to MAX_TOP keys
+    static void setTop(size_t top)      { top_ = top; }
+    static bool isEnabled()             { return top_ > 0; }
+
+    /**
+     * @param path  without the query, nullptr if the request line was not parsed
+     * @param addr  the IPv4 or IPv6 address of the client, addr_len 0 if unknown, like a Unix socket
+     */
+    static void record(const char* path, size_t path_len, const uint8_t* addr, size_t addr_len, uint64_t bytes);
+
+    // the "<name> <value>" lines of the stats page, the value of a top line is "<count> <key>"
+    static void render(string* out);
+
+private:
+    enum SUMMARY
+    {
+        SUMMARY_PATH_REQUESTS,
+        SUMMARY_PATH_BYTES,
+        SUMMARY_CLIENT_REQUESTS,
+        SUMMARY_CLIENT_BYTES,
+        SUMMARIES
+    };
+
+    static const size_t MAX_SLOTS = 4 * MAX_TOP;
+    static const int SKETCH_DEPTH = 4;
+    // the estimates of the sketch are over by at most e / SKETCH_WIDTH of the total, with 98% probability
+    static const size_t SKETCH_WIDTH = 1024;
+    static const int64_t MERGE_INTERVAL_MS = 1000;
+    static const int64_t DECAY_INTERVAL_MS = 60 * 1000;
+
+    struct Summary
+    {
+        uint64_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+        uint64_t total;
+        size_t used;
+        // the Space-Saving counters, the hashes apart from the keys so the search reads a few cache lines
+        uint64_t hashes[MAX_SLOTS];
+        uint64_t counts[MAX_SLOTS];
+        uint64_t errors[MAX_SLOTS];     // the count the key may have taken over from the evicted one
+        uint8_t lens[MAX_SLOTS];
+        char keys[MAX_SLOTS][KEY_SIZE];
+
+        void clear();
+        void count(uint64_t hash, uint64_t weight);
+        uint64_t estimate(uint64_t hash) const;
+        void addSlot(uint64_t hash, const char* key, size_t len, uint64_t weight, uint64_t error);
+        void halve();
+    };
+
+    struct ThreadSummaries
+    {
+        Summary summaries[SUMMARIES];
+        int64_t merged;                 // by monotonicMs()
+        bool dirty;
+    };
+
+    static size_t top_;
+
+    static MutexLock lock_;
+    static unique_ptr<ThreadSummaries> process_;
+    static int64_t decayed_;
+    static thread_local unique_ptr<ThreadSummaries> thread_;
+
+    static void add(Summary* summary, const char* key, size_t len, uint64_t weight);
+    static void merge(ThreadSummaries* local, int64_t now);
+};
+
+#endif //WEBSERVER_HEAVYHITTERS_H
@@ -0,0 +1,448 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cstring>
+
+#include "Hpack.h"
+
+namespace {
+
+struct StaticEntry
+{
+    const char* name;
+    const char* value;
+};
+
+/**
+ * RFC 7541 Appendix A, the index starts from 1
+ */
+const StaticEntry STATIC_TABLE[] = {
+        { ":authority", "" },
+        { ":method", "GET" },
+        { ":method", "POST" },
+        { ":path", "/" },
+        { ":path", "/index.html" },
+        { ":scheme", "http" },
+        { ":scheme", "https" },
+        { ":status", "200" },
+        { ":status", "204" },
+        { ":status", "206" },
+        { ":status", "304" },
+        { ":status", "400" },
+        { ":status", "404" },
+        { ":status", "500" },
+        { "accept-charset", "" },
+        { "accept-encoding", "gzip, deflate" },
+        { "accept-language", "" },
+        { "accept-ranges", "" },
+        { "accept", "" },
+        { "access-control-allow-origin", "" },
+        { "age", "" },
+        { "allow", "" },
+        { "authorization", "" },
+        { "cache-control", "" },
+        { "content-disposition", "" },
+        { "content-encoding", "" },
+        { "content-language", "" },
+        { "content-length", "" },
+        { "content-location", "" },
+        { "content-range", "" },
+        { "content-type", "" },
+        { "cookie", "" },
+        { "date", "" },
+        { "etag", "" },
+        { "expect", "" },
+        { "expires", "" },
+        { "from", "" },
+        { "host", "" },
+        { "if-match", "" },
+        { "if-modified-since", "" },
+        { "if-none-match", "" },
+        { "if-range", "" },
+        { "if-unmodified-since", "" },
+        { "last-modified", "" },
+        { "link", "" },
+        { "location", "" },
+        { "max-forwards", "" },
+        { "proxy-authenticate", "" },
+        { "proxy-authorization", "" },
+        { "range", "" },
+        { "referer", "" },
+        { "refresh", "" },
+        { "retry-after", "" },
+        { "server", "" },
+        { "set-cookie", "" },
+        { "strict-transport-security", "" },
+        { "transfer-encoding", "" },
+        { "user-agent", "" },
+        { "vary", "" },
+        { "via", "" },
+        { "www-authenticate", "" },
+};
+
+const uint64_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+/**
+ * RFC 7541 Appendix B, the code of every symbol and its bit length, 256 is EOS
+ */
+const uint32_t HUFFMAN_CODES[257] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+        0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+        0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+        0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+        0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+        0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+        0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+        0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+        0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+        0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+        0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+        0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+        0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+        0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+        0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+        0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+        0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+        0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+        0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+        0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+        0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+        0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+        0x3fffffff,
+};
+const uint8_t HUFFMAN_LENGTHS[257] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30,
+};
+
+/**
+ * @brief The binary tree of the Huffman codes, decoded one bit per step
+ *        A node is a leaf if its children are both -1, the symbol of a leaf is in symbol
+ */
+class HuffmanTree
+{
+public:
+    struct Node
+    {
+        int16_t child[2];
+        int16_t symbol;
+    };
+
+    HuffmanTree()
+    {
+        nodes_.push_back({ { -1, -1 }, -1 });
+        for(int symbol = 0; symbol <= 256; symbol++)
+        {
+            int node = 0;
+            for(int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; bit--)
+            {
+                int b = (HUFFMAN_CODES[symbol] >> bit) & 1;
+                if(nodes_[node].child[b] == -1)
+                {
+                    nodes_[node].child[b] = static_cast<int16_t>(nodes_.size());
+                    nodes_.push_back({ { -1, -1 }, -1 });
+                }
+                node = nodes_[node].child[b];
+            }
+            nodes_[node].symbol = static_cast<int16_t>(symbol);
+        }
+    }
+
+    static const HuffmanTree& instance()
+    {
+        static HuffmanTree tree;
+        return tree;
+    }
+
+    const Node& operator[](int i) const { return nodes_[i]; }
+
+private:
+    vector<Node> nodes_;
+};
+
+bool huffmanDecode(const uint8_t* data, size_t len, string* out)
+{
+    const HuffmanTree& tree = HuffmanTree::instance();
+    int node = 0;
+    int depth = 0;          // the bits since the last symbol
+    bool all_ones = true;   // the padding must be the most significant bits of EOS
+    for(size_t i = 0; i < len; i++)
+    {
+        for(int bit = 7; bit >= 0; bit--)
+        {
+            int b = (data[i] >> bit) & 1;
+            node = tree[node].child[b];
+            if(node == -1)
+                return false;
+            ++depth;
+            all_ones = all_ones && b;
+            if(tree[node].symbol != -1)
+            {
+                if(tree[node].symbol == 256)
+                    return false;
+                out->push_back(static_cast<char>(tree[node].symbol));
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return depth < 8 && all_ones;
+}
+
+/**
+ * @brief Decode an integer with an N-bit prefix
+ */
+bool decodeInteger(const uint8_t*& pos, const uint8_t* end, int prefix, uint64_t* value)
+{
+    if(pos >= end)
+        return false;
+    uint64_t max_prefix = (1u << prefix) - 1;
+    *value = *pos++ & max_prefix;
+    if(*value < max_prefix)
+        return true;
+    for(int shift = 0; pos < end; shift += 7)
+    {
+        // no header field needs more than 2^28
+        if(shift > 21)
+            return false;
+        uint8_t byte = *pos++;
+        *value += static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool decodeString(const uint8_t*& pos, const uint8_t* end, string* out)
+{
+    if(pos >= end)
+        return false;
+    bool huffman = *pos & 0x80;
+    uint64_t len;
+    if(!decodeInteger(pos, end, 7, &len) || len > static_cast<uint64_t>(end - pos))
+        return false;
+    out->clear();
+    if(huffman)
+    {
+        if(!huffmanDecode(pos, len, out))
+            return false;
+    }
+    else
+        out->assign(reinterpret_cast<const char*>(pos), len);
+    pos += len;
+    return true;
+}
+
+void encodeInteger(uint64_t value, int prefix, uint8_t flags, string* out)
+{
+    uint64_t max_prefix = (1u << prefix) - 1;
+    if(value < max_prefix)
+    {
+        out->push_back(static_cast<char>(flags | value));
+        return;
+    }
+    out->push_back(static_cast<char>(flags | max_prefix));
+    value -= max_prefix;
+    while(value >= 0x80)
+    {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+void encodeString(const string& str, string* out)
+{
+    encodeInteger(str.size(), 7, 0, out);
+    out->append(str);
+}
+
+// the size of an entry in the dynamic table
+size_t entrySize(const string& name, const string& value)
+{
+    return name.size() + value.size() + 32;
+}
+
+}
+
+HpackDecoder::HpackDecoder(size_t maxTableSize, size_t maxListSize)
+        : table_size_(0), max_table_size_(maxTableSize),
+          settings_table_size_(maxTableSize), max_list_size_(maxListSize)
+{
+}
+
+bool HpackDecoder::lookup(uint64_t index, const string** name, const string** value) const
+{
+    static const vector<pair<string, string>> static_table = [] {
+        vector<pair<string, string>> table;
+        for(const StaticEntry& entry : STATIC_TABLE)
+            table.emplace_back(entry.name, entry.value);
+        return table;
+    }();
+    if(index == 0)
+        return false;
+    if(index <= STATIC_TABLE_SIZE)
+    {
+        *name = &static_table[index - 1].first;
+        *value = &static_table[index - 1].second;
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= table_.size())
+        return false;
+    *name = &table_[index].first;
+    *value = &table_[index].second;
+    return true;
+}
+
+void HpackDecoder::evict(size_t limit)
+{
+    while(table_size_ > limit)
+    {
+        table_size_ -= entrySize(table_.back().first, table_.back().second);
+        table_.pop_back();
+    }
+}
+
+void HpackDecoder::insert(const string& name, const string& value)
+{
+    size_t size = entrySize(name, value);
+    // An entry larger than the table empties it
+    if(size > max_table_size_)
+    {
+        evict(0);
+        return;
+    }
+    evict(max_table_size_ - size);
+    table_.emplace_front(name, value);
+    table_size_ += size;
+}
+
+HpackDecoder::DECODE_RESULT HpackDecoder::decode(const uint8_t* data, size_t len, HeaderList* headers)
+{
+    const uint8_t* pos = data;
+    const uint8_t* end = data + len;
+    size_t list_size = 0;
+    bool header_seen = false;
+    string name, value;
+    headers->clear();
+
+    while(pos < end)
+    {
+        uint8_t byte = *pos;
+        uint64_t index;
+        if(byte & 0x80)
+        {
+            // Indexed Header Field
+            const string *n, *v;
+            if(!decodeInteger(pos, end, 7, &index) || !lookup(index, &n, &v))
+                return DECODE_ERROR;
+            name = *n;
+            value = *v;
+        }
+        else if((byte & 0xe0) == 0x20)
+        {
+            // Dynamic Table Size Update, only at the beginning of a block
+            if(header_seen || !decodeInteger(pos, end, 5, &index) || index > settings_table_size_)
+                return DECODE_ERROR;
+            max_table_size_ = index;
+            evict(max_table_size_);
+            continue;
+        }
+        else
+        {
+            // Literal Header Field with Incremental Indexing (01), without Indexing (0000) or Never Indexed (0001)
+            bool indexing = (byte & 0xc0) == 0x40;
+            if(!decodeInteger(pos, end, indexing ? 6 : 4, &index))
+                return DECODE_ERROR;
+            if(index == 0)
+            {
+                if(!decodeString(pos, end, &name))
+                    return DECODE_ERROR;
+            }
+            else
+            {
+                const string *n, *v;
+                if(!lookup(index, &n, &v))
+                    return DECODE_ERROR;
+                name = *n;
+            }
+            if(!decodeString(pos, end, &value))
+                return DECODE_ERROR;
+            if(indexing)
+                insert(name, value);
+        }
+        header_seen = true;
+        // The table must be updated by the whole block, even if the list is dropped
+        list_size += entrySize(name, value);
+        if(list_size <= max_list_size_)
+            headers->emplace_back(name, value);
+    }
+    if(list_size > max_list_size_)
+    {
+        headers->clear();
+        return DECODE_TOO_LARGE;
+    }
+    return DECODE_OK;
+}
+
+void HpackEncoder::encode(const HeaderList& headers, string* out)
+{
+    if(first_block_)
+    {
+        // Dynamic Table Size Update to 0
+        out->push_back(0x20);
+        first_block_ = false;
+    }
+    for(const pair<string, string>& header : headers)
+    {
+        uint64_t name_index = 0;
+        uint64_t full_index = 0;
+        for(uint64_t i = 0; i < STATIC_TABLE_SIZE && !full_index; i++)
+        {
+            if(header.first != STATIC_TABLE[i].name)
+                continue;
+            if(!name_index)
+                name_index = i + 1;
+            if(header.second == STATIC_TABLE[i].value)
+                full_index = i + 1;
+        }
+        if(full_index)
+        {
+            encodeInteger(full_index, 7, 0x80, out);
+            continue;
+        }
+        // Literal Header Field without Indexing
+        encodeInteger(name_index, 4, 0x00, out);
+        if(!name_index)
+            encodeString(header.first, out);
+        encodeString(header.second, out);
+    }
+}
@@ -0,0 +1,70 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_HPACK_H
+#define WEBSERVER_HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+typedef vector<pair<string, string>> HeaderList;
+
+/**
+ * @brief The HPACK (RFC 7541) decoder of one HTTP/2 connection, the dynamic table lives as long as the connection
+ */
+class HpackDecoder
+{
+public:
+    enum DECODE_RESULT
+    {
+        DECODE_OK,
+        DECODE_TOO_LARGE,       // the block is decoded, but the headers are dropped
+        DECODE_ERROR            // COMPRESSION_ERROR, the connection must be closed
+    };
+
+    /**
+     * @param maxTableSize  the SETTINGS_HEADER_TABLE_SIZE announced to the peer
+     * @param maxListSize   the max decoded size of one header list
+     */
+    HpackDecoder(size_t maxTableSize, size_t maxListSize);
+
+    DECODE_RESULT decode(const uint8_t* data, size_t len, HeaderList* headers);
+
+private:
+    deque<pair<string, string>> table_;     // the newest entry is the front
+    size_t table_size_;
+    size_t max_table_size_;                 // changed by the dynamic table size update
+    const size_t settings_table_size_;
+    const size_t max_list_size_;
+
+    bool lookup(uint64_t index, const string** name, const string** value) const;
+    void insert(const string& name, const string& value);
+    void evict(size_t limit);
+};
+
+/**
+ * @brief The HPACK encoder, it never adds entries to the dynamic table
+ *
+ * The static table is used when it matches, all the other fields are literals without indexing,
+ * so the encoder is stateless and the SETTINGS_HEADER_TABLE_SIZE of the peer does not matter.
+ */
+class HpackEncoder
+{
+public:
+    // the first block tells the peer that the dynamic table is not used
+    HpackEncoder() : first_block_(true) {}
+
+    void encode(const HeaderList& headers, string* out);
+
+private:
+    bool first_block_;
+};
+
+#endif //WEBSERVER_HPACK_H
@@ -0,0 +1,1353 @@
+/**
+ * The frames, streams and flow control of the HTTP/2 cleartext connections (RFC 9113)
+ */
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HeavyHitters.h"
+#include "Http2Session.h"
+#include "HttpResponse.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Utils.h"
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t FRAME_HEADER_LEN = 9;
+// the rounds of reading the CGI and framing the data in one wakeup, the rest is done on EPOLLOUT
+static const int MAX_ROUNDS = 64;
+
+static uint32_t readUint32(const uint8_t* p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+           | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static void appendUint32(string* out, uint32_t value)
+{
+    char buf[4] = { static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+                    static_cast<char>(value >> 8), static_cast<char>(value) };
+    out->append(buf, 4);
+}
+
+/**
+ * @brief Append the "Name: value\r\n" lines to the header list in lowercase,
+ *        the fields of HTTP/1.1 connections and the duplicated names are dropped
+ */
+static void appendFields(const char* data, size_t len, HeaderList* list)
+{
+    const char* end = data + len;
+    while(data < end)
+    {
+        const char* eol = static_cast<const char*>(memchr(data, '\n', end - data));
+        const char* line_end = eol ? eol : end;
+        const char* colon = static_cast<const char*>(memchr(data, ':', line_end - data));
+        if(colon)
+        {
+            string name(data, colon);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            const char* value = colon + 1;
+            while(value < line_end && *value == ' ')
+                ++value;
+            const char* value_end = line_end;
+            if(value_end > value && value_end[-1] == '\r')
+                --value_end;
+
+            bool skip = (name == "connection" || name == "keep-alive" || name == "transfer-encoding");
+            for(size_t i = 0; i < list->size() && !skip; i++)
+                skip = (*list)[i].first == name;
+            if(!skip)
+                list->emplace_back(name, string(value, value_end));
+        }
+        data = eol ? eol + 1 : end;
+    }
+}
+
+static bool preadFull(int fd, char* buf, size_t len, off_t off)
+{
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, off);
+        if(n < 0 && errno == EINTR)
+            continue;
+        // The file was truncated after the content-length was sent
+        if(n <= 0)
+            return false;
+        buf += n;
+        len -= static_cast<size_t>(n);
+        off += n;
+    }
+    return true;
+}
+
+int Http2Session::matchPreface(const char* data, size_t len)
+{
+    size_t n = min(len, PREFACE_LEN);
+    if(memcmp(data, PREFACE, n) != 0)
+        return -1;
+    return (n == PREFACE_LEN) ? 1 : 0;
+}
+
+bool Http2Session::decodeUpgradeSettings(const string& value, string* payload)
+{
+    // base64url, the padding is not used but tolerated
+    payload->clear();
+    uint32_t acc = 0;
+    int bits = 0;
+    for(char ch : value)
+    {
+        uint32_t v;
+        if(ch >= 'A' && ch <= 'Z')
+            v = static_cast<uint32_t>(ch - 'A');
+        else if(ch >= 'a' && ch <= 'z')
+            v = static_cast<uint32_t>(ch - 'a' + 26);
+        else if(ch >= '0' && ch <= '9')
+            v = static_cast<uint32_t>(ch - '0' + 52);
+        else if(ch == '-')
+            v = 62;
+        else if(ch == '_')
+            v = 63;
+        else if(ch == '=')
+            break;
+        else
+            return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            payload->push_back(static_cast<char>((acc >> bits) & 0xff));
+        }
+    }
+    return payload->size() % 6 == 0;
+}
+
+Http2Session::Stream::Stream(uint32_t stream_id)
+        : id(stream_id), remote_closed(false), headers_sent(false), local_closed(false),
+          send_window(0), recv_window(0), recv_unacked(0), body_received(0), body(),
+          route_pending(false),
+          is_cgi(false), cgi_pid(-1), cgi_in_fd(-1), cgi_out_fd(-1), cgi_in_wait(false), cgi_out_wait(false),
+          cgi_in_off(0), cgi_out_off(0),
+          cgi_eof(false), cgi_timeout(false), cgi_deadline(0),
+          access_start(AccessLog::isEnabled() ? Trace::now() : 0), access_response(0), status(0), bytes_out(0)
+{
+}
+
+Http2Session::Http2Session(HttpHandler* conn, const string* upgrade_settings)
+        : conn_(conn), decoder_(4096, HttpHandler::maxHeaderSize), out_off_(0),
+          preface_received_(false), settings_received_(false),
+          peer_max_frame_size_(MAX_FRAME_SIZE), peer_initial_window_(DEFAULT_WINDOW),
+          conn_send_window_(DEFAULT_WINDOW), conn_recv_window_(CONN_RECV_WINDOW),
+          header_stream_(0), header_end_stream_(false),
+          last_stream_id_(0), last_sent_id_(0), goaway_sent_(false), closing_(false), last_active_(nowMs())
+{
+    if(upgrade_settings)
+    {
+        size_t len = 0;
+        const char* line = ResponseBuilder::getStatusLine(101, &len);
+        out_.assign(line, len);
+        out_ += "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        // The 101 response acknowledges the settings of the upgrade request
+        applySettings(reinterpret_cast<const uint8_t*>(upgrade_settings->data()),
+                      static_cast<uint32_t>(upgrade_settings->size()));
+    }
+    appendSettings();
+    appendWindowUpdate(0, static_cast<uint32_t>(CONN_RECV_WINDOW - DEFAULT_WINDOW));
+    INFO("HTTP/2 session started (socket: %d)%s", conn_->client_fd_, upgrade_settings ? " by upgrade" : "");
+}
+
+Http2Session::~Http2Session()
+{
+    for(auto& kv : streams_)
+    {
+        stopCgi(kv.second, true);
+        kv.second->body.release();
+        delete kv.second;
+    }
+}
+
+int64_t Http2Session::nowMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void Http2Session::startUpgradeStream(const string& method, const string& path, const map<string, string>& headers)
+{
+    Stream* stream = new Stream(1);
+    stream->method = method;
+    stream->path = path;
+    stream->headers = headers;
+    stream->remote_closed = true;
+    stream->send_window = peer_initial_window_;
+    stream->recv_window = DEFAULT_WINDOW;
+    streams_[1] = stream;
+    last_stream_id_ = 1;
+    startStream(stream);
+}
+
+bool Http2Session::RunEventLoop(unsigned events)
+{
+    TraceSpan span("h2 session");
+    if(events & HttpHandler::EVENT_CLIENT_CLOSED)
+    {
+        INFO("Socket(%d) was closed by peer.", conn_->client_fd_);
+        return false;
+    }
+    int64_t now = nowMs();
+    if(events & HttpHandler::EVENT_TIMEOUT)
+    {
+        if(now - last_active_ >= conn_->timeoutPerRequest * 1000)
+        {
+            INFO("HTTP/2 socket(%d) timeout, %ld streams left.", conn_->client_fd_, streams_.size());
+            appendGoaway(H2_NO_ERROR);
+            flush();
+            return false;
+        }
+        checkTimeouts(now);
+    }
+
+    if(!readFrames())
+        return false;
+    if(closing_)
+    {
+        flush();
+        return false;
+    }
+    // The graceful shutdown, the open streams are finished
+    if(HttpHandler::draining_.load(memory_order_relaxed) && !goaway_sent_)
+        appendGoaway(H2_NO_ERROR);
+
+    for(int round = 0; round < MAX_ROUNDS; round++)
+    {
+        for(auto iter = streams_.begin(); iter != streams_.end(); )
+        {
+            // the stream may be closed by pumpStream()
+            Stream* stream = iter->second;
+            ++iter;
+            pumpStream(stream);
+        }
+        bool produced = scheduleData();
+        if(!flush())
+            return false;
+        if(out_off_ < out_.size() || !produced)
+            break;
+    }
+
+    if(goaway_sent_ && streams_.empty())
+    {
+        INFO("HTTP/2 socket(%d) went away.", conn_->client_fd_);
+        return false;
+    }
+    return rearmEvents();
+}
+
+bool Http2Session::readFrames()
+{
+    for(;;)
+    {
+        if(!parseFrames())
+            return true;
+        // The peer does not read the responses, stop reading its requests
+        if(out_.size() - out_off_ >= OUT_HIGH_WATER * 4)
+            break;
+        ssize_t len = conn_->readClient(IN_LIMIT);
+        if(len > 0)
+        {
+            last_active_ = nowMs();
+            continue;
+        }
+        if(len == 0)
+        {
+            INFO("HTTP/2 socket(%d) was closed.", conn_->client_fd_);
+            return false;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN)
+            break;
+        ERROR("HTTP/2 read request failed ! (%s)", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Process the complete frames in the input buffer
+ * @return false if a connection error happened
+ */
+bool Http2Session::parseFrames()
+{
+    InputBuffer& in = conn_->in_;
+    if(!preface_received_)
+    {
+        int matched = matchPreface(in.peek(), in.readable());
+        if(matched < 0)
+            return connectionError(H2_PROTOCOL_ERROR);
+        if(matched == 0)
+            return true;
+        in.retrieve(PREFACE_LEN);
+        preface_received_ = true;
+    }
+
+    while(!closing_ && in.readable() >= FRAME_HEADER_LEN)
+    {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(in.peek());
+        uint32_t len = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+        uint8_t type = p[3];
+        uint8_t flags = p[4];
+        uint32_t stream_id = readUint32(p + 5) & 0x7fffffff;
+        if(len > MAX_FRAME_SIZE)
+            return connectionError(H2_FRAME_SIZE_ERROR);
+        if(in.readable() < FRAME_HEADER_LEN + len)
+            break;
+        if(!processFrame(type, flags, stream_id, p + FRAME_HEADER_LEN, len))
+            return false;
+        in.retrieve(FRAME_HEADER_LEN + len);
+    }
+    return !closing_;
+}
+
+bool Http2Session::processFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len)
+{
+    // A header block is never interleaved with other frames
+    if(header_stream_ != 0 && (type != FRAME_CONTINUATION || stream_id != header_stream_))
+        return connectionError(H2_PROTOCOL_ERROR);
+    // The first frame of the client is SETTINGS
+    if(!settings_received_ && type != FRAME_SETTINGS)
+        return connectionError(H2_PROTOCOL_ERROR);
+
+    switch(type)
+    {
+        case FRAME_DATA:
+            return onData(flags, stream_id, payload, len);
+        case FRAME_HEADERS:
+        case FRAME_CONTINUATION:
+            return onHeaders(type, flags, stream_id, payload, len);
+        case FRAME_PRIORITY:
+            // The priorities are not used, the streams are served round-robin
+            if(stream_id == 0)
+                return connectionError(H2_PROTOCOL_ERROR);
+            if(len != 5)
+                return connectionError(H2_FRAME_SIZE_ERROR);
+            return true;
+        case FRAME_RST_STREAM:
+        {
+            if(stream_id == 0 || stream_id > last_stream_id_)
+                return connectionError(H2_PROTOCOL_ERROR);
+            if(len != 4)
+                return connectionError(H2_FRAME_SIZE_ERROR);
+            auto iter = streams_.find(stream_id);
+            if(iter != streams_.end())
+            {
+                INFO("HTTP/2 stream %u reset by peer (error %u)", stream_id, readUint32(payload));
+                closeStream(iter->second);
+            }
+            return true;
+        }
+        case FRAME_SETTINGS:
+            if(stream_id != 0)
+                return connectionError(H2_PROTOCOL_ERROR);
+            return onSettings(flags, payload, len);
+        case FRAME_PUSH_PROMISE:
+            return connectionError(H2_PROTOCOL_ERROR);
+        case FRAME_PING:
+            if(stream_id != 0)
+                return connectionError(H2_PROTOCOL_ERROR);
+            if(len != 8)
+                return connectionError(H2_FRAME_SIZE_ERROR);
+            if(!(flags & FLAG_ACK))
+            {
+                appendFrameHeader(8, FRAME_PING, FLAG_ACK, 0);
+                out_.append(reinterpret_cast<const char*>(payload), 8);
+            }
+            return true;
+        case FRAME_GOAWAY:
+            if(stream_id != 0)
+                return connectionError(H2_PROTOCOL_ERROR);
+            if(len < 8)
+                return connectionError(H2_FRAME_SIZE_ERROR);
+            INFO("HTTP/2 GOAWAY from socket(%d) (error %u)", conn_->client_fd_, readUint32(payload + 4));
+            // No new streams will come, close the connection after the open ones
+            if(!goaway_sent_)
+                appendGoaway(H2_NO_ERROR);
+            return true;
+        case FRAME_WINDOW_UPDATE:
+            return onWindowUpdate(stream_id, payload, len);
+        default:
+            // The unknown frames are ignored
+            return true;
+    }
+}
+
+bool Http2Session::onData(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len)
+{
+    if(stream_id == 0)
+        return connectionError(H2_PROTOCOL_ERROR);
+
+    // The connection window is returned at once, the buffered data is limited by the stream windows
+    conn_recv_window_ -= len;
+    if(conn_recv_window_ < 0)
+        return connectionError(H2_FLOW_CONTROL_ERROR);
+    if(conn_recv_window_ < CONN_RECV_WINDOW / 2)
+    {
+        appendWindowUpdate(0, static_cast<uint32_t>(CONN_RECV_WINDOW - conn_recv_window_));
+        conn_recv_window_ = CONN_RECV_WINDOW;
+    }
+
+    const uint8_t* data = payload;
+    uint32_t data_len = len;
+    if(flags & FLAG_PADDED)
+    {
+        if(len < 1 || payload[0] >= len)
+            return connectionError(H2_PROTOCOL_ERROR);
+        data = payload + 1;
+        data_len = len - 1 - payload[0];
+    }
+
+    auto iter = streams_.find(stream_id);
+    if(iter == streams_.end())
+    {
+        if(stream_id > last_stream_id_)
+            return connectionError(H2_PROTOCOL_ERROR);
+        // The stream was closed by the server, the frames in flight are dropped
+        return true;
+    }
+    Stream* stream = iter->second;
+    if(stream->remote_closed)
+    {
+        resetStream(stream, H2_STREAM_CLOSED);
+        return true;
+    }
+    stream->recv_window -= len;
+    if(stream->recv_window < 0)
+    {
+        resetStream(stream, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    if(flags & FLAG_END_STREAM)
+        stream->remote_closed = true;
+
+    stream->body_received += data_len;
+    if(stream->is_cgi && stream->cgi_in_fd != -1)
+    {
+        if(stream->body_received > HttpHandler::maxBodySize)
+        {
+            WARN("HTTP/2 stream %u: Payload Too Large.", stream_id);
+            stopCgi(stream, true);
+            stream->is_cgi = false;
+            if(stream->headers_sent)
+                resetStream(stream, H2_CANCEL);
+            else
+                respondError(stream, 413);
+            return true;
+        }
+        stream->cgi_in.append(reinterpret_cast<const char*>(data), data_len);
+        stream->recv_unacked += len - data_len;
+    }
+    else if(stream->route_pending)
+    {
+        // The body of a native route is limited, its window is returned at once
+        stream->recv_unacked += len;
+        if(stream->body_received > Router::getMaxBodySize())
+        {
+            WARN("HTTP/2 stream %u: Payload Too Large.", stream_id);
+            stream->route_pending = false;
+            string().swap(stream->route_body);
+            respondError(stream, 413);
+            return true;
+        }
+        stream->route_body.append(reinterpret_cast<const char*>(data), data_len);
+        if(stream->remote_closed)
+            runPendingRoute(stream);
+    }
+    else
+        stream->recv_unacked += len;
+    return true;
+}
+
+bool Http2Session::onHeaders(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len)
+{
+    if(type == FRAME_CONTINUATION)
+    {
+        if(header_stream_ == 0)
+            return connectionError(H2_PROTOCOL_ERROR);
+        header_block_.append(reinterpret_cast<const char*>(payload), len);
+    }
+    else
+    {
+        if(stream_id == 0 || !(stream_id & 1))
+            return connectionError(H2_PROTOCOL_ERROR);
+        const uint8_t* p = payload;
+        uint32_t n = len;
+        if(flags & FLAG_PADDED)
+        {
+            if(n < 1 || p[0] >= n)
+                return connectionError(H2_PROTOCOL_ERROR);
+            n -= 1 + p[0];
+            ++p;
+        }
+        if(flags & FLAG_PRIORITY)
+        {
+            if(n < 5)
+                return connectionError(H2_PROTOCOL_ERROR);
+            p += 5;
+            n -= 5;
+        }
+        header_block_.assign(reinterpret_cast<const char*>(p), n);
+        header_stream_ = stream_id;
+        header_end_stream_ = flags & FLAG_END_STREAM;
+    }
+    if(header_block_.size() > HttpHandler::maxHeaderSize * 2)
+        return connectionError(H2_ENHANCE_YOUR_CALM);
+    if(!(flags & FLAG_END_HEADERS))
+        return true;
+    return onHeaderBlock();
+}
+
+bool Http2Session::onHeaderBlock()
+{
+    uint32_t stream_id = header_stream_;
+    header_stream_ = 0;
+    HeaderList fields;
+    // The block is always decoded, the dynamic table is shared by all the streams
+    HpackDecoder::DECODE_RESULT result = decoder_.decode(reinterpret_cast<const uint8_t*>(header_block_.data()),
+                                                         header_block_.size(), &fields);
+    header_block_.clear();
+    if(result == HpackDecoder::DECODE_ERROR)
+        return connectionError(H2_COMPRESSION_ERROR);
+
+    auto iter = streams_.find(stream_id);
+    if(iter != streams_.end())
+    {
+        // The trailers end the request body, they are not passed to the CGI
+        Stream* stream = iter->second;
+        if(stream->remote_closed)
+            resetStream(stream, H2_STREAM_CLOSED);
+        else if(!header_end_stream_)
+            resetStream(stream, H2_PROTOCOL_ERROR);
+        else
+        {
+            stream->remote_closed = true;
+            if(stream->route_pending)
+                runPendingRoute(stream);
+        }
+        return true;
+    }
+    // A stream closed by the server
+    if(stream_id <= last_stream_id_)
+        return true;
+    last_stream_id_ = stream_id;
+    // The streams after GOAWAY are not answered, the client retries them on a new connection
+    if(goaway_sent_)
+        return true;
+
+    Stream* stream = new Stream(stream_id);
+    stream->remote_closed = header_end_stream_;
+    stream->send_window = peer_initial_window_;
+    stream->recv_window = DEFAULT_WINDOW;
+    streams_[stream_id] = stream;
+    if(streams_.size() > MAX_CONCURRENT_STREAMS)
+    {
+        resetStream(stream, H2_REFUSED_STREAM);
+        return true;
+    }
+    if(result == HpackDecoder::DECODE_TOO_LARGE)
+    {
+        respondError(stream, 431);
+        return true;
+    }
+
+    // The pseudo fields come first, the regular fields are kept like the headers of HTTP/1.1
+    string uri;
+    bool regular = false;
+    bool malformed = false;
+    for(const pair<string, string>& field : fields)
+    {
+        const string& name = field.first;
+        const string& value = field.second;
+        if(name.empty() || any_of(name.begin(), name.end(), ::isupper))
+            malformed = true;
+        else if(name[0] == ':')
+        {
+            if(regular)
+                malformed = true;
+            else if(name == ":method")
+                stream->method = value;
+            else if(name == ":path")
+                uri = value;
+            else if(name == ":authority")
+                stream->headers["host"] = value;
+            else if(name != ":scheme")
+                malformed = true;
+        }
+        else
+        {
+            regular = true;
+            if(name == "connection" || name == "keep-alive" || name == "transfer-encoding"
+               || name == "upgrade" || name == "proxy-connection")
+                malformed = true;
+            string& slot = stream->headers[name];
+            if(slot.empty())
+                slot = value;
+            else
+                slot += (name == "cookie" ? "; " : ", ") + value;
+        }
+    }
+    if(malformed || stream->method.empty() || uri.empty() || uri[0] != '/')
+    {
+        WARN("HTTP/2 stream %u: malformed request.", stream_id);
+        resetStream(stream, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    stream->path = HttpHandler::www_path + "/" + uri;
+    HttpHandler::request_total_.fetch_add(1, memory_order_relaxed);
+    // Every stream is a request of the client, the upgrade request was counted by the connection
+    if(!RateLimit::allowRequest(conn_->client_key_))
+    {
+        WARN("HTTP/2 stream %u: too many requests.", stream_id);
+        respondError(stream, 429);
+    }
+    else
+        startStream(stream);
+    return true;
+}
+
+bool Http2Session::onSettings(uint8_t flags, const uint8_t* payload, uint32_t len)
+{
+    if(flags & FLAG_ACK)
+        return len == 0 || connectionError(H2_FRAME_SIZE_ERROR);
+    if(len % 6 != 0)
+        return connectionError(H2_FRAME_SIZE_ERROR);
+    if(!applySettings(payload, len))
+        return false;
+    settings_received_ = true;
+    appendFrameHeader(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    return true;
+}
+
+bool Http2Session::applySettings(const uint8_t* payload, uint32_t len)
+{
+    for(uint32_t i = 0; i + 6 <= len; i += 6)
+    {
+        uint16_t id = static_cast<uint16_t>((payload[i] << 8) | payload[i + 1]);
+        uint32_t value = readUint32(payload + i + 2);
+        switch(id)
+        {
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1)
+                    return connectionError(H2_PROTOCOL_ERROR);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if(value > MAX_WINDOW)
+                    return connectionError(H2_FLOW_CONTROL_ERROR);
+                // The change applies to the open streams too
+                int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+                for(auto& kv : streams_)
+                {
+                    kv.second->send_window += delta;
+                    if(kv.second->send_window > MAX_WINDOW)
+                        return connectionError(H2_FLOW_CONTROL_ERROR);
+                }
+                peer_initial_window_ = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if(value < MAX_FRAME_SIZE || value > 0xffffff)
+                    return connectionError(H2_PROTOCOL_ERROR);
+                // The larger frames only save a few bytes, keep the default
+                peer_max_frame_size_ = min(value, MAX_FRAME_SIZE);
+                break;
+            default:
+                // The encoder never uses the dynamic table, the other limits are not needed
+                break;
+        }
+    }
+    return true;
+}
+
+bool Http2Session::onWindowUpdate(uint32_t stream_id, const uint8_t* payload, uint32_t len)
+{
+    if(len != 4)
+        return connectionError(H2_FRAME_SIZE_ERROR);
+    uint32_t increment = readUint32(payload) & 0x7fffffff;
+    if(stream_id == 0)
+    {
+        if(increment == 0)
+            return connectionError(H2_PROTOCOL_ERROR);
+        conn_send_window_ += increment;
+        if(conn_send_window_ > MAX_WINDOW)
+            return connectionError(H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+
+    auto iter = streams_.find(stream_id);
+    if(iter == streams_.end())
+        return stream_id <= last_stream_id_ || connectionError(H2_PROTOCOL_ERROR);
+    Stream* stream = iter->second;
+    if(increment == 0)
+        resetStream(stream, H2_PROTOCOL_ERROR);
+    else if((stream->send_window += increment) > MAX_WINDOW)
+        resetStream(stream, H2_FLOW_CONTROL_ERROR);
+    return true;
+}
+
+bool Http2Session::connectionError(H2_ERROR code)
+{
+    WARN("HTTP/2 connection error %d (socket: %d)", code, conn_->client_fd_);
+    if(!closing_)
+    {
+        goaway_sent_ = false;
+        appendGoaway(code);
+    }
+    closing_ = true;
+    return false;
+}
+
+int Http2Session::methodType(const string& method)
+{
+    if(method == "GET")
+        return HttpHandler::METHOD_GET;
+    else if(method == "HEAD")
+        return HttpHandler::METHOD_HEAD;
+    else if(method == "POST")
+        return HttpHandler::METHOD_POST;
+    return -1;
+}
+
+/**
+ * @brief Answer a request by its route like HTTP/1.1
+ */
+void Http2Session::startStream(Stream* stream)
+{
+    INFO("HTTP/2 stream %u: %s %s", stream->id, stream->method.c_str(), stream->path.c_str());
+    int method = methodType(stream->method);
+    if(method == -1)
+    {
+        respondError(stream, 501);
+        return;
+    }
+    Router::Request req;
+    const Router::Route* route = Router::match(method, stream->path.c_str() + HttpHandler::www_path.size() + 1, &req);
+    if(!route)
+    {
+        respondError(stream, 404);
+        return;
+    }
+    switch(route->type)
+    {
+        case Router::ROUTE_HANDLER:
+            if(stream->remote_closed)
+                runRoute(stream, route, &req);
+            else
+                stream->route_pending = true;
+            break;
+        case Router::ROUTE_PROXY:
+            // The proxy relays HTTP/1.1 connections only
+            respondError(stream, 501);
+            break;
+        case Router::ROUTE_STATIC:
+            respondStatic(stream);
+            break;
+        case Router::ROUTE_CGI:
+            startCgi(stream);
+            break;
+    }
+}
+
+/**
+ * @brief Run a native handler with the whole request body, its body is sent from route_out
+ */
+void Http2Session::runRoute(Stream* stream, const Router::Route* route, Router::Request* req)
+{
+    TraceSpan span("route handler");
+    stream->route_pending = false;
+    req->body = Router::View(stream->route_body.data(), stream->route_body.size());
+    req->headers = &stream->headers;
+    req->peer = conn_->getPeerCred();
+    Router::Response resp(&stream->route_out);
+    route->handler(*req, &resp, route->arg);
+    string().swap(stream->route_body);
+
+    size_t line_len;
+    int code = resp.getStatus();
+    if(!ResponseBuilder::getStatusLine(code, &line_len))
+    {
+        WARN("Route %s answered the unknown status %d", route->pattern.c_str(), code);
+        string().swap(stream->route_out);
+        respondError(stream, 500);
+        return;
+    }
+    string fields = "Content-Type: ";
+    fields += resp.getContentType().empty() ? MimeType::getMineType("txt") : resp.getContentType();
+    fields += "\r\nContent-Length: " + to_string(stream->route_out.size()) + "\r\n";
+    fields += resp.getFields();
+    stream->body.release();
+    stream->body.data = stream->route_out.data();
+    stream->body.len = (stream->method == "HEAD") ? 0 : stream->route_out.size();
+    sendHeaders(stream, code, fields, stream->body.len == 0);
+}
+
+void Http2Session::runPendingRoute(Stream* stream)
+{
+    Router::Request req;
+    const Router::Route* route = Router::match(methodType(stream->method),
+                                               stream->path.c_str() + HttpHandler::www_path.size() + 1, &req);
+    assert(route && route->type == Router::ROUTE_HANDLER);
+    runRoute(stream, route, &req);
+}
+
+void Http2Session::respondStatic(Stream* stream)
+{
+    int code = 200;
+    string fields;
+    HttpHandler::ERROR_TYPE err = HttpHandler::findStaticFile(stream->path, stream->headers,
+                                                              &stream->body, &fields, &code);
+    if(err != HttpHandler::ERR_SUCCESS)
+    {
+        stream->body.release();
+        respondError(stream, err == HttpHandler::ERR_NOT_FOUND ? 404 : 500);
+        return;
+    }
+    if(stream->method == "HEAD")
+        stream->body.len = 0;
+    sendHeaders(stream, code, fields, stream->body.len == 0);
+}
+
+void Http2Session::respondError(Stream* stream, int code)
+{
+    const ErrorPages::Page* page = ErrorPages::get(code);
+    assert(page);
+    stream->body.release();
+    if(stream->method != "HEAD")
+    {
+        stream->body.data = page->tail.data() + page->header_len;
+        stream->body.len = page->tail.size() - page->header_len;
+    }
+    sendHeaders(stream, code, string(page->tail.data(), page->header_len), stream->body.len == 0);
+}
+
+/**
+ * @brief Queue the HEADERS and CONTINUATION frames of a response
+ * @param fields  the "Name: value\r\n" lines after the status line of HTTP/1.1
+ */
+void Http2Session::sendHeaders(Stream* stream, int code, const string& fields, bool end_stream)
+{
+    HeaderList list;
+    list.emplace_back(":status", to_string(code));
+    ResponseBuilder common;
+    common.date();
+    common.server();
+    appendFields(common.data(), common.size(), &list);
+    appendFields(fields.data(), fields.size(), &list);
+
+    string block;
+    encoder_.encode(list, &block);
+    size_t off = 0;
+    bool first = true;
+    do
+    {
+        size_t n = min(block.size() - off, static_cast<size_t>(peer_max_frame_size_));
+        uint8_t flags = (off + n == block.size()) ? FLAG_END_HEADERS : 0;
+        if(first && end_stream)
+            flags |= FLAG_END_STREAM;
+        appendFrameHeader(static_cast<uint32_t>(n), first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream->id);
+        out_.append(block, off, n);
+        off += n;
+        first = false;
+    } while(off < block.size());
+
+    stream->headers_sent = true;
+    stream->status = code;
+    stream->bytes_out += block.size();
+    if(stream->access_start)
+        stream->access_response = Trace::now();
+    if(end_stream)
+        stream->local_closed = true;
+}
+
+void Http2Session::resetStream(Stream* stream, H2_ERROR code)
+{
+    appendRstStream(stream->id, code);
+    closeStream(stream);
+}
+
+void Http2Session::closeStream(Stream* stream)
+{
+    logStream(stream);
+    if(HeavyHitters::isEnabled())
+    {
+        // path is www_path + "/" + :path
+        const char* path = stream->path.c_str() + min(stream->path.size(), HttpHandler::www_path.size() + 1);
+        conn_->recordHeavyHitters(path, strcspn(path, "?"), stream->bytes_out);
+    }
+    stopCgi(stream, true);
+    stream->body.release();
+    streams_.erase(stream->id);
+    delete stream;
+}
+
+/**
+ * @brief Append the access record of a stream, the peer and the TLS come from the connection
+ */
+void Http2Session::logStream(Stream* stream)
+{
+    if(!stream->access_start || !AccessLog::isEnabled())
+        return;
+    int64_t now = Trace::now();
+    AccessLog::Record record = conn_->access_;
+    if(stream->method == "GET")
+        record.method = AccessLog::RECORD_GET;
+    else if(stream->method == "POST")
+        record.method = AccessLog::RECORD_POST;
+    else if(stream->method == "HEAD")
+        record.method = AccessLog::RECORD_HEAD;
+    else
+        record.method = AccessLog::RECORD_OTHER;
+    record.flags = (conn_->access_.flags & AccessLog::FLAG_IPV6) | AccessLog::FLAG_HTTP2;
+    if(conn_->tls_)
+        record.flags |= AccessLog::FLAG_TLS;
+    if(!stream->local_closed)
+        record.flags |= AccessLog::FLAG_ABORTED;
+    record.status = static_cast<uint16_t>(stream->status);
+    record.time_us = AccessLog::toWallClock(stream->access_start);
+    record.total_us = static_cast<uint32_t>(min<int64_t>(now - stream->access_start, UINT32_MAX));
+    // The HEADERS are complete when the stream starts
+    record.read_us = 0;
+    record.handle_us = stream->access_response ?
+                       static_cast<uint32_t>(min<int64_t>(stream->access_response - stream->access_start, UINT32_MAX)) : 0;
+    record.bytes_in = stream->body_received;
+    record.bytes_out = stream->bytes_out;
+    // path is www_path + "/" + :path
+    const char* path = stream->path.c_str() + min(stream->path.size(), HttpHandler::www_path.size() + 1);
+    AccessLog::append(&record, path, strcspn(path, "?"));
+    stream->access_start = 0;
+}
+
+/**
+ * @brief Run the CGI of a POST stream, the checks are the same as HTTP/1.1
+ */
+void Http2Session::startCgi(Stream* stream)
+{
+    if(!is_path_parent(HttpHandler::www_path, stream->path))
+    {
+        respondError(stream, 404);
+        return;
+    }
+    struct stat st;
+    if(stat(stream->path.c_str(), &st) == -1)
+    {
+        WARN("Can not get file [%s] state ! (%s)", stream->path.c_str(), strerror(errno));
+        respondError(stream, errno == ENOENT ? 404 : 500);
+        return;
+    }
+    if(S_ISDIR(st.st_mode))
+        stream->path += "/index.html";
+
+    pid_t pid = HttpHandler::spawnCgi(stream->path, conn_->getPeerCred(), &stream->cgi_in_fd, &stream->cgi_out_fd);
+    if(pid == -1)
+    {
+        respondError(stream, 500);
+        return;
+    }
+    stream->is_cgi = true;
+    stream->cgi_pid = pid;
+
+    // The pipes of all the streams wake up the connection, and every wakeup polls all of them
+    void* event = &conn_->stream_event_;
+    stream->cgi_in_wait = stream->cgi_out_wait = true;
+    if(!conn_->epoll_->add(stream->cgi_in_fd, event, 0)
+       || !conn_->epoll_->add(stream->cgi_out_fd, event, 0))
+    {
+        WARN("Register CGI fds(%d, %d) fail! (%s)", stream->cgi_in_fd, stream->cgi_out_fd, strerror(errno));
+        stopCgi(stream, true);
+        stream->is_cgi = false;
+        respondError(stream, 500);
+    }
+}
+
+void Http2Session::stopCgi(Stream* stream, bool kill_child)
+{
+    closeCgiInput(stream);
+    if(stream->cgi_out_fd != -1)
+    {
+        conn_->epoll_->del(stream->cgi_out_fd);
+        close(stream->cgi_out_fd);
+        stream->cgi_out_fd = -1;
+    }
+    if(stream->cgi_pid == -1)
+        return;
+    if(kill_child)
+        HttpHandler::killProcess(stream->cgi_pid);
+    HttpHandler::waitProcess(stream->cgi_pid);
+    stream->cgi_pid = -1;
+}
+
+/**
+ * @brief Close the CGI input, the rest of the request body is dropped
+ */
+void Http2Session::closeCgiInput(Stream* stream)
+{
+    if(stream->cgi_in_fd == -1)
+        return;
+    conn_->epoll_->del(stream->cgi_in_fd);
+    close(stream->cgi_in_fd);
+    stream->cgi_in_fd = -1;
+    stream->recv_unacked += stream->cgi_in.size() - stream->cgi_in_off;
+    stream->cgi_in.clear();
+    stream->cgi_in_off = 0;
+    // The CGI runtime is counted after the whole request is received
+    if(stream->cgi_pid != -1 && stream->cgi_deadline == 0)
+        stream->cgi_deadline = nowMs() + conn_->maxCGIRuntime;
+}
+
+/**
+ * @brief Write the request body to the CGI and read its output, then return the consumed window
+ *        The stream is closed if the CGI failed
+ */
+void Http2Session::pumpStream(Stream* stream)
+{
+    if(stream->is_cgi)
+    {
+        // 1. the request body, the window is returned after the CGI takes it
+        while(stream->cgi_in_fd != -1 && stream->cgi_in_off < stream->cgi_in.size())
+        {
+            ssize_t len = write(stream->cgi_in_fd, stream->cgi_in.data() + stream->cgi_in_off,
+                                stream->cgi_in.size() - stream->cgi_in_off);
+            if(len < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN)
+                {
+                    stream->cgi_in_wait = true;
+                    break;
+                }
+                // The CGI does not read its input
+                closeCgiInput(stream);
+                break;
+            }
+            stream->cgi_in_off += static_cast<size_t>(len);
+            stream->recv_unacked += static_cast<size_t>(len);
+        }
+        if(stream->cgi_in_off == stream->cgi_in.size())
+        {
+            stream->cgi_in.clear();
+            stream->cgi_in_off = 0;
+            if(stream->remote_closed)
+                closeCgiInput(stream);
+        }
+
+        // 2. the output, buffered until the flow control allows it
+        while(stream->cgi_out_fd != -1 && stream->cgi_out.size() - stream->cgi_out_off < CGI_OUT_BUF)
+        {
+            if(stream->cgi_out_off == stream->cgi_out.size())
+            {
+                stream->cgi_out.clear();
+                stream->cgi_out_off = 0;
+            }
+            char buf[16384];
+            size_t room = CGI_OUT_BUF - (stream->cgi_out.size() - stream->cgi_out_off);
+            ssize_t len = read(stream->cgi_out_fd, buf, min(room, sizeof(buf)));
+            if(len > 0)
+            {
+                stream->cgi_out.append(buf, static_cast<size_t>(len));
+                last_active_ = nowMs();
+                continue;
+            }
+            if(len < 0 && errno == EINTR)
+                continue;
+            if(len < 0 && errno == EAGAIN)
+            {
+                stream->cgi_out_wait = true;
+                break;
+            }
+            // The CGI closed its output
+            stopCgi(stream, false);
+            stream->cgi_eof = true;
+        }
+        if(stream->cgi_out_off > 0 && stream->cgi_out_off >= stream->cgi_out.size() / 2)
+        {
+            stream->cgi_out.erase(0, stream->cgi_out_off);
+            stream->cgi_out_off = 0;
+        }
+
+        // 3. the headers are sent with the first output
+        if(!stream->headers_sent && stream->cgi_out.size() > stream->cgi_out_off)
+            sendHeaders(stream, 200, "Content-Type: " + MimeType::getMineType("txt") + "\r\n", false);
+        if(stream->cgi_eof && !stream->headers_sent)
+        {
+            stream->is_cgi = false;
+            respondError(stream, 500);
+        }
+        else if(stream->cgi_eof && stream->cgi_timeout)
+        {
+            // Do not end the stream, so that the client knows the output is truncated
+            resetStream(stream, H2_INTERNAL_ERROR);
+            return;
+        }
+    }
+
+    // Return the window when half of it is consumed
+    if(!stream->remote_closed && stream->recv_unacked >= DEFAULT_WINDOW / 2)
+    {
+        appendWindowUpdate(stream->id, static_cast<uint32_t>(stream->recv_unacked));
+        stream->recv_window += static_cast<int64_t>(stream->recv_unacked);
+        stream->recv_unacked = 0;
+    }
+}
+
+/**
+ * @brief Queue the DATA frames of the streams round-robin, until out_ reaches the high water mark
+ * @return true if any frame was queued
+ */
+bool Http2Session::scheduleData()
+{
+    bool produced = false;
+    bool progress = true;
+    while(progress && out_.size() - out_off_ < OUT_HIGH_WATER && !streams_.empty())
+    {
+        progress = false;
+        // one frame of every stream in a round, starting after the last served one
+        auto iter = streams_.upper_bound(last_sent_id_);
+        for(size_t i = 0, n = streams_.size(); i < n && !streams_.empty(); i++)
+        {
+            if(out_.size() - out_off_ >= OUT_HIGH_WATER)
+                break;
+            if(iter == streams_.end())
+                iter = streams_.begin();
+            Stream* stream = iter->second;
+            ++iter;
+
+            if(!stream->local_closed)
+            {
+                if(!stream->headers_sent)
+                    continue;
+                size_t avail = stream->is_cgi ? stream->cgi_out.size() - stream->cgi_out_off : stream->body.len;
+                bool last = !stream->is_cgi || stream->cgi_eof;
+                if(avail == 0 && !last)
+                    continue;
+                int64_t window = min(stream->send_window, conn_send_window_);
+                size_t len = min(avail, static_cast<size_t>(peer_max_frame_size_));
+                len = (window <= 0) ? 0 : min(len, static_cast<size_t>(window));
+                // Blocked by the flow control
+                if(len == 0 && avail > 0)
+                    continue;
+
+                bool end = last && len == avail;
+                appendFrameHeader(static_cast<uint32_t>(len), FRAME_DATA, end ? FLAG_END_STREAM : 0, stream->id);
+                stream->bytes_out += len;
+                if(stream->is_cgi)
+                {
+                    out_.append(stream->cgi_out, stream->cgi_out_off, len);
+                    stream->cgi_out_off += len;
+                }
+                else if(stream->body.data)
+                {
+                    out_.append(stream->body.data + stream->body.off, len);
+                    stream->body.off += static_cast<off_t>(len);
+                    stream->body.len -= len;
+                }
+                else
+                {
+                    size_t base = out_.size();
+                    out_.resize(base + len);
+                    if(!preadFull(stream->body.fd, &out_[base], len, stream->body.off))
+                    {
+                        out_.resize(base - FRAME_HEADER_LEN);
+                        WARN("HTTP/2 stream %u: read body failed.", stream->id);
+                        resetStream(stream, H2_INTERNAL_ERROR);
+                        continue;
+                    }
+                    stream->body.off += static_cast<off_t>(len);
+                    stream->body.len -= len;
+                }
+                stream->send_window -= static_cast<int64_t>(len);
+                conn_send_window_ -= static_cast<int64_t>(len);
+                last_sent_id_ = stream->id;
+                produced = progress = true;
+                stream->local_closed = end;
+            }
+            if(stream->local_closed)
+            {
+                // The response is complete, the rest of the request is not needed
+                if(!stream->remote_closed)
+                    appendRstStream(stream->id, H2_NO_ERROR);
+                closeStream(stream);
+            }
+        }
+    }
+    return produced;
+}
+
+bool Http2Session::hasSendableData() const
+{
+    for(auto& kv : streams_)
+    {
+        const Stream* stream = kv.second;
+        if(!stream->headers_sent)
+            continue;
+        if(stream->local_closed)
+            return true;
+        size_t avail = stream->is_cgi ? stream->cgi_out.size() - stream->cgi_out_off : stream->body.len;
+        if(avail == 0 ? (!stream->is_cgi || stream->cgi_eof)
+                      : (stream->send_window > 0 && conn_send_window_ > 0))
+            return true;
+    }
+    return false;
+}
+
+void Http2Session::checkTimeouts(int64_t now)
+{
+    for(auto& kv : streams_)
+    {
+        Stream* stream = kv.second;
+        // Kill the CGI, the output pipe will be closed soon
+        if(stream->cgi_pid != -1 && stream->cgi_deadline != 0 && now >= stream->cgi_deadline && !stream->cgi_timeout)
+        {
+            WARN("HTTP/2 stream %u: sub process timeout.", stream->id);
+            HttpHandler::killProcess(stream->cgi_pid);
+            stream->cgi_timeout = true;
+        }
+    }
+}
+
+int64_t Http2Session::nextDeadline() const
+{
+    int64_t deadline = last_active_ + conn_->timeoutPerRequest * 1000;
+    for(auto& kv : streams_)
+    {
+        const Stream* stream = kv.second;
+        if(stream->cgi_pid != -1 && stream->cgi_deadline != 0 && !stream->cgi_timeout)
+            deadline = min(deadline, stream->cgi_deadline);
+    }
+    return deadline;
+}
+
+/**
+ * @brief Send out_ until the socket is full
+ * @return false if the connection is broken
+ */
+bool Http2Session::flush()
+{
+    while(out_off_ < out_.size())
+    {
+        ssize_t len = conn_->sendClient(out_.data() + out_off_, out_.size() - out_off_, 0);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            ERROR("HTTP/2 send failed ! (%s)", strerror(errno));
+            return false;
+        }
+        out_off_ += static_cast<size_t>(len);
+        last_active_ = nowMs();
+    }
+    if(out_off_ == out_.size())
+    {
+        out_.clear();
+        out_off_ = 0;
+    }
+    else if(out_off_ >= OUT_HIGH_WATER)
+    {
+        out_.erase(0, out_off_);
+        out_off_ = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief Wait for the socket, and for the socket writable if there is something to send
+ *        The timer is the idle timeout of the connection or the nearest CGI deadline
+ */
+bool Http2Session::rearmEvents()
+{
+    // Do not hold the memory of a large response on an idle connection
+    if(streams_.empty() && out_.empty() && out_.capacity() > OUT_HIGH_WATER)
+        string().swap(out_);
+
+    bool ret1 = true, ret2;
+    if(conn_->timer_)
+    {
+        int64_t delay = max<int64_t>(nextDeadline() - nowMs(), 1);
+        conn_->timer_->setTime(delay / 1000, (delay % 1000) * 1000000L);
+        ret1 = conn_->epoll_->modify(conn_->timer_->getFd(), conn_->getTimerEpollEvent(), conn_->getTimerTriggerCond());
+    }
+    int client_events = conn_->getClientTriggerCond();
+    if(out_off_ < out_.size() || hasSendableData())
+        client_events |= EPOLLOUT;
+    ret2 = conn_->epoll_->modify(conn_->client_fd_, conn_->getClientEpollEvent(), client_events);
+    // readFrames() stops at the same backlog
+    if(out_.size() - out_off_ < OUT_HIGH_WATER * 4)
+        conn_->wakeForTlsPending();
+
+    // Only the pipes found empty or full are waited, a full output buffer is read after the window opens
+    bool ret3 = true;
+    for(auto& kv : streams_)
+    {
+        Stream* stream = kv.second;
+        if(stream->cgi_out_wait && stream->cgi_out_fd != -1)
+            ret3 = conn_->epoll_->modify(stream->cgi_out_fd, &conn_->stream_event_, conn_->getPipeTriggerCond()) && ret3;
+        if(stream->cgi_in_wait && stream->cgi_in_fd != -1)
+            ret3 = conn_->epoll_->modify(stream->cgi_in_fd, &conn_->stream_event_, conn_->getPipeWriteCond()) && ret3;
+        stream->cgi_out_wait = stream->cgi_in_wait = false;
+    }
+    assert(ret1 && ret2 && ret3);
+    return ret1 && ret2 && ret3;
+}
+
+void Http2Session::appendFrameHeader(uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    char header[FRAME_HEADER_LEN] = {
+            static_cast<char>(len >> 16), static_cast<char>(len >> 8), static_cast<char>(len),
+            static_cast<char>(type), static_cast<char>(flags),
+            static_cast<char>(stream_id >> 24), static_cast<char>(stream_id >> 16),
+            static_cast<char>(stream_id >> 8), static_cast<char>(stream_id)
+    };
+    out_.append(header, FRAME_HEADER_LEN);
+}
+
+void Http2Session::appendSettings()
+{
+    static const uint16_t ids[] = { SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_MAX_HEADER_LIST_SIZE };
+    uint32_t values[] = { MAX_CONCURRENT_STREAMS, static_cast<uint32_t>(HttpHandler::maxHeaderSize) };
+    appendFrameHeader(6 * 2, FRAME_SETTINGS, 0, 0);
+    for(int i = 0; i < 2; i++)
+    {
+        out_.push_back(static_cast<char>(ids[i] >> 8));
+        out_.push_back(static_cast<char>(ids[i]));
+        appendUint32(&out_, values[i]);
+    }
+}
+
+void Http2Session::appendWindowUpdate(uint32_t stream_id, uint32_t increment)
+{
+    appendFrameHeader(4, FRAME_WINDOW_UPDATE, 0, stream_id);
+    appendUint32(&out_, increment);
+}
+
+void Http2Session::appendRstStream(uint32_t stream_id, H2_ERROR code)
+{
+    appendFrameHeader(4, FRAME_RST_STREAM, 0, stream_id);
+    appendUint32(&out_, code);
+}
+
+void Http2Session::appendGoaway(H2_ERROR code)
+{
+    if(goaway_sent_)
+        return;
+    appendFrameHeader(8, FRAME_GOAWAY, 0, 0);
+    appendUint32(&out_, last_stream_id_);
+    appendUint32(&out_, code);
+    goaway_sent_ = true;
+}
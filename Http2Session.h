@@ -0,0 +1,239 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_HTTP2SESSION_H
+#define WEBSERVER_HTTP2SESSION_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "Hpack.h"
+#include "HttpHandler.h"
+
+using namespace std;
+
+/**
+ * @brief The HTTP/2 cleartext (h2c) state of a connection, created by HttpHandler after the
+ *        connection preface ("prior knowledge") or after answering "Upgrade: h2c" with 101
+ *
+ * The session runs inside the event loop of its HttpHandler, so it is never run by two threads at once.
+ * The socket is still read into the input buffer of the handler, the frames are parsed from it and the
+ * output frames are queued in out_, then sent when the socket is writable.
+ *
+ * Every stream is a static response or a CGI. The static bodies are read into DATA frames when there is
+ * flow control window. The CGI pipes of all the streams share one epoll data of the connection, so every
+ * wakeup polls all of them, and the pipes which reached EAGAIN are rearmed. The DATA frames of the streams
+ * are interleaved round-robin.
+ */
+class Http2Session
+{
+public:
+    // "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+    static constexpr size_t PREFACE_LEN = 24;
+
+    /**
+     * @brief Match the beginning of a connection with the client preface
+     * @return 1 if matched, 0 if the data is a prefix of the preface, -1 if it is not
+     */
+    static int matchPreface(const char* data, size_t len);
+
+    /**
+     * @brief Decode the HTTP2-Settings header of an upgrade request
+     * @return false if the value is not a valid SETTINGS payload in base64url, the upgrade is ignored then
+     */
+    static bool decodeUpgradeSettings(const string& value, string* payload);
+
+    /**
+     * @brief Start the session, the server connection preface is queued
+     * @param upgrade_settings  the decoded HTTP2-Settings of an upgrade, nullptr for the prior knowledge
+     */
+    Http2Session(HttpHandler* conn, const string* upgrade_settings);
+    ~Http2Session();
+
+    Http2Session(const Http2Session&) = delete;
+    Http2Session& operator=(const Http2Session&) = delete;
+
+    /**
+     * @brief Answer the request of the upgrade as stream 1, its request is complete
+     */
+    void startUpgradeStream(const string& method, const string& path, const map<string, string>& headers);
+
+    /**
+     * @brief Handle the events of the connection, the events are EVENT_TYPE of HttpHandler
+     * @return false if the connection should be closed
+     */
+    bool RunEventLoop(unsigned events);
+
+private:
+    enum FRAME_TYPE
+    {
+        FRAME_DATA          = 0x0,
+        FRAME_HEADERS       = 0x1,
+        FRAME_PRIORITY      = 0x2,
+        FRAME_RST_STREAM    = 0x3,
+        FRAME_SETTINGS      = 0x4,
+        FRAME_PUSH_PROMISE  = 0x5,
+        FRAME_PING          = 0x6,
+        FRAME_GOAWAY        = 0x7,
+        FRAME_WINDOW_UPDATE = 0x8,
+        FRAME_CONTINUATION  = 0x9
+    };
+
+    enum FRAME_FLAG
+    {
+        FLAG_END_STREAM     = 0x1,
+        FLAG_ACK            = 0x1,
+        FLAG_END_HEADERS    = 0x4,
+        FLAG_PADDED         = 0x8,
+        FLAG_PRIORITY       = 0x20
+    };
+
+    enum SETTINGS_ID
+    {
+        SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+        SETTINGS_ENABLE_PUSH            = 0x2,
+        SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+        SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+        SETTINGS_MAX_FRAME_SIZE         = 0x5,
+        SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6
+    };
+
+    enum H2_ERROR
+    {
+        H2_NO_ERROR             = 0x0,
+        H2_PROTOCOL_ERROR       = 0x1,
+        H2_INTERNAL_ERROR       = 0x2,
+        H2_FLOW_CONTROL_ERROR   = 0x3,
+        H2_STREAM_CLOSED        = 0x5,
+        H2_FRAME_SIZE_ERROR     = 0x6,
+        H2_REFUSED_STREAM       = 0x7,
+        H2_CANCEL               = 0x8,
+        H2_COMPRESSION_ERROR    = 0x9,
+        H2_ENHANCE_YOUR_CALM    = 0xb
+    };
+
+    struct Stream
+    {
+        uint32_t id;
+        string method;
+        string path;                    // www_path + "/" + :path, like the path of HTTP/1.1
+        map<string, string> headers;    // the regular fields, the names are in lowercase
+
+        bool remote_closed;             // END_STREAM received
+        bool headers_sent;
+        bool local_closed;              // END_STREAM sent
+        int64_t send_window;
+        int64_t recv_window;
+        size_t recv_unacked;            // the consumed bytes not returned by WINDOW_UPDATE yet
+        size_t body_received;
+
+        StaticBody body;                // the static file, the error page or route_out
+
+        bool route_pending;             // a native route waits for the whole request body
+        string route_body;              // the request body of the native route
+        string route_out;               // the response body of the native route
+
+        bool is_cgi;
+        pid_t cgi_pid;
+        int cgi_in_fd;
+        int cgi_out_fd;
+        bool cgi_in_wait;               // rearm the pipe at the end of the wakeup
+        bool cgi_out_wait;
+        string cgi_in;                  // the request body not written to the CGI yet
+        size_t cgi_in_off;
+        string cgi_out;                 // the CGI output not framed yet
+        size_t cgi_out_off;
+        bool cgi_eof;
+        bool cgi_timeout;
+        int64_t cgi_deadline;           // in ms, 0 until the whole request is written to the CGI
+
+        // the access record, the times are by Trace::now(), access_start is 0 without the access log
+        int64_t access_start;
+        int64_t access_response;
+        int status;
+        uint64_t bytes_out;
+
+        explicit Stream(uint32_t stream_id);
+    };
+
+    static constexpr uint32_t MAX_FRAME_SIZE = 16384;
+    static const uint32_t MAX_CONCURRENT_STREAMS = 100;
+    static const int64_t DEFAULT_WINDOW = 65535;
+    static const int64_t MAX_WINDOW = 0x7fffffff;
+    // the request bodies are limited by the stream windows, the connection window is not a limit
+    static const int64_t CONN_RECV_WINDOW = 16 * 1024 * 1024;
+    static const size_t OUT_HIGH_WATER = 64 * 1024;
+    static const size_t CGI_OUT_BUF = 64 * 1024;
+    static const size_t IN_LIMIT = 64 * 1024;
+
+    HttpHandler* conn_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+
+    string out_;
+    size_t out_off_;
+
+    bool preface_received_;
+    bool settings_received_;
+    uint32_t peer_max_frame_size_;
+    int64_t peer_initial_window_;
+    int64_t conn_send_window_;
+    int64_t conn_recv_window_;
+
+    string header_block_;               // HEADERS and the CONTINUATION frames after it
+    uint32_t header_stream_;            // 0 if no header block is in progress
+    bool header_end_stream_;
+
+    map<uint32_t, Stream*> streams_;
+    uint32_t last_stream_id_;
+    uint32_t last_sent_id_;             // the round-robin position of DATA frames
+    bool goaway_sent_;
+    bool closing_;                      // a connection error happened, send the GOAWAY and close
+    int64_t last_active_;
+
+    static int64_t nowMs();
+
+    bool readFrames();
+    bool parseFrames();
+    bool processFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    bool onData(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    bool onHeaders(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    bool onSettings(uint8_t flags, const uint8_t* payload, uint32_t len);
+    bool onWindowUpdate(uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    bool onHeaderBlock();
+    bool applySettings(const uint8_t* payload, uint32_t len);
+    bool connectionError(H2_ERROR code);
+
+    // the METHOD_TYPE of HttpHandler, -1 if not implemented
+    static int methodType(const string& method);
+    void startStream(Stream* stream);
+    void startCgi(Stream* stream);
+    void respondStatic(Stream* stream);
+    void runRoute(Stream* stream, const Router::Route* route, Router::Request* req);
+    void runPendingRoute(Stream* stream);
+    void respondError(Stream* stream, int code);
+    void sendHeaders(Stream* stream, int code, const string& fields, bool end_stream);
+    void resetStream(Stream* stream, H2_ERROR code);
+    void closeStream(Stream* stream);
+    void logStream(Stream* stream);
+    void stopCgi(Stream* stream, bool kill_child);
+    void closeCgiInput(Stream* stream);
+
+    void pumpStream(Stream* stream);
+    bool scheduleData();
+    bool hasSendableData() const;
+    void checkTimeouts(int64_t now);
+    int64_t nextDeadline() const;
+    bool flush();
+    bool rearmEvents();
+
+    void appendFrameHeader(uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id);
+    void appendSettings();
+    void appendWindowUpdate(uint32_t stream_id, uint32_t increment);
+    void appendRstStream(uint32_t stream_id, H2_ERROR code);
+    void appendGoaway(H2_ERROR code);
+};
+
+#endif //WEBSERVER_HTTP2SESSION_H
@@ -5,12 +5,16 @@
  * Maintain basic connection, log some correct or wrong detail
  */
 #include <algorithm>
+#include <arpa/inet.h>
 #include <cassert>
 #include <cstring>
 #include <cctype>
 #include <fcntl.h>
 #include <sstream>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,9 +22,17 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "HeavyHitters.h"
+#include "Http2Session.h"
 #include "HttpHandler.h"
+#include "HttpResponse.h"
 #include "Log.h"
+#include "Proxy.h"
+#include "Scan.h"
+#include "Tls.h"
+#include "Trace.h"
 #include "Utils.h"
+#include "WebSocketSession.h"
 
 /**
  * Declare the static member variable
@@ -28,6 +40,25 @@
  */
 
 string HttpHandler::www_path = ".";
+size_t HttpHandler::maxHeaderSize = 16 * 1024;
+size_t HttpHandler::maxBodySize = 64 * 1024 * 1024;
+size_t HttpHandler::maxIdleConnections = 10000;
+int HttpHandler::maxRequestsPerConnection = 100;
+int64_t HttpHandler::idleParkDelay = 1000;
+MutexLock HttpHandler::idle_lock_;
+HttpHandler* HttpHandler::idle_head_ = nullptr;
+HttpHandler* HttpHandler::idle_tail_ = nullptr;
+size_t HttpHandler::idle_count_ = 0;
+HttpHandler* HttpHandler::parked_head_ = nullptr;
+HttpHandler* HttpHandler::parked_tail_ = nullptr;
+size_t HttpHandler::parked_count_ = 0;
+atomic<size_t> HttpHandler::conn_count_(0);
+atomic<uint64_t> HttpHandler::request_total_(0);
+atomic<bool> HttpHandler::draining_(false);
+MutexLock HttpHandler::retired_lock_;
+vector<HttpHandler*> HttpHandler::retired_;
+MutexLock HttpHandler::zombies_lock_;
+vector<pid_t> HttpHandler::zombies_;
 
 /**
  * Initialize client fd and epoll event
@@ -37,24 +68,81 @@ string HttpHandler::www_path = ".";
  * Under HTTP1.1, the default is continuous connection
  * Unless the client http headers have Connection: close
  */
-HttpHandler::HttpHandler(Epoll* epoll, int client_fd, Timer* timer)
+HttpHandler::HttpHandler(Epoll* epoll, int client_fd, Timer* timer, bool tls)
         : client_fd_(client_fd), client_event_{client_fd_, this},
-          timer_(timer), epoll_(epoll), curr_parse_pos_(0)
+          tls_(tls ? new TlsConnection(client_fd) : nullptr),
+          timer_(timer), epoll_(epoll), sched_(0),
+          idle_prev_(nullptr), idle_next_(nullptr), is_idle_(false), parked_(false), idle_since_(0), client_key_(), peer_cred_(), has_peer_cred_(false), rate_checked_(false), requests_(0),
+          in_(MAXBUF), curr_parse_pos_(0),
+          cgi_pid_(-1), cgi_in_fd_(-1), cgi_in_event_{-1, this},
+          cgi_out_fd_(-1), cgi_out_event_{-1, this},
+          out_body_(), h2_(nullptr), stream_event_{-1, this}, ws_(nullptr),
+          upstream_(nullptr), up_fd_(-1), up_event_{-1, this}, relay_pipe_{-1, -1}, pipe_len_(0),
+          trace_id_(0), trace_start_(0), trace_queued_(0), deadline_(0), access_()
 {
     isKeepAlive_ = true;
     reset();
     if(timer)
         timer_event_ = {timer->getFd(), this};
+    ++conn_count_;
 }
 
 HttpHandler::~HttpHandler()
 {
+    if(client_fd_ != -1)
+        closeConnection();
+    --conn_count_;
+}
+
+/**
+ * Unregister and close all the fds of the connection
+ * The memory is freed later by the event loop, because the event of current epoll wait may still refer to it
+ */
+void HttpHandler::closeConnection()
+{
+    // An idle connection closed by the client has no request, the upgrade of a WebSocket was finished
+    if(h2_ || (!ws_ && state_ != STATE_PARSE_URI))
+        finishTrace("request aborted");
+    // The streams of a session are logged by the session
+    if(!h2_)
+        logAccess(true);
+    // The counters were charged after the last RunEventLoop
+    if(PerfCounters::isEnabled() && !h2_ && !ws_ && state_ != STATE_PARSE_URI && state_ != STATE_FINISHED
+       && state_ != STATE_ERROR)
+        recordPerf();
+    if(HeavyHitters::isEnabled() && !h2_ && !ws_ && state_ != STATE_PARSE_URI && state_ != STATE_FINISHED
+       && state_ != STATE_ERROR)
+        recordHeavyHitters();
+    leaveIdle();
+    stopCgi(true);
+    CgiCache::release(&cgi_cache_, this);
+    stopProxy();
+    if(relay_pipe_[0] != -1)
+    {
+        close(relay_pipe_[0]);
+        close(relay_pipe_[1]);
+    }
+    out_body_.release();
+    // the pipes of the streams are unregistered by the session
+    delete h2_;
+    h2_ = nullptr;
+    // No publisher wakes the socket after this
+    delete ws_;
+    ws_ = nullptr;
+    if(tls_)
+    {
+        tls_->shutdown();
+        delete tls_;
+        tls_ = nullptr;
+    }
+
     bool ret1 = epoll_->del(client_fd_);
     bool ret2 = true;
     if(timer_)
     {
         ret2 = epoll_->del(timer_->getFd());
         delete timer_;
+        timer_ = nullptr;
     }
     assert(ret1 && ret2);
     INFO("------------------------ "
@@ -62,6 +150,453 @@ HttpHandler::~HttpHandler()
          "------------------------",
          client_fd_);
     close(client_fd_);
+    client_fd_ = -1;
+}
+
+unsigned HttpHandler::translateEvent(const EpollEvent* event, unsigned epoll_events)
+{
+    if(event == &timer_event_)
+        return EVENT_TIMEOUT;
+    if(event == &up_event_)
+    {
+        bool broken = (epoll_events & EPOLLHUP) || (epoll_events & EPOLLERR);
+        unsigned events = 0;
+        if(broken || (epoll_events & EPOLLIN) || (epoll_events & EPOLLRDHUP))
+            events |= EVENT_UPSTREAM_IN;
+        if(broken || (epoll_events & EPOLLOUT))
+            events |= EVENT_UPSTREAM_OUT;
+        return events;
+    }
+    // EPOLLHUP of the pipe means the CGI closed its output
+    if(event == &cgi_out_event_)
+        return EVENT_CGI_OUT;
+    if(event == &cgi_in_event_)
+        return EVENT_CGI_IN;
+    if(event == &stream_event_)
+        return EVENT_STREAM;
+
+    if((epoll_events & EPOLLHUP) || (epoll_events & EPOLLRDHUP) || (epoll_events & EPOLLERR))
+        return EVENT_CLIENT_CLOSED;
+    unsigned events = 0;
+    if(epoll_events & EPOLLIN)
+        events |= EVENT_CLIENT_IN;
+    if(epoll_events & EPOLLOUT)
+        events |= EVENT_CLIENT_OUT;
+    return events;
+}
+
+bool HttpHandler::notify(unsigned events)
+{
+    unsigned old = sched_.fetch_or(events | SCHED_FLAG);
+    return !(old & SCHED_FLAG);
+}
+
+void HttpHandler::traceDispatch(int64_t woke_at)
+{
+    if(!trace_id_)
+        return;
+    trace_queued_ = Trace::now();
+    Trace::record(trace_id_, "epoll dispatch", woke_at, trace_queued_);
+}
+
+void HttpHandler::runPendingEvents()
+{
+    if(trace_queued_)
+    {
+        Trace::record(trace_id_, "queue wait", trace_queued_, Trace::now());
+        trace_queued_ = 0;
+    }
+    for(;;)
+    {
+        leaveIdle();
+        // A parked connection needs its timer again before running
+        if(parked_ && !unpark())
+        {
+            closeConnection();
+            retire(this);
+            return;
+        }
+        // take all the pending events, but keep the connection owned
+        unsigned events = sched_.exchange(SCHED_FLAG) & ~SCHED_FLAG;
+        bool alive;
+        {
+            Trace::setCurrent(trace_id_);
+            TraceSpan span("RunEventLoop");
+            if(PerfCounters::isEnabled())
+                PerfCounters::read(&perf_mark_);
+            alive = RunEventLoop(events);
+            if(PerfCounters::isEnabled())
+            {
+                PerfCounters::charge(&perf_mark_, &perf_total_);
+                if(h2_ || ws_)
+                    recordPerf();
+            }
+        }
+        if(!alive)
+        {
+            // SCHED_FLAG is kept, so that the later events of the closed connection will be ignored
+            closeConnection();
+            Trace::setCurrent(0);
+            retire(this);
+            return;
+        }
+        Trace::setCurrent(0);
+        // Waiting for the next request
+        if(!h2_ && !ws_ && state_ == STATE_PARSE_URI && in_.readable() == 0 && requests_ > 0)
+        {
+            // The response was sent with keep-alive before the draining started
+            if(draining_.load(memory_order_relaxed))
+            {
+                closeConnection();
+                retire(this);
+                return;
+            }
+            enterIdle();
+        }
+
+        // If new events came when running, run again
+        unsigned expected = SCHED_FLAG;
+        if(sched_.compare_exchange_strong(expected, 0))
+            return;
+    }
+}
+
+int64_t HttpHandler::taskDeadline(int64_t now)
+{
+    // The streams of a session and the WebSocket have their own timeouts
+    if(h2_ || ws_)
+        return now + timeoutPerRequest * 1000;
+    // Passed already when the timer fires, the timeout is still handled, a 504 or killing the CGI
+    if(deadline_ <= now)
+        deadline_ = now + timeoutPerRequest * 1000;
+    return deadline_;
+}
+
+void HttpHandler::dropExpired()
+{
+    WARN("Request expired in the queue, close the connection (socket: %d)", client_fd_);
+    closeConnection();
+    retire(this);
+}
+
+void HttpHandler::extendDeadline()
+{
+    if(timer_)
+        timer_->setTime(timeoutPerRequest, 0);
+    deadline_ = monotonicMs() + timeoutPerRequest * 1000;
+}
+
+/**
+ * @brief Own the connection if no thread is running it
+ */
+bool HttpHandler::tryAcquire()
+{
+    unsigned expected = 0;
+    return sched_.compare_exchange_strong(expected, SCHED_FLAG);
+}
+
+void HttpHandler::retire(HttpHandler* handler)
+{
+    MutexLockGuard guard(retired_lock_);
+    retired_.push_back(handler);
+}
+
+void HttpHandler::enterIdle()
+{
+    // The buffers go back to the pool, the next request takes them again
+    in_.release();
+    up_in_.release();
+    {
+        MutexLockGuard guard(idle_lock_);
+        if(is_idle_)
+            return;
+        is_idle_ = true;
+        idle_since_ = monotonicMs();
+        idle_prev_ = idle_tail_;
+        idle_next_ = nullptr;
+        if(idle_tail_)
+            idle_tail_->idle_next_ = this;
+        else
+            idle_head_ = this;
+        idle_tail_ = this;
+        ++idle_count_;
+        if(idle_count_ + parked_count_ <= maxIdleConnections)
+            return;
+    }
+    evictIdle(1);
+}
+
+void HttpHandler::leaveIdle()
+{
+    MutexLockGuard guard(idle_lock_);
+    if(is_idle_)
+        unlinkIdle();
+}
+
+void HttpHandler::unlinkIdle()
+{
+    HttpHandler*& head = parked_ ? parked_head_ : idle_head_;
+    HttpHandler*& tail = parked_ ? parked_tail_ : idle_tail_;
+    if(idle_prev_)
+        idle_prev_->idle_next_ = idle_next_;
+    else
+        head = idle_next_;
+    if(idle_next_)
+        idle_next_->idle_prev_ = idle_prev_;
+    else
+        tail = idle_prev_;
+    idle_prev_ = idle_next_ = nullptr;
+    is_idle_ = false;
+    if(parked_)
+        --parked_count_;
+    else
+        --idle_count_;
+}
+
+size_t HttpHandler::evictIdle(size_t num)
+{
+    size_t evicted = 0;
+    while(evicted < num)
+    {
+        HttpHandler* handler;
+        {
+            /**
+             * A connection in the lists can not be retired, because closeConnection() removes it first.
+             * If a thread is running it, the connection is not idle any more, skip it
+             * The parked connections are older than the others, they go first
+             */
+            MutexLockGuard guard(idle_lock_);
+            handler = parked_head_ ? parked_head_ : idle_head_;
+            if(!handler)
+                break;
+            bool owned = handler->tryAcquire();
+            handler->unlinkIdle();
+            if(!owned)
+                continue;
+        }
+        INFO("Evict idle connection (socket: %d)", handler->client_fd_);
+        handler->closeConnection();
+        retire(handler);
+        ++evicted;
+    }
+    return evicted;
+}
+
+size_t HttpHandler::getIdleCount()
+{
+    MutexLockGuard guard(idle_lock_);
+    return idle_count_ + parked_count_;
+}
+
+size_t HttpHandler::getParkedCount()
+{
+    MutexLockGuard guard(idle_lock_);
+    return parked_count_;
+}
+
+size_t HttpHandler::parkIdle(int64_t now)
+{
+    size_t parked = 0;
+    while(idleParkDelay >= 0)
+    {
+        HttpHandler* handler;
+        {
+            MutexLockGuard guard(idle_lock_);
+            handler = idle_head_;
+            if(!handler || now - handler->idle_since_ < idleParkDelay)
+                break;
+            bool owned = handler->tryAcquire();
+            handler->unlinkIdle();
+            if(!owned)
+                continue;
+        }
+        handler->park();
+        {
+            MutexLockGuard guard(idle_lock_);
+            handler->is_idle_ = true;
+            handler->idle_prev_ = parked_tail_;
+            handler->idle_next_ = nullptr;
+            if(parked_tail_)
+                parked_tail_->idle_next_ = handler;
+            else
+                parked_head_ = handler;
+            parked_tail_ = handler;
+            ++parked_count_;
+        }
+        // Only the event loop thread notifies, so no event came while it was owned here
+        handler->sched_.store(0);
+        ++parked;
+    }
+
+    // The parked connections have no timer, the ones past the keep-alive timeout are closed here
+    for(;;)
+    {
+        HttpHandler* handler;
+        {
+            MutexLockGuard guard(idle_lock_);
+            handler = parked_head_;
+            if(!handler || now - handler->idle_since_ < handler->timeoutPerRequest * 1000)
+                break;
+            bool owned = handler->tryAcquire();
+            handler->unlinkIdle();
+            if(!owned)
+                continue;
+        }
+        INFO("Parked connection timeout (socket: %d)", handler->client_fd_);
+        handler->closeConnection();
+        retire(handler);
+    }
+    return parked;
+}
+
+/**
+ * @brief Drop everything an idle connection can take again on its next request, the connection is owned
+ *        The buffers were given back when it became idle
+ */
+void HttpHandler::park()
+{
+    parked_ = true;
+    string().swap(path_);
+    string().swap(out_pending_);
+    string().swap(up_head_);
+    string().swap(up_pending_);
+    if(relay_pipe_[0] != -1)
+    {
+        close(relay_pipe_[0]);
+        close(relay_pipe_[1]);
+        relay_pipe_[0] = relay_pipe_[1] = -1;
+    }
+    if(timer_)
+    {
+        epoll_->del(timer_->getFd());
+        delete timer_;
+        timer_ = nullptr;
+    }
+}
+
+/**
+ * @brief Create the timer of a parked connection woken by an event
+ * @return false if no timerfd is available, the connection should be closed
+ */
+bool HttpHandler::unpark()
+{
+    Timer* timer = new Timer(TFD_NONBLOCK | TFD_CLOEXEC);
+    if(!timer->isValid())
+    {
+        WARN("No timer for the parked connection (socket: %d)! (%s)", client_fd_, strerror(errno));
+        delete timer;
+        return false;
+    }
+    timer_event_ = {timer->getFd(), this};
+    if(!epoll_->add(timer->getFd(), &timer_event_, getTimerTriggerCond()))
+    {
+        WARN("Add the timer of the parked connection (socket: %d) failed!", client_fd_);
+        delete timer;
+        return false;
+    }
+    timer_ = timer;
+    timer_->setTime(timeoutPerRequest, 0);
+    parked_ = false;
+    return true;
+}
+
+size_t HttpHandler::startDraining()
+{
+    draining_.store(true);
+    WebSocketSession::closeAll();
+    return evictIdle(SIZE_MAX);
+}
+
+void HttpHandler::reclaimRetired()
+{
+    vector<HttpHandler*> retired;
+    {
+        MutexLockGuard guard(retired_lock_);
+        retired.swap(retired_);
+    }
+    for(size_t i = 0; i < retired.size(); i++)
+        delete retired[i];
+}
+
+void HttpHandler::reapChildren()
+{
+    MutexLockGuard guard(zombies_lock_);
+    for(size_t i = 0; i < zombies_.size(); )
+    {
+        int wstats = 0;
+        pid_t ret = waitpid(zombies_[i], &wstats, WNOHANG);
+        if(ret == 0)
+        {
+            ++i;
+            continue;
+        }
+        zombies_[i] = zombies_.back();
+        zombies_.pop_back();
+    }
+}
+
+/**
+ * @brief Kill the CGI process and its children, the process is still needed to be waited
+ */
+void HttpHandler::killCgi()
+{
+    if(cgi_pid_ != -1)
+        killProcess(cgi_pid_);
+}
+
+void HttpHandler::killProcess(pid_t pid)
+{
+    /**
+     * @brief 先 kill pid 是为了防止子进程太久没有轮到执行,仍然处于fork与execl之间的状态
+     * NOTE: -pid 指的是杀死当前子进程以及该子进程自身的子进程,例如shell脚本
+     * Kill * -pid * only after the pgid of the child process changes to prevent the child process in other threads from being injured by mistake
+     */
+    kill(pid, SIGKILL);
+    if(getpgid(pid) == pid)
+        kill(-pid, SIGKILL);
+}
+
+void HttpHandler::waitProcess(pid_t pid)
+{
+    int wstats = 0;
+    if(waitpid(pid, &wstats, WNOHANG) == 0)
+    {
+        MutexLockGuard guard(zombies_lock_);
+        zombies_.push_back(pid);
+    }
+}
+
+/**
+ * @brief Close the CGI output pipe and wait for the CGI process
+ *        If the process is still running, it is reaped later by reapChildren()
+ */
+void HttpHandler::stopCgi(bool kill_child)
+{
+    closeCgiInput();
+    if(cgi_out_fd_ != -1)
+    {
+        epoll_->del(cgi_out_fd_);
+        close(cgi_out_fd_);
+        cgi_out_fd_ = -1;
+    }
+    if(cgi_pid_ == -1)
+        return;
+    if(kill_child)
+        killCgi();
+    waitProcess(cgi_pid_);
+    cgi_pid_ = -1;
+}
+
+/**
+ * @brief Close the CGI input pipe, the CGI will read EOF
+ */
+void HttpHandler::closeCgiInput()
+{
+    if(cgi_in_fd_ == -1)
+        return;
+    epoll_->del(cgi_in_fd_);
+    close(cgi_in_fd_);
+    cgi_in_fd_ = -1;
 }
 
 /**
@@ -70,33 +605,78 @@ HttpHandler::~HttpHandler()
  */
 void HttpHandler::reset()
 {
-    assert(request_.length() >= curr_parse_pos_);
-    request_.clear();
+    // Keep the pipelined requests, and do not hold the memory of a large request
+    assert(in_.readable() >= curr_parse_pos_);
+    in_.retrieve(curr_parse_pos_);
+    in_.compact();
+    in_.shrink();
     curr_parse_pos_ = 0;
     state_ = STATE_PARSE_URI;
+    method_ = METHOD_GET;
+    path_.clear();
     againTimes_ = maxAgainTimes;
     headers_.clear();
-    http_body_.clear();
+    headers_done_ = false;
+    isChunkedBody_ = false;
+    in_chunk_state_ = CHUNK_SIZE;
+    in_chunk_left_ = 0;
+    body_left_ = 0;
+    body_received_ = 0;
+    body_done_ = true;
+    relay_input_ = Task<ERROR_TYPE>();
+    relay_output_ = Task<ERROR_TYPE>();
+    cgi_timeout_ = false;
+    cgi_eof_ = false;
+    CgiCache::release(&cgi_cache_, this);
+    cgi_capture_ = false;
+    isChunked_ = false;
+    headers_sent_ = false;
+    use_splice_ = true;
+    chunk_left_ = 0;
+    // Do not keep the capacity of a large response head
+    if(out_pending_.capacity() > MAXBUF)
+        string().swap(out_pending_);
+    else
+        out_pending_.clear();
+    out_body_.release();
     if(timer_)
         timer_->setTime(timeoutPerRequest, 0);
+    deadline_ = 0;
+    rate_checked_ = false;
+    access_start_ = 0;
+    access_headers_ = 0;
+    access_response_ = 0;
+    status_ = 0;
+    bytes_in_ = 0;
+    bytes_out_ = 0;
+    perf_class_ = PerfCounters::CLASS_OTHER;
+    perf_total_.clear();
+    trace_id_ = Trace::sample();
+    trace_start_ = 0;
 }
 
 HttpHandler::ERROR_TYPE HttpHandler::readRequest()
 {
+    TraceSpan span("read");
     INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<"
          "- Request Packet -"
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
 
-    char buffer[MAXBUF];
-
+    // The body of a native route is read into the buffer as a whole
+    size_t limit = maxHeaderSize;
+    if(state_ == STATE_ANALYSI_REQUEST)
+        limit = max(limit, curr_parse_pos_ + body_left_);
     while(true)
     {
-        ssize_t len = recv(client_fd_, buffer, MAXBUF, MSG_DONTWAIT);
+        ssize_t len = readClient(limit);
         if(len < 0) {
             if(errno == EAGAIN)
                 return ERR_SUCCESS;
             else if(errno == EINTR)
                 continue;
+            // The buffer is full, the parser drains it or rejects the request
+            else if(errno == ENOBUFS)
+                return ERR_SUCCESS;
             return ERR_READ_REQUEST_FAIL;
         }
         else if(len == 0)
@@ -104,11 +684,7 @@ HttpHandler::ERROR_TYPE HttpHandler::readRequest()
             return ERR_CONNECTION_CLOSED;
         }
 
-        // Assemble the read the data
-        string request(buffer, buffer + len);
-        INFO("{%s}", escapeStr(request, MAXBUF).c_str());
-
-        request_ += request;
+        INFO("{%s}", escapeStr(in_.peek() + in_.readable() - len, static_cast<size_t>(len), MAXBUF).c_str());
     }
     return ERR_SUCCESS;
 }
@@ -119,14 +695,17 @@ HttpHandler::ERROR_TYPE HttpHandler::readRequest()
  */
 HttpHandler::ERROR_TYPE HttpHandler::parseURI()
 {
-    size_t pos1, pos2;
-
-    pos1 = request_.find("\r\n");
-    if(pos1 == string::npos)    return ERR_AGAIN;
-    string&& first_line = request_.substr(0, pos1);
-    pos1 = first_line.find(' ');
-    if(pos1 == string::npos)    return ERR_BAD_REQUEST;
-    string methodStr = first_line.substr(0, pos1);
+    TraceSpan span("parse uri");
+    size_t line_len = in_.findCRLF(0);
+    if(line_len == InputBuffer::npos)
+        return (in_.readable() >= maxHeaderSize) ? ERR_HEADER_TOO_LARGE : ERR_AGAIN;
+    const char* line = in_.peek();
+    const char* line_end = line + line_len;
+    // the method is a token ended by a space
+    const char* method_end = Scan::findNonToken(line, line_end);
+    if(method_end == line || method_end == line_end || *method_end != ' ')
+        return ERR_BAD_REQUEST;
+    string methodStr(line, static_cast<size_t>(method_end - line));
 
     string output_method = "Method: ";
     if(methodStr == "GET")
@@ -140,21 +719,17 @@ HttpHandler::ERROR_TYPE HttpHandler::parseURI()
     INFO("Method: %s", methodStr.c_str());
 
     // b. check the path
-    pos1++;
-    pos2 = first_line.find(' ', pos1);
-    if(pos2 == string::npos)    return ERR_BAD_REQUEST;
-
-    // get the path
-    path_ = www_path + "/" + first_line.substr(pos1, pos2 - pos1);
-    // determine the traversal vulnerability
-    if(!is_path_parent(www_path, path_))
-        return ERR_NOT_FOUND;
+    const char* uri = method_end + 1;
+    const char* uri_end = static_cast<const char*>(memchr(uri, ' ', static_cast<size_t>(line_end - uri)));
+    if(!uri_end)    return ERR_BAD_REQUEST;
 
+    // get the path, the traversal vulnerability is determined after the whole headers are read
+    path_.reserve(www_path.size() + 1 + static_cast<size_t>(uri_end - uri));
+    path_.assign(www_path).append("/").append(uri, static_cast<size_t>(uri_end - uri));
     INFO("Path: %s", path_.c_str());
 
     // c. check the version of http
-    pos2++;
-    string http_version_str = first_line.substr(pos2, first_line.length() - pos2);
+    string http_version_str(uri_end + 1, static_cast<size_t>(line_end - uri_end - 1));
     INFO("HTTP Version: %s", http_version_str.c_str());
     if(http_version_str == "HTTP/1.0")
         http_version_ = HTTP_1_0;
@@ -164,284 +739,1799 @@ HttpHandler::ERROR_TYPE HttpHandler::parseURI()
         return ERR_HTTP_VERSION_NOT_SUPPORTED;
 
     // update curr_parse_pos_
-    curr_parse_pos_ += first_line.length() + 2;
+    curr_parse_pos_ += line_len + 2;
     return ERR_SUCCESS;
 }
 
 HttpHandler::ERROR_TYPE HttpHandler::parseHttpHeader()
 {
+    TraceSpan span("parse header");
     INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<"
          "- Request Info -"
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>");
 
     size_t pos1, pos2;
     for(pos1 = curr_parse_pos_;
-        (pos2 = request_.find("\r\n", pos1)) != string::npos;
+        (pos2 = in_.findCRLF(pos1)) != InputBuffer::npos;
         pos1 = pos2 + 2)
     {
-        string&& header = request_.substr(pos1, pos2 - pos1);
+        const char* line = in_.peek() + pos1;
+        const char* line_end = in_.peek() + pos2;
 
-        if(header.size() == 0)
+        if(line == line_end)
         {
             curr_parse_pos_ = pos1 + 2;
             return ERR_SUCCESS;
         }
-        pos1 = header.find(' ');
-
-        if(pos1 == string::npos)    return ERR_BAD_REQUEST;
-
-        string&& key = header.substr(0, pos1);
-
-        if(key.size() < 2 || key.back() != ':') return ERR_BAD_REQUEST;
-        key.pop_back();
+        // the name is a token ended by ":", no space before it
+        const char* colon = Scan::findNonToken(line, line_end);
+        if(colon == line || colon == line_end || *colon != ':')
+            return ERR_BAD_REQUEST;
 
+        string key(line, static_cast<size_t>(colon - line));
         // key tolower
         transform(key.begin(), key.end(), key.begin(), ::tolower);
-        // get the value
-        string&& value = header.substr(pos1 + 1);
+        // get the value, without the spaces around it
+        const char* value_begin = colon + 1;
+        while(value_begin < line_end && (*value_begin == ' ' || *value_begin == '\t'))
+            value_begin++;
+        const char* value_end = line_end;
+        while(value_end > value_begin && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+        string value(value_begin, static_cast<size_t>(value_end - value_begin));
 
         INFO("HTTP Header: [%s : %s]", key.c_str(), value.c_str());
 
         headers_[key] = value;
     }
+    // The header section does not end in the buffer limit
+    if(in_.readable() >= maxHeaderSize)
+        return ERR_HEADER_TOO_LARGE;
     return ERR_AGAIN;
 }
 
+/**
+ * @brief Get the framing of the request body, the body itself is forwarded by pumpCgiInput()
+ */
 HttpHandler::ERROR_TYPE HttpHandler::parseBody()
 {
+    TraceSpan span("parse body");
     assert(method_ == METHOD_POST);
 
     auto content_len_iter = headers_.find("content-length");
+    auto encoding_iter = headers_.find("transfer-encoding");
+
+    if(encoding_iter != headers_.end())
+    {
+        string value = encoding_iter->second;
+        transform(value.begin(), value.end(), value.begin(), ::tolower);
+        // Both of them may be a request smuggling, reject it
+        if(value != "chunked" || content_len_iter != headers_.end())
+            return ERR_BAD_REQUEST;
+        isChunkedBody_ = true;
+        in_chunk_state_ = CHUNK_SIZE;
+        body_done_ = false;
+        return ERR_SUCCESS;
+    }
+
     if(content_len_iter == headers_.end())
         return ERR_LENGTH_REQUIRED;
 
     string len_str = content_len_iter->second;
-    if(!isNumericStr(len_str))
+    if(len_str.empty() || !isNumericStr(len_str))
         return ERR_BAD_REQUEST;
+    if(len_str.size() > 18)
+        return ERR_PAYLOAD_TOO_LARGE;
 
-    int len = atoi(len_str.c_str());
-
-    if(request_.length() < curr_parse_pos_ + len)
-        return ERR_AGAIN;
-    http_body_ = request_.substr(curr_parse_pos_, len);
-
-    // output the last body
-    INFO("HTTP Body: {%s}", escapeStr(http_body_, MAXBUF).c_str());
-
+    body_left_ = strtoull(len_str.c_str(), nullptr, 10);
+    if(body_left_ > maxBodySize)
+        return ERR_PAYLOAD_TOO_LARGE;
+    body_done_ = false;
     return ERR_SUCCESS;
 }
 
-HttpHandler::ERROR_TYPE HttpHandler::handleRequest()
+/**
+ * @brief Parse the chunk size line "1a;ext=val", the extensions are ignored
+ */
+static bool parseChunkSize(const char* begin, const char* end, size_t* size)
 {
-    // continuous connection only in HTTP 1.0
-    if(http_version_ == HTTP_1_0)
-        isKeepAlive_ = false;
-
-    auto conHeaderIter = headers_.find("connection");
-    if(conHeaderIter != headers_.end())
+    size_t value = 0;
+    const char* pos = begin;
+    for(; pos < end && isxdigit(static_cast<unsigned char>(*pos)); pos++)
     {
-        string value = conHeaderIter->second;
-        transform(value.begin(), value.end(), value.begin(), ::tolower);
-        if(value == "keep-alive")
-            isKeepAlive_ = true;
+        if(value > (SIZE_MAX >> 4))
+            return false;
+        int ch = tolower(static_cast<unsigned char>(*pos));
+        value = (value << 4) | static_cast<size_t>(isdigit(ch) ? ch - '0' : ch - 'a' + 10);
     }
+    if(pos == begin || (pos < end && *pos != ';' && *pos != ' ' && *pos != '\t'))
+        return false;
+    *size = value;
+    return true;
+}
 
-    // get the file detail
-    struct stat st;
-    if(stat(path_.c_str(), &st) == -1)
+/**
+ * @brief Find the next decoded part of the request body in the buffer, the chunk framing before it is consumed
+ * @param data  the part, at curr_parse_pos_
+ * @param len   0 if more of the request is needed, or the body is done
+ * @return ERR_BAD_REQUEST or ERR_PAYLOAD_TOO_LARGE if the chunk framing is rejected
+ */
+HttpHandler::ERROR_TYPE HttpHandler::nextBodyData(const char** data, size_t* len)
+{
+    *len = 0;
+    while(!body_done_)
     {
-        WARN("Can not get file [%s] state ! (%s)", path_.c_str(), strerror(errno));
-        if(errno == ENOENT)
-            return ERR_NOT_FOUND;
-        else
-            return ERR_INTERNAL_SERVER_ERR;
-    }
-    // If try to visit the directory, default visit the index.html
-    if (S_ISDIR(st.st_mode)) {
-        path_ += "/index.html";
-        if(stat(path_.c_str(), &st) == -1)
-        {
-            WARN("Can not get file [%s] state ! (%s)", path_.c_str(), strerror(errno));
-            if(errno == ENOENT)
-                return ERR_NOT_FOUND;
-            else
-                return ERR_INTERNAL_SERVER_ERR;
-        }
-    }
+        *data = in_.peek() + curr_parse_pos_;
+        size_t avail = in_.readable() - curr_parse_pos_;
 
-    // process request
-    // GET OR HEAD
-    if(method_ == METHOD_GET || method_ == METHOD_HEAD)
-    {
-        // Open the file
-        int file_fd;
-        if((file_fd = open(path_.c_str(), O_RDONLY, 0)) == -1)
+        if(!isChunkedBody_)
         {
-            WARN("File [%s] open failed ! (%s)", path_.c_str(), strerror(errno));
-            if(errno == ENOENT)
-                // If the file not exist, return 404
-                return ERR_NOT_FOUND;
+            if(body_left_ == 0)
+                body_done_ = true;
             else
-                return ERR_INTERNAL_SERVER_ERR;
+                *len = min(avail, body_left_);
+            break;
         }
-        // Read file
-        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
-        close(file_fd);
-        // ERROR process
-        if(addr == MAP_FAILED)
+        else if(in_chunk_state_ == CHUNK_DATA)
         {
-            WARN("Can not map file [%s] -> mem! (%s)", path_.c_str(), strerror(errno));
-            return ERR_INTERNAL_SERVER_ERR;
-        }
-        // Save the data from memory in responseBody
-        char* file_data_ptr = static_cast<char*>(addr);
-        string responseBody(file_data_ptr, file_data_ptr + st.st_size);
-        // clear the memory
-        int res = munmap(addr, st.st_size);
-        if(res == -1)
-            WARN("Can not unmap file [%s] -> mem! (%s)", path_.c_str(), strerror(errno));
-        // get the content type
-        string suffix = path_;
-        // find the .
-        size_t dot_pos;
-        while((dot_pos = suffix.find('.')) != string::npos)
-            suffix = suffix.substr(dot_pos + 1);
-
-        return sendResponse("200", "OK", MimeType::getMineType(suffix), responseBody);
-    }
-
-    // For POST, the http body is passed into the target executable file and the result is returned to the client
-    else if(method_ == METHOD_POST)
-    {
-        // create two pipes
-        int cgi_output[2];
-        int cgi_input[2];
-
-        if (pipe2(cgi_output, O_CLOEXEC) == -1) {
-            WARN("cgi_output create error. (%s)", strerror(errno));
-            return ERR_INTERNAL_SERVER_ERR;
+            *len = min(avail, in_chunk_left_);
+            break;
         }
-        if (pipe2(cgi_input, O_CLOEXEC) == -1) {
-            WARN("cgi_input create error. (%s)", strerror(errno));
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-            return ERR_INTERNAL_SERVER_ERR;
+        else if(in_chunk_state_ == CHUNK_DATA_CRLF)
+        {
+            if(avail < 2)
+                break;
+            if((*data)[0] != '\r' || (*data)[1] != '\n')
+                return ERR_BAD_REQUEST;
+            curr_parse_pos_ += 2;
+            in_chunk_state_ = CHUNK_SIZE;
+            continue;
         }
 
-        pid_t pid;
-        if((pid = fork()) < 0)
+        size_t pos = in_.findCRLF(curr_parse_pos_);
+        if(pos == InputBuffer::npos)
         {
-            WARN("Fork error. (%s)", strerror(errno));
-            close(cgi_input[0]);
-            close(cgi_input[1]);
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-            return ERR_INTERNAL_SERVER_ERR;
+            if(avail > maxChunkLine)
+                return ERR_BAD_REQUEST;
+            break;
         }
+        const char* line_end = in_.peek() + pos;
+        curr_parse_pos_ = pos + 2;
 
-        if(pid == 0)
+        if(in_chunk_state_ == CHUNK_TRAILER)
         {
-            if(setpgid(0, 0) == -1)
-                FATAL("setpgid fail in child process! (%s)", strerror(errno));
-            if(prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
-                FATAL("prctl fail in child process! (%s)", strerror(errno));
-
-            if(dup2(cgi_input[0], 0) == -1
-               || dup2(cgi_output[1], 1) == -1
-               || dup2(1, 2) == -1)
-                FATAL("dup2 fail! (%s)", strerror(errno));
-            close(cgi_input[0]);
-            close(cgi_input[1]);
-            close(cgi_output[0]);
-            close(cgi_output[1]);
-
-            // read the data
-            char path[path_.size() + 1];
-            strcpy(path, path_.c_str());
-            char* const args[] = { path, NULL };
-
-            // execute the program
-            execve(path, args, environ);
-            FATAL("execve fail in child process! (%s)", strerror(errno));
+            // the empty line ends the body
+            if(line_end == *data)
+                body_done_ = true;
+            continue;
         }
-        else
-        {
-            close(cgi_input[0]);
-            close(cgi_output[1]);
+        if(!parseChunkSize(*data, line_end, &in_chunk_left_))
+            return ERR_BAD_REQUEST;
+        if(in_chunk_left_ > maxBodySize - body_received_)
+            return ERR_PAYLOAD_TOO_LARGE;
+        body_received_ += in_chunk_left_;
+        in_chunk_state_ = (in_chunk_left_ == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+    }
+    return ERR_SUCCESS;
+}
+
+/**
+ * @brief Consume the forwarded bytes of the part found by nextBodyData()
+ */
+void HttpHandler::consumeBodyData(size_t len)
+{
+    curr_parse_pos_ += len;
+    if(!isChunkedBody_)
+        body_left_ -= len;
+    else if((in_chunk_left_ -= len) == 0)
+        in_chunk_state_ = CHUNK_DATA_CRLF;
+}
+
+/**
+ * @brief Drop the forwarded part of the request body from the buffer, a slow upload is not limited as
+ *        long as it keeps going
+ */
+void HttpHandler::dropForwardedBody()
+{
+    if(curr_parse_pos_ == 0)
+        return;
+    in_.retrieve(curr_parse_pos_);
+    curr_parse_pos_ = 0;
+    if(!body_done_)
+        extendDeadline();
+}
+
+/**
+ * @brief Decode the received request body and write it to the CGI input
+ *
+ * The body is written directly from the request buffer, and the consumed part of the buffer is dropped.
+ * If the pipe is full, the socket is not read any more until the CGI consumes its input.
+ *
+ * @return ERR_SUCCESS after the whole body was forwarded, ERR_BAD_REQUEST or ERR_PAYLOAD_TOO_LARGE
+ */
+Task<HttpHandler::ERROR_TYPE> HttpHandler::pumpCgiInput()
+{
+    while(!body_done_)
+    {
+        const char* data = nullptr;
+        size_t forward = 0;
+        ERROR_TYPE body_err = nextBodyData(&data, &forward);
+        if(body_err != ERR_SUCCESS)
+            co_return body_err;
+        if(forward == 0)
+        {
+            if(body_done_)
+                break;
+            dropForwardedBody();
+            co_await waitEvents(EVENT_CLIENT_IN);
+            continue;
+        }
+
+        ssize_t len = static_cast<ssize_t>(forward);
+        // If the CGI closed its input, the rest of body is just dropped
+        if(cgi_in_fd_ != -1)
+        {
+            len = write(cgi_in_fd_, data, forward);
+            if(len < 0)
+            {
+                if(errno == EAGAIN)
+                {
+                    dropForwardedBody();
+                    co_await waitEvents(EVENT_CGI_IN);
+                }
+                else if(errno != EINTR)
+                {
+                    WARN("Write %ld bytes to CGI input fail! (%s)", forward, strerror(errno));
+                    closeCgiInput();
+                }
+                continue;
+            }
+        }
+        INFO("HTTP Body: {%s}", escapeStr(data, static_cast<size_t>(len), MAXBUF).c_str());
+        consumeBodyData(static_cast<size_t>(len));
+    }
+
+    // The forwarded data is never needed again, it is compacted when the request finished
+    dropForwardedBody();
+    closeCgiInput();
+    // The CGI runtime is counted after the whole request is received
+    if(timer_)
+        timer_->setTime(maxCGIRuntime / 1000, (maxCGIRuntime % 1000) * 1000000L);
+    co_return ERR_SUCCESS;
+}
+
+/**
+ * @brief Decide whether the connection is kept after this request
+ */
+void HttpHandler::updateKeepAlive()
+{
+    // continuous connection is the default only in HTTP 1.1
+    isKeepAlive_ = (http_version_ == HTTP_1_1);
+
+    auto conHeaderIter = headers_.find("connection");
+    if(conHeaderIter != headers_.end())
+    {
+        string value = conHeaderIter->second;
+        transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if(value == "keep-alive")
+            isKeepAlive_ = true;
+        else if(value == "close")
+            isKeepAlive_ = false;
+    }
+    // This is the last request of the connection
+    if(remainingRequests() == 0 || draining_.load(memory_order_relaxed))
+        isKeepAlive_ = false;
+}
+
+/**
+ * @brief Check the "Upgrade: h2c" of an HTTP/1.1 request, the request with a body is answered by HTTP/1.1
+ * @param settings  the decoded HTTP2-Settings
+ */
+bool HttpHandler::isH2cUpgrade(string* settings)
+{
+    // h2 over TLS is chosen by ALPN
+    if(http_version_ != HTTP_1_1 || tls_ || draining_.load(memory_order_relaxed))
+        return false;
+    auto upgradeIter = headers_.find("upgrade");
+    auto settingsIter = headers_.find("http2-settings");
+    if(upgradeIter == headers_.end() || settingsIter == headers_.end())
+        return false;
+    auto lenIter = headers_.find("content-length");
+    if(headers_.count("transfer-encoding") || (lenIter != headers_.end() && lenIter->second != "0"))
+        return false;
+
+    // "h2c" is one of the protocols, like "h2c, websocket"
+    return hasHeaderToken(upgradeIter->second, "h2c")
+           && Http2Session::decodeUpgradeSettings(settingsIter->second, settings);
+}
+
+/**
+ * @brief Switch the connection to HTTP/2, the session owns the connection from now on
+ * @param upgrade_settings  the HTTP2-Settings of the upgrade request, nullptr for the prior knowledge
+ */
+bool HttpHandler::startHttp2(const string* upgrade_settings)
+{
+    in_.retrieve(curr_parse_pos_);
+    curr_parse_pos_ = 0;
+    // The frames of the streams are small writes, do not hold them for the ACK of the last one
+    if(!setSocketNoDelay(client_fd_))
+        WARN("Set TCP_NODELAY of socket(%d) failed! (%s)", client_fd_, strerror(errno));
+    h2_ = new Http2Session(this, upgrade_settings);
+    if(upgrade_settings)
+    {
+        static const char* method_names[] = { "GET", "POST", "HEAD" };
+        h2_->startUpgradeStream(method_names[method_], path_, headers_);
+    }
+    return h2_->RunEventLoop(0);
+}
+
+/**
+ * @brief Check the "Upgrade: websocket" of a GET request of HTTP/1.1 on a WebSocket route
+ * @return 1 if the connection should switch, 0 if the request is served as usual, -1 for 400
+ */
+int HttpHandler::isWebSocketUpgrade(string* accept)
+{
+    if(!WebSocketSession::isEnabled() || http_version_ != HTTP_1_1 || method_ != METHOD_GET
+       || draining_.load(memory_order_relaxed) || !WebSocketSession::match(path_.c_str() + www_path.size() + 1))
+        return 0;
+    if(headers_.count("transfer-encoding") || headers_.count("content-length"))
+        return headers_.count("upgrade") ? -1 : 0;
+    return WebSocketSession::checkUpgrade(headers_, accept);
+}
+
+/**
+ * @brief Switch the connection to WebSocket, the session owns the connection from now on
+ */
+bool HttpHandler::startWebSocket(const string& accept)
+{
+    in_.retrieve(curr_parse_pos_);
+    curr_parse_pos_ = 0;
+    // The messages are small writes, do not hold them for the ACK of the last one
+    if(!setSocketNoDelay(client_fd_))
+        WARN("Set TCP_NODELAY of socket(%d) failed! (%s)", client_fd_, strerror(errno));
+    // The path without the query is the channel
+    string channel(path_, www_path.size() + 1);
+    size_t query = channel.find('?');
+    if(query != string::npos)
+        channel.resize(query);
+    noteResponse(101);
+    finishTrace("websocket upgrade");
+    logAccess(false);
+    if(PerfCounters::isEnabled())
+    {
+        perf_class_ = PerfCounters::CLASS_WEBSOCKET;
+        PerfCounters::charge(&perf_mark_, &perf_total_);
+        recordPerf();
+    }
+    if(HeavyHitters::isEnabled())
+        recordHeavyHitters();
+    ws_ = new WebSocketSession(this, channel, accept);
+    return ws_->RunEventLoop(0);
+}
+
+HttpHandler::ERROR_TYPE HttpHandler::handleRequest()
+{
+    TraceSpan span("handle request");
+    Router::Request req;
+    const Router::Route* route = Router::match(method_, path_.c_str() + www_path.size() + 1, &req);
+    if(!route)
+        return ERR_NOT_FOUND;
+    switch(route->type)
+    {
+        case Router::ROUTE_HANDLER:
+            perf_class_ = PerfCounters::CLASS_HANDLER;
+            return runRoute(route, &req);
+        case Router::ROUTE_PROXY:
+            // The paths of the proxy routes are served by the upstreams
+            perf_class_ = PerfCounters::CLASS_PROXY;
+            return startProxy(Proxy::pick(route->proxy));
+        case Router::ROUTE_STATIC:
+            perf_class_ = PerfCounters::CLASS_STATIC;
+            return serveStatic();
+        case Router::ROUTE_CGI:
+            perf_class_ = PerfCounters::CLASS_CGI;
+            break;
+    }
+
+    // determine the traversal vulnerability
+    if(!is_path_parent(www_path, path_))
+        return ERR_NOT_FOUND;
+
+    // get the file detail
+    struct stat st;
+    if(stat(path_.c_str(), &st) == -1)
+    {
+        WARN("Can not get file [%s] state ! (%s)", path_.c_str(), strerror(errno));
+        if(errno == ENOENT)
+            return ERR_NOT_FOUND;
+        else
+            return ERR_INTERNAL_SERVER_ERR;
+    }
+    // If try to visit the directory, default visit the index.html
+    if (S_ISDIR(st.st_mode))
+        path_ += "/index.html";
+
+    ERROR_TYPE err;
+    if(CgiCache::isEnabled() && lookupCgiCache(&err))
+        return err;
+    // For POST, the http body is passed into the target executable file and the result is returned to the client
+    return startCgi();
+}
+
+/**
+ * @brief Answer the POST of a --cgi-cache script from the cache, or wait for the leader of the same request
+ *
+ * The whole body is the key, so it is received before the lookup. A woken waiter comes here again.
+ *
+ * @return true if answered or waiting, with err; false to run the CGI, as the leader if cgi_cache_ is set
+ */
+bool HttpHandler::lookupCgiCache(ERROR_TYPE* err)
+{
+    CgiCache::LOOKUP result;
+    if(cgi_cache_)
+        result = CgiCache::check(&cgi_cache_);
+    else
+    {
+        // path_ is www_path + "/" + the URI
+        const char* script = path_.c_str() + www_path.size() + 1;
+        size_t script_len = path_.size() - www_path.size() - 1;
+        int64_t ttl = CgiCache::getTtl(script, script_len);
+        // The CGI of a Unix socket client gets its credentials, its output is its own
+        if(ttl == 0 || has_peer_cred_ || isChunkedBody_ || body_left_ > CgiCache::MAX_BODY_SIZE)
+            return false;
+        if(in_.readable() - curr_parse_pos_ < body_left_)
+        {
+            *err = ERR_AGAIN;
+            return true;
+        }
+        result = CgiCache::lookup(script, script_len, ttl, in_.peek() + curr_parse_pos_, body_left_,
+                                  this, wakeCgiCacheWaiter, &cgi_cache_);
+    }
+    if(result == CgiCache::LOOKUP_WAIT)
+    {
+        *err = ERR_AGAIN;
+        return true;
+    }
+    if(result == CgiCache::LOOKUP_RUN)
+    {
+        cgi_capture_ = (cgi_cache_ != nullptr);
+        return false;
+    }
+
+    // The body is not forwarded to anyone
+    curr_parse_pos_ += body_left_;
+    body_left_ = 0;
+    body_done_ = true;
+    out_body_.output = CgiCache::getOutput(cgi_cache_);
+    out_body_.data = out_body_.output->data();
+    out_body_.len = out_body_.output->size();
+    CgiCache::release(&cgi_cache_, this);
+
+    noteResponse(200);
+    ResponseBuilder header;
+    header.statusLine(200);
+    header.date();
+    header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+    header.server();
+    header.contentLength(out_body_.len);
+    header.contentType(MimeType::getMineType("txt"));
+    header.finish();
+    out_pending_.assign(header.data(), header.size());
+    *err = ERR_SUCCESS;
+    return true;
+}
+
+/**
+ * @brief Wake a connection waiting in lookupCgiCache(), by EPOLLOUT of its writable socket
+ */
+void HttpHandler::wakeCgiCacheWaiter(void* waiter)
+{
+    HttpHandler* conn = static_cast<HttpHandler*>(waiter);
+    conn->epoll_->modify(conn->client_fd_, conn->getClientEpollEvent(), conn->getClientTriggerCond() | EPOLLOUT);
+}
+
+/**
+ * @brief Answer GET or HEAD with a static file, the body is sent after the headers in out_pending_
+ */
+HttpHandler::ERROR_TYPE HttpHandler::serveStatic()
+{
+    int code = 200;
+    string fields;
+    ERROR_TYPE err = findStaticFile(path_, headers_, &out_body_, &fields, &code);
+    if(err != ERR_SUCCESS)
+        return err;
+    // if request is HEAD, do not send the http body
+    if(method_ == METHOD_HEAD)
+        out_body_.len = 0;
+
+    noteResponse(code);
+    ResponseBuilder header;
+    header.statusLine(code);
+    header.date();
+    header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+    header.server();
+    header.raw(fields.data(), fields.size());
+    header.finish();
+    if(header.isOverflow())
+        return ERR_INTERNAL_SERVER_ERR;
+    out_pending_.assign(header.data(), header.size());
+    return ERR_SUCCESS;
+}
+
+/**
+ * @brief Run a native handler, its body is written into out_pending_ and the headers are put before it
+ *
+ * The request body is a view of the input buffer, so the handler runs after the whole body is received.
+ * A chunked body is not taken, its decoded parts are not contiguous in the buffer.
+ *
+ * @return ERR_AGAIN if the body is not complete yet
+ */
+HttpHandler::ERROR_TYPE HttpHandler::runRoute(const Router::Route* route, Router::Request* req)
+{
+    if(method_ == METHOD_POST)
+    {
+        if(isChunkedBody_)
+            return ERR_LENGTH_REQUIRED;
+        if(body_left_ > Router::getMaxBodySize())
+            return ERR_PAYLOAD_TOO_LARGE;
+        if(in_.readable() - curr_parse_pos_ < body_left_)
+            return ERR_AGAIN;
+        req->body = Router::View(in_.peek() + curr_parse_pos_, body_left_);
+    }
+    req->headers = &headers_;
+    req->peer = has_peer_cred_ ? &peer_cred_ : nullptr;
+
+    TraceSpan span("route handler");
+    assert(out_pending_.empty());
+    Router::Response resp(&out_pending_);
+    route->handler(*req, &resp, route->arg);
+    // The body is not needed after the handler
+    curr_parse_pos_ += body_left_;
+    body_left_ = 0;
+    body_done_ = true;
+
+    size_t line_len;
+    int code = resp.getStatus();
+    if(!ResponseBuilder::getStatusLine(code, &line_len))
+    {
+        WARN("Route %s answered the unknown status %d", route->pattern.c_str(), code);
+        out_pending_.clear();
+        return ERR_INTERNAL_SERVER_ERR;
+    }
+    noteResponse(code);
+    ResponseBuilder header;
+    header.statusLine(code);
+    header.date();
+    header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+    header.server();
+    header.contentLength(resp.getBodySize());
+    header.contentType(resp.getContentType().empty() ? MimeType::getMineType("txt") : resp.getContentType());
+    header.raw(resp.getFields().data(), resp.getFields().size());
+    header.finish();
+    if(header.isOverflow())
+    {
+        out_pending_.clear();
+        return ERR_INTERNAL_SERVER_ERR;
+    }
+    if(method_ == METHOD_HEAD)
+        out_pending_.clear();
+    out_pending_.insert(0, header.data(), header.size());
+    return ERR_SUCCESS;
+}
+
+string HttpHandler::getContentType(const string& path)
+{
+    string suffix = path;
+    // find the .
+    size_t dot_pos;
+    while((dot_pos = suffix.find('.')) != string::npos)
+        suffix = suffix.substr(dot_pos + 1);
+    return MimeType::getMineType(suffix);
+}
+
+/**
+ * @brief Find the static file of a GET or HEAD request, shared by HTTP/1.1 and HTTP/2
+ *
+ * The bundle is looked up first, then the file cache and the file system.
+ *
+ * @param path      the path under www_path, changed to the index.html of a directory
+ * @param body      the source of the body, release() it after sending
+ * @param fields    the header fields after the status line, every line ends with "\r\n"
+ * @param code      200, or 304 if the etag of the client matches
+ */
+HttpHandler::ERROR_TYPE HttpHandler::findStaticFile(string& path, const map<string, string>& headers,
+                                                    StaticBody* body, string* fields, int* code)
+{
+    *code = 200;
+    // The bundle holds the clean paths only, it is looked up before touching the file system
+    if(Bundle::isEnabled())
+    {
+        TraceSpan span("bundle lookup");
+        const char* uri = path.c_str() + www_path.size() + 1;
+        const Bundle::Entry* entry = Bundle::find(uri, strcspn(uri, "?"));
+        if(entry)
+        {
+            findBundleVariant(entry, headers, body, fields, code);
+            return ERR_SUCCESS;
+        }
+    }
+
+    // determine the traversal vulnerability
+    {
+        TraceSpan span("is_path_parent");
+        if(!is_path_parent(www_path, path))
+            return ERR_NOT_FOUND;
+    }
+
+    // The cached files are revalidated by the cache itself, stat is not needed
+    TraceSpan lookup_span("file lookup");
+    if(FileCache::lookup(path, &body->ref))
+    {
+        // The reader is released after the body is sent
+        body->ref_held = true;
+        body->data = body->ref.data;
+        body->len = body->ref.size;
+        renderFileFields(path, body->len, fields);
+        return ERR_SUCCESS;
+    }
+
+    // get the file detail
+    struct stat st;
+    if(stat(path.c_str(), &st) == -1)
+    {
+        WARN("Can not get file [%s] state ! (%s)", path.c_str(), strerror(errno));
+        if(errno == ENOENT)
+            return ERR_NOT_FOUND;
+        else
+            return ERR_INTERNAL_SERVER_ERR;
+    }
+    // If try to visit the directory, default visit the index.html
+    if (S_ISDIR(st.st_mode)) {
+        path += "/index.html";
+        if(FileCache::lookup(path, &body->ref))
+        {
+            body->ref_held = true;
+            body->data = body->ref.data;
+            body->len = body->ref.size;
+            renderFileFields(path, body->len, fields);
+            return ERR_SUCCESS;
+        }
+        if(stat(path.c_str(), &st) == -1)
+        {
+            WARN("Can not get file [%s] state ! (%s)", path.c_str(), strerror(errno));
+            if(errno == ENOENT)
+                return ERR_NOT_FOUND;
+            else
+                return ERR_INTERNAL_SERVER_ERR;
+        }
+    }
+
+    // Open the file
+    int file_fd;
+    if((file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0)) == -1)
+    {
+        WARN("File [%s] open failed ! (%s)", path.c_str(), strerror(errno));
+        if(errno == ENOENT)
+            // If the file not exist, return 404
+            return ERR_NOT_FOUND;
+        else
+            return ERR_INTERNAL_SERVER_ERR;
+    }
+    // Keep a copy for the next requests, of this process and the other workers
+    if(S_ISREG(st.st_mode))
+        FileCache::insert(path, st, file_fd);
+
+    // The body is sent by sendfile, the fd is closed after it
+    body->fd = file_fd;
+    body->fd_owned = true;
+    body->off = 0;
+    body->len = static_cast<size_t>(st.st_size);
+    renderFileFields(path, body->len, fields);
+    return ERR_SUCCESS;
+}
+
+void HttpHandler::renderFileFields(const string& path, size_t len, string* fields)
+{
+    char num[UINT_STR_MAX_LEN];
+    fields->assign("Content-Length: ");
+    fields->append(num, fastUintToStr(len, num));
+    fields->append("\r\nContent-Type: ");
+    fields->append(getContentType(path));
+    fields->append("\r\n");
+}
+
+/**
+ * @brief Choose the variant of the bundle entry, and answer 304 if the etag of the client matches
+ */
+void HttpHandler::findBundleVariant(const Bundle::Entry* entry, const map<string, string>& headers,
+                                    StaticBody* body, string* fields, int* code)
+{
+    const Bundle::Variant* variant = &entry->variants[Bundle::VARIANT_IDENTITY];
+    const Bundle::Variant& gzip = entry->variants[Bundle::VARIANT_GZIP];
+    if(gzip.fields_len > 0 && isGzipAccepted(headers))
+        variant = &gzip;
+
+    auto etagIter = headers.find("if-none-match");
+    if(etagIter != headers.end() && isEtagMatched(etagIter->second, Bundle::at(variant->etag_off), variant->etag_len))
+    {
+        *code = 304;
+        fields->assign("ETag: ");
+        fields->append(Bundle::at(variant->etag_off), variant->etag_len);
+        fields->append("\r\n");
+        return;
+    }
+
+    fields->assign(Bundle::at(variant->fields_off), variant->fields_len);
+    // Sent by sendfile from the page aligned body, or from the memory if the bundle is in huge pages
+    body->fd = Bundle::getFd();
+    body->fd_owned = false;
+    body->data = (body->fd == -1) ? Bundle::at(variant->body_off) : nullptr;
+    body->off = (body->fd == -1) ? 0 : static_cast<off_t>(variant->body_off);
+    body->len = variant->body_len;
+    INFO("Bundle hit: %.*s", static_cast<int>(entry->path_len), Bundle::at(entry->path_off));
+}
+
+bool HttpHandler::isGzipAccepted(const map<string, string>& headers)
+{
+    auto iter = headers.find("accept-encoding");
+    if(iter == headers.end())
+        return false;
+    // "gzip, deflate, br" or "gzip;q=0.8", "gzip;q=0" refuses it, the coding is a whole token
+    const string& value = iter->second;
+    size_t pos = 0;
+    while(pos < value.size())
+    {
+        size_t end = value.find(',', pos);
+        if(end == string::npos)
+            end = value.size();
+        size_t begin = value.find_first_not_of(" \t", pos);
+        size_t token_end = (begin < end) ? value.find_first_of(" \t;,", begin) : string::npos;
+        if(token_end == string::npos || token_end > end)
+            token_end = end;
+        if(begin < end && token_end - begin == 4 && strncasecmp(value.c_str() + begin, "gzip", 4) == 0)
+        {
+            // the parameters after the coding, like " ; q=0.5"
+            for(size_t param = value.find(';', token_end); param < end; param = value.find(';', param + 1))
+            {
+                size_t name = value.find_first_not_of(" \t", param + 1);
+                if(name + 2 <= end && (value[name] == 'q' || value[name] == 'Q') && value[name + 1] == '=')
+                    return strtod(value.c_str() + name + 2, nullptr) > 0;
+            }
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief Match the If-None-Match header, like "\"a\", \"b\"", W/"a" or *
+ */
+bool HttpHandler::isEtagMatched(const string& value, const char* etag, size_t len)
+{
+    if(value == "*")
+        return true;
+    size_t pos = 0;
+    while((pos = value.find('"', pos)) != string::npos)
+    {
+        size_t end = value.find('"', pos + 1);
+        if(end == string::npos)
+            return false;
+        if(end + 1 - pos == len && value.compare(pos, len, etag, len) == 0)
+            return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief Send the headers in out_pending_ and the body, continued on EPOLLOUT if the socket is full
+ *
+ * A memory body is sent together with the headers by writev,
+ * a file body is sent by sendfile after the headers corked with MSG_MORE.
+ */
+HttpHandler::ERROR_TYPE HttpHandler::sendBody()
+{
+    TraceSpan span("send body");
+    StaticBody& body = out_body_;
+    bool progressed = false;
+    if(body.data && !out_pending_.empty() && body.len > 0)
+    {
+        iovec iov[2];
+        iov[0].iov_base = const_cast<char*>(out_pending_.data());
+        iov[0].iov_len = out_pending_.size();
+        iov[1].iov_base = const_cast<char*>(body.data + body.off);
+        iov[1].iov_len = body.len;
+        ssize_t len = writevClient(iov, 2);
+        if(len < 0)
+            return ERR_SEND_RESPONSE_FAIL;
+        size_t sent = static_cast<size_t>(len);
+        if(sent < out_pending_.size())
+            out_pending_.erase(0, sent);
+        else
+        {
+            sent -= out_pending_.size();
+            out_pending_.clear();
+            body.off += static_cast<off_t>(sent);
+            body.len -= sent;
+        }
+        progressed = len > 0;
+    }
+    else if(!out_pending_.empty())
+    {
+        size_t before = out_pending_.size();
+        ERROR_TYPE err = flushPending(body.len > 0);
+        progressed = out_pending_.size() < before;
+        if(err == ERR_AGAIN && progressed)
+            extendDeadline();
+        if(err != ERR_SUCCESS)
+            return err;
+    }
+
+    while(body.len > 0)
+    {
+        ssize_t len;
+        if(body.data)
+            len = sendClient(body.data + body.off, body.len, 0);
+        else
+            len = sendfileClient(body.fd, &body.off, body.len);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            return ERR_SEND_RESPONSE_FAIL;
+        }
+        // The file was truncated after the Content-Length was sent
+        if(len == 0)
+            return ERR_SEND_RESPONSE_FAIL;
+        if(body.data)
+            body.off += len;
+        body.len -= static_cast<size_t>(len);
+        progressed = true;
+    }
+    if(body.len > 0 || !out_pending_.empty())
+    {
+        // A slow client is not closed while it keeps reading
+        if(progressed)
+            extendDeadline();
+        return ERR_AGAIN;
+    }
+    body.release();
+    return ERR_SUCCESS;
+}
+
+/**
+ * @brief Release the source of the body
+ */
+void StaticBody::release()
+{
+    if(fd_owned)
+        close(fd);
+    if(ref_held)
+        FileCache::release(ref);
+    fd = -1;
+    fd_owned = false;
+    ref_held = false;
+    output.reset();
+    data = nullptr;
+    off = 0;
+    len = 0;
+}
+
+/**
+ * @brief Fork and exec the CGI, the pipes of its stdin and stdout are nonblocking in the server side
+ * @return the pid, or -1 if failed
+ */
+pid_t HttpHandler::spawnCgi(const string& cgi_path, const ucred* peer, int* in_fd, int* out_fd)
+{
+    // The environment is built before fork, the child only execs
+    vector<string> peer_env;
+    vector<char*> env;
+    if(peer)
+    {
+        peer_env.push_back("REMOTE_PID=" + to_string(peer->pid));
+        peer_env.push_back("REMOTE_UID=" + to_string(peer->uid));
+        peer_env.push_back("REMOTE_GID=" + to_string(peer->gid));
+        for(char** var = environ; *var; var++)
+            env.push_back(*var);
+        for(string& var : peer_env)
+            env.push_back(&var[0]);
+        env.push_back(nullptr);
+    }
+
+    // create two pipes
+    int cgi_output[2];
+    int cgi_input[2];
+
+    if (pipe2(cgi_output, O_CLOEXEC) == -1) {
+        WARN("cgi_output create error. (%s)", strerror(errno));
+        return -1;
+    }
+    if (pipe2(cgi_input, O_CLOEXEC) == -1) {
+        WARN("cgi_input create error. (%s)", strerror(errno));
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        return -1;
+    }
+
+    pid_t pid;
+    if((pid = fork()) < 0)
+    {
+        WARN("Fork error. (%s)", strerror(errno));
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        if(setpgid(0, 0) == -1)
+            FATAL("setpgid fail in child process! (%s)", strerror(errno));
+        if(prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+            FATAL("prctl fail in child process! (%s)", strerror(errno));
+        // The server blocks the signals read by signalfd, do not pass the mask to the CGI
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+        if(dup2(cgi_input[0], 0) == -1
+           || dup2(cgi_output[1], 1) == -1
+           || dup2(1, 2) == -1)
+            FATAL("dup2 fail! (%s)", strerror(errno));
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+
+        // read the data
+        char path[cgi_path.size() + 1];
+        strcpy(path, cgi_path.c_str());
+        char* const args[] = { path, NULL };
+
+        // execute the program
+        execve(path, args, peer ? env.data() : environ);
+        FATAL("execve fail in child process! (%s)", strerror(errno));
+    }
+
+    close(cgi_input[0]);
+    close(cgi_output[1]);
+    *in_fd = cgi_input[1];
+    *out_fd = cgi_output[0];
+    if(!setFdNoBlock(*in_fd) || !setFdNoBlock(*out_fd))
+    {
+        close(*in_fd);
+        close(*out_fd);
+        *in_fd = *out_fd = -1;
+        killProcess(pid);
+        waitProcess(pid);
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief fork the CGI process, the body and the output are relayed by the coroutines of pumpCgiInput()
+ *        and relayCgiOutput()
+ */
+HttpHandler::ERROR_TYPE HttpHandler::startCgi()
+{
+    TraceSpan span("cgi spawn");
+    pid_t pid = spawnCgi(path_, getPeerCred(), &cgi_in_fd_, &cgi_out_fd_);
+    if(pid == -1)
+        return ERR_INTERNAL_SERVER_ERR;
+    cgi_pid_ = pid;
+    cgi_in_event_.fd = cgi_in_fd_;
+    cgi_out_event_.fd = cgi_out_fd_;
+
+    // The request body is forwarded by pumpCgiInput() when it arrives
+    if(!epoll_->add(cgi_in_fd_, &cgi_in_event_, 0)
+       || !epoll_->add(cgi_out_fd_, &cgi_out_event_, 0))
+    {
+        WARN("Register CGI fds(%d, %d) fail! (%s)", cgi_in_fd_, cgi_out_fd_, strerror(errno));
+        stopCgi(true);
+        return ERR_INTERNAL_SERVER_ERR;
+    }
+
+    // HTTP/1.0 does not know chunked, the end of the output is marked by closing the connection
+    isChunked_ = (http_version_ == HTTP_1_1);
+    if(!isChunked_)
+        isKeepAlive_ = false;
+    // They start at the next pass of RunEventLoop
+    relay_input_ = pumpCgiInput();
+    relay_output_ = relayCgiOutput();
+    return ERR_SUCCESS;
+}
+
+/**
+ * @brief Send out_pending_ to the client
+ * @param more true if the chunk data will be sent right after it
+ * @return ERR_AGAIN if the socket is full
+ */
+HttpHandler::ERROR_TYPE HttpHandler::flushPending(bool more)
+{
+    size_t sent = 0;
+    while(sent < out_pending_.size())
+    {
+        ssize_t len = sendClient(out_pending_.data() + sent, out_pending_.size() - sent,
+                                 more ? MSG_MORE : 0);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            return ERR_SEND_RESPONSE_FAIL;
+        }
+        sent += static_cast<size_t>(len);
+    }
+    out_pending_.erase(0, sent);
+    return out_pending_.empty() ? ERR_SUCCESS : ERR_AGAIN;
+}
+
+/**
+ * @brief Move a part of the current chunk from the CGI output to the socket, or to out_pending_ if
+ *        splice can not be used, the buffer of read is not kept in the coroutine frame
+ * @return the moved bytes, -1 with errno, EINTR if splice is not supported
+ */
+ssize_t HttpHandler::relayChunkPart()
+{
+    // The userspace TLS has to encrypt the output, and the leader of a cached request keeps a copy
+    if(use_splice_ && !cgi_capture_ && (!tls_ || tls_->isKernelSend()))
+    {
+        ssize_t len = splice(cgi_out_fd_, nullptr, client_fd_, nullptr, chunk_left_,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if(len > 0)
+            bytes_out_ += static_cast<size_t>(len);
+        if(len < 0 && errno == EINVAL)
+        {
+            WARN("Socket(%d) does not support splice, fall back to send.", client_fd_);
+            use_splice_ = false;
+            errno = EINTR;
+        }
+        return len;
+    }
+    char buf[MAXBUF];
+    ssize_t len = read(cgi_out_fd_, buf, min(chunk_left_, MAXBUF));
+    if(len > 0)
+    {
+        out_pending_.append(buf, static_cast<size_t>(len));
+        // An output too large for the cache is only relayed
+        if(cgi_capture_ && !CgiCache::capture(&cgi_cache_, buf, static_cast<size_t>(len)))
+            cgi_capture_ = false;
+    }
+    return len;
+}
+
+/**
+ * @brief Relay the CGI output to the client as it is produced
+ *
+ * The pipe is moved to the socket by splice without copying to the userspace,
+ * if the socket does not support splice, fall back to read and send.
+ * Under HTTP/1.1 every readable part of the pipe is sent as one chunk.
+ *
+ * @return ERR_SUCCESS if all the output was sent, ERR_INTERNAL_SERVER_ERR if the CGI wrote nothing,
+ *         ERR_SEND_RESPONSE_FAIL
+ */
+Task<HttpHandler::ERROR_TYPE> HttpHandler::relayCgiOutput()
+{
+    for(;;)
+    {
+        ERROR_TYPE err = flushPending(chunk_left_ > 0);
+        if(err == ERR_AGAIN)
+        {
+            co_await waitEvents(EVENT_CLIENT_OUT);
+            continue;
+        }
+        else if(err != ERR_SUCCESS)
+            co_return err;
+
+        if(cgi_eof_)
+            co_return ERR_SUCCESS;
+
+        // 1. relay the rest of current chunk
+        if(chunk_left_ > 0)
+        {
+            ssize_t len = relayChunkPart();
+            if(len < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                // The pipe has chunk_left_ bytes at least, so only the socket can be full
+                if(errno == EAGAIN)
+                {
+                    co_await waitEvents(EVENT_CLIENT_OUT);
+                    continue;
+                }
+                co_return ERR_SEND_RESPONSE_FAIL;
+            }
+            else if(len == 0)
+                co_return ERR_SEND_RESPONSE_FAIL;
+
+            chunk_left_ -= static_cast<size_t>(len);
+            if(chunk_left_ == 0 && isChunked_)
+                out_pending_ += "\r\n";
+            continue;
+        }
+
+        // 2. start a new chunk with all the readable data of the pipe
+        int avail = 0;
+        if(ioctl(cgi_out_fd_, FIONREAD, &avail) == -1)
+            co_return ERR_SEND_RESPONSE_FAIL;
+
+        if(avail == 0)
+        {
+            pollfd pfd = { cgi_out_fd_, POLLIN, 0 };
+            if(poll(&pfd, 1, 0) == 0 || (pfd.revents & POLLIN))
+            {
+                co_await waitEvents(EVENT_CGI_OUT);
+                continue;
+            }
+            // The CGI closed its output
+            stopCgi(false);
+            if(!headers_sent_)
+                co_return ERR_INTERNAL_SERVER_ERR;
+            // Do not terminate the chunked body, so that the client knows the output is truncated
+            if(cgi_timeout_)
+                co_return ERR_SEND_RESPONSE_FAIL;
+            cgi_eof_ = true;
+            if(cgi_capture_)
+            {
+                CgiCache::complete(&cgi_cache_);
+                cgi_capture_ = false;
+            }
+            if(isChunked_)
+                out_pending_ += "0\r\n\r\n";
+            continue;
+        }
+
+        if(!headers_sent_)
+        {
+            noteResponse(200);
+            ResponseBuilder header;
+            header.statusLine(200);
+            header.date();
+            header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+            header.server();
+            if(isChunked_)
+                header.raw("Transfer-Encoding: chunked\r\n", 28);
+            header.contentType(MimeType::getMineType("txt"));
+            header.finish();
+            out_pending_.append(header.data(), header.size());
+            headers_sent_ = true;
+
+            INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
+            INFO("{%s}", escapeStr(out_pending_, MAXBUF).c_str());
+        }
+        if(isChunked_)
+        {
+            char hex[32];
+            int hex_len = snprintf(hex, sizeof(hex), "%x\r\n", avail);
+            out_pending_.append(hex, static_cast<size_t>(hex_len));
+        }
+        chunk_left_ = static_cast<size_t>(avail);
+    }
+}
+
+/**
+ * @brief The address of the client for X-Forwarded-For
+ */
+static string getPeerAddress(int fd)
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char buf[INET6_ADDRSTRLEN] = "unknown";
+    if(getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0)
+    {
+        if(addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&addr)->sin_addr, buf, sizeof(buf));
+        else if(addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr, buf, sizeof(buf));
+        else if(addr.ss_family == AF_UNIX)
+            return "unix";
+    }
+    return buf;
+}
+
+/**
+ * @brief Forward the request to the upstream, the response is relayed by relayProxyOutput()
+ *
+ * The request goes as HTTP/1.1 on a keep-alive connection of the upstream pool. The hop-by-hop headers
+ * are dropped and the body framing is rendered again, a chunked body is sent chunked.
+ */
+HttpHandler::ERROR_TYPE HttpHandler::startProxy(Upstream* upstream)
+{
+    TraceSpan span("proxy connect");
+    static const char* method_names[] = { "GET", "POST", "HEAD" };
+    static const char* dropped[] = { "connection", "keep-alive", "proxy-connection", "te", "trailer",
+                                     "transfer-encoding", "upgrade", "http2-settings", "content-length",
+                                     "expect", "x-forwarded-for", "x-forwarded-proto" };
+    up_head_ = method_names[method_];
+    up_head_ += ' ';
+    up_head_.append(path_, www_path.size() + 1, string::npos);
+    up_head_ += " HTTP/1.1\r\n";
+    for(const auto& header : headers_)
+    {
+        auto isDropped = [&header](const char* name) { return header.first == name; };
+        if(find_if(begin(dropped), end(dropped), isDropped) != end(dropped))
+            continue;
+        up_head_ += header.first + ": " + header.second + "\r\n";
+    }
+    if(headers_.find("host") == headers_.end())
+        up_head_ += "host: " + upstream->getName() + "\r\n";
+    // The client is appended to the proxies before this one
+    auto forwardedIter = headers_.find("x-forwarded-for");
+    up_head_ += "x-forwarded-for: ";
+    if(forwardedIter != headers_.end())
+        up_head_ += forwardedIter->second + ", ";
+    up_head_ += getPeerAddress(client_fd_);
+    up_head_ += tls_ ? "\r\nx-forwarded-proto: https\r\n" : "\r\nx-forwarded-proto: http\r\n";
+    if(method_ == METHOD_POST && isChunkedBody_)
+        up_head_ += "transfer-encoding: chunked\r\n";
+    else if(method_ == METHOD_POST)
+    {
+        char num[UINT_STR_MAX_LEN];
+        up_head_ += "content-length: ";
+        up_head_.append(num, fastUintToStr(body_left_, num));
+        up_head_ += "\r\n";
+    }
+    up_head_ += "connection: keep-alive\r\n\r\n";
+
+    upstream_ = upstream;
+    up_retried_ = false;
+    if(!connectUpstream())
+        return ERR_BAD_GATEWAY;
+    up_head_done_ = false;
+    up_done_ = false;
+    up_keep_alive_ = false;
+    up_body_type_ = UP_BODY_NONE;
+    up_left_ = 0;
+    up_chunk_state_ = CHUNK_SIZE;
+    isChunked_ = false;
+    // They start at the next pass of RunEventLoop
+    relay_input_ = pumpProxyInput();
+    relay_output_ = relayProxyOutput();
+    INFO("Proxy %s to upstream %s", path_.c_str() + www_path.size(), upstream->getName().c_str());
+    return ERR_SUCCESS;
+}
+
+/**
+ * @brief Take a connection of upstream_ and queue the request head on it
+ */
+bool HttpHandler::connectUpstream()
+{
+    up_fd_ = upstream_->acquire(&up_reused_);
+    if(up_fd_ == -1)
+        return false;
+    up_event_.fd = up_fd_;
+    if(!epoll_->add(up_fd_, &up_event_, 0))
+    {
+        WARN("Register upstream fd(%d) fail! (%s)", up_fd_, strerror(errno));
+        upstream_->release(up_fd_, false);
+        up_fd_ = -1;
+        return false;
+    }
+    up_pending_ = up_head_;
+    up_sent_ = false;
+    return true;
+}
+
+/**
+ * @brief Send the request again on a new connection, if the pooled one was closed by the upstream
+ *        before any response. Only the requests without a body can be sent again
+ */
+bool HttpHandler::retryProxy()
+{
+    if(!up_reused_ || up_retried_ || method_ == METHOD_POST || up_head_done_ || up_in_.readable() > 0)
+        return false;
+    INFO("Upstream %s closed the pooled connection, send the request again", upstream_->getName().c_str());
+    epoll_->del(up_fd_);
+    upstream_->release(up_fd_, false);
+    up_fd_ = -1;
+    up_retried_ = true;
+    return connectUpstream();
+}
+
+void HttpHandler::stopProxy()
+{
+    if(!upstream_)
+        return;
+    if(up_fd_ != -1)
+    {
+        bool reusable = up_sent_ && up_done_ && up_keep_alive_ && up_in_.readable() == 0;
+        epoll_->del(up_fd_);
+        upstream_->release(up_fd_, reusable);
+        up_fd_ = -1;
+    }
+    upstream_ = nullptr;
+    up_in_.retrieve(up_in_.readable());
+    up_in_.shrink();
+    up_head_.clear();
+    up_pending_.clear();
+    // The rest of a broken response is never sent
+    if(pipe_len_ > 0)
+    {
+        close(relay_pipe_[0]);
+        close(relay_pipe_[1]);
+        relay_pipe_[0] = relay_pipe_[1] = -1;
+        pipe_len_ = 0;
+    }
+}
+
+/**
+ * @brief Send the request head and the body to the upstream as the body arrives
+ *
+ * The body is sent directly from the request buffer, if the upstream is full the socket is not read any more.
+ * Every decoded part of a chunked body is sent as one chunk.
+ *
+ * @return ERR_SUCCESS if the whole request was sent, ERR_BAD_REQUEST, ERR_PAYLOAD_TOO_LARGE or ERR_BAD_GATEWAY
+ */
+Task<HttpHandler::ERROR_TYPE> HttpHandler::pumpProxyInput()
+{
+    for(;;)
+    {
+        // 1. the head and the chunk framing
+        if(!up_pending_.empty())
+        {
+            ssize_t len = send(up_fd_, up_pending_.data(), up_pending_.size(), MSG_NOSIGNAL);
+            if(len < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN)
+                {
+                    dropForwardedBody();
+                    co_await waitEvents(EVENT_UPSTREAM_OUT);
+                    continue;
+                }
+                if(retryProxy())
+                    continue;
+                WARN("Send the request to upstream %s fail! (%s)", upstream_->getName().c_str(), strerror(errno));
+                co_return ERR_BAD_GATEWAY;
+            }
+            up_pending_.erase(0, static_cast<size_t>(len));
+            continue;
+        }
+        if(body_done_)
+            break;
+
+        // 2. the body
+        const char* data = nullptr;
+        size_t forward = 0;
+        ERROR_TYPE body_err = nextBodyData(&data, &forward);
+        if(body_err != ERR_SUCCESS)
+            co_return body_err;
+        if(body_done_)
+        {
+            if(isChunkedBody_)
+                up_pending_ += "0\r\n\r\n";
+            continue;
+        }
+        if(forward == 0)
+        {
+            dropForwardedBody();
+            co_await waitEvents(EVENT_CLIENT_IN);
+            continue;
+        }
+        if(isChunkedBody_)
+        {
+            char hex[32];
+            int hex_len = snprintf(hex, sizeof(hex), "%zx\r\n", forward);
+            up_pending_.append(hex, static_cast<size_t>(hex_len));
+            up_pending_.append(data, forward);
+            up_pending_ += "\r\n";
+            consumeBodyData(forward);
+            continue;
+        }
+
+        ssize_t len = send(up_fd_, data, forward, MSG_NOSIGNAL);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+            {
+                dropForwardedBody();
+                co_await waitEvents(EVENT_UPSTREAM_OUT);
+                continue;
+            }
+            WARN("Send %zu bytes to upstream %s fail! (%s)", forward, upstream_->getName().c_str(), strerror(errno));
+            co_return ERR_BAD_GATEWAY;
+        }
+        consumeBodyData(static_cast<size_t>(len));
+    }
+
+    // The sent data is never needed again, and the upstream has the whole timeout for the response
+    dropForwardedBody();
+    up_sent_ = true;
+    extendDeadline();
+    co_return ERR_SUCCESS;
+}
+
+/**
+ * @brief Relay the upstream response to the client as it arrives
+ *
+ * The body is moved from the upstream socket to the pipe and from the pipe to the client by splice, without
+ * copying it to the userspace. The response head and the chunk framing of the upstream are read into up_in_,
+ * the body bytes read together with them are sent from there. A body without Content-Length is sent chunked
+ * to an HTTP/1.1 client, every part pulled from the upstream is one chunk.
+ *
+ * @return ERR_SUCCESS if the whole response was sent, ERR_BAD_GATEWAY or ERR_SEND_RESPONSE_FAIL
+ */
+Task<HttpHandler::ERROR_TYPE> HttpHandler::relayProxyOutput()
+{
+    bool progress = false;
+    for(;;)
+    {
+        // 1. the client side, the head and the chunk size go before the data in the pipe
+        ERROR_TYPE err = flushPending(pipe_len_ > 0);
+        if(err == ERR_SUCCESS && pipe_len_ > 0)
+        {
+            ssize_t len = splice(relay_pipe_[0], nullptr, client_fd_, nullptr, pipe_len_,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if(len < 0 && errno == EINTR)
+                continue;
+            if(len < 0)
+                err = (errno == EAGAIN) ? ERR_AGAIN : ERR_SEND_RESPONSE_FAIL;
+            else
+            {
+                pipe_len_ -= static_cast<size_t>(len);
+                bytes_out_ += static_cast<size_t>(len);
+                if(pipe_len_ == 0 && isChunked_)
+                    out_pending_ += "\r\n";
+                progress = true;
+                continue;
+            }
+        }
+
+        unsigned wait = EVENT_CLIENT_OUT;
+        if(err == ERR_SUCCESS)
+        {
+            if(up_done_)
+                co_return ERR_SUCCESS;
+
+            // 2. the upstream side
+            if(!up_head_done_)
+                err = readUpstreamHead();
+            else if(up_left_ == 0)
+                err = nextUpstreamPart();
+            else
+                err = pullUpstreamBody();
+            // The pooled connection was closed by the upstream before the request came, send it again
+            if(err == ERR_BAD_GATEWAY && retryProxy())
+            {
+                relay_input_ = pumpProxyInput();
+                if(!relay_input_.wake(0) || relay_input_.result() == ERR_SUCCESS)
+                    continue;
+                err = relay_input_.result();
+            }
+            if(err == ERR_SUCCESS)
+            {
+                progress = true;
+                continue;
+            }
+            wait = EVENT_UPSTREAM_IN;
+        }
+        if(err != ERR_AGAIN)
+            co_return err;
+
+        if(progress)
+            extendDeadline();
+        progress = false;
+        co_await waitEvents(wait);
+    }
+}
 
-            ssize_t len = writen(cgi_input[1], http_body_.c_str(), http_body_.length(), true);
-            if(len <= 0)
-                WARN("Write %ld bytes to CGI input fail! (%s)", http_body_.length(), strerror(errno));
+/**
+ * @brief Read the upstream into up_in_ once
+ * @return ERR_AGAIN if nothing to read, ERR_BAD_GATEWAY if the upstream closed or failed
+ */
+HttpHandler::ERROR_TYPE HttpHandler::readUpstream()
+{
+    for(;;)
+    {
+        ssize_t len = up_in_.readFd(up_fd_, maxHeaderSize);
+        if(len > 0)
+            return ERR_SUCCESS;
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len < 0 && errno == EAGAIN)
+            return ERR_AGAIN;
+        WARN("Read upstream %s fail! (%s)", upstream_->getName().c_str(), len == 0 ? "closed" : strerror(errno));
+        return ERR_BAD_GATEWAY;
+    }
+}
 
-            close(cgi_input[1]);
+/**
+ * @brief Read and parse the response head, and queue the head of the client response
+ */
+HttpHandler::ERROR_TYPE HttpHandler::readUpstreamHead()
+{
+    for(;;)
+    {
+        // the empty line ends the head
+        size_t pos = 0, end;
+        while((end = up_in_.findCRLF(pos)) != InputBuffer::npos && end != pos)
+            pos = end + 2;
+        if(end == InputBuffer::npos)
+        {
+            if(up_in_.readable() >= maxHeaderSize)
+            {
+                WARN("The response head of upstream %s is too large.", upstream_->getName().c_str());
+                return ERR_BAD_GATEWAY;
+            }
+            ERROR_TYPE err = readUpstream();
+            if(err != ERR_SUCCESS)
+                return err;
+            continue;
+        }
+        size_t head_len = end + 2;
+        const char* head = up_in_.peek();
+
+        // "HTTP/1.1 200 OK"
+        size_t status_end = up_in_.findCRLF(0);
+        string status(head, status_end);
+        if(status.size() < 12 || status.compare(0, 7, "HTTP/1.") != 0 || status[8] != ' '
+           || !isdigit(static_cast<unsigned char>(status[9])) || !isdigit(static_cast<unsigned char>(status[10]))
+           || !isdigit(static_cast<unsigned char>(status[11])) || (status.size() > 12 && status[12] != ' '))
+        {
+            WARN("Invalid status line of upstream %s: {%s}", upstream_->getName().c_str(),
+                 escapeStr(status, MAXBUF).c_str());
+            return ERR_BAD_GATEWAY;
+        }
+        int code = atoi(status.c_str() + 9);
+        // The interim responses are not relayed, and the protocol is never switched
+        if(code < 200)
+        {
+            if(code == 101)
+                return ERR_BAD_GATEWAY;
+            up_in_.retrieve(head_len);
+            continue;
+        }
 
-            int timeouts = maxCGIRuntime;
-            while(true)
+        noteResponse(code);
+        up_keep_alive_ = (status[7] == '1');
+        bool chunked = false;
+        bool has_length = false;
+        size_t length = 0;
+        string fields;
+        for(pos = status_end + 2; pos < end; pos = up_in_.findCRLF(pos) + 2)
+        {
+            const char* line = head + pos;
+            size_t line_len = up_in_.findCRLF(pos) - pos;
+            const char* colon = Scan::findNonToken(line, line + line_len);
+            if(colon == line || colon == line + line_len || *colon != ':')
+                return ERR_BAD_GATEWAY;
+            string name(line, static_cast<size_t>(colon - line));
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            const char* value_pos = colon + 1;
+            while(value_pos < line + line_len && (*value_pos == ' ' || *value_pos == '\t'))
+                value_pos++;
+            string value(value_pos, static_cast<size_t>(line + line_len - value_pos));
+
+            if(name == "connection")
             {
-                if(!usleep(cgiStepTime * 1000))
-                    timeouts -= cgiStepTime;
-                int wstats = -1;
-                // wait the child finish his job
-                int waitpid_ret = waitpid(pid, &wstats, WNOHANG);
-                if(waitpid_ret < 0)
-                {
-                    WARN("waitpid error. (%s)", strerror(errno));
-                    // you should turn the output pipe off
-                    close(cgi_output[0]);
-                    return ERR_INTERNAL_SERVER_ERR;
-                }
-                else if(waitpid_ret > 0) {
-                    bool ifExited = WIFEXITED(wstats);
-                    bool ifKilled = WIFSIGNALED(wstats) && (WTERMSIG(wstats) != 0);
-                    if (ifExited || ifKilled)
-                        break;
-                }
-                else if(timeouts <= 0)
-                {
-                    /**
-                     * @brief 把 kill 放到循环内部是为了 waitpid 回收子进程
-                     * NOTE: -pid 指的是杀死当前子进程以及该子进程自身的子进程,例如shell脚本
-                     * NOTE: 再kill一次 pid 是为了防止子进程太久没有轮到执行,仍然处于fork与execl之间的状态
-                     *       此时,之前的 kill -pid 将会不起作用.因此为了确保子进程一定被kill,需要再kill一次pid
-                     */
-                    int res_kill_sub = kill(pid, SIGKILL);
-                    int res_kill_pgid = 0;
-                    // Kill * -pid * only after the pgid of the child process changes to prevent the child process in other threads from being injured by mistake
-                    if(getpgid(pid) == pid)
-                        res_kill_pgid = kill(-pid, SIGKILL);
-                    assert(!res_kill_sub && !res_kill_pgid);
-                    WARN("Sub process timeout.");
-                }
+                transform(value.begin(), value.end(), value.begin(), ::tolower);
+                if(value.find("close") != string::npos)
+                    up_keep_alive_ = false;
+                else if(value.find("keep-alive") != string::npos)
+                    up_keep_alive_ = true;
+            }
+            else if(name == "transfer-encoding")
+            {
+                transform(value.begin(), value.end(), value.begin(), ::tolower);
+                chunked = (value.find("chunked") != string::npos);
+            }
+            else if(name == "content-length")
+            {
+                if(value.empty() || value.size() > 18 || !isNumericStr(value))
+                    return ERR_BAD_GATEWAY;
+                length = strtoull(value.c_str(), nullptr, 10);
+                has_length = true;
             }
+            else if(name != "keep-alive" && name != "proxy-connection" && name != "te"
+                    && name != "trailer" && name != "upgrade")
+                fields.append(line, line_len).append("\r\n");
+        }
+        up_in_.retrieve(head_len);
+
+        if(method_ == METHOD_HEAD || code == 204 || code == 304)
+            up_body_type_ = UP_BODY_NONE;
+        else if(chunked)
+            up_body_type_ = UP_BODY_CHUNKED;
+        else if(has_length)
+        {
+            up_body_type_ = UP_BODY_LENGTH;
+            up_left_ = length;
+        }
+        else
+        {
+            up_body_type_ = UP_BODY_EOF;
+            up_left_ = SIZE_MAX;
+            up_keep_alive_ = false;
+        }
 
-            string responseBody;
-            char buf[MAXBUF];
+        // HTTP/1.0 does not know chunked, the end of the body is marked by closing the connection
+        if(up_body_type_ == UP_BODY_CHUNKED || up_body_type_ == UP_BODY_EOF)
+        {
+            isChunked_ = (http_version_ == HTTP_1_1);
+            if(!isChunked_)
+                isKeepAlive_ = false;
+        }
+        out_pending_ = "HTTP/1.1 ";
+        out_pending_.append(status, 9, string::npos).append("\r\n").append(fields);
+        if(has_length && !chunked)
+        {
+            char num[UINT_STR_MAX_LEN];
+            out_pending_ += "Content-Length: ";
+            out_pending_.append(num, fastUintToStr(length, num)).append("\r\n");
+        }
+        if(isChunked_)
+            out_pending_ += "Transfer-Encoding: chunked\r\n";
+        ResponseBuilder header;
+        header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+        out_pending_.append(header.data(), header.size()).append("\r\n");
+        up_head_done_ = true;
+        headers_sent_ = true;
+
+        INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
+        INFO("{%s}", escapeStr(out_pending_, MAXBUF).c_str());
+        return ERR_SUCCESS;
+    }
+}
 
-            if(!setFdNoBlock(cgi_output[0]))
+/**
+ * @brief Start the next part of the upstream body, the chunk framing is read into up_in_
+ */
+HttpHandler::ERROR_TYPE HttpHandler::nextUpstreamPart()
+{
+    if(up_body_type_ != UP_BODY_CHUNKED)
+    {
+        up_done_ = true;
+        return ERR_SUCCESS;
+    }
+    for(;;)
+    {
+        if(up_chunk_state_ == CHUNK_DATA_CRLF && up_in_.readable() >= 2)
+        {
+            if(up_in_.peek()[0] != '\r' || up_in_.peek()[1] != '\n')
+                return ERR_BAD_GATEWAY;
+            up_in_.retrieve(2);
+            up_chunk_state_ = CHUNK_SIZE;
+            continue;
+        }
+        size_t pos = (up_chunk_state_ == CHUNK_DATA_CRLF) ? InputBuffer::npos : up_in_.findCRLF(0);
+        if(pos != InputBuffer::npos)
+        {
+            size_t size = 0;
+            if(up_chunk_state_ == CHUNK_TRAILER)
             {
-                WARN("set fd(%d) no block fail! (%s)", cgi_output[0], strerror(errno));
-                close(cgi_output[0]);
-                return ERR_INTERNAL_SERVER_ERR;
+                up_in_.retrieve(pos + 2);
+                // the empty line ends the body
+                if(pos > 0)
+                    continue;
+                up_done_ = true;
+                if(isChunked_)
+                    out_pending_ += "0\r\n\r\n";
+                return ERR_SUCCESS;
             }
-            while((len = readn(cgi_output[0], buf, MAXBUF)) > 0)
-                responseBody += string(buf, buf + len);
-            close(cgi_output[0]);
-
-            if(responseBody.empty())
-                return ERR_INTERNAL_SERVER_ERR;
-            // send the data
-            return sendResponse("200", "OK", MimeType::getMineType("txt"), responseBody);
+            if(!parseChunkSize(up_in_.peek(), up_in_.peek() + pos, &size))
+                return ERR_BAD_GATEWAY;
+            up_in_.retrieve(pos + 2);
+            if(size == 0)
+            {
+                up_chunk_state_ = CHUNK_TRAILER;
+                continue;
+            }
+            up_left_ = size;
+            up_chunk_state_ = CHUNK_DATA_CRLF;
+            return ERR_SUCCESS;
         }
+        if(up_in_.readable() > maxChunkLine)
+            return ERR_BAD_GATEWAY;
+        ERROR_TYPE err = readUpstream();
+        if(err != ERR_SUCCESS)
+            return err;
+    }
+}
+
+/**
+ * @brief Pull a part of the current body or chunk from the upstream, into the pipe or out_pending_
+ */
+HttpHandler::ERROR_TYPE HttpHandler::pullUpstreamBody()
+{
+    // The bytes read with the head or the framing go first
+    if(up_in_.readable() > 0)
+    {
+        size_t len = min(up_left_, up_in_.readable());
+        appendChunk(up_in_.peek(), len);
+        up_in_.retrieve(len);
+        if(up_body_type_ != UP_BODY_EOF)
+            up_left_ -= len;
+        return ERR_SUCCESS;
+    }
+
+    // A pipe holds 64 KB by default
+    size_t want = min(up_left_, static_cast<size_t>(65536));
+    ssize_t len;
+    bool spliced = false;
+    // The userspace TLS has to encrypt the body
+    if(use_splice_ && (!tls_ || tls_->isKernelSend())
+       && (relay_pipe_[0] != -1 || pipe2(relay_pipe_, O_NONBLOCK | O_CLOEXEC) == 0))
+    {
+        len = splice(up_fd_, nullptr, relay_pipe_[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        spliced = true;
     }
     else
-        return ERR_INTERNAL_SERVER_ERR;
-    UNREACHABLE();
+    {
+        char buf[MAXBUF];
+        len = recv(up_fd_, buf, min(want, MAXBUF), 0);
+        if(len > 0)
+            appendChunk(buf, static_cast<size_t>(len));
+    }
+
+    if(len < 0)
+    {
+        if(errno == EINTR)
+            return ERR_SUCCESS;
+        if(errno == EAGAIN)
+            return ERR_AGAIN;
+        WARN("Read the body of upstream %s fail! (%s)", upstream_->getName().c_str(), strerror(errno));
+        return ERR_BAD_GATEWAY;
+    }
+    if(len == 0)
+    {
+        if(up_body_type_ != UP_BODY_EOF)
+        {
+            WARN("Upstream %s closed in the middle of the body.", upstream_->getName().c_str());
+            return ERR_BAD_GATEWAY;
+        }
+        up_done_ = true;
+        if(isChunked_)
+            out_pending_ += "0\r\n\r\n";
+        return ERR_SUCCESS;
+    }
+    if(spliced)
+    {
+        pipe_len_ = static_cast<size_t>(len);
+        if(isChunked_)
+        {
+            char hex[32];
+            int hex_len = snprintf(hex, sizeof(hex), "%zx\r\n", pipe_len_);
+            out_pending_.append(hex, static_cast<size_t>(hex_len));
+        }
+    }
+    if(up_body_type_ != UP_BODY_EOF)
+        up_left_ -= static_cast<size_t>(len);
     return ERR_SUCCESS;
 }
 
+/**
+ * @brief Queue a part of the body to the client, as one chunk if the response is chunked
+ */
+void HttpHandler::appendChunk(const char* data, size_t len)
+{
+    if(isChunked_)
+    {
+        char hex[32];
+        int hex_len = snprintf(hex, sizeof(hex), "%zx\r\n", len);
+        out_pending_.append(hex, static_cast<size_t>(hex_len));
+    }
+    out_pending_.append(data, len);
+    if(isChunked_)
+        out_pending_ += "\r\n";
+}
+
 bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
 {
     bool isSuccess = false;
+    // The rest of a rejected request is unknown, the next request can not be found
+    if(err >= ERR_BAD_REQUEST && (!headers_done_ || !body_done_))
+        isKeepAlive_ = false;
+
     switch(err)
     {
         case ERR_SUCCESS:
@@ -470,32 +2560,62 @@ bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
             break;
         case ERR_BAD_REQUEST:
             WARN("HTTP Bad Request.");
-            sendErrorResponse("400", "Bad Request");
+            sendErrorResponse(400);
             state_ = STATE_ERROR;
             break;
         case ERR_NOT_FOUND:
             WARN("HTTP Not Found.");
-            sendErrorResponse("404", "Not Found");
+            sendErrorResponse(404);
             state_ = STATE_ERROR;
             break;
         case ERR_LENGTH_REQUIRED:
             WARN("HTTP Length Required.");
-            sendErrorResponse("411", "Length Required");
+            sendErrorResponse(411);
+            state_ = STATE_ERROR;
+            break;
+        case ERR_PAYLOAD_TOO_LARGE:
+            WARN("HTTP Payload Too Large.");
+            // The rest of the body is not read, the connection can not be reused
+            isKeepAlive_ = false;
+            sendErrorResponse(413);
+            state_ = STATE_ERROR;
+            break;
+        case ERR_TOO_MANY_REQUESTS:
+            WARN("HTTP Too Many Requests.");
+            // The request is not read, the connection can not be reused
+            isKeepAlive_ = false;
+            sendErrorResponse(429);
+            state_ = STATE_ERROR;
+            break;
+        case ERR_HEADER_TOO_LARGE:
+            WARN("HTTP Request Header Fields Too Large.");
+            isKeepAlive_ = false;
+            sendErrorResponse(431);
             state_ = STATE_ERROR;
             break;
         case ERR_NOT_IMPLEMENTED:
             WARN("HTTP Request method is not implemented.");
-            sendErrorResponse("501", "Not Implemented");
+            sendErrorResponse(501);
             state_ = STATE_ERROR;
             break;
         case ERR_INTERNAL_SERVER_ERR:
             WARN("HTTP Internal Server Error.");
-            sendErrorResponse("500", "Internal Server Error");
+            sendErrorResponse(500);
+            state_ = STATE_ERROR;
+            break;
+        case ERR_BAD_GATEWAY:
+            WARN("HTTP Bad Gateway.");
+            sendErrorResponse(502);
+            state_ = STATE_ERROR;
+            break;
+        case ERR_GATEWAY_TIMEOUT:
+            WARN("HTTP Gateway Timeout.");
+            sendErrorResponse(504);
             state_ = STATE_ERROR;
             break;
         case ERR_HTTP_VERSION_NOT_SUPPORTED:
             WARN("HTTP Request HTTP Version Not Supported.");
-            sendErrorResponse("505", "HTTP Version Not Supported");
+            sendErrorResponse(505);
             state_ = STATE_ERROR;
             break;
         default:
@@ -504,87 +2624,559 @@ bool HttpHandler::handleErrorType(HttpHandler::ERROR_TYPE err)
     return isSuccess;
 }
 
-HttpHandler::ERROR_TYPE HttpHandler::sendResponse(const string& responseCode, const string& responseMsg,
-                                                  const string& responseBodyType, const string& responseBody)
+HttpHandler::ERROR_TYPE HttpHandler::sendResponse(int responseCode, const string& responseBodyType,
+                                                  const char* responseBody, size_t bodyLen)
 {
-    stringstream sstream;
-    sstream << "HTTP/1.1" << " " << responseCode << " " << responseMsg << "\r\n";
-    sstream << "Connection: " << (isKeepAlive_ ? "Keep-Alive" : "Close") << "\r\n";
-    if(isKeepAlive_)
-        sstream << "Keep-Alive: timeout=" << timeoutPerRequest << ", max=" << againTimes_ << "\r\n";
+    TraceSpan span("send response");
+    ResponseBuilder header;
+    if(!header.statusLine(responseCode))
+        return ERR_INTERNAL_SERVER_ERR;
+    noteResponse(responseCode);
+    header.date();
+    header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+    header.server();
+    header.contentLength(bodyLen);
+    header.contentType(responseBodyType);
+    header.finish();
+    if(header.isOverflow())
+        return ERR_INTERNAL_SERVER_ERR;
 
-    sstream << "Server: WebServer/1.1" << "\r\n";
-    sstream << "Content-length: " << responseBody.size() << "\r\n";
-    sstream << "Content-type: " << responseBodyType << "\r\n";
-    sstream << "\r\n";
+    iovec iov[2];
+    iov[0].iov_base = const_cast<char*>(header.data());
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = const_cast<char*>(responseBody);
     // if request is HEAD, do not send the http body
-    if(method_ != METHOD_HEAD)
-        sstream << responseBody;
-
-    string&& response = sstream.str();
+    iov[1].iov_len = (method_ != METHOD_HEAD) ? bodyLen : 0;
+    size_t total = iov[0].iov_len + iov[1].iov_len;
 
-    ssize_t len = writen(client_fd_, (void*)response.c_str(), response.size());
+    ssize_t len = writevClient(iov, 2);
 
     // output the response data
     INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
-    INFO("{%s}", escapeStr(response, MAXBUF).c_str());
+    INFO("{%s}", escapeStr(header.data(), header.size(), MAXBUF).c_str());
 
-    if(len < 0 || static_cast<size_t>(len) != response.size())
+    if(len < 0 || static_cast<size_t>(len) != total)
         return ERR_SEND_RESPONSE_FAIL;
     return ERR_SUCCESS;
 }
 
-HttpHandler::ERROR_TYPE HttpHandler::sendErrorResponse(const string& errCode, const string& errMsg)
+HttpHandler::ERROR_TYPE HttpHandler::sendErrorResponse(int errCode)
 {
-    string errStr = errCode + " " + errMsg;
-    string responseBody =
-            "<html>"
-            "<title>" + errStr + "</title>"
-                                 "<body>" + errStr +
-            "<hr><em> Kelpie Web Server</em>"
-            "</body>"
-            "</html>";
-    return sendResponse(errCode, errMsg, "text/html", responseBody);
+    TraceSpan span("send error");
+    const ErrorPages::Page* page = ErrorPages::get(errCode);
+    size_t statusLen = 0;
+    const char* statusLine = ResponseBuilder::getStatusLine(errCode, &statusLen);
+    assert(page && statusLine);
+    noteResponse(errCode);
+
+    // Only the date and the connection headers are rendered here
+    ResponseBuilder header;
+    header.date();
+    header.connection(isKeepAlive_, timeoutPerRequest, remainingRequests());
+
+    iovec iov[3];
+    iov[0].iov_base = const_cast<char*>(statusLine);
+    iov[0].iov_len = statusLen;
+    iov[1].iov_base = const_cast<char*>(header.data());
+    iov[1].iov_len = header.size();
+    iov[2].iov_base = const_cast<char*>(page->tail.data());
+    iov[2].iov_len = (method_ != METHOD_HEAD) ? page->tail.size() : page->header_len;
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+    ssize_t len = writevClient(iov, 3);
+
+    INFO("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<- Response Packet ->>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ");
+    INFO("{%s}", escapeStr(statusLine, statusLen, MAXBUF).c_str());
+
+    if(len < 0 || static_cast<size_t>(len) != total)
+        return ERR_SEND_RESPONSE_FAIL;
+    return ERR_SUCCESS;
 }
 
-bool HttpHandler::RunEventLoop()
+bool HttpHandler::RunEventLoop(unsigned events)
 {
-    if(!handleErrorType(readRequest()))
+    if(tls_ && !tls_->isEstablished())
+    {
+        if(!continueHandshake(events))
+            return false;
+        if(!tls_->isEstablished())
+            return true;
+        // The request may come with the end of the handshake
+        events |= EVENT_CLIENT_IN;
+    }
+    if(trace_id_ && !trace_start_)
+        trace_start_ = Trace::now();
+    if(h2_)
+        return h2_->RunEventLoop(events);
+    if(ws_)
+        return ws_->RunEventLoop(events);
+    if(events & EVENT_CLIENT_CLOSED)
+    {
+        INFO("Socket(%d) was closed by peer.", client_fd_);
         return false;
+    }
+    if(events & EVENT_TIMEOUT)
+    {
+        // The upstream did not answer in time
+        if(state_ == STATE_PROXY_RELAY && !headers_sent_)
+        {
+            WARN("Upstream %s timeout.", upstream_->getName().c_str());
+            stopProxy();
+            handleErrorType(ERR_GATEWAY_TIMEOUT);
+        }
+        else if(state_ != STATE_CGI_RELAY)
+        {
+            INFO("-------->>>>> "
+                 "New Message: socket(%d) - timerfd(%d) timeout."
+                 " <<<<<--------",
+                 client_fd_, timer_->getFd());
+            return false;
+        }
+        // Kill the CGI, the output pipe will be closed soon
+        WARN("Sub process timeout.");
+        killCgi();
+        cgi_timeout_ = true;
+        extendDeadline();
+    }
 
-    // parse the info ------------------------------------------
-    // 1. parse first line
-    if(state_ == STATE_PARSE_URI && handleErrorType(parseURI()))
-        state_ = STATE_PARSE_HEADER;
-    // 2. parse each header
-    if(state_ == STATE_PARSE_HEADER && handleErrorType(parseHttpHeader()))
-        state_ = STATE_PARSE_BODY;
-    // 3. parse the http body
-    if(state_ == STATE_PARSE_BODY)
+    // The socket is not read when the CGI is receiving the body but its input is full
+    bool relaying = (state_ == STATE_CGI_RELAY || state_ == STATE_PROXY_RELAY);
+    if((events & EVENT_CLIENT_IN) && state_ != STATE_SEND_BODY && (!relaying || (!body_done_ && !isBodyBlocked())))
     {
-        if(method_ != METHOD_POST || handleErrorType(parseBody()))
-            state_ = STATE_ANALYSI_REQUEST;
+        if(!handleErrorType(readRequest()))
+            return false;
     }
-    // 4. process data
-    if(state_ == STATE_ANALYSI_REQUEST && handleErrorType(handleRequest()))
-        state_ = STATE_FINISHED;
 
-    if(state_ == STATE_ERROR || state_ == STATE_FINISHED)
+    for(;;)
     {
-        if(isKeepAlive_)
+        if(state_ != STATE_CGI_RELAY && state_ != STATE_PROXY_RELAY)
+        {
+            // parse the info ------------------------------------------
+            // 0. the HTTP/2 connection preface instead of the first request line
+            if(state_ == STATE_PARSE_URI && requests_ == 0 && in_.readable() > 0)
+            {
+                int matched = Http2Session::matchPreface(in_.peek(), in_.readable());
+                if(matched > 0)
+                    return startHttp2(nullptr);
+                else if(matched == 0)
+                    break;
+            }
+            // 1. parse first line, a client over its request rate is refused before any parsing
+            if(state_ == STATE_PARSE_URI && !rate_checked_ && in_.readable() > 0)
+            {
+                rate_checked_ = true;
+                if(AccessLog::isEnabled())
+                    access_start_ = Trace::now();
+                if(!RateLimit::allowRequest(client_key_))
+                    handleErrorType(ERR_TOO_MANY_REQUESTS);
+            }
+            if(state_ == STATE_PARSE_URI && handleErrorType(parseURI()))
+            {
+                ++requests_;
+                request_total_.fetch_add(1, memory_order_relaxed);
+                state_ = STATE_PARSE_HEADER;
+            }
+            // 2. parse each header
+            if(state_ == STATE_PARSE_HEADER && handleErrorType(parseHttpHeader()))
+            {
+                headers_done_ = true;
+                if(access_start_)
+                    access_headers_ = Trace::now();
+                updateKeepAlive();
+                state_ = STATE_PARSE_BODY;
+                // The request is answered as the stream 1 of HTTP/2
+                string settings;
+                if(isH2cUpgrade(&settings))
+                    return startHttp2(&settings);
+                // The request of a WebSocket route switches the protocol
+                string accept;
+                int upgrade = isWebSocketUpgrade(&accept);
+                if(upgrade > 0)
+                    return startWebSocket(accept);
+                else if(upgrade < 0)
+                    handleErrorType(ERR_BAD_REQUEST);
+            }
+            // 3. get the framing of http body, the body is streamed to the CGI
+            if(state_ == STATE_PARSE_BODY)
+            {
+                if(method_ != METHOD_POST || handleErrorType(parseBody()))
+                    state_ = STATE_ANALYSI_REQUEST;
+            }
+            // 4. process data, a native route may wait for the rest of the body
+            ERROR_TYPE err = (state_ == STATE_ANALYSI_REQUEST) ? handleRequest() : ERR_AGAIN;
+            if(err != ERR_AGAIN && handleErrorType(err))
+            {
+                if(upstream_)
+                    state_ = STATE_PROXY_RELAY;
+                else
+                    state_ = (cgi_pid_ != -1) ? STATE_CGI_RELAY : STATE_SEND_BODY;
+            }
+        }
+
+        // 5. send the static response, the rest is sent when the socket is writable
+        if(state_ == STATE_SEND_BODY)
+        {
+            ERROR_TYPE err = sendBody();
+            if(err == ERR_SUCCESS)
+                state_ = STATE_FINISHED;
+            else if(err != ERR_AGAIN)
+                state_ = STATE_FATAL_ERROR;
+        }
+
+        if(state_ == STATE_CGI_RELAY)
+        {
+            // 6. forward the request body to CGI, the coroutines go on where they waited
+            if(relay_input_.wake(events))
+            {
+                ERROR_TYPE err = relay_input_.result();
+                if(err == ERR_BAD_REQUEST || err == ERR_PAYLOAD_TOO_LARGE)
+                {
+                    // The rest of the request can not be parsed any more
+                    isKeepAlive_ = false;
+                    killCgi();
+                    if(headers_sent_)
+                        state_ = STATE_FATAL_ERROR;
+                    else
+                        handleErrorType(err);
+                }
+            }
+            // 7. relay the output of CGI
+            if(state_ == STATE_CGI_RELAY && relay_output_.wake(events))
+            {
+                ERROR_TYPE err = relay_output_.result();
+                if(err == ERR_SUCCESS)
+                {
+                    state_ = STATE_FINISHED;
+                    // The CGI finished before reading the whole body
+                    if(!body_done_)
+                        isKeepAlive_ = false;
+                }
+                else if(err == ERR_INTERNAL_SERVER_ERR && !headers_sent_)
+                {
+                    if(!body_done_)
+                        isKeepAlive_ = false;
+                    handleErrorType(err);
+                }
+                else
+                    state_ = STATE_FATAL_ERROR;
+            }
+        }
+
+        if(state_ == STATE_PROXY_RELAY)
+        {
+            // 6. send the request to the upstream, and 7. relay the response
+            TraceSpan span("proxy relay");
+            ERROR_TYPE err = ERR_AGAIN;
+            if(relay_input_.wake(events) && relay_input_.result() != ERR_SUCCESS)
+                err = relay_input_.result();
+            else if(relay_output_.wake(events))
+                err = relay_output_.result();
+            if(err == ERR_SUCCESS)
+            {
+                state_ = STATE_FINISHED;
+                // The upstream answered before the whole body
+                if(!body_done_)
+                    isKeepAlive_ = false;
+            }
+            else if(err != ERR_AGAIN)
+            {
+                // The rest of the request can not be parsed any more
+                if(!body_done_)
+                    isKeepAlive_ = false;
+                stopProxy();
+                if(headers_sent_ || err == ERR_SEND_RESPONSE_FAIL)
+                    state_ = STATE_FATAL_ERROR;
+                else
+                    handleErrorType(err);
+            }
+        }
+
+        if(state_ == STATE_ERROR || state_ == STATE_FINISHED)
+        {
+            stopCgi(true);
+            stopProxy();
+            finishTrace("request");
+            logAccess(false);
+            if(PerfCounters::isEnabled())
+            {
+                PerfCounters::charge(&perf_mark_, &perf_total_);
+                recordPerf();
+            }
+            if(HeavyHitters::isEnabled())
+                recordHeavyHitters();
+            if(!isKeepAlive_)
+                return false;
             reset();
-        else
+            // The next pipelined request is already in the buffer
+            if(in_.readable() > 0)
+            {
+                Trace::setCurrent(trace_id_);
+                if(trace_id_)
+                    trace_start_ = Trace::now();
+                continue;
+            }
+        }
+        else if(state_ == STATE_FATAL_ERROR)
             return false;
+        break;
     }
-    else if(state_ == STATE_FATAL_ERROR)
-        return false;
 
     // if run here that means to need more data
-    bool ret1 = true;
+    return rearmEvents();
+}
+
+bool HttpHandler::isBodyBlocked() const
+{
+    return (relay_input_.waiting() & (EVENT_CGI_IN | EVENT_UPSTREAM_OUT)) != 0;
+}
+
+/**
+ * @brief Wait for the next events of the state, the socket is not read when the CGI input is full
+ */
+bool HttpHandler::rearmEvents()
+{
+    bool ret1 = true, ret2 = true, ret3 = true;
     if(timer_)
         ret1 = epoll_->modify(timer_->getFd(), getTimerEpollEvent(), getTimerTriggerCond());
-    bool ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), getClientTriggerCond());
+
+    if(state_ == STATE_CGI_RELAY)
+    {
+        // the events the coroutines wait for, the socket is not read when the CGI input is full
+        unsigned waiting = relay_input_.waiting() | relay_output_.waiting();
+        int client_events = 0;
+        if(waiting & EVENT_CGI_OUT)
+            ret2 = epoll_->modify(cgi_out_fd_, &cgi_out_event_, getPipeTriggerCond());
+        if(waiting & EVENT_CGI_IN)
+            ret3 = epoll_->modify(cgi_in_fd_, &cgi_in_event_, getPipeWriteCond());
+        if(waiting & EVENT_CLIENT_OUT)
+            client_events |= getClientWriteCond();
+        if(waiting & EVENT_CLIENT_IN)
+            client_events |= getClientTriggerCond();
+
+        if(client_events)
+            ret2 = ret2 && epoll_->modify(client_fd_, getClientEpollEvent(), client_events);
+    }
+    else if(state_ == STATE_PROXY_RELAY)
+    {
+        // the same for the upstream, the socket is not read when the upstream is full
+        unsigned waiting = relay_input_.waiting() | relay_output_.waiting();
+        int client_events = 0;
+        int up_events = 0;
+        if(waiting & EVENT_UPSTREAM_IN)
+            up_events |= EPOLLIN;
+        if(waiting & EVENT_UPSTREAM_OUT)
+            up_events |= EPOLLOUT;
+        if(waiting & EVENT_CLIENT_OUT)
+            client_events |= getClientWriteCond();
+        if(waiting & EVENT_CLIENT_IN)
+            client_events |= getClientTriggerCond();
+
+        if(up_events)
+            ret3 = epoll_->modify(up_fd_, &up_event_, EPOLLET | EPOLLONESHOT | EPOLLRDHUP | up_events);
+        if(client_events)
+            ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), client_events);
+    }
+    else if(state_ == STATE_SEND_BODY)
+        ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), getClientWriteCond());
+    else
+    {
+        ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), getClientTriggerCond());
+        // The wakeup of a leader finished since lookupCgiCache() may be overwritten above
+        if(state_ == STATE_ANALYSI_REQUEST && cgi_cache_ && CgiCache::isSettled(cgi_cache_))
+            ret2 = epoll_->modify(client_fd_, getClientEpollEvent(), getClientTriggerCond() | EPOLLOUT);
+    }
+    assert(ret1 && ret2 && ret3);
+
+    bool relaying = (state_ == STATE_CGI_RELAY || state_ == STATE_PROXY_RELAY);
+    if(state_ != STATE_SEND_BODY && (!relaying || (!body_done_ && !isBodyBlocked())))
+        wakeForTlsPending();
+
+    return ret1 && ret2 && ret3;
+}
+
+/**
+ * @brief Continue the TLS handshake of an HTTPS connection, the timer limits the whole handshake
+ * @return false if the handshake failed
+ */
+bool HttpHandler::continueHandshake(unsigned events)
+{
+    if(events & EVENT_CLIENT_CLOSED)
+    {
+        INFO("Socket(%d) was closed by peer during TLS handshake.", client_fd_);
+        return false;
+    }
+    if(events & EVENT_TIMEOUT)
+    {
+        INFO("Socket(%d) TLS handshake timeout.", client_fd_);
+        return false;
+    }
+    TraceSpan span("tls handshake");
+
+    TlsConnection::HANDSHAKE_RESULT result = tls_->handshake();
+    if(result == TlsConnection::HANDSHAKE_ERROR)
+        return false;
+    if(result == TlsConnection::HANDSHAKE_DONE)
+        return true;
+
+    int client_events = (result == TlsConnection::HANDSHAKE_WANT_WRITE) ? getClientWriteCond() : getClientTriggerCond();
+    bool ret1 = epoll_->modify(client_fd_, getClientEpollEvent(), client_events);
+    bool ret2 = !timer_ || epoll_->modify(timer_->getFd(), getTimerEpollEvent(), getTimerTriggerCond());
     assert(ret1 && ret2);
+    return ret1 && ret2;
+}
 
-    return true;
-}
\ No newline at end of file
+/**
+ * @brief Record the whole request as a span, the detail is the request line
+ */
+void HttpHandler::finishTrace(const char* name)
+{
+    if(!trace_id_ || !trace_start_)
+        return;
+    static const char* method_names[] = { "GET", "POST", "HEAD" };
+    string detail = h2_ ? "HTTP/2" : method_names[method_];
+    // path_ is www_path + "/" + the URI
+    if(path_.size() > www_path.size() + 1)
+        detail.append(" ").append(path_, www_path.size() + 1, string::npos);
+    Trace::record(trace_id_, name, trace_start_, Trace::now(), detail.c_str());
+    trace_start_ = 0;
+}
+
+void HttpHandler::noteResponse(int code)
+{
+    status_ = code;
+    if(access_start_)
+        access_response_ = Trace::now();
+}
+
+void HttpHandler::recordPerf()
+{
+    if(h2_)
+        PerfCounters::record(PerfCounters::CLASS_HTTP2, 0, perf_total_);
+    else if(ws_)
+        PerfCounters::record(PerfCounters::CLASS_WEBSOCKET, 0, perf_total_);
+    else
+        PerfCounters::record(perf_class_, status_, perf_total_);
+    perf_total_.clear();
+}
+
+void HttpHandler::recordHeavyHitters()
+{
+    // path_ is www_path + "/" + the URI, set once the request line was parsed
+    if(path_.size() > www_path.size() + 1)
+    {
+        const char* path = path_.c_str() + www_path.size() + 1;
+        recordHeavyHitters(path, strcspn(path, "?"), bytes_out_);
+    }
+    else
+        recordHeavyHitters(nullptr, 0, bytes_out_);
+}
+
+/**
+ * The client is the peer of the access record, filled after the accept with the heavy hitters
+ */
+void HttpHandler::recordHeavyHitters(const char* path, size_t path_len, uint64_t bytes)
+{
+    size_t addr_len = (access_.flags & AccessLog::FLAG_IPV6) ? 16 : 4;
+    // A Unix socket client has no address
+    static const uint8_t none[4] = { 0, 0, 0, 0 };
+    if(addr_len == 4 && memcmp(access_.addr, none, sizeof(none)) == 0)
+        addr_len = 0;
+    HeavyHitters::record(path, path_len, access_.addr, addr_len, bytes);
+}
+
+void HttpHandler::logAccess(bool aborted)
+{
+    if(!access_start_ || !AccessLog::isEnabled())
+        return;
+    int64_t now = Trace::now();
+    AccessLog::Record record = access_;
+    // the request line was parsed if the path is set
+    const char* path = nullptr;
+    size_t path_len = 0;
+    // path_ is www_path + "/" + the URI
+    if(path_.size() > www_path.size() + 1)
+    {
+        path = path_.c_str() + www_path.size() + 1;
+        path_len = strcspn(path, "?");
+    }
+    record.method = path ? static_cast<uint8_t>(method_) : static_cast<uint8_t>(AccessLog::RECORD_OTHER);
+    record.flags = access_.flags & AccessLog::FLAG_IPV6;
+    if(path && http_version_ == HTTP_1_0)
+        record.flags |= AccessLog::FLAG_HTTP10;
+    if(tls_)
+        record.flags |= AccessLog::FLAG_TLS;
+    if(aborted)
+        record.flags |= AccessLog::FLAG_ABORTED;
+    else if(isKeepAlive_)
+        record.flags |= AccessLog::FLAG_KEEPALIVE;
+    record.status = static_cast<uint16_t>(status_);
+    record.time_us = AccessLog::toWallClock(access_start_);
+    record.total_us = static_cast<uint32_t>(min<int64_t>(now - access_start_, UINT32_MAX));
+    int64_t headers = access_headers_ ? access_headers_ : now;
+    record.read_us = static_cast<uint32_t>(min<int64_t>(headers - access_start_, UINT32_MAX));
+    record.handle_us = (access_headers_ && access_response_) ?
+                       static_cast<uint32_t>(min<int64_t>(access_response_ - access_headers_, UINT32_MAX)) : 0;
+    record.bytes_in = bytes_in_;
+    record.bytes_out = bytes_out_;
+    AccessLog::append(&record, path, path_len);
+    access_start_ = 0;
+}
+
+void HttpHandler::wakeForTlsPending()
+{
+    // The thread running this connection runs it again
+    if(tls_ && tls_->hasPending())
+        notify(EVENT_CLIENT_IN);
+}
+
+ssize_t HttpHandler::readClient(size_t limit)
+{
+    ssize_t len;
+    if(!tls_)
+        len = in_.readFd(client_fd_, limit);
+    else
+    {
+        auto tlsReadv = [](void* source, const iovec* iov, int iovcnt)
+        {
+            return static_cast<TlsConnection*>(source)->readv(iov, iovcnt);
+        };
+        len = in_.readFrom(tlsReadv, tls_, limit);
+    }
+    if(len > 0)
+        bytes_in_ += static_cast<size_t>(len);
+    return len;
+}
+
+ssize_t HttpHandler::sendClient(const void* buf, size_t len, int flags)
+{
+    ssize_t sent = tls_ ? tls_->send(buf, len, flags) : send(client_fd_, buf, len, flags);
+    if(sent > 0)
+        bytes_out_ += static_cast<size_t>(sent);
+    return sent;
+}
+
+ssize_t HttpHandler::writevClient(iovec* iov, int iovcnt)
+{
+    ssize_t sent;
+    if(!tls_)
+        sent = writevn(client_fd_, iov, iovcnt);
+    else
+    {
+        auto tlsWritev = [](void* sink, const iovec* iov, int iovcnt)
+        {
+            return static_cast<TlsConnection*>(sink)->writev(iov, iovcnt);
+        };
+        sent = writevn(tlsWritev, tls_, iov, iovcnt);
+    }
+    if(sent > 0)
+        bytes_out_ += static_cast<size_t>(sent);
+    return sent;
+}
+
+ssize_t HttpHandler::sendfileClient(int fd, off_t* off, size_t len)
+{
+    ssize_t sent = tls_ ? tls_->sendfile(fd, off, len) : sendfile(client_fd_, fd, off, len);
+    if(sent > 0)
+        bytes_out_ += static_cast<size_t>(sent);
+    return sent;
+}
@@ -5,40 +5,197 @@
 #ifndef WEBSERVER_HTTPHANDLER_H
 #define WEBSERVER_HTTPHANDLER_H
 
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <vector>
 
+#include "AccessLog.h"
+#include "Bundle.h"
+#include "CgiCache.h"
+#include "Coroutine.h"
 #include "epoll.h"
+#include "FileCache.h"
+#include "InputBuffer.h"
+#include "MutexLock.h"
+#include "PerfCounters.h"
+#include "RateLimit.h"
+#include "Router.h"
 #include "Timer.h"
 
 using namespace std;
 
+/**
+ * @brief The body of a static response, from the memory or from a file by sendfile
+ */
+struct StaticBody
+{
+    const char* data;           // nullptr if the body is in fd
+    int fd;
+    bool fd_owned;
+    bool ref_held;
+    FileCache::Ref ref;         // the cached file is read until the body is sent
+    shared_ptr<const string> output;    // a cached CGI output, data points into it
+    off_t off;
+    size_t len;
+
+    StaticBody() : data(nullptr), fd(-1), fd_owned(false), ref_held(false), ref(), off(0), len(0) {}
+    void release();
+};
+
+class Http2Session;
+class TlsConnection;
+class Upstream;
+class WebSocketSession;
+
 class HttpHandler
 {
+    friend class Http2Session;
+    friend class WebSocketSession;
 public:
-    explicit HttpHandler(Epoll* epoll, int client_fd, Timer* timer);
+    /**
+     * @param tls  the connection came from an HTTPS listener, the TLS handshake is done first
+     */
+    explicit HttpHandler(Epoll* epoll, int client_fd, Timer* timer, bool tls = false);
     ~HttpHandler();
 
-    bool RunEventLoop();
+    /**
+     * The events of the fds owned by this connection
+     */
+    enum EVENT_TYPE
+    {
+        EVENT_CLIENT_IN     = 1 << 0,   // the socket is readable
+        EVENT_CLIENT_OUT    = 1 << 1,   // the socket is writable
+        EVENT_CLIENT_CLOSED = 1 << 2,   // the socket was closed by peer or error
+        EVENT_TIMEOUT       = 1 << 3,   // the timer expired
+        EVENT_CGI_OUT       = 1 << 4,   // the CGI output pipe is readable or closed
+        EVENT_CGI_IN        = 1 << 5,   // the CGI input pipe is writable or closed
+        EVENT_STREAM        = 1 << 6,   // a CGI pipe of an HTTP/2 stream is ready
+        EVENT_UPSTREAM_IN   = 1 << 7,   // the upstream socket of the proxied request is readable or closed
+        EVENT_UPSTREAM_OUT  = 1 << 8,   // the upstream socket is writable or closed
+    };
+
+    bool RunEventLoop(unsigned events);
     int getClientFd() { return client_fd_; }
     Epoll* getEpoll() { return epoll_;}
     Timer* getTimer() {return timer_;}
 
     int getClientTriggerCond() { return EPOLLET | EPOLLIN | EPOLLONESHOT | EPOLLRDHUP | EPOLLHUP; }
+    int getClientWriteCond()   { return EPOLLET | EPOLLOUT | EPOLLONESHOT | EPOLLRDHUP | EPOLLHUP; }
     int getTimerTriggerCond()  { return EPOLLET | EPOLLIN | EPOLLONESHOT; };
+    int getPipeTriggerCond()   { return EPOLLET | EPOLLIN | EPOLLONESHOT; }
+    int getPipeWriteCond()     { return EPOLLET | EPOLLOUT | EPOLLONESHOT; }
 
     void* getClientEpollEvent() { return &client_event_; }
     void* getTimerEpollEvent()  { return &timer_event_;}
 
+    /**
+     * @brief Translate an epoll event of this connection to EVENT_TYPE
+     */
+    unsigned translateEvent(const EpollEvent* event, unsigned epoll_events);
+
+    /**
+     * @brief Record the events, only one thread runs a connection at the same time
+     * @return true if the caller should schedule runPendingEvents(), false if a thread is already running it
+     */
+    bool notify(unsigned events);
+
+    /**
+     * @brief Record the epoll dispatch of a sampled request, before the task is queued
+     * @param woke_at the time the epoll wait returned, by Trace::now()
+     */
+    void traceDispatch(int64_t woke_at);
+
+    // the rate limit buckets of the client, set right after the accept
+    void setClientKey(const RateLimit::ClientKey& key) { client_key_ = key; }
+    // the peer of the access records
+    void setPeer(const sockaddr* addr) { AccessLog::fillPeer(addr, &access_); }
+    // the SO_PEERCRED of a client on a Unix socket, set right after the accept
+    void setPeerCred(const ucred& cred) { peer_cred_ = cred; has_peer_cred_ = true; }
+    // the process of the client, nullptr if it is not on a Unix socket
+    const ucred* getPeerCred() const    { return has_peer_cred_ ? &peer_cred_ : nullptr; }
+
+    /**
+     * @brief Run RunEventLoop until no more events are pending.
+     *        The connection is retired if RunEventLoop returns false, never touch it afterwards
+     */
+    void runPendingEvents();
+
+    /**
+     * @brief The deadline of the task running the events, the request is useless after it
+     *        It is the arrival of the request plus timeoutPerRequest, moved on while the body or the response
+     *        is making progress, like the timer. Only called by the thread which schedules runPendingEvents()
+     * @param now by monotonicMs()
+     */
+    int64_t taskDeadline(int64_t now);
+    /**
+     * @brief Close the connection instead of runPendingEvents() when its task expired in the queue,
+     *        the connection is retired
+     */
+    void dropExpired();
+
+    /**
+     * @brief Free the retired connections, must be called by the event loop thread before epoll wait
+     */
+    static void reclaimRetired();
+    /**
+     * @brief Reap the exited CGI processes which were not waited by the connection
+     */
+    static void reapChildren();
+
     static void setWWWPath(string path) { www_path = path; };
     static string getWWWPath()          { return www_path; }
 
+    // the max bytes of the request line and headers, answered with 431
+    static void setMaxHeaderSize(size_t size)   { maxHeaderSize = size; }
+    // the max bytes of the request body, answered with 413
+    static void setMaxBodySize(size_t size)     { maxBodySize = size; }
+    // the max idle keep-alive connections, the oldest ones are closed beyond it
+    static void setMaxIdleConnections(size_t num)       { maxIdleConnections = num; }
+    // the max requests served by one connection
+    static void setMaxRequestsPerConnection(int num)    { maxRequestsPerConnection = num; }
+
+    /**
+     * @brief Close the oldest idle keep-alive connections to release fds and memory
+     * @return the number of closed connections
+     */
+    static size_t evictIdle(size_t num);
+    // the idle connections, the parked ones included
+    static size_t getIdleCount();
+    static size_t getParkedCount();
+
+    // the idle time before a keep-alive connection is parked, -1 never parks
+    static void setIdleParkDelay(int64_t ms)    { idleParkDelay = ms; }
+    /**
+     * @brief Park the connections idle longer than the park delay, and close the parked ones idle longer
+     *        than the keep-alive timeout. Called by the event loop thread every second
+     * @param now by monotonicMs()
+     * @return the number of parked connections
+     */
+    static size_t parkIdle(int64_t now);
+
+    /**
+     * @brief Stop keeping connections alive for the graceful shutdown,
+     *        the idle ones are closed now and the busy ones after their current response
+     * @return the number of closed idle connections
+     */
+    static size_t startDraining();
+    static bool isDraining()            { return draining_.load(memory_order_relaxed); }
+    // the connections not freed yet
+    static size_t getConnectionCount()  { return conn_count_.load(); }
+    // the requests received by this process, the HTTP/2 streams included
+    static uint64_t getRequestTotal()   { return request_total_.load(memory_order_relaxed); }
+
     enum STATE_TYPE
     {
         STATE_PARSE_URI,
         STATE_PARSE_HEADER,
         STATE_PARSE_BODY,
         STATE_ANALYSI_REQUEST,
+        STATE_CGI_RELAY,
+        STATE_PROXY_RELAY,
+        STATE_SEND_BODY,
         STATE_FINISHED,
         STATE_ERROR,
         STATE_FATAL_ERROR
@@ -55,12 +212,18 @@ private:
 
         ERR_SEND_RESPONSE_FAIL,
 
+        // the errors answered with a response, keep ERR_BAD_REQUEST the first one
         ERR_BAD_REQUEST,                //  400 Bad Request
         ERR_NOT_FOUND,                  //  404 Not Found
         ERR_LENGTH_REQUIRED,            //  411 Length Required
+        ERR_PAYLOAD_TOO_LARGE,          //  413 Payload Too Large
+        ERR_TOO_MANY_REQUESTS,          //  429 Too Many Requests
+        ERR_HEADER_TOO_LARGE,           //  431 Request Header Fields Too Large
 
         ERR_NOT_IMPLEMENTED,            //  501 Not Implemented
         ERR_INTERNAL_SERVER_ERR,        //  500 Internal Server Error
+        ERR_BAD_GATEWAY,                //  502 Bad Gateway
+        ERR_GATEWAY_TIMEOUT,            //  504 Gateway Timeout
         ERR_HTTP_VERSION_NOT_SUPPORTED  //  505 HTTP Version Not Supported
     };
     enum HTTP_VERSION{
@@ -77,45 +240,272 @@ private:
 
 
     static string www_path;
+    static size_t maxHeaderSize;
+    static size_t maxBodySize;
+    static size_t maxIdleConnections;
+    static int maxRequestsPerConnection;
+    static int64_t idleParkDelay;
+
+    /**
+     * The intrusive LRU lists of idle keep-alive connections, the head is the oldest one
+     * An idle connection gives its buffers back to the pool. After idleParkDelay it moves to the parked
+     * list, its strings and its timerfd are released, the parked list is swept for the keep-alive timeout
+     */
+    static MutexLock idle_lock_;
+    static HttpHandler* idle_head_;
+    static HttpHandler* idle_tail_;
+    static size_t idle_count_;
+    static HttpHandler* parked_head_;
+    static HttpHandler* parked_tail_;
+    static size_t parked_count_;
+
+    static atomic<size_t> conn_count_;
+    static atomic<uint64_t> request_total_;
+    static atomic<bool> draining_;
 
 
     const size_t MAXBUF = 4096;
+    const size_t maxChunkLine = 1024;
     const int maxAgainTimes = 10;
     const int maxCGIRuntime = 1000;
-    const int cgiStepTime = 1;
     const int timeoutPerRequest = 10;
 
+    // the flag in sched_ means a thread owns the connection
+    static const unsigned SCHED_FLAG = 1u << 31;
+
+    static MutexLock retired_lock_;
+    static vector<HttpHandler*> retired_;
+    static MutexLock zombies_lock_;
+    static vector<pid_t> zombies_;
+
     int client_fd_;
     EpollEvent client_event_;
+    // the TLS of an HTTPS connection, nullptr for the plain HTTP
+    TlsConnection* tls_;
 
     Timer* timer_;
     EpollEvent timer_event_;;
 
     Epoll* epoll_;
 
-    string request_;
+    // SCHED_FLAG | the pending EVENT_TYPE
+    atomic<unsigned> sched_;
+
+    // the node in the idle LRU list, protected by idle_lock_
+    HttpHandler* idle_prev_;
+    HttpHandler* idle_next_;
+    bool is_idle_;
+    bool parked_;                   // in the parked list, or woken from it without a timer yet
+    int64_t idle_since_;            // by monotonicMs()
+    RateLimit::ClientKey client_key_;
+    ucred peer_cred_;
+    bool has_peer_cred_;
+    bool rate_checked_;             // the current request has taken its token
+    int requests_;                  // the requests received by this connection
+
+    InputBuffer in_;
     map<string, string> headers_;
+    bool headers_done_;
     METHOD_TYPE method_;
     string path_;
     HTTP_VERSION http_version_;
     STATE_TYPE state_;
 
     int againTimes_;
-    string http_body_;
     bool isKeepAlive_;
 
+    /**
+     * The request body, decoded and forwarded to the CGI input when it arrives
+     */
+    enum CHUNK_STATE
+    {
+        CHUNK_SIZE,         // wait the chunk size line
+        CHUNK_DATA,         // forward the chunk data
+        CHUNK_DATA_CRLF,    // wait the CRLF after the chunk data
+        CHUNK_TRAILER       // skip the trailer until the empty line
+    };
+    bool isChunkedBody_;
+    CHUNK_STATE in_chunk_state_;
+    size_t in_chunk_left_;          // the bytes of current request chunk not forwarded
+    size_t body_left_;              // the bytes of Content-Length body not forwarded
+    size_t body_received_;          // the bytes of chunked body received
+    bool body_done_;
+
     size_t curr_parse_pos_;
+
+    /**
+     * The CGI process and its output relay
+     */
+    pid_t cgi_pid_;
+    int cgi_in_fd_;
+    EpollEvent cgi_in_event_;
+    int cgi_out_fd_;
+    EpollEvent cgi_out_event_;
+    Task<ERROR_TYPE> relay_input_;  // pumpCgiInput() or pumpProxyInput()
+    Task<ERROR_TYPE> relay_output_; // relayCgiOutput() or relayProxyOutput()
+    bool cgi_timeout_;
+    bool cgi_eof_;
+    CgiCache::Ticket cgi_cache_;    // the entry the request leads or waits for
+    bool cgi_capture_;              // the output is copied into cgi_cache_ as the leader
+    bool isChunked_;
+    bool headers_sent_;
+    bool use_splice_;
+    size_t chunk_left_;             // the bytes of current chunk not relayed
+    string out_pending_;            // headers and chunk framing not sent yet
+    StaticBody out_body_;           // the body of a static response
+
+    // the connection speaks HTTP/2 after the preface or the upgrade, nullptr before
+    Http2Session* h2_;
+    // the epoll data of the CGI pipes of all the HTTP/2 streams
+    EpollEvent stream_event_;
+    // the connection speaks WebSocket after the upgrade, nullptr before
+    WebSocketSession* ws_;
+
+    /**
+     * The proxied request and the relay of the upstream response
+     */
+    enum UP_BODY_TYPE
+    {
+        UP_BODY_NONE,               // HEAD, 204 and 304
+        UP_BODY_LENGTH,             // Content-Length
+        UP_BODY_CHUNKED,            // chunked, the framing is read into up_in_
+        UP_BODY_EOF                 // until the upstream closes
+    };
+    Upstream* upstream_;            // nullptr if the request is not proxied
+    int up_fd_;
+    EpollEvent up_event_;
+    bool up_reused_;                // the connection came from the pool
+    bool up_retried_;
+    string up_head_;                // the request head, kept to send again on a new connection
+    string up_pending_;             // the request head and the chunk framing not sent yet
+    bool up_sent_;                  // the whole request was sent
+    InputBuffer up_in_;             // the response head and the chunk framing
+    bool up_head_done_;
+    bool up_done_;                  // the whole response was read
+    bool up_keep_alive_;            // the upstream keeps the connection after the response
+    UP_BODY_TYPE up_body_type_;
+    size_t up_left_;                // the bytes of the body or the current chunk not read
+    CHUNK_STATE up_chunk_state_;
+    // the body is spliced from the upstream to the pipe and from the pipe to the client, kept by the connection
+    int relay_pipe_[2];
+    size_t pipe_len_;               // the bytes in the pipe
+
+    // the trace of the current request, 0 if it is not sampled
+    uint64_t trace_id_;
+    int64_t trace_start_;           // the first wakeup of the request
+    int64_t trace_queued_;          // the task was queued to the thread pool
+
+    // the deadline of the current request by monotonicMs(), 0 before it arrives
+    int64_t deadline_;
+
+    // the access record of the current request, the times are by Trace::now()
+    AccessLog::Record access_;      // the peer, filled after the accept
+    int64_t access_start_;          // the first byte, 0 before it or without the access log
+    int64_t access_headers_;
+    int64_t access_response_;
+    int status_;                    // the status of the response, 0 before it starts
+    uint64_t bytes_in_;
+    uint64_t bytes_out_;
+
+    // the perf counters of the current request, with --perf-counters
+    int perf_class_;                // REQUEST_CLASS of PerfCounters
+    PerfCounters::Sample perf_mark_;    // the counters of this thread at the last charge
+    PerfCounters::Sample perf_total_;   // charged to the request so far
+
     void reset();
+    void closeConnection();
+    bool continueHandshake(unsigned events);
+    // read the decrypted data buffered by OpenSSL, the socket will not report it
+    void wakeForTlsPending();
+
+    // the socket I/O, through TLS on the HTTPS connections
+    ssize_t readClient(size_t limit);
+    ssize_t sendClient(const void* buf, size_t len, int flags);
+    ssize_t writevClient(iovec* iov, int iovcnt);
+    ssize_t sendfileClient(int fd, off_t* off, size_t len);
+
+    bool tryAcquire();
+    static void retire(HttpHandler* handler);
+    void enterIdle();
+    void leaveIdle();
+    // remove from its idle list, idle_lock_ is held
+    void unlinkIdle();
+    // give back the memory and the timerfd of a parked connection, and take the timerfd again when it wakes
+    void park();
+    bool unpark();
+    void updateKeepAlive();
+    bool isH2cUpgrade(string* settings);
+    bool startHttp2(const string* upgrade_settings);
+    int isWebSocketUpgrade(string* accept);
+    bool startWebSocket(const string& accept);
+    int remainingRequests() { return max(maxRequestsPerConnection - requests_, 0); }
+    void killCgi();
+    // the peer of a Unix socket is passed to the CGI as REMOTE_PID, REMOTE_UID and REMOTE_GID
+    static pid_t spawnCgi(const string& cgi_path, const ucred* peer, int* in_fd, int* out_fd);
+    // kill the process group of the CGI
+    static void killProcess(pid_t pid);
+    // wait the process, or let reapChildren() reap it later
+    static void waitProcess(pid_t pid);
+    void stopCgi(bool kill_child);
+    void closeCgiInput();
+    bool connectUpstream();
+    bool retryProxy();
+    // give back the upstream connection, it is pooled if the exchange was complete
+    void stopProxy();
+    bool rearmEvents();
+    void finishTrace(const char* name);
+    // the status of the response being started
+    void noteResponse(int code);
+    // append the record of the current request to the access log
+    void logAccess(bool aborted);
+    // account the request, or the wakeup of an HTTP/2 or WebSocket connection
+    void recordPerf();
+    // count the current request in the heavy hitters, or a stream of the HTTP/2 session
+    void recordHeavyHitters();
+    void recordHeavyHitters(const char* path, size_t path_len, uint64_t bytes);
+    // the request made progress, restart the timer and move the deadline
+    void extendDeadline();
 
     ERROR_TYPE readRequest();
     ERROR_TYPE parseURI();
     ERROR_TYPE parseHttpHeader();
     ERROR_TYPE parseBody();
+    ERROR_TYPE nextBodyData(const char** data, size_t* len);
+    void consumeBodyData(size_t len);
     ERROR_TYPE handleRequest();
+    ERROR_TYPE serveStatic();
+    ERROR_TYPE runRoute(const Router::Route* route, Router::Request* req);
+    static string getContentType(const string& path);
+    static ERROR_TYPE findStaticFile(string& path, const map<string, string>& headers,
+                                     StaticBody* body, string* fields, int* code);
+    static void renderFileFields(const string& path, size_t len, string* fields);
+    static void findBundleVariant(const Bundle::Entry* entry, const map<string, string>& headers,
+                                  StaticBody* body, string* fields, int* code);
+    static bool isGzipAccepted(const map<string, string>& headers);
+    static bool isEtagMatched(const string& value, const char* etag, size_t len);
+    ERROR_TYPE sendBody();
+    ERROR_TYPE startCgi();
+    bool lookupCgiCache(ERROR_TYPE* err);
+    static void wakeCgiCacheWaiter(void* waiter);
+    void dropForwardedBody();
+    Task<ERROR_TYPE> pumpCgiInput();
+    ssize_t relayChunkPart();
+    Task<ERROR_TYPE> relayCgiOutput();
+    // the request body can not be forwarded until the CGI input or the upstream is writable
+    bool isBodyBlocked() const;
+    ERROR_TYPE startProxy(Upstream* upstream);
+    Task<ERROR_TYPE> pumpProxyInput();
+    Task<ERROR_TYPE> relayProxyOutput();
+    ERROR_TYPE readUpstream();
+    ERROR_TYPE readUpstreamHead();
+    ERROR_TYPE nextUpstreamPart();
+    ERROR_TYPE pullUpstreamBody();
+    void appendChunk(const char* data, size_t len);
+    ERROR_TYPE flushPending(bool more);
     bool handleErrorType(ERROR_TYPE err);
 
-    ERROR_TYPE sendResponse(const string& responseCode, const string& responseMsg,  const string& responseBodyType, const string& responseBody);
-    ERROR_TYPE sendErrorResponse(const string& errCode, const string& errMsg);
+    ERROR_TYPE sendResponse(int responseCode, const string& responseBodyType, const char* responseBody, size_t bodyLen);
+    ERROR_TYPE sendErrorResponse(int errCode);
 };
 
 /**
@@ -0,0 +1,216 @@
+/**
+ * Pre-serialized response header fragments, the cached Date header and the pre-rendered error pages
+ */
+#include <cassert>
+#include <cstring>
+#include <ctime>
+
+#include "HttpResponse.h"
+#include "Utils.h"
+
+#define SERVER_LINE "Server: WebServer/1.1\r\n"
+
+char HttpDate::lines_[2][HttpDate::LINE_LEN + 1];
+atomic<int> HttpDate::curr_(0);
+atomic<long> HttpDate::last_sec_(-1);
+
+void HttpDate::update()
+{
+    time_t now = time(nullptr);
+    if(now == last_sec_.load(memory_order_relaxed))
+        return;
+
+    int next = 1 - curr_.load(memory_order_relaxed);
+    struct tm tm_now;
+    gmtime_r(&now, &tm_now);
+    strftime(lines_[next], sizeof(lines_[next]), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm_now);
+
+    curr_.store(next, memory_order_release);
+    last_sec_.store(now, memory_order_relaxed);
+}
+
+size_t HttpDate::copyTo(char* buf)
+{
+    // The event loop did not start yet
+    if(last_sec_.load(memory_order_relaxed) == -1)
+        update();
+    memcpy(buf, lines_[curr_.load(memory_order_acquire)], LINE_LEN);
+    return LINE_LEN;
+}
+
+/**
+ * The constant status lines
+ */
+struct StatusLine
+{
+    int code;
+    const char* line;
+    size_t len;
+};
+
+#define STATUS_LINE(code, msg) { code, "HTTP/1.1 " #code " " msg "\r\n", sizeof("HTTP/1.1 " #code " " msg "\r\n") - 1 }
+
+static const StatusLine status_lines[] = {
+        STATUS_LINE(101, "Switching Protocols"),
+        STATUS_LINE(200, "OK"),
+        STATUS_LINE(201, "Created"),
+        STATUS_LINE(204, "No Content"),
+        STATUS_LINE(304, "Not Modified"),
+        STATUS_LINE(400, "Bad Request"),
+        STATUS_LINE(403, "Forbidden"),
+        STATUS_LINE(404, "Not Found"),
+        STATUS_LINE(405, "Method Not Allowed"),
+        STATUS_LINE(411, "Length Required"),
+        STATUS_LINE(413, "Payload Too Large"),
+        STATUS_LINE(429, "Too Many Requests"),
+        STATUS_LINE(431, "Request Header Fields Too Large"),
+        STATUS_LINE(500, "Internal Server Error"),
+        STATUS_LINE(501, "Not Implemented"),
+        STATUS_LINE(502, "Bad Gateway"),
+        STATUS_LINE(503, "Service Unavailable"),
+        STATUS_LINE(504, "Gateway Timeout"),
+        STATUS_LINE(505, "HTTP Version Not Supported"),
+};
+
+#undef STATUS_LINE
+
+const char* ResponseBuilder::getStatusLine(int code, size_t* len)
+{
+    for(size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++)
+    {
+        if(status_lines[i].code == code)
+        {
+            *len = status_lines[i].len;
+            return status_lines[i].line;
+        }
+    }
+    return nullptr;
+}
+
+void ResponseBuilder::append(const char* data, size_t len)
+{
+    if(len_ + len > MAX_HEADER_SIZE)
+    {
+        overflow_ = true;
+        return;
+    }
+    memcpy(buf_ + len_, data, len);
+    len_ += len;
+}
+
+bool ResponseBuilder::statusLine(int code)
+{
+    size_t len = 0;
+    const char* line = getStatusLine(code, &len);
+    if(!line)
+        return false;
+    append(line, len);
+    return true;
+}
+
+void ResponseBuilder::date()
+{
+    if(len_ + HttpDate::LINE_LEN > MAX_HEADER_SIZE)
+    {
+        overflow_ = true;
+        return;
+    }
+    len_ += HttpDate::copyTo(buf_ + len_);
+}
+
+void ResponseBuilder::server()
+{
+    append(SERVER_LINE, sizeof(SERVER_LINE) - 1);
+}
+
+void ResponseBuilder::connection(bool isKeepAlive, int timeout, int maxRequests)
+{
+    static const char close_line[] = "Connection: Close\r\n";
+    static const char keep_alive_line[] = "Connection: Keep-Alive\r\nKeep-Alive: timeout=";
+    static const char max_prefix[] = ", max=";
+
+    if(!isKeepAlive)
+    {
+        append(close_line, sizeof(close_line) - 1);
+        return;
+    }
+    char num[UINT_STR_MAX_LEN];
+    append(keep_alive_line, sizeof(keep_alive_line) - 1);
+    append(num, fastUintToStr(static_cast<uint64_t>(timeout), num));
+    append(max_prefix, sizeof(max_prefix) - 1);
+    append(num, fastUintToStr(static_cast<uint64_t>(maxRequests), num));
+    append("\r\n", 2);
+}
+
+void ResponseBuilder::contentLength(size_t len)
+{
+    static const char prefix[] = "Content-Length: ";
+    char num[UINT_STR_MAX_LEN];
+    append(prefix, sizeof(prefix) - 1);
+    append(num, fastUintToStr(len, num));
+    append("\r\n", 2);
+}
+
+void ResponseBuilder::contentType(const string& type)
+{
+    static const char prefix[] = "Content-Type: ";
+    append(prefix, sizeof(prefix) - 1);
+    append(type.c_str(), type.size());
+    append("\r\n", 2);
+}
+
+void ResponseBuilder::raw(const char* data, size_t len)
+{
+    append(data, len);
+}
+
+void ResponseBuilder::finish()
+{
+    append("\r\n", 2);
+}
+
+/**
+ * Render the error pages
+ */
+ErrorPages::ErrorPages()
+{
+    for(size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++)
+    {
+        int code = status_lines[i].code;
+        if(code < 400)
+            continue;
+        // "HTTP/1.1 404 Not Found\r\n" -> "404 Not Found"
+        string errStr(status_lines[i].line + 9, status_lines[i].len - 9 - 2);
+        string body =
+                "<html>"
+                "<title>" + errStr + "</title>"
+                "<body>" + errStr +
+                "<hr><em> Kelpie Web Server</em>"
+                "</body>"
+                "</html>";
+
+        char num[UINT_STR_MAX_LEN];
+        Page& page = pages_[code];
+        page.tail = SERVER_LINE;
+        page.tail += "Content-Length: ";
+        page.tail.append(num, fastUintToStr(body.size(), num));
+        page.tail += "\r\nContent-Type: text/html\r\n\r\n";
+        page.header_len = page.tail.size();
+        page.tail += body;
+    }
+}
+
+ErrorPages& ErrorPages::instance()
+{
+    static ErrorPages pages;
+    return pages;
+}
+
+const ErrorPages::Page* ErrorPages::get(int code)
+{
+    ErrorPages& pages = instance();
+    auto iter = pages.pages_.find(code);
+    if(iter == pages.pages_.end())
+        return nullptr;
+    return &iter->second;
+}
@@ -0,0 +1,105 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_HTTPRESPONSE_H
+#define WEBSERVER_HTTPRESPONSE_H
+
+#include <atomic>
+#include <map>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief The cached "Date: ...\r\n" header line
+ *
+ * Formatting the date with strftime for every response is expensive,
+ * so the event loop calls update() after each wakeup and the line is
+ * only re-rendered when the second changes.
+ */
+class HttpDate
+{
+public:
+    // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    static const size_t LINE_LEN = 37;
+
+    static void update();
+    // copy the current date line into buf, return the copied length
+    static size_t copyTo(char* buf);
+
+private:
+    /**
+     * Two slots, the writer always renders the slot readers are not using and then flips the index.
+     * A reader could only see a torn line if it was preempted for two whole seconds in the middle of a memcpy.
+     */
+    static char lines_[2][LINE_LEN + 1];
+    static atomic<int> curr_;
+    static atomic<long> last_sec_;
+};
+
+/**
+ * @brief Build the response header block in a preallocated buffer
+ *
+ * All the fixed parts of a header block (status lines, Server, Connection) are constant fragments,
+ * only the numbers and the date are rendered per response.
+ */
+class ResponseBuilder
+{
+public:
+    static const size_t MAX_HEADER_SIZE = 1024;
+
+    ResponseBuilder() : len_(0), overflow_(false) {}
+
+    // return false if the status code is unknown
+    bool statusLine(int code);
+    void date();
+    void server();
+    void connection(bool isKeepAlive, int timeout, int maxRequests);
+    void contentLength(size_t len);
+    void contentType(const string& type);
+    // append a raw header fragment, the fragment must end with "\r\n"
+    void raw(const char* data, size_t len);
+    void finish();
+
+    bool isOverflow()    const { return overflow_; }
+    const char* data()   const { return buf_; }
+    size_t size()        const { return len_; }
+
+    static const char* getStatusLine(int code, size_t* len);
+
+private:
+    void append(const char* data, size_t len);
+
+    char buf_[MAX_HEADER_SIZE];
+    size_t len_;
+    bool overflow_;
+};
+
+/**
+ * @brief The error pages are fully rendered at startup
+ *
+ * Every page holds everything after the Connection header:
+ * Server, Content-Length, Content-Type, the blank line and the html body.
+ */
+class ErrorPages
+{
+public:
+    struct Page
+    {
+        string tail;            // the pre-rendered headers and body
+        size_t header_len;      // the length without the body, used by HEAD
+    };
+
+    static const Page* get(int code);
+    // render all the pages, call it once at startup
+    static void init() { instance(); }
+
+private:
+    ErrorPages();
+    static ErrorPages& instance();
+
+    map<int, Page> pages_;
+};
+
+#endif //WEBSERVER_HTTPRESPONSE_H
@@ -0,0 +1,188 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+
+#include "InputBuffer.h"
+#include "Scan.h"
+
+std::atomic<size_t> InputBuffer::allocated_bytes_(0);
+std::atomic<size_t> InputBuffer::pooled_bytes_(0);
+thread_local InputBuffer::LocalPool InputBuffer::local_pool_;
+MutexLock InputBuffer::pool_lock_;
+std::vector<char*> InputBuffer::pool_;
+
+InputBuffer::InputBuffer(size_t initSize)
+        : data_(nullptr), cap_(0), init_size_(initSize), rd_(0), wr_(0)
+{
+}
+
+InputBuffer::~InputBuffer()
+{
+    rd_ = wr_ = 0;
+    release();
+}
+
+char* InputBuffer::takeBlock()
+{
+    char* block = nullptr;
+    if(local_pool_.size > 0)
+        block = local_pool_.blocks[--local_pool_.size];
+    else
+    {
+        MutexLockGuard guard(pool_lock_);
+        if(pool_.empty())
+            return nullptr;
+        block = pool_.back();
+        pool_.pop_back();
+    }
+    pooled_bytes_.fetch_sub(POOL_BLOCK, std::memory_order_relaxed);
+    return block;
+}
+
+void InputBuffer::putBlock(char* block)
+{
+    if(local_pool_.size < LOCAL_POOL_BLOCKS)
+        local_pool_.blocks[local_pool_.size++] = block;
+    else
+    {
+        MutexLockGuard guard(pool_lock_);
+        if(pool_.size() >= MAX_POOL_BLOCKS)
+        {
+            free(block);
+            return;
+        }
+        pool_.push_back(block);
+    }
+    pooled_bytes_.fetch_add(POOL_BLOCK, std::memory_order_relaxed);
+}
+
+void InputBuffer::retrieve(size_t len)
+{
+    assert(len <= readable());
+    rd_ += len;
+    // Nothing left, start from the front again without moving
+    if(rd_ == wr_)
+        rd_ = wr_ = 0;
+}
+
+void InputBuffer::compact()
+{
+    if(rd_ == 0)
+        return;
+    memmove(data_, data_ + rd_, readable());
+    wr_ -= rd_;
+    rd_ = 0;
+}
+
+void InputBuffer::shrink()
+{
+    if(cap_ <= init_size_ || readable() > init_size_)
+        return;
+    compact();
+    char* data = static_cast<char*>(realloc(data_, init_size_));
+    if(data)
+    {
+        allocated_bytes_.fetch_sub(cap_ - init_size_, std::memory_order_relaxed);
+        data_ = data;
+        cap_ = init_size_;
+    }
+}
+
+void InputBuffer::release()
+{
+    if(!data_ || readable() > 0)
+        return;
+    allocated_bytes_.fetch_sub(cap_, std::memory_order_relaxed);
+    if(cap_ == POOL_BLOCK)
+        putBlock(data_);
+    else
+        free(data_);
+    data_ = nullptr;
+    cap_ = rd_ = wr_ = 0;
+}
+
+void InputBuffer::reserve(size_t size)
+{
+    if(size <= cap_)
+        return;
+    // The blocks are malloc'd, a pooled one can still grow by realloc
+    if(cap_ == 0 && size == POOL_BLOCK && (data_ = takeBlock()) != nullptr)
+    {
+        cap_ = size;
+        allocated_bytes_.fetch_add(size, std::memory_order_relaxed);
+        return;
+    }
+    char* data = static_cast<char*>(realloc(data_, size));
+    if(!data)
+        return;
+    allocated_bytes_.fetch_add(size - cap_, std::memory_order_relaxed);
+    data_ = data;
+    cap_ = size;
+}
+
+size_t InputBuffer::findCRLF(size_t from) const
+{
+    const char* begin = peek();
+    const char* pos = Scan::findCRLF(begin + from, begin + readable());
+    return pos ? static_cast<size_t>(pos - begin) : npos;
+}
+
+ssize_t InputBuffer::readFd(int fd, size_t limit)
+{
+    auto readFdv = [](void* source, const iovec* iov, int iovcnt)
+    {
+        return readv(static_cast<int>(reinterpret_cast<intptr_t>(source)), iov, iovcnt);
+    };
+    return readFrom(readFdv, reinterpret_cast<void*>(static_cast<intptr_t>(fd)), limit);
+}
+
+ssize_t InputBuffer::readFrom(ReadvFunc func, void* source, size_t limit)
+{
+    size_t room = (limit > readable()) ? limit - readable() : 0;
+    if(room == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if(cap_ == 0)
+        reserve(std::min(init_size_, limit));
+    // Only move the data when the tail is used up
+    if(wr_ == cap_ && rd_ > 0)
+        compact();
+
+    char extra_buf[65536];
+    iovec iov[2];
+    iov[0].iov_base = data_ + wr_;
+    iov[0].iov_len = std::min(cap_ - wr_, room);
+    iov[1].iov_base = extra_buf;
+    iov[1].iov_len = std::min(sizeof(extra_buf), room - iov[0].iov_len);
+
+    ssize_t len = func(source, iov, 2);
+    if(len <= 0)
+        return len;
+
+    size_t in_buf = std::min(static_cast<size_t>(len), iov[0].iov_len);
+    wr_ += in_buf;
+    size_t in_extra = static_cast<size_t>(len) - in_buf;
+    if(in_extra > 0)
+    {
+        compact();
+        reserve(std::min(std::max(cap_ * 2, wr_ + in_extra), limit));
+        if(cap_ - wr_ < in_extra)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(data_ + wr_, extra_buf, in_extra);
+        wr_ += in_extra;
+    }
+    return len;
+}
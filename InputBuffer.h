@@ -0,0 +1,107 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_INPUTBUFFER_H
+#define WEBSERVER_INPUTBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "MutexLock.h"
+
+/**
+ * @brief The reusable input buffer of a connection
+ *
+ * The socket is read into the free tail of the buffer directly with readv,
+ * a stack buffer behind it catches the rest of a large read and the buffer grows only then.
+ * The consumed data is not moved on every read, the buffer is compacted after the requests are consumed.
+ * The buffer never holds more than the limit given to readFd().
+ *
+ * The memory is only taken by the first read. An idle connection gives it back by release(), the
+ * blocks of POOL_BLOCK bytes are kept for the next reads, in a small cache of the thread first and then
+ * in a pool shared by all the threads.
+ */
+class InputBuffer
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+    // the size of the pooled blocks, the initial size of the connection buffers
+    static const size_t POOL_BLOCK = 4096;
+    // the free blocks kept by a thread and by the shared pool, the others are freed
+    static const size_t LOCAL_POOL_BLOCKS = 16;
+    static const size_t MAX_POOL_BLOCKS = 1024;
+
+    explicit InputBuffer(size_t initSize = 4096);
+    ~InputBuffer();
+
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+
+    const char* peek() const    { return data_ + rd_; }
+    size_t readable() const     { return wr_ - rd_; }
+    size_t capacity() const     { return cap_; }
+
+    // consume len bytes of the readable data
+    void retrieve(size_t len);
+    // move the readable data to the front of the buffer
+    void compact();
+    // give back the memory beyond the initial size, only when there is little readable data
+    void shrink();
+    // give back all the memory when there is no readable data, the next read takes it again
+    void release();
+
+    // the memory held by all the buffers, and the free blocks in the pool
+    static size_t getAllocatedBytes()   { return allocated_bytes_.load(std::memory_order_relaxed); }
+    static size_t getPooledBytes()      { return pooled_bytes_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief find "\r\n" in the readable data
+     * @return the offset from peek(), npos if not found
+     */
+    size_t findCRLF(size_t from) const;
+
+    /**
+     * @brief read the fd once
+     * @param limit the max readable bytes the buffer can hold
+     * @return the read bytes, 0 if EOF, -1 if error.
+     *         If the buffer already holds limit bytes, return -1 and set errno to ENOBUFS
+     */
+    ssize_t readFd(int fd, size_t limit);
+
+    // read like readv, -1 with errno if failed
+    typedef ssize_t (*ReadvFunc)(void* source, const iovec* iov, int iovcnt);
+    /**
+     * @brief read the source once, like readFd(), for the sources other than a plain fd (TLS)
+     */
+    ssize_t readFrom(ReadvFunc func, void* source, size_t limit);
+
+private:
+    struct LocalPool
+    {
+        char* blocks[LOCAL_POOL_BLOCKS];
+        size_t size;
+    };
+
+    void reserve(size_t size);
+    // nullptr if no block is free
+    static char* takeBlock();
+    static void putBlock(char* block);
+
+    static std::atomic<size_t> allocated_bytes_;
+    static std::atomic<size_t> pooled_bytes_;
+    static thread_local LocalPool local_pool_;
+    static MutexLock pool_lock_;
+    static std::vector<char*> pool_;
+
+    char* data_;
+    size_t cap_;
+    size_t init_size_;
+    size_t rd_;
+    size_t wr_;
+};
+
+#endif //WEBSERVER_INPUTBUFFER_H
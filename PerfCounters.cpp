@@ -0,0 +1,181 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "PerfCounters.h"
+
+bool PerfCounters::enabled_ = false;
+atomic<unsigned> PerfCounters::available_(0);
+atomic<size_t> PerfCounters::threads_(0);
+PerfCounters::Bucket PerfCounters::buckets_[PerfCounters::CLASSES][PerfCounters::MAX_STATUS];
+thread_local PerfCounters::ThreadGroup PerfCounters::group_;
+
+static const char* const counterNames[PerfCounters::COUNTERS] =
+{
+    "cycles", "instructions", "cache_misses", "context_switches", "task_clock_ns"
+};
+
+static const char* const classNames[PerfCounters::CLASSES] =
+{
+    "other", "static", "cgi", "proxy", "handler", "http2", "websocket"
+};
+
+static int openEvent(uint32_t type, uint64_t config, int group_fd)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    // The kernel part is refused to the users by perf_event_paranoid >= 2
+    for(int exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++)
+    {
+        attr.exclude_kernel = static_cast<uint64_t>(exclude_kernel);
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+        if(fd != -1)
+            return fd;
+    }
+    return -1;
+}
+
+PerfCounters::ThreadGroup::ThreadGroup() : opened(false), size(0)
+{
+    for(int i = 0; i < COUNTERS; i++)
+        fds[i] = slots[i] = -1;
+}
+
+PerfCounters::ThreadGroup::~ThreadGroup()
+{
+    for(int i = 0; i < size; i++)
+        close(fds[i]);
+}
+
+/**
+ * @brief Open the events of this thread in one group, so they are counted together and read by one call
+ */
+void PerfCounters::ThreadGroup::open()
+{
+    static const struct { uint32_t type; uint64_t config; } events[COUNTERS] =
+    {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    };
+    opened = true;
+    unsigned opened_bits = 0;
+    for(int i = 0; i < COUNTERS; i++)
+    {
+        int fd = openEvent(events[i].type, events[i].config, size ? fds[0] : -1);
+        if(fd == -1)
+            continue;
+        slots[i] = size;
+        fds[size++] = fd;
+        opened_bits |= 1u << i;
+    }
+    if(size == 0)
+        WARN("Open the perf counters of the thread failed! (%s)", strerror(errno));
+    else
+        threads_.fetch_add(1, memory_order_relaxed);
+    available_.fetch_or(opened_bits, memory_order_relaxed);
+}
+
+void PerfCounters::read(Sample* sample)
+{
+    if(!group_.opened)
+        group_.open();
+    // nr, then the values in the order of the group
+    uint64_t buf[1 + COUNTERS];
+    if(group_.size == 0 || ::read(group_.fds[0], buf, sizeof(buf)) < static_cast<ssize_t>(sizeof(uint64_t)))
+    {
+        sample->clear();
+        return;
+    }
+    for(int i = 0; i < COUNTERS; i++)
+    {
+        int slot = group_.slots[i];
+        sample->values[i] = (slot != -1 && static_cast<uint64_t>(slot) < buf[0]) ? buf[1 + slot] : 0;
+    }
+}
+
+void PerfCounters::charge(Sample* mark, Sample* total)
+{
+    Sample now;
+    read(&now);
+    for(int i = 0; i < COUNTERS; i++)
+        total->values[i] += now.values[i] - mark->values[i];
+    *mark = now;
+}
+
+void PerfCounters::record(int req_class, int status, const Sample& sample)
+{
+    if(req_class < 0 || req_class >= CLASSES)
+        req_class = CLASS_OTHER;
+    if(status < 0 || status >= MAX_STATUS)
+        status = 0;
+    Bucket& bucket = buckets_[req_class][status];
+    bucket.count.fetch_add(1, memory_order_relaxed);
+    for(int i = 0; i < COUNTERS; i++)
+        bucket.values[i].fetch_add(sample.values[i], memory_order_relaxed);
+}
+
+static void appendLine(string* out, const char* name, uint64_t value)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", name, value);
+    out->append(line, static_cast<size_t>(len));
+}
+
+/**
+ * perf_<class>_<status>_<counter> for every class and status seen, with the IPC in 1/1000 if the cycles
+ * and the instructions are both counted
+ */
+void PerfCounters::render(string* out)
+{
+    char name[96];
+    unsigned available = available_.load(memory_order_relaxed);
+    appendLine(out, "perf_threads", threads_.load(memory_order_relaxed));
+    for(int i = 0; i < COUNTERS; i++)
+    {
+        snprintf(name, sizeof(name), "perf_available_%s", counterNames[i]);
+        appendLine(out, name, (available >> i) & 1);
+    }
+    bool has_ipc = (available & (1u << COUNTER_CYCLES)) && (available & (1u << COUNTER_INSTRUCTIONS));
+    for(int req_class = 0; req_class < CLASSES; req_class++)
+    {
+        for(int status = 0; status < MAX_STATUS; status++)
+        {
+            const Bucket& bucket = buckets_[req_class][status];
+            uint64_t count = bucket.count.load(memory_order_relaxed);
+            if(count == 0)
+                continue;
+            snprintf(name, sizeof(name), "perf_%s_%d_count", classNames[req_class], status);
+            appendLine(out, name, count);
+            for(int i = 0; i < COUNTERS; i++)
+            {
+                if(!((available >> i) & 1))
+                    continue;
+                snprintf(name, sizeof(name), "perf_%s_%d_%s", classNames[req_class], status, counterNames[i]);
+                appendLine(out, name, bucket.values[i].load(memory_order_relaxed));
+            }
+            uint64_t cycles = bucket.values[COUNTER_CYCLES].load(memory_order_relaxed);
+            if(has_ipc && cycles)
+            {
+                snprintf(name, sizeof(name), "perf_%s_%d_ipc_milli", classNames[req_class], status);
+                appendLine(out, name, bucket.values[COUNTER_INSTRUCTIONS].load(memory_order_relaxed) * 1000 / cycles);
+            }
+        }
+    }
+}
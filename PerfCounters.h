@@ -0,0 +1,100 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_PERFCOUNTERS_H
+#define WEBSERVER_PERFCOUNTERS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief The hardware counters of the threads running the connections, by request class and status
+ *
+ * With --perf-counters, every thread opens a group of perf_event_open counters of its own at its first
+ * read, and the connection reads the group before and after RunEventLoop, so a request is charged with
+ * the work done for it in any thread. A request is accounted when its response is finished or aborted;
+ * an HTTP/2 or WebSocket connection is accounted at every wakeup, under status 0.
+ *
+ * The events the kernel refuses (no PMU in a VM, perf_event_paranoid) are left out, and their counters
+ * stay 0. The counters of the thread include the kernel when it is allowed, like the syscalls of sendfile.
+ */
+class PerfCounters
+{
+public:
+    enum COUNTER
+    {
+        COUNTER_CYCLES,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_CACHE_MISSES,
+        COUNTER_CONTEXT_SWITCHES,
+        COUNTER_TASK_CLOCK,         // the CPU time in ns, the fallback without a PMU
+        COUNTERS
+    };
+
+    enum REQUEST_CLASS
+    {
+        CLASS_OTHER,                // answered before routing, like 400 and 404
+        CLASS_STATIC,
+        CLASS_CGI,
+        CLASS_PROXY,
+        CLASS_HANDLER,
+        CLASS_HTTP2,
+        CLASS_WEBSOCKET,
+        CLASSES
+    };
+
+    // the counters of a thread, or the part of them charged to a request
+    struct Sample
+    {
+        uint64_t values[COUNTERS];
+
+        Sample() : values() {}
+        void clear()    { *this = Sample(); }
+    };
+
+    static void enable()                { enabled_ = true; }
+    static bool isEnabled()             { return enabled_; }
+
+    // read the counters of this thread, all 0 if it could not open any
+    static void read(Sample* sample);
+    // add the counters since mark to total, and move mark to now
+    static void charge(Sample* mark, Sample* total);
+    static void record(int req_class, int status, const Sample& sample);
+
+    // the "<name> <value>" lines of the stats page
+    static void render(string* out);
+
+private:
+    static const int MAX_STATUS = 600;
+
+    struct Bucket
+    {
+        atomic<uint64_t> count;
+        atomic<uint64_t> values[COUNTERS];
+    };
+
+    struct ThreadGroup
+    {
+        bool opened;
+        int fds[COUNTERS];          // the leader first, -1 for a refused event
+        int slots[COUNTERS];        // the position in the read of the group, -1 if not counted
+        int size;
+
+        ThreadGroup();
+        ~ThreadGroup();
+        void open();
+    };
+
+    static bool enabled_;
+    static atomic<unsigned> available_;     // the COUNTER bits opened by some thread
+    static atomic<size_t> threads_;
+    static Bucket buckets_[CLASSES][MAX_STATUS];
+    static thread_local ThreadGroup group_;
+};
+
+#endif //WEBSERVER_PERFCOUNTERS_H
@@ -0,0 +1,184 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "Proxy.h"
+#include "Router.h"
+#include "Utils.h"
+
+size_t Upstream::maxIdle = 32;
+vector<Proxy::Route*> Proxy::routes_;
+
+Upstream* Upstream::create(const string& spec)
+{
+    Upstream* upstream = new Upstream;
+    if(spec.compare(0, 5, "unix:") == 0)
+    {
+        string path = spec.substr(5);
+        sockaddr_un* addr = reinterpret_cast<sockaddr_un*>(&upstream->addr_);
+        if(path.empty() || path.size() >= sizeof(addr->sun_path))
+        {
+            ERROR("Invalid upstream socket path: %s", spec.c_str());
+            delete upstream;
+            return nullptr;
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.c_str(), path.size());
+        upstream->addr_len_ = sizeof(sockaddr_un);
+        upstream->name_ = "localhost";
+        return upstream;
+    }
+
+    // "host:port" or "[::1]:port"
+    size_t colon = spec.rfind(':');
+    string host = (colon == string::npos) ? "" : spec.substr(0, colon);
+    string port = (colon == string::npos) ? "" : spec.substr(colon + 1);
+    if(host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    addrinfo* result = nullptr;
+    int ret = -1;
+    if(!host.empty() && isNumericStr(port) && !port.empty())
+        ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+    if(ret != 0 || !result)
+    {
+        ERROR("Invalid upstream address: %s (%s)", spec.c_str(), ret == -1 ? "host:port" : gai_strerror(ret));
+        delete upstream;
+        return nullptr;
+    }
+    // The address is resolved once, the first one is used
+    memcpy(&upstream->addr_, result->ai_addr, result->ai_addrlen);
+    upstream->addr_len_ = result->ai_addrlen;
+    upstream->name_ = spec;
+    freeaddrinfo(result);
+    return upstream;
+}
+
+int Upstream::acquire(bool* reused)
+{
+    for(;;)
+    {
+        int fd;
+        {
+            MutexLockGuard guard(idle_lock_);
+            if(idle_fds_.empty())
+                break;
+            fd = idle_fds_.back();
+            idle_fds_.pop_back();
+        }
+        // The upstream may have closed the idle connection, or sent something unexpected
+        char ch;
+        if(recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN)
+        {
+            *reused = true;
+            ++active_;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = false;
+    int fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        WARN("Create the socket of upstream %s failed! (%s)", name_.c_str(), strerror(errno));
+        return -1;
+    }
+    if(addr_.ss_family != AF_UNIX)
+        setSocketNoDelay(fd);
+    // A Unix socket connects at once, or fails with EAGAIN if its backlog is full
+    if(connect(fd, reinterpret_cast<sockaddr*>(&addr_), addr_len_) == -1 && errno != EINPROGRESS)
+    {
+        WARN("Connect upstream %s failed! (%s)", name_.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    ++active_;
+    return fd;
+}
+
+void Upstream::release(int fd, bool reusable)
+{
+    --active_;
+    if(reusable)
+    {
+        MutexLockGuard guard(idle_lock_);
+        if(idle_fds_.size() < maxIdle)
+        {
+            idle_fds_.push_back(fd);
+            return;
+        }
+    }
+    close(fd);
+}
+
+bool Proxy::addRoute(const string& spec)
+{
+    size_t eq = spec.find('=');
+    if(eq == string::npos || eq == 0 || spec[0] != '/' || eq + 1 == spec.size())
+    {
+        ERROR("Invalid proxy route: %s", spec.c_str());
+        return false;
+    }
+    Route* route = new Route;
+    route->prefix = spec.substr(0, eq);
+    // "/api/" matches the same paths as "/api"
+    while(route->prefix.size() > 1 && route->prefix.back() == '/')
+        route->prefix.pop_back();
+    route->next = 0;
+
+    size_t pos = eq + 1;
+    while(pos <= spec.size())
+    {
+        size_t end = spec.find(',', pos);
+        if(end == string::npos)
+            end = spec.size();
+        Upstream* upstream = Upstream::create(spec.substr(pos, end - pos));
+        if(!upstream)
+        {
+            for(Upstream* created : route->upstreams)
+                delete created;
+            delete route;
+            return false;
+        }
+        route->upstreams.push_back(upstream);
+        pos = end + 1;
+    }
+
+    // The route is dispatched by the router, its prefix may not be taken twice
+    if(!Router::addProxy(route))
+    {
+        for(Upstream* created : route->upstreams)
+            delete created;
+        delete route;
+        return false;
+    }
+    routes_.push_back(route);
+    INFO("Proxy %s to %ld upstreams", route->prefix.c_str(), route->upstreams.size());
+    return true;
+}
+
+Upstream* Proxy::pick(Route* route)
+{
+    size_t num = route->upstreams.size();
+    size_t start = route->next.fetch_add(1, memory_order_relaxed);
+    Upstream* best = nullptr;
+    for(size_t i = 0; i < num; i++)
+    {
+        Upstream* upstream = route->upstreams[(start + i) % num];
+        if(!best || upstream->getActive() < best->getActive())
+            best = upstream;
+    }
+    return best;
+}
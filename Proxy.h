@@ -0,0 +1,99 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_PROXY_H
+#define WEBSERVER_PROXY_H
+
+#include <atomic>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief An upstream HTTP/1.1 server of the proxy routes, on a Unix socket or TCP
+ *
+ * The keep-alive connections to the upstream are pooled. A connection serves one request at a time,
+ * and it is put back only after a complete response. The pool belongs to the process, the workers
+ * do not share their connections.
+ */
+class Upstream
+{
+public:
+    /**
+     * @param spec  "unix:/path/to.sock", "host:port" or "[ipv6]:port"
+     * @return nullptr if the address can not be resolved
+     */
+    static Upstream* create(const string& spec);
+
+    /**
+     * @brief Take an idle connection, or start a nonblocking connect
+     * @param reused  set to true if the connection came from the pool
+     * @return the fd, -1 if the connection failed at once
+     */
+    int acquire(bool* reused);
+    /**
+     * @brief Give back the connection of a finished request
+     * @param reusable  the whole exchange is done and the upstream keeps the connection
+     */
+    void release(int fd, bool reusable);
+
+    // the requests being served, for the least-connections balancing
+    int getActive() const           { return active_.load(memory_order_relaxed); }
+    // the Host of the requests without one
+    const string& getName() const   { return name_; }
+
+    // the max idle connections kept for every upstream
+    static void setMaxIdle(size_t num)  { maxIdle = num; }
+
+private:
+    Upstream() : addr_(), addr_len_(0), active_(0) {}
+
+    string name_;
+    sockaddr_storage addr_;
+    socklen_t addr_len_;
+    atomic<int> active_;
+
+    MutexLock idle_lock_;
+    vector<int> idle_fds_;          // the most recently used at the back
+
+    static size_t maxIdle;
+};
+
+/**
+ * @brief The proxy routes, the requests under the path prefix of a route are forwarded to its upstreams
+ *
+ *   --proxy /api=unix:/run/app.sock,127.0.0.1:9000
+ *
+ * The longest prefix wins, and it matches whole path segments, "/api" matches "/api" and "/api/x" but
+ * not "/apix". The request of a route goes to the upstream serving the least requests.
+ */
+class Proxy
+{
+public:
+    struct Route
+    {
+        string prefix;
+        vector<Upstream*> upstreams;
+        atomic<unsigned> next;      // where the next least-connections scan starts, to rotate the ties
+    };
+
+    /**
+     * @param spec  "<prefix>=<upstream>[,<upstream>...]"
+     * @return false if the spec is invalid
+     */
+    static bool addRoute(const string& spec);
+    static bool isEnabled()     { return !routes_.empty(); }
+
+    // the upstream serving the least requests
+    static Upstream* pick(Route* route);
+
+private:
+    static vector<Route*> routes_;
+};
+
+#endif //WEBSERVER_PROXY_H
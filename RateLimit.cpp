@@ -0,0 +1,233 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <new>
+#include <sys/mman.h>
+
+#include "Log.h"
+#include "RateLimit.h"
+#include "Utils.h"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the buckets are shared by the processes");
+
+// the tokens of a bucket are counted in 1/TOKEN_UNIT
+static const uint64_t TOKEN_UNIT = 16;
+// bounds the refill arithmetic in 64 bits
+static const uint32_t MAX_RATE = 1000000;
+// the stamps of the other threads are ahead by a few ms at most, a stamp further ahead is a stale one
+// the 32 bits clock wrapped around, after 24.8 days without any request of the client
+static const int32_t MAX_STAMP_SKEW_MS = 60 * 1000;
+
+RateLimit::Limit RateLimit::conn_limit_ = { 0, 0 };
+RateLimit::Limit RateLimit::req_limit_ = { 0, 0 };
+uint32_t RateLimit::subnet_scale_ = 8;
+RateLimit::Header* RateLimit::header_ = nullptr;
+RateLimit::Shard* RateLimit::table_ = nullptr;
+size_t RateLimit::shard_num_ = 0;
+
+/**
+ * @brief FNV-1a with a final mix, the high bits are the tag of the bucket
+ */
+static uint64_t hashBytes(const void* data, size_t len, uint64_t seed)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+/**
+ * The bucket word: the tag in 16 bits, the tokens in 16 bits and the stamp of the last refill in 32 bits
+ */
+static uint64_t packBucket(uint64_t tag, uint64_t tokens, uint32_t stamp)
+{
+    return (tag << 48) | (tokens << 32) | stamp;
+}
+
+bool RateLimit::parseLimit(const char* spec, Limit* limit)
+{
+    char* end;
+    errno = 0;
+    unsigned long rate = strtoul(spec, &end, 10);
+    unsigned long burst = min(rate, static_cast<unsigned long>(MAX_BURST));
+    if(end != spec && *end == ':' && isNumericStr(end + 1) && end[1])
+        burst = strtoul(end + 1, &end, 10);
+    if(end == spec || *end || errno || rate > MAX_RATE || burst > MAX_BURST || (rate && !burst))
+    {
+        ERROR("Invalid rate limit: %s (<rate>[:<burst>], the max burst is %u)", spec, MAX_BURST);
+        return false;
+    }
+    limit->rate = static_cast<uint32_t>(rate);
+    limit->burst = static_cast<uint32_t>(burst);
+    return true;
+}
+
+bool RateLimit::create(size_t slots)
+{
+    static_assert(sizeof(Header) <= sizeof(Shard), "the header takes one shard");
+    if(conn_limit_.rate == 0 && req_limit_.rate == 0)
+        return true;
+    shard_num_ = max((slots + SHARD_SLOTS - 1) / SHARD_SLOTS, static_cast<size_t>(1));
+    size_t size = sizeof(Shard) + shard_num_ * sizeof(Shard);
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED)
+    {
+        ERROR("Map the rate limit table of %ld bytes failed! (%s)", size, strerror(errno));
+        return false;
+    }
+    // The header takes the first cache line, the mapping is zeroed, so all the buckets are empty
+    header_ = new (addr) Header;
+    header_->base_ms = monotonicMs();
+    table_ = reinterpret_cast<Shard*>(static_cast<char*>(addr) + sizeof(Shard));
+    INFO("Rate limit: %u/s (burst %u) connections, %u/s (burst %u) requests, %ld buckets",
+         conn_limit_.rate, conn_limit_.burst, req_limit_.rate, req_limit_.burst, shard_num_ * SHARD_SLOTS);
+    return true;
+}
+
+RateLimit::ClientKey RateLimit::keyOf(const sockaddr* addr)
+{
+    ClientKey key = { 0, 0 };
+    const unsigned char* ip = nullptr;
+    if(addr->sa_family == AF_INET)
+        ip = reinterpret_cast<const unsigned char*>(&reinterpret_cast<const sockaddr_in*>(addr)->sin_addr);
+    else if(addr->sa_family == AF_INET6)
+    {
+        const in6_addr* ip6 = &reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr;
+        if(!IN6_IS_ADDR_V4MAPPED(ip6))
+        {
+            key.host = hashBytes(ip6->s6_addr, 16, 6);
+            key.subnet = hashBytes(ip6->s6_addr, 8, 64);
+            return key;
+        }
+        ip = ip6->s6_addr + 12;
+    }
+    if(ip)
+    {
+        key.host = hashBytes(ip, 4, 4);
+        key.subnet = hashBytes(ip, 3, 24);
+    }
+    return key;
+}
+
+bool RateLimit::take(uint64_t key, BUCKET_KIND kind, const Limit& limit, uint32_t now)
+{
+    uint64_t hash = hashBytes(&key, sizeof(key), kind);
+    Shard& shard = table_[hash % shard_num_];
+    uint64_t tag = (hash >> 48) ? (hash >> 48) : 1;
+    uint64_t full = limit.burst * TOKEN_UNIT;
+
+    for(;;)
+    {
+        atomic<uint64_t>* slot = nullptr;
+        uint64_t word = 0;
+        // A new client takes the empty bucket, or the one not refilled for the longest time
+        atomic<uint64_t>* victim = nullptr;
+        uint64_t victim_word = 0;
+        uint32_t victim_age = 0;
+        for(size_t i = 0; i < SHARD_SLOTS; i++)
+        {
+            uint64_t curr = shard.slots[i].load(memory_order_relaxed);
+            if((curr >> 48) == tag)
+            {
+                slot = &shard.slots[i];
+                word = curr;
+                break;
+            }
+            uint32_t age = curr ? now - static_cast<uint32_t>(curr) : UINT32_MAX;
+            if(!victim || age > victim_age)
+            {
+                victim = &shard.slots[i];
+                victim_word = curr;
+                victim_age = age;
+            }
+        }
+
+        uint64_t next;
+        if(slot)
+        {
+            uint64_t tokens = (word >> 32) & 0xffff;
+            uint32_t stamp = static_cast<uint32_t>(word);
+            // Another thread may have stamped it with a later clock
+            int32_t elapsed = static_cast<int32_t>(now - stamp);
+            uint64_t added = (elapsed > 0) ? static_cast<uint64_t>(elapsed) * limit.rate * TOKEN_UNIT / 1000 : 0;
+            if(elapsed < -MAX_STAMP_SKEW_MS || tokens + added >= full)
+            {
+                tokens = full;
+                stamp = now;
+            }
+            else if(added > 0)
+            {
+                // Only the time of the whole added units is taken, the slow rates still refill
+                tokens += added;
+                stamp += static_cast<uint32_t>(added * 1000 / (limit.rate * TOKEN_UNIT));
+            }
+            if(tokens < TOKEN_UNIT)
+                return false;
+            next = packBucket(tag, tokens - TOKEN_UNIT, stamp);
+        }
+        else
+        {
+            slot = victim;
+            word = victim_word;
+            next = packBucket(tag, full - TOKEN_UNIT, now);
+        }
+        if(slot->compare_exchange_weak(word, next, memory_order_relaxed))
+            return true;
+    }
+}
+
+bool RateLimit::allow(const ClientKey& key, const Limit& limit, BUCKET_KIND host_kind, BUCKET_KIND subnet_kind)
+{
+    if(!table_ || limit.rate == 0 || key.host == 0)
+        return true;
+    uint32_t now = static_cast<uint32_t>(monotonicMs() - header_->base_ms);
+    if(!take(key.host, host_kind, limit, now))
+        return false;
+    if(subnet_scale_ == 0)
+        return true;
+    Limit subnet;
+    subnet.rate = static_cast<uint32_t>(min<uint64_t>(static_cast<uint64_t>(limit.rate) * subnet_scale_, MAX_RATE));
+    subnet.burst = static_cast<uint32_t>(min<uint64_t>(static_cast<uint64_t>(limit.burst) * subnet_scale_, MAX_BURST));
+    // The token of the address is not given back, a refused client keeps paying for its network
+    return take(key.subnet, subnet_kind, subnet, now);
+}
+
+bool RateLimit::allowConnection(const ClientKey& key)
+{
+    if(allow(key, conn_limit_, BUCKET_CONN_HOST, BUCKET_CONN_SUBNET))
+        return true;
+    header_->refused_conns.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+bool RateLimit::allowRequest(const ClientKey& key)
+{
+    if(allow(key, req_limit_, BUCKET_REQ_HOST, BUCKET_REQ_SUBNET))
+        return true;
+    header_->limited_requests.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+uint64_t RateLimit::getRefusedConnections()
+{
+    return header_ ? header_->refused_conns.load(memory_order_relaxed) : 0;
+}
+
+uint64_t RateLimit::getLimitedRequests()
+{
+    return header_ ? header_->limited_requests.load(memory_order_relaxed) : 0;
+}
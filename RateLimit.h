@@ -0,0 +1,112 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_RATELIMIT_H
+#define WEBSERVER_RATELIMIT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+using namespace std;
+
+/**
+ * @brief The token buckets of the client addresses, for the connection rate and the request rate
+ *
+ * Every client is limited by the bucket of its address and the bucket of its network, the /24 of IPv4
+ * or the /64 of IPv6, which gets a multiple of the limits. A connection over the limit is reset right
+ * after the accept, a request over the limit is answered 429 before it is parsed.
+ *
+ * The buckets live in a fixed table in a shared mapping, created before forking the workers, so all the
+ * processes count the same clients. The table is split into shards of one cache line, a bucket is one
+ * 64 bits word updated by compare-and-swap, no lock is taken. A new client takes the stalest bucket of
+ * its shard, and two clients may share a bucket if their 16 bits tags collide, which only makes the
+ * limit stricter for them.
+ */
+class RateLimit
+{
+public:
+    // the buckets in a shard, a cache line
+    static const size_t SHARD_SLOTS = 8;
+    // the max burst, the tokens are counted in 1/16 in 16 bits
+    static const uint32_t MAX_BURST = 4095;
+
+    struct Limit
+    {
+        uint32_t rate;      // the tokens added per second, 0 is unlimited
+        uint32_t burst;     // the max tokens
+    };
+
+    /**
+     * The hashes of the address and the network of a client, 0 if the client is not limited
+     */
+    struct ClientKey
+    {
+        uint64_t host;
+        uint64_t subnet;
+    };
+
+    /**
+     * @param spec  "<rate>[:<burst>]", the burst is the rate by default
+     * @return false if the spec is invalid
+     */
+    static bool parseLimit(const char* spec, Limit* limit);
+    static void setConnectionLimit(const Limit& limit)  { conn_limit_ = limit; }
+    static void setRequestLimit(const Limit& limit)     { req_limit_ = limit; }
+    // the network of a client gets scale times the limits of an address, 0 disables the network buckets
+    static void setSubnetScale(uint32_t scale)          { subnet_scale_ = scale; }
+
+    /**
+     * @brief Create the shared table, call it before forking the workers. Nothing is created without a limit
+     * @param slots  the buckets of the table, rounded up to the shards
+     */
+    static bool create(size_t slots);
+    static bool isEnabled() { return table_ != nullptr; }
+
+    // the key of an accepted client, Unix sockets are not limited
+    static ClientKey keyOf(const sockaddr* addr);
+
+    /**
+     * @brief Take a token of the connection buckets of the client
+     * @return false if the client is over its connection rate
+     */
+    static bool allowConnection(const ClientKey& key);
+    /**
+     * @brief Take a token of the request buckets of the client
+     * @return false if the client is over its request rate
+     */
+    static bool allowRequest(const ClientKey& key);
+
+    static uint64_t getRefusedConnections();
+    static uint64_t getLimitedRequests();
+
+private:
+    enum BUCKET_KIND { BUCKET_CONN_HOST = 1, BUCKET_CONN_SUBNET, BUCKET_REQ_HOST, BUCKET_REQ_SUBNET };
+
+    struct alignas(64) Shard
+    {
+        atomic<uint64_t> slots[SHARD_SLOTS];
+    };
+
+    struct Header
+    {
+        int64_t base_ms;                    // the stamps of the buckets are milliseconds since it
+        atomic<uint64_t> refused_conns;
+        atomic<uint64_t> limited_requests;
+    };
+
+    static bool take(uint64_t key, BUCKET_KIND kind, const Limit& limit, uint32_t now);
+    static bool allow(const ClientKey& key, const Limit& limit, BUCKET_KIND host_kind, BUCKET_KIND subnet_kind);
+
+    static Limit conn_limit_;
+    static Limit req_limit_;
+    static uint32_t subnet_scale_;
+
+    static Header* header_;
+    static Shard* table_;
+    static size_t shard_num_;
+};
+
+#endif //WEBSERVER_RATELIMIT_H
@@ -0,0 +1,274 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "Log.h"
+#include "Router.h"
+
+Router::Node Router::root_;
+bool Router::compiled_ = false;
+size_t Router::maxBodySize = 64 * 1024;
+
+bool Router::View::equals(const char* str) const
+{
+    return strlen(str) == len && memcmp(str, data, len) == 0;
+}
+
+Router::View Router::Request::param(const char* name) const
+{
+    for(size_t i = 0; route_ && i < param_count_ && i < route_->param_names.size(); i++)
+    {
+        if(route_->param_names[i] == name)
+            return params_[i];
+    }
+    return View();
+}
+
+const string* Router::Request::header(const char* name) const
+{
+    if(!headers)
+        return nullptr;
+    auto iter = headers->find(name);
+    return (iter != headers->end()) ? &iter->second : nullptr;
+}
+
+void Router::Response::addHeader(const char* name, const string& value)
+{
+    fields_ += name;
+    fields_ += ": ";
+    fields_ += value;
+    fields_ += "\r\n";
+}
+
+bool Router::addHandler(unsigned methods, const string& pattern, Handler handler, void* arg)
+{
+    if(methods & MASK_GET)
+        methods |= MASK_HEAD;
+    Route* route = new Route{ ROUTE_HANDLER, methods & MASK_ALL, pattern, {}, handler, arg, nullptr };
+    return add(route);
+}
+
+bool Router::addStatic(const string& pattern)
+{
+    return add(new Route{ ROUTE_STATIC, MASK_GET | MASK_HEAD, pattern, {}, nullptr, nullptr, nullptr });
+}
+
+bool Router::addCgi(const string& pattern)
+{
+    return add(new Route{ ROUTE_CGI, MASK_POST, pattern, {}, nullptr, nullptr, nullptr });
+}
+
+bool Router::addProxy(Proxy::Route* proxy)
+{
+    string pattern = (proxy->prefix == "/") ? "/*" : proxy->prefix + "/*";
+    return add(new Route{ ROUTE_PROXY, MASK_ALL, pattern, {}, nullptr, nullptr, proxy });
+}
+
+/**
+ * @brief Put the route in the trie, the route is deleted if it is rejected
+ */
+bool Router::add(Route* route)
+{
+    assert(!compiled_);
+    const string& pattern = route->pattern;
+    Node* node = &root_;
+    vector<Route*>* target = nullptr;
+    bool valid = !pattern.empty() && pattern[0] == '/' && route->methods != 0;
+    for(size_t pos = 1; valid && !target; )
+    {
+        size_t end = min(pattern.find('/', pos), pattern.size());
+        string segment = pattern.substr(pos, end - pos);
+        if(!segment.empty() && segment[0] == '*')
+        {
+            // "*" captures the rest, it is the last segment
+            valid = (end == pattern.size());
+            route->param_names.push_back(segment.size() > 1 ? segment.substr(1) : "*");
+            target = &node->rest_routes;
+        }
+        else if(!segment.empty() && segment[0] == ':')
+        {
+            valid = (segment.size() > 1);
+            route->param_names.push_back(segment.substr(1));
+            if(!node->param_child)
+                node->param_child = new Node;
+            node = node->param_child;
+        }
+        else
+        {
+            string label = "/" + segment;
+            auto iter = find_if(node->children.begin(), node->children.end(),
+                                [&label](const Node* child) { return child->label == label; });
+            if(iter == node->children.end())
+            {
+                node->children.push_back(new Node);
+                node->children.back()->label = label;
+                iter = node->children.end() - 1;
+            }
+            node = *iter;
+        }
+        if(end == pattern.size())
+            break;
+        pos = end + 1;
+    }
+    valid = valid && route->param_names.size() <= MAX_PARAMS;
+    if(!target)
+        target = &node->routes;
+    // Two routes of the same pattern can not take the same method
+    for(size_t i = 0; valid && i < target->size(); i++)
+        valid = ((*target)[i]->methods & route->methods) == 0;
+    if(!valid)
+    {
+        ERROR("Invalid or duplicate route: %s", pattern.c_str());
+        delete route;
+        return false;
+    }
+    target->push_back(route);
+    INFO("Route %s (type %d, methods %u)", pattern.c_str(), route->type, route->methods);
+    return true;
+}
+
+// the first segment of a label, without its "/"
+static size_t firstSegmentLen(const string& label)
+{
+    return min(label.find('/', 1), label.size()) - 1;
+}
+
+static int compareSegment(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    int cmp = memcmp(a, b, min(a_len, b_len));
+    return cmp ? cmp : (a_len < b_len ? -1 : (a_len > b_len ? 1 : 0));
+}
+
+/**
+ * @brief Merge every chain of literal nodes without a route into one edge, and sort the edges by their
+ *        first segment for the binary search
+ */
+void Router::compileNode(Node* node)
+{
+    for(Node* child : node->children)
+    {
+        while(child->children.size() == 1 && !child->param_child && child->routes.empty()
+              && child->rest_routes.empty())
+        {
+            Node* next = child->children[0];
+            child->label += next->label;
+            child->children.swap(next->children);
+            child->param_child = next->param_child;
+            child->routes.swap(next->routes);
+            child->rest_routes.swap(next->rest_routes);
+            delete next;
+        }
+        compileNode(child);
+    }
+    if(node->param_child)
+        compileNode(node->param_child);
+    sort(node->children.begin(), node->children.end(), [](const Node* a, const Node* b)
+    {
+        return compareSegment(a->label.data() + 1, firstSegmentLen(a->label),
+                              b->label.data() + 1, firstSegmentLen(b->label)) < 0;
+    });
+}
+
+void Router::compile()
+{
+    if(compiled_)
+        return;
+    // The files are served where no other route takes the whole path space
+    bool taken = false;
+    for(const Route* route : root_.rest_routes)
+        taken = taken || (route->methods & (MASK_GET | MASK_HEAD));
+    if(!taken)
+        addStatic("/*");
+    taken = false;
+    for(const Route* route : root_.rest_routes)
+        taken = taken || (route->methods & MASK_POST);
+    if(!taken)
+        addCgi("/*");
+    compileNode(&root_);
+    compiled_ = true;
+}
+
+const Router::Route* Router::findRoute(const vector<Route*>& routes, unsigned mask)
+{
+    for(const Route* route : routes)
+    {
+        if(route->methods & mask)
+            return route;
+    }
+    return nullptr;
+}
+
+/**
+ * @param pos   at the "/" of the next segment, or at end if the path is matched
+ */
+const Router::Route* Router::matchNode(const Node* node, const char* pos, const char* end, unsigned mask,
+                                       Request* req)
+{
+    const Route* route = nullptr;
+    if(pos == end)
+        route = findRoute(node->routes, mask);
+    else
+    {
+        const char* segment = pos + 1;
+        const char* segment_end = static_cast<const char*>(memchr(segment, '/', static_cast<size_t>(end - segment)));
+        if(!segment_end)
+            segment_end = end;
+        size_t segment_len = static_cast<size_t>(segment_end - segment);
+
+        // 1. the literal edge of the segment, the edges of a node differ in their first segment
+        auto iter = lower_bound(node->children.begin(), node->children.end(), segment,
+                                [segment_len](const Node* child, const char* seg)
+        {
+            return compareSegment(child->label.data() + 1, firstSegmentLen(child->label), seg, segment_len) < 0;
+        });
+        if(iter != node->children.end())
+        {
+            const string& label = (*iter)->label;
+            size_t left = static_cast<size_t>(end - pos);
+            if(label.size() <= left && memcmp(pos, label.data(), label.size()) == 0
+               && (label.size() == left || pos[label.size()] == '/'))
+                route = matchNode(*iter, pos + label.size(), end, mask, req);
+        }
+        // 2. the capture of one segment
+        if(!route && node->param_child && segment_len > 0 && req->param_count_ < MAX_PARAMS)
+        {
+            size_t count = req->param_count_;
+            req->params_[req->param_count_++] = View(segment, segment_len);
+            route = matchNode(node->param_child, segment_end, end, mask, req);
+            if(!route)
+                req->param_count_ = count;
+        }
+    }
+    if(route)
+        return route;
+
+    // 3. the rest of the path
+    route = findRoute(node->rest_routes, mask);
+    if(route && req->param_count_ < MAX_PARAMS)
+    {
+        const char* rest = (pos == end) ? end : pos + 1;
+        req->params_[req->param_count_++] = View(rest, static_cast<size_t>(end - rest));
+        req->route_ = route;
+        return route;
+    }
+    return nullptr;
+}
+
+const Router::Route* Router::match(int method, const char* uri, Request* req)
+{
+    assert(compiled_);
+    size_t len = strcspn(uri, "?");
+    req->method = method;
+    req->path = View(uri, len);
+    req->query = uri[len] ? View(uri + len + 1, strlen(uri + len + 1)) : View();
+    req->param_count_ = 0;
+    req->route_ = nullptr;
+    const Route* route = matchNode(&root_, uri, uri + len, 1u << method, req);
+    if(route)
+        req->route_ = route;
+    return route;
+}
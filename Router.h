@@ -0,0 +1,188 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_ROUTER_H
+#define WEBSERVER_ROUTER_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include "Proxy.h"
+
+using namespace std;
+
+/**
+ * @brief The routing table of the requests, a radix trie of path segments built at startup
+ *
+ * A pattern is a path of segments, a segment is a literal, ":name" that captures one non-empty segment,
+ * or a last "*" (or "*name") that captures the rest of the path, empty included, so "/api/" followed by
+ * a star matches "/api" too. A literal is tried before a capture, and a capture before "*", so
+ * "/api/health" wins over "/api/:id" and over the star; a route that does not take the method is passed
+ * over like a missing one.
+ *
+ * Every request is dispatched by one lookup, HTTP/1.1 and HTTP/2 alike. The files of www_path are the
+ * routes of "/" followed by a star, of GET and HEAD (static) and of POST (CGI), added by compile() unless
+ * the same pattern is taken. The routes are added before the server starts and never change after compile(), the lookups
+ * take no lock.
+ */
+class Router
+{
+public:
+    enum ROUTE_TYPE
+    {
+        ROUTE_HANDLER,      // a native handler, run in the thread of the connection
+        ROUTE_STATIC,       // the files of www_path
+        ROUTE_CGI,          // the executable files of www_path, run with the request body
+        ROUTE_PROXY         // the upstreams of a --proxy route
+    };
+
+    // the methods of a route, a bit for every METHOD_TYPE of HttpHandler
+    enum METHOD_MASK
+    {
+        MASK_GET    = 1 << 0,
+        MASK_POST   = 1 << 1,
+        MASK_HEAD   = 1 << 2,
+        MASK_ALL    = MASK_GET | MASK_POST | MASK_HEAD
+    };
+
+    static const size_t MAX_PARAMS = 8;
+
+    /**
+     * @brief A part of the request, not copied, it is valid during the handler only
+     */
+    struct View
+    {
+        const char* data;
+        size_t len;
+
+        View() : data(""), len(0) {}
+        View(const char* view_data, size_t view_len) : data(view_data), len(view_len) {}
+        string str() const          { return string(data, len); }
+        bool equals(const char* str) const;
+    };
+
+    struct Route;
+
+    struct Request
+    {
+        int method;                             // METHOD_TYPE of HttpHandler
+        View path;                              // without the query
+        View query;                             // after "?", empty if none
+        View body;                              // the whole body of POST
+        const map<string, string>* headers;     // the names are in lowercase
+        const ucred* peer;                      // the client process of a Unix socket, nullptr for TCP
+
+        Request() : method(0), headers(nullptr), peer(nullptr), route_(nullptr), param_count_(0) {}
+        // the segment captured by ":name" or "*name", "*" for an unnamed "*", empty if none
+        View param(const char* name) const;
+        // nullptr if the field is not sent, the name is in lowercase
+        const string* header(const char* name) const;
+
+    private:
+        friend class Router;
+        const Route* route_;
+        View params_[MAX_PARAMS];
+        size_t param_count_;
+    };
+
+    /**
+     * @brief The response of a handler, the body is written straight into the output buffer of the
+     *        connection, the status line and the fields are added in front of it after the handler
+     */
+    class Response
+    {
+    public:
+        explicit Response(string* out) : out_(out), body_start_(out->size()), status_(200) {}
+
+        // 200 by default, a code without a status line is answered as 500
+        void setStatus(int code)                    { status_ = code; }
+        // "text/plain" by default
+        void setContentType(const string& type)     { content_type_ = type; }
+        // the name and the value must not contain "\r\n"
+        void addHeader(const char* name, const string& value);
+        void write(const char* data, size_t len)    { out_->append(data, len); }
+        void write(const string& data)              { out_->append(data); }
+
+        int getStatus() const                       { return status_; }
+        const string& getContentType() const        { return content_type_; }
+        // the "Name: value\r\n" lines of addHeader()
+        const string& getFields() const             { return fields_; }
+        size_t getBodySize() const                  { return out_->size() - body_start_; }
+
+    private:
+        string* out_;
+        size_t body_start_;
+        int status_;
+        string content_type_;
+        string fields_;
+    };
+
+    typedef void (*Handler)(const Request& req, Response* resp, void* arg);
+
+    struct Route
+    {
+        ROUTE_TYPE type;
+        unsigned methods;               // METHOD_MASK
+        string pattern;
+        vector<string> param_names;     // in the order of the captures
+        Handler handler;
+        void* arg;
+        Proxy::Route* proxy;            // the upstreams of ROUTE_PROXY
+    };
+
+    /**
+     * @brief Add a native handler, GET takes HEAD too, and the body of HEAD is dropped
+     * @return false if the pattern is invalid, or a route of the same pattern takes one of the methods
+     */
+    static bool addHandler(unsigned methods, const string& pattern, Handler handler, void* arg = nullptr);
+    static bool addStatic(const string& pattern);
+    static bool addCgi(const string& pattern);
+    // the prefix matches whole path segments, all the methods are proxied
+    static bool addProxy(Proxy::Route* proxy);
+
+    /**
+     * @brief Add the default routes of www_path and merge the chains of literal segments, call it once
+     *        before the server starts
+     */
+    static void compile();
+
+    /**
+     * @brief Find the route of a request
+     * @param uri   "/" + the path, the query is not matched
+     * @param req   the path, the query and the captures are set, the rest is left to the caller
+     * @return nullptr if no route takes the path and the method (404)
+     */
+    static const Route* match(int method, const char* uri, Request* req);
+
+    // the max request body of a native handler, the body must fit in the input buffer
+    static void setMaxBodySize(size_t size)     { maxBodySize = size; }
+    static size_t getMaxBodySize()              { return maxBodySize; }
+
+private:
+    struct Node
+    {
+        string label;                   // the literal segments of the edge, each one with its leading "/"
+        vector<Node*> children;         // the literal edges, sorted by label
+        Node* param_child;              // the edge of ":name"
+        vector<Route*> routes;          // the routes ending here
+        vector<Route*> rest_routes;     // the routes of "*" here
+
+        Node() : param_child(nullptr) {}
+    };
+
+    static Node root_;
+    static bool compiled_;
+    static size_t maxBodySize;
+
+    static bool add(Route* route);
+    static void compileNode(Node* node);
+    static const Route* findRoute(const vector<Route*>& routes, unsigned mask);
+    static const Route* matchNode(const Node* node, const char* pos, const char* end, unsigned mask,
+                                  Request* req);
+};
+
+#endif //WEBSERVER_ROUTER_H
@@ -0,0 +1,325 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <array>
+
+#include "Scan.h"
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." / "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+static constexpr array<bool, 256> makeTokenChars()
+{
+    array<bool, 256> chars{};
+    for(int ch = '0'; ch <= '9'; ch++)
+        chars[ch] = true;
+    for(int ch = 'a'; ch <= 'z'; ch++)
+        chars[ch] = chars[ch - 'a' + 'A'] = true;
+    for(const char* special = "!#$%&'*+-.^_`|~"; *special; special++)
+        chars[static_cast<unsigned char>(*special)] = true;
+    return chars;
+}
+
+static constexpr array<bool, 256> tokenChars = makeTokenChars();
+
+static inline bool isUnprintable(char ch)
+{
+    return static_cast<unsigned char>(ch - 0x20) >= 0x5f;
+}
+
+static const char* findCRLFScalar(const char* begin, const char* end)
+{
+    for(const char* pos = begin; pos + 1 < end; pos++)
+    {
+        if(pos[0] == '\r' && pos[1] == '\n')
+            return pos;
+    }
+    return nullptr;
+}
+
+static const char* findNonTokenScalar(const char* begin, const char* end)
+{
+    const char* pos = begin;
+    while(pos < end && tokenChars[static_cast<unsigned char>(*pos)])
+        pos++;
+    return pos;
+}
+
+static const char* findUnprintableScalar(const char* begin, const char* end)
+{
+    const char* pos = begin;
+    while(pos < end && !isUnprintable(*pos))
+        pos++;
+    return pos;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * The tchars by the nibbles for vpshufb: a byte is a tchar if the entry of its low nibble has the bit of
+ * its high nibble, the bytes >= 0x80 have no bit. The table is repeated for the two 128 bits lanes.
+ */
+static constexpr array<char, 32> makeTokenNibbles()
+{
+    array<char, 32> bits{};
+    for(int ch = 0; ch < 0x80; ch++)
+    {
+        if(tokenChars[ch])
+        {
+            bits[ch & 0x0f] = static_cast<char>(bits[ch & 0x0f] | (1 << (ch >> 4)));
+            bits[16 + (ch & 0x0f)] = bits[ch & 0x0f];
+        }
+    }
+    return bits;
+}
+
+alignas(32) static constexpr array<char, 32> tokenNibbles = makeTokenNibbles();
+
+// the bytes of [lo, hi], by the unsigned compare of SSE2: x - lo <= hi - lo
+static inline __m128i inRange(__m128i bytes, char lo, char hi)
+{
+    __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(static_cast<char>(hi - lo))), offset);
+}
+
+/*
+ * The masks of 16 bytes at pos, a bit for every byte found. They are inlined into the AVX2 kernels too,
+ * for the blocks shorter than 32 bytes.
+ */
+static inline unsigned crlfMask16(const char* pos)
+{
+    __m128i cr = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)), _mm_set1_epi8('\r'));
+    __m128i lf = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 1)), _mm_set1_epi8('\n'));
+    return static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(cr, lf)));
+}
+
+static inline unsigned nonTokenMask16(const char* pos)
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    // the controls, space, DEL and the bytes >= 0x80, then the separators between them
+    __m128i bad = _mm_xor_si128(inRange(bytes, 0x21, 0x7e), _mm_set1_epi8(-1));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+    bad = _mm_or_si128(bad, inRange(bytes, '(', ')'));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(',')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('/')));
+    bad = _mm_or_si128(bad, inRange(bytes, ':', '@'));
+    bad = _mm_or_si128(bad, inRange(bytes, '[', ']'));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('{')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('}')));
+    return static_cast<unsigned>(_mm_movemask_epi8(bad));
+}
+
+static inline unsigned unprintableMask16(const char* pos)
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    return static_cast<unsigned>(_mm_movemask_epi8(inRange(bytes, 0x20, 0x7e))) ^ 0xffff;
+}
+
+/*
+ * The last block of a kernel ends at end, and overlaps the bytes already checked, which have no match.
+ * The "\n" of a "\r" at the last byte of a block is in the second load of crlfMask, one byte further.
+ */
+#define SCAN_BLOCKS(WIDTH, OVERRUN, MASK, NOT_FOUND)                      \
+    do {                                                                  \
+        const char* pos = begin;                                          \
+        for(; end - pos > (WIDTH) + (OVERRUN); pos += (WIDTH))            \
+        {                                                                 \
+            unsigned mask = MASK(pos);                                    \
+            if(mask)                                                      \
+                return pos + __builtin_ctz(mask);                         \
+        }                                                                 \
+        pos = end - (WIDTH) - (OVERRUN);                                  \
+        unsigned mask = MASK(pos);                                        \
+        return mask ? pos + __builtin_ctz(mask) : (NOT_FOUND);            \
+    } while(false)
+
+static const char* findCRLFSse2(const char* begin, const char* end)
+{
+    if(end - begin < 17)
+        return findCRLFScalar(begin, end);
+    SCAN_BLOCKS(16, 1, crlfMask16, nullptr);
+}
+
+static const char* findNonTokenSse2(const char* begin, const char* end)
+{
+    if(end - begin < 16)
+        return findNonTokenScalar(begin, end);
+    SCAN_BLOCKS(16, 0, nonTokenMask16, end);
+}
+
+static const char* findUnprintableSse2(const char* begin, const char* end)
+{
+    if(end - begin < 16)
+        return findUnprintableScalar(begin, end);
+    SCAN_BLOCKS(16, 0, unprintableMask16, end);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned crlfMask32(const char* pos)
+{
+    __m256i cr = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos)), _mm256_set1_epi8('\r'));
+    __m256i lf = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos + 1)),
+                                   _mm256_set1_epi8('\n'));
+    return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(cr, lf)));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned nonTokenMask32(const char* pos)
+{
+    const __m256i lo_table = _mm256_load_si256(reinterpret_cast<const __m256i*>(tokenNibbles.data()));
+    const __m256i hi_table = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+    __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(bytes, nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+    return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi),
+                                                                        _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned unprintableMask32(const char* pos)
+{
+    __m256i offset = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos)), _mm256_set1_epi8(0x20));
+    __m256i good = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(0x5e)), offset);
+    return ~static_cast<unsigned>(_mm256_movemask_epi8(good));
+}
+
+__attribute__((target("avx2")))
+static const char* findCRLFAvx2(const char* begin, const char* end)
+{
+    if(end - begin < 17)
+        return findCRLFScalar(begin, end);
+    if(end - begin < 33)
+        SCAN_BLOCKS(16, 1, crlfMask16, nullptr);
+    SCAN_BLOCKS(32, 1, crlfMask32, nullptr);
+}
+
+__attribute__((target("avx2")))
+static const char* findNonTokenAvx2(const char* begin, const char* end)
+{
+    if(end - begin < 16)
+        return findNonTokenScalar(begin, end);
+    if(end - begin < 32)
+        SCAN_BLOCKS(16, 0, nonTokenMask16, end);
+    SCAN_BLOCKS(32, 0, nonTokenMask32, end);
+}
+
+__attribute__((target("avx2")))
+static const char* findUnprintableAvx2(const char* begin, const char* end)
+{
+    if(end - begin < 16)
+        return findUnprintableScalar(begin, end);
+    if(end - begin < 32)
+        SCAN_BLOCKS(16, 0, unprintableMask16, end);
+    SCAN_BLOCKS(32, 0, unprintableMask32, end);
+}
+
+#endif
+
+struct Kernels
+{
+    const char* (*findCRLF)(const char*, const char*);
+    const char* (*findNonToken)(const char*, const char*);
+    const char* (*findUnprintable)(const char*, const char*);
+};
+
+// by LEVEL
+static const Kernels kernels[] =
+{
+    { findCRLFScalar, findNonTokenScalar, findUnprintableScalar },
+#ifdef SCAN_X86
+    { findCRLFSse2, findNonTokenSse2, findUnprintableSse2 },
+    { findCRLFAvx2, findNonTokenAvx2, findUnprintableAvx2 },
+#endif
+};
+
+static Scan::LEVEL supportedLevel()
+{
+#ifdef SCAN_X86
+    // the check of the CPU includes the support of the AVX state by the OS
+    return __builtin_cpu_supports("avx2") ? Scan::LEVEL_AVX2 : Scan::LEVEL_SSE2;
+#else
+    return Scan::LEVEL_SCALAR;
+#endif
+}
+
+static Scan::LEVEL& currentLevel()
+{
+    static Scan::LEVEL level = supportedLevel();
+    return level;
+}
+
+const char* Scan::findCRLF(const char* begin, const char* end)
+{
+    return kernels[currentLevel()].findCRLF(begin, end);
+}
+
+const char* Scan::findNonToken(const char* begin, const char* end)
+{
+    return kernels[currentLevel()].findNonToken(begin, end);
+}
+
+const char* Scan::findUnprintable(const char* begin, const char* end)
+{
+    return kernels[currentLevel()].findUnprintable(begin, end);
+}
+
+bool Scan::escape(const char* data, size_t len, size_t limit, string* out)
+{
+    const Kernels& kernel = kernels[currentLevel()];
+    size_t start = out->size();
+    const char* end = data + len;
+    for(const char* pos = data; pos < end; )
+    {
+        // the bytes of a binary body are often unprintable in a row
+        const char* bad = isUnprintable(*pos) ? pos : kernel.findUnprintable(pos, end);
+        // the printable run is copied up to the first byte over the limit
+        size_t room = limit - (out->size() - start);
+        size_t run = static_cast<size_t>(bad - pos);
+        if(run > room)
+        {
+            out->append(pos, room + 1);
+            return false;
+        }
+        out->append(pos, run);
+        if(bad == end)
+            break;
+        if(*bad == '\r')
+            out->append("\\r", 2);
+        else if(*bad == '\n')
+            out->append("\\n", 2);
+        else
+        {
+            static const char digits[] = "0123456789abcdef";
+            unsigned char ch = static_cast<unsigned char>(*bad);
+            char hex[4] = { '\\', 'x', digits[ch >> 4], digits[ch & 0x0f] };
+            out->append(hex, 4);
+        }
+        if(out->size() - start > limit)
+            return false;
+        pos = bad + 1;
+    }
+    return true;
+}
+
+Scan::LEVEL Scan::getLevel()
+{
+    return currentLevel();
+}
+
+void Scan::setLevel(LEVEL level)
+{
+    currentLevel() = min(level, supportedLevel());
+}
+
+const char* Scan::levelName(LEVEL level)
+{
+    static const char* const names[] = { "scalar", "sse2", "avx2" };
+    return names[level];
+}
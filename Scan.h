@@ -0,0 +1,50 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_SCAN_H
+#define WEBSERVER_SCAN_H
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+/**
+ * @brief The byte scanning kernels of the parsers and the log, 16 or 32 bytes per step
+ *
+ * Every kernel has a scalar, an SSE2 and an AVX2 version, the best one the CPU supports is picked at
+ * the first call. The vector loads never pass end, the bytes of the last partial block are scanned
+ * one by one. All the versions give the same results, ScanBench compares them.
+ */
+class Scan
+{
+public:
+    enum LEVEL
+    {
+        LEVEL_SCALAR,
+        LEVEL_SSE2,
+        LEVEL_AVX2
+    };
+
+    // the first "\r\n" in [begin, end), nullptr if none
+    static const char* findCRLF(const char* begin, const char* end);
+    // the first byte that is not a tchar of RFC 7230, like the ":" after a field name, end if none
+    static const char* findNonToken(const char* begin, const char* end);
+    // the first byte isprint() rejects in the C locale, end if none
+    static const char* findUnprintable(const char* begin, const char* end);
+
+    /**
+     * @brief Append data to out with "\r", "\n" and the other unprintable bytes escaped, in one pass
+     * @param limit stop once out grows by more than limit bytes
+     * @return false if stopped by the limit, the rest of data is not escaped
+     */
+    static bool escape(const char* data, size_t len, size_t limit, string* out);
+
+    static LEVEL getLevel();
+    // use a lower level than the CPU supports, for the benchmarks, a higher one is lowered
+    static void setLevel(LEVEL level);
+    static const char* levelName(LEVEL level);
+};
+
+#endif //WEBSERVER_SCAN_H
@@ -0,0 +1,87 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <unistd.h>
+
+#include "CgiCache.h"
+#include "Coroutine.h"
+#include "HeavyHitters.h"
+#include "HttpHandler.h"
+#include "InputBuffer.h"
+#include "PerfCounters.h"
+#include "RateLimit.h"
+#include "Stats.h"
+
+static void appendLine(string* out, const char* name, uint64_t value)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", name, value);
+    out->append(line, static_cast<size_t>(len));
+}
+
+string Stats::render()
+{
+    string out;
+    size_t conns = HttpHandler::getConnectionCount();
+    appendLine(&out, "pid", static_cast<uint64_t>(getpid()));
+    appendLine(&out, "connections", conns);
+    appendLine(&out, "connections_idle", HttpHandler::getIdleCount());
+    appendLine(&out, "connections_parked", HttpHandler::getParkedCount());
+    appendLine(&out, "requests_total", HttpHandler::getRequestTotal());
+
+    // The memory of the connections: the handlers and their input buffers, a parked one has no buffer
+    size_t handler_bytes = conns * sizeof(HttpHandler);
+    size_t buffer_bytes = InputBuffer::getAllocatedBytes();
+    appendLine(&out, "memory_handler_size", sizeof(HttpHandler));
+    appendLine(&out, "memory_handlers_bytes", handler_bytes);
+    appendLine(&out, "memory_buffers_bytes", buffer_bytes);
+    appendLine(&out, "memory_buffer_pool_bytes", InputBuffer::getPooledBytes());
+    appendLine(&out, "memory_bytes_per_connection", conns ? (handler_bytes + buffer_bytes) / conns : 0);
+    // the relays in progress, and the free frames kept for the next ones
+    appendLine(&out, "coroutine_frames", FramePool::getLiveFrames());
+    appendLine(&out, "memory_coroutine_pool_bytes", FramePool::getPooledBytes());
+    // a parked connection gave back its timerfd
+    appendLine(&out, "timer_fds", conns - min(conns, HttpHandler::getParkedCount()));
+
+    if(RateLimit::isEnabled())
+    {
+        appendLine(&out, "ratelimit_refused_connections", RateLimit::getRefusedConnections());
+        appendLine(&out, "ratelimit_limited_requests", RateLimit::getLimitedRequests());
+    }
+    if(CgiCache::isEnabled())
+    {
+        // a coalesced request waited for the leader instead of forking
+        appendLine(&out, "cgi_cache_hits", CgiCache::getHits());
+        appendLine(&out, "cgi_cache_misses", CgiCache::getMisses());
+        appendLine(&out, "cgi_cache_coalesced", CgiCache::getCoalesced());
+        appendLine(&out, "cgi_cache_entries", CgiCache::getEntries());
+        appendLine(&out, "cgi_cache_bytes", CgiCache::getBytes());
+    }
+    if(PerfCounters::isEnabled())
+        PerfCounters::render(&out);
+    if(HeavyHitters::isEnabled())
+        HeavyHitters::render(&out);
+    return out;
+}
+
+void Stats::serve(const Router::Request&, Router::Response* resp, void*)
+{
+    resp->addHeader("Cache-Control", "no-store");
+    resp->write(render());
+}
+
+void Stats::serveHealth(const Router::Request&, Router::Response* resp, void*)
+{
+    bool draining = HttpHandler::isDraining();
+    char body[256];
+    int len = snprintf(body, sizeof(body), "{\"status\":\"%s\",\"pid\":%d,\"connections\":%zu}\n",
+                       draining ? "draining" : "ok", static_cast<int>(getpid()), HttpHandler::getConnectionCount());
+    resp->setStatus(draining ? 503 : 200);
+    resp->setContentType("application/json");
+    resp->addHeader("Cache-Control", "no-store");
+    resp->write(body, static_cast<size_t>(len));
+}
@@ -0,0 +1,31 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_STATS_H
+#define WEBSERVER_STATS_H
+
+#include <string>
+
+#include "Router.h"
+
+using namespace std;
+
+/**
+ * @brief The counters of this process, answered as text to a GET of the stats path
+ *
+ * Every line is "<name> <value>", so the page can be read by a script or by eye. The counters are read
+ * without stopping the server, they are not a snapshot of one moment. The workers answer with their own.
+ */
+class Stats
+{
+public:
+    static string render();
+
+    // the native handlers of --stats-path and --health-path
+    static void serve(const Router::Request& req, Router::Response* resp, void* arg);
+    // 200 with {"status":"ok",...}, or 503 with "draining" after SIGTERM, for the load balancers
+    static void serveHealth(const Router::Request& req, Router::Response* resp, void* arg);
+};
+
+#endif //WEBSERVER_STATS_H
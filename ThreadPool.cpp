@@ -12,6 +12,8 @@
 ThreadPool::ThreadPool(size_t threadNum, ShutdownMode shutdown_mode, size_t maxQueueSize)
         : threadNum_(threadNum),
           maxQueueSize_(maxQueueSize),
+          next_seq_(0),
+          expired_count_(0),
           threadpool_cond_(threadpool_mutex_),
           shutdown_mode_(shutdown_mode)
 {
@@ -43,9 +45,9 @@ ThreadPool::~ThreadPool()
         // Adding the exit thread in the queue
         for(size_t i = 0; i < threadNum_; i++)
         {
+            // after all the other tasks in the graceful mode
             auto pthreadExit = [](void*) { pthread_exit(0); };
-            ThreadpoolTask task = { pthreadExit, nullptr };
-            task_queue_.push(task);
+            pushTask(pthreadExit, nullptr, NO_DEADLINE, nullptr);
         }
         // Waking up all threads and quiting the queue.
         threadpool_cond_.notifyAll();
@@ -57,7 +59,13 @@ ThreadPool::~ThreadPool()
     }
 }
 
-bool ThreadPool::appendTask(void (*function)(void*), void* arguments)
+void ThreadPool::pushTask(void (*function)(void*), void* arguments, int64_t deadline, void (*expired)(void*))
+{
+    ThreadpoolTask task = { function, arguments, deadline, expired, next_seq_++ };
+    task_queue_.push(task);
+}
+
+bool ThreadPool::appendTask(void (*function)(void*), void* arguments, int64_t deadline, void (*expired)(void*))
 {
     // When operating the task queue, we have to lock the thread
     MutexLockGuard guard(threadpool_mutex_);
@@ -66,8 +74,7 @@ bool ThreadPool::appendTask(void (*function)(void*), void* arguments)
         return false;
     else
     {
-        ThreadpoolTask task = { function, arguments };
-        task_queue_.push(task);
+        pushTask(function, arguments, deadline, expired);
         threadpool_cond_.notify();
         return true;
     }
@@ -97,10 +104,18 @@ void* ThreadPool::TaskForWorkerThreads_(void* arg)
                 pool->threadpool_cond_.wait();
 
             assert(pool->task_queue_.size() != 0);
-            task = pool->task_queue_.front();
+            task = pool->task_queue_.top();
             pool->task_queue_.pop();
         }
 
+        // No work for the task nobody waits for
+        if(task.deadline != NO_DEADLINE && task.deadline < monotonicMs())
+        {
+            pool->expired_count_.fetch_add(1, memory_order_relaxed);
+            if(task.expired)
+                (task.expired)(task.arguments);
+            continue;
+        }
         (task.function)(task.arguments);
     }
     UNREACHABLE();
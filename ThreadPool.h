@@ -5,17 +5,30 @@
 #ifndef WEBSERVER_THREADPOOL_H
 #define WEBSERVER_THREADPOOL_H
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <queue>
+#include <vector>
 
 #include "Condition.h"
 #include "MutexLock.h"
 
 using namespace std;
 
+/**
+ * @brief The worker threads, the tasks are run earliest-deadline-first
+ *
+ * A task may carry a deadline, the time its work is useless after, e.g. the client has given up the request.
+ * The task of the earliest deadline is run first, the tasks without one are run in FIFO after them. A task
+ * whose deadline has passed when it is taken is not run, its expired function is called to clean it up.
+ */
 class ThreadPool
 {
 public:
+    // the deadline of a task which never expires
+    static const int64_t NO_DEADLINE = INT64_MAX;
+
     /**
      * Two types of shutdown
      * 1. wait events done and shutdown
@@ -38,8 +51,14 @@ public:
 
     /***
      * @brief   Adds the current task to the thread pool
+     * @param   deadline    the monotonic time in ms by monotonicMs()
+     * @param   expired     called instead of the function if the deadline has passed, nullptr to drop silently
      */
-    bool appendTask(void (*function)(void*), void* arguments);
+    bool appendTask(void (*function)(void*), void* arguments,
+                    int64_t deadline = NO_DEADLINE, void (*expired)(void*) = nullptr);
+
+    // the tasks not run because of the deadline
+    size_t getExpiredCount() const { return expired_count_.load(memory_order_relaxed); }
 
 private:
     /**
@@ -54,11 +73,28 @@ private:
     {
         void (*function)(void*);
         void* arguments;
+        int64_t deadline;
+        void (*expired)(void*);
+        uint64_t seq;                           // FIFO between the same deadlines
+    };
+
+    // the top of the heap is the earliest deadline
+    struct LaterDeadline
+    {
+        bool operator()(const ThreadpoolTask& a, const ThreadpoolTask& b) const
+        {
+            return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+        }
     };
 
+    void pushTask(void (*function)(void*), void* arguments, int64_t deadline, void (*expired)(void*));
+
     size_t threadNum_;                          // The number of threads
     size_t maxQueueSize_;                       // The max size of queue. if the size exceeded, stop adding tasks
-    queue<ThreadpoolTask> task_queue_;          // Task queue
+    // Task queue, ordered by the deadline
+    priority_queue<ThreadpoolTask, vector<ThreadpoolTask>, LaterDeadline> task_queue_;
+    uint64_t next_seq_;
+    atomic<size_t> expired_count_;
     vector<pthread_t> threads_;                 // The flag of thread
 
     // Thread lock. Ensure that only one thread in the thread poll works at the same time
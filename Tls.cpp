@@ -0,0 +1,381 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "Log.h"
+#include "Tls.h"
+
+SSL_CTX* TlsContext::ctx_ = nullptr;
+vector<TlsContext::TicketKey> TlsContext::ticket_keys_;
+
+// the max plaintext of one record, the writes of userspace TLS are gathered up to it
+static const size_t TLS_RECORD_SIZE = 16384;
+// the lifetime of the tickets, the keys should be rotated slower than it
+static const long TICKET_LIFETIME = 2 * 3600;
+
+// "h2" is preferred if the client offers it, the connection preface is detected as h2c prior knowledge
+static const unsigned char ALPN_PROTOCOLS[] = "\x02h2\x08http/1.1";
+
+/**
+ * @brief Pop the OpenSSL error queue of this thread as a message
+ */
+static string takeSslError()
+{
+    char buf[256];
+    unsigned long code = ERR_get_error();
+    if(code == 0)
+        return "unknown error";
+    ERR_error_string_n(code, buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+bool TlsContext::init(const string& cert_file, const string& key_file, const vector<string>& ticket_key_files)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx)
+    {
+        ERROR("Create TLS context failed! (%s)", takeSslError().c_str());
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Only the AEAD ciphers of TLS 1.2, the kernel can take over their keys
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20:!aNULL");
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION |
+                             SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // The send buffers of the handler move and grow between the retries of a write
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+       || SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+       || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERROR("Load TLS certificate %s and key %s failed! (%s)",
+              cert_file.c_str(), key_file.c_str(), takeSslError().c_str());
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    // The sessions are resumed by the tickets only, no worker keeps a session cache
+    ticket_keys_.clear();
+    for(const string& path : ticket_key_files)
+    {
+        TicketKey key;
+        if(!loadTicketKey(path, &key))
+        {
+            SSL_CTX_free(ctx);
+            return false;
+        }
+        ticket_keys_.push_back(key);
+    }
+    if(ticket_keys_.empty())
+    {
+        TicketKey key;
+        key.key_len = 32;
+        if(RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1
+           || RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1)
+        {
+            ERROR("Generate TLS ticket key failed! (%s)", takeSslError().c_str());
+            SSL_CTX_free(ctx);
+            return false;
+        }
+        ticket_keys_.push_back(key);
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(ctx, TICKET_LIFETIME);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketKeyCallback);
+
+    SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, nullptr);
+
+    ctx_ = ctx;
+    INFO("TLS enabled, certificate: %s, %ld ticket keys%s", cert_file.c_str(), ticket_keys_.size(),
+         ticket_key_files.empty() ? " (random)" : "");
+    return true;
+}
+
+/**
+ * @brief Load a ticket key file in the format of nginx,
+ *        48 bytes: name 16 | HMAC key 16 | AES-128 key, 80 bytes: name 16 | HMAC key 32 | AES-256 key
+ */
+bool TlsContext::loadTicketKey(const string& path, TicketKey* key)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        ERROR("Open TLS ticket key %s failed! (%s)", path.c_str(), strerror(errno));
+        return false;
+    }
+    unsigned char buf[81];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if(len != 48 && len != 80)
+    {
+        ERROR("TLS ticket key %s must be 48 or 80 bytes", path.c_str());
+        return false;
+    }
+    key->key_len = (len == 48) ? 16 : 32;
+    memcpy(key->name, buf, sizeof(key->name));
+    memcpy(key->hmac_key, buf + 16, key->key_len);
+    memcpy(key->aes_key, buf + 16 + key->key_len, key->key_len);
+    return true;
+}
+
+/**
+ * @brief Encrypt the new tickets with the first key, decrypt the tickets with any known key
+ * @return 1 if done, 2 if the ticket is accepted but should be renewed, 0 if the ticket is unknown
+ */
+int TlsContext::ticketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                                  EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc)
+{
+    (void)ssl;
+    const TicketKey* key = nullptr;
+    size_t index = 0;
+    if(enc)
+    {
+        key = &ticket_keys_[0];
+        memcpy(key_name, key->name, sizeof(key->name));
+        if(RAND_bytes(iv, 16) != 1)
+            return -1;
+    }
+    else
+    {
+        for(index = 0; index < ticket_keys_.size(); index++)
+            if(memcmp(key_name, ticket_keys_[index].name, sizeof(ticket_keys_[index].name)) == 0)
+                break;
+        if(index == ticket_keys_.size())
+            return 0;
+        key = &ticket_keys_[index];
+    }
+
+    const EVP_CIPHER* cipher = (key->key_len == 16) ? EVP_aes_128_cbc() : EVP_aes_256_cbc();
+    OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                              const_cast<unsigned char*>(key->hmac_key), key->key_len),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+            OSSL_PARAM_construct_end()
+    };
+    if(EVP_MAC_CTX_set_params(mac_ctx, params) != 1)
+        return -1;
+    int ret = enc ? EVP_EncryptInit_ex(cipher_ctx, cipher, nullptr, key->aes_key, iv)
+                  : EVP_DecryptInit_ex(cipher_ctx, cipher, nullptr, key->aes_key, iv);
+    if(ret != 1)
+        return -1;
+    return (index == 0) ? 1 : 2;
+}
+
+int TlsContext::selectAlpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                           const unsigned char* in, unsigned int in_len, void* arg)
+{
+    (void)ssl;
+    (void)arg;
+    unsigned char* selected = nullptr;
+    if(SSL_select_next_proto(&selected, out_len, ALPN_PROTOCOLS, sizeof(ALPN_PROTOCOLS) - 1,
+                             in, in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+TlsConnection::TlsConnection(int fd)
+        : fd_(fd), ssl_(SSL_new(TlsContext::get())), established_(false), ktls_send_(false)
+{
+    if(ssl_ && SSL_set_fd(ssl_, fd) != 1)
+    {
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+    }
+    if(ssl_)
+        SSL_set_accept_state(ssl_);
+    else
+        ERROR("Create TLS connection failed! (%s)", takeSslError().c_str());
+}
+
+TlsConnection::~TlsConnection()
+{
+    // The socket is closed by the handler
+    if(ssl_)
+        SSL_free(ssl_);
+}
+
+TlsConnection::HANDSHAKE_RESULT TlsConnection::handshake()
+{
+    if(!ssl_)
+        return HANDSHAKE_ERROR;
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl_);
+    if(ret == 1)
+    {
+        established_ = true;
+        bool ktls_recv = false;
+#ifndef OPENSSL_NO_KTLS
+        ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+        ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#endif
+        const unsigned char* alpn = nullptr;
+        unsigned int alpn_len = 0;
+        SSL_get0_alpn_selected(ssl_, &alpn, &alpn_len);
+        INFO("TLS handshake done (socket: %d), %s %s%s, ALPN: %.*s, kTLS send: %s, recv: %s",
+             fd_, SSL_get_version(ssl_), SSL_get_cipher_name(ssl_), SSL_session_reused(ssl_) ? " resumed" : "",
+             static_cast<int>(alpn_len), alpn ? reinterpret_cast<const char*>(alpn) : "",
+             ktls_send_ ? "on" : "off", ktls_recv ? "on" : "off");
+        return HANDSHAKE_DONE;
+    }
+    int err = SSL_get_error(ssl_, ret);
+    if(err == SSL_ERROR_WANT_READ)
+        return HANDSHAKE_WANT_READ;
+    if(err == SSL_ERROR_WANT_WRITE)
+        return HANDSHAKE_WANT_WRITE;
+    if(err == SSL_ERROR_SYSCALL)
+        WARN("TLS handshake of socket(%d) failed! (%s)", fd_, errno ? strerror(errno) : "connection closed");
+    else
+        WARN("TLS handshake of socket(%d) failed! (%s)", fd_, takeSslError().c_str());
+    ERR_clear_error();
+    return HANDSHAKE_ERROR;
+}
+
+ssize_t TlsConnection::failed(int ret, bool reading)
+{
+    int err = SSL_get_error(ssl_, ret);
+    if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    // close_notify, or EOF without it
+    if(err == SSL_ERROR_ZERO_RETURN && reading)
+        return 0;
+    if(err == SSL_ERROR_SYSCALL && errno != 0)
+    {
+        ERR_clear_error();
+        return -1;
+    }
+    if(err == SSL_ERROR_SSL)
+        WARN("TLS %s of socket(%d) failed! (%s)", reading ? "read" : "write", fd_, takeSslError().c_str());
+    ERR_clear_error();
+    errno = (err == SSL_ERROR_ZERO_RETURN) ? EPIPE : EPROTO;
+    return -1;
+}
+
+/**
+ * @brief Read the records into the buffers until OpenSSL has no more data
+ */
+ssize_t TlsConnection::readv(const iovec* iov, int iovcnt)
+{
+    ssize_t total = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        char* pos = static_cast<char*>(iov[i].iov_base);
+        size_t left = iov[i].iov_len;
+        while(left > 0)
+        {
+            size_t len = 0;
+            ERR_clear_error();
+            int ret = SSL_read_ex(ssl_, pos, left, &len);
+            // The error comes again on the next read
+            if(ret != 1)
+                return (total > 0) ? total : failed(ret, true);
+            pos += len;
+            left -= len;
+            total += static_cast<ssize_t>(len);
+        }
+    }
+    return total;
+}
+
+ssize_t TlsConnection::write(const void* buf, size_t len)
+{
+    if(len == 0)
+        return 0;
+    size_t written = 0;
+    ERR_clear_error();
+    int ret = SSL_write_ex(ssl_, buf, len, &written);
+    if(ret != 1)
+        return failed(ret, false);
+    return static_cast<ssize_t>(written);
+}
+
+ssize_t TlsConnection::send(const void* buf, size_t len, int flags)
+{
+    if(ktls_send_)
+        return ::send(fd_, buf, len, flags);
+    return write(buf, len);
+}
+
+/**
+ * @brief Write like writev, the small buffers are gathered into one record in the userspace TLS
+ */
+ssize_t TlsConnection::writev(const iovec* iov, int iovcnt)
+{
+    if(ktls_send_)
+        return ::writev(fd_, iov, iovcnt);
+
+    while(iovcnt > 0 && iov->iov_len == 0)
+    {
+        ++iov;
+        --iovcnt;
+    }
+    if(iovcnt == 0)
+        return 0;
+    if(iovcnt == 1 || iov->iov_len >= TLS_RECORD_SIZE)
+        return write(iov->iov_base, iov->iov_len);
+
+    char buf[TLS_RECORD_SIZE];
+    size_t len = 0;
+    for(int i = 0; i < iovcnt && len < sizeof(buf); i++)
+    {
+        size_t part = min(iov[i].iov_len, sizeof(buf) - len);
+        memcpy(buf + len, iov[i].iov_base, part);
+        len += part;
+    }
+    return write(buf, len);
+}
+
+/**
+ * @brief Send a file, by the kernel if it encrypts the records, or read it and encrypt it in the userspace
+ * @return the sent bytes, 0 if the file ends, the offset is advanced by the sent bytes
+ */
+ssize_t TlsConnection::sendfile(int in_fd, off_t* offset, size_t len)
+{
+    if(ktls_send_)
+    {
+        ERR_clear_error();
+        ossl_ssize_t sent = SSL_sendfile(ssl_, in_fd, *offset, len, 0);
+        if(sent < 0)
+            return failed(static_cast<int>(sent), false);
+        *offset += sent;
+        return sent;
+    }
+
+    // The same bytes are read again if the write has to be retried
+    char buf[TLS_RECORD_SIZE];
+    ssize_t read_len = pread(in_fd, buf, min(len, sizeof(buf)), *offset);
+    if(read_len <= 0)
+        return read_len;
+    ssize_t sent = write(buf, static_cast<size_t>(read_len));
+    if(sent > 0)
+        *offset += sent;
+    return sent;
+}
+
+void TlsConnection::shutdown()
+{
+    if(!ssl_ || !established_)
+        return;
+    ERR_clear_error();
+    SSL_shutdown(ssl_);
+    ERR_clear_error();
+}
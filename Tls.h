@@ -0,0 +1,110 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_TLS_H
+#define WEBSERVER_TLS_H
+
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+using namespace std;
+
+/**
+ * @brief The TLS settings of the HTTPS listeners, shared by all the connections
+ *
+ * The context is created before the workers are forked, so the certificate and the session ticket
+ * keys are the same in all the workers, and a ticket issued by a worker is accepted by the others.
+ * The tickets are stateless, the server keeps no session cache. The ticket keys are random if no key
+ * file is given, then the tickets do not survive a restart or a hot upgrade.
+ *
+ * kTLS is asked for every connection, after the handshake OpenSSL gives the keys to the kernel if the
+ * "tls" ULP and the cipher are supported, and the files are sent by sendfile without copying.
+ */
+class TlsContext
+{
+public:
+    /**
+     * @brief Load the certificate chain and the private key
+     * @param ticket_key_files  the files of 48 or 80 random bytes ("openssl rand 80"), the first one
+     *                          encrypts the new tickets, the others only decrypt the tickets issued before
+     * @return false if a file can not be loaded
+     */
+    static bool init(const string& cert_file, const string& key_file, const vector<string>& ticket_key_files);
+    static bool isEnabled()     { return ctx_ != nullptr; }
+    static SSL_CTX* get()       { return ctx_; }
+
+private:
+    struct TicketKey
+    {
+        unsigned char name[16];
+        unsigned char hmac_key[32];
+        unsigned char aes_key[32];
+        size_t key_len;             // 16 for AES-128 and HMAC 16 bytes, 32 for AES-256
+    };
+
+    static SSL_CTX* ctx_;
+    static vector<TicketKey> ticket_keys_;
+
+    static bool loadTicketKey(const string& path, TicketKey* key);
+    static int ticketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                                 EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc);
+    static int selectAlpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                          const unsigned char* in, unsigned int in_len, void* arg);
+};
+
+/**
+ * @brief The TLS state of one connection, the I/O methods act like the syscalls on a nonblocking socket
+ *
+ * They return -1 and set errno to EAGAIN if the socket is not ready. The records are read by OpenSSL,
+ * the writes go to the socket directly when the kernel encrypts them.
+ */
+class TlsConnection
+{
+public:
+    enum HANDSHAKE_RESULT
+    {
+        HANDSHAKE_DONE,
+        HANDSHAKE_WANT_READ,
+        HANDSHAKE_WANT_WRITE,
+        HANDSHAKE_ERROR
+    };
+
+    explicit TlsConnection(int fd);
+    ~TlsConnection();
+
+    TlsConnection(const TlsConnection&) = delete;
+    TlsConnection& operator=(const TlsConnection&) = delete;
+
+    HANDSHAKE_RESULT handshake();
+    bool isEstablished() const  { return established_; }
+    // the records are sent by the kernel, so sendfile and splice work on the socket
+    bool isKernelSend() const   { return ktls_send_; }
+    // the decrypted data buffered by OpenSSL, the socket may not be readable for it
+    bool hasPending() const     { return ssl_ && SSL_pending(ssl_) > 0; }
+
+    ssize_t readv(const iovec* iov, int iovcnt);
+    ssize_t send(const void* buf, size_t len, int flags);
+    ssize_t writev(const iovec* iov, int iovcnt);
+    ssize_t sendfile(int in_fd, off_t* offset, size_t len);
+
+    // send close_notify if the socket can take it, never wait for the peer
+    void shutdown();
+
+private:
+    int fd_;
+    SSL* ssl_;
+    bool established_;
+    bool ktls_send_;
+
+    ssize_t write(const void* buf, size_t len);
+    // map the failed OpenSSL call to errno, like the syscall would fail
+    ssize_t failed(int ret, bool reading);
+};
+
+#endif //WEBSERVER_TLS_H
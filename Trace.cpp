@@ -0,0 +1,174 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "Trace.h"
+
+unsigned Trace::rate_ = 0;
+atomic<uint64_t> Trace::next_id_(1);
+thread_local uint64_t Trace::current_ = 0;
+thread_local unsigned Trace::countdown_ = 0;
+thread_local Trace::ThreadBuffer* Trace::buffer_ = nullptr;
+MutexLock Trace::buffers_lock_;
+vector<Trace::ThreadBuffer*> Trace::buffers_;
+
+uint64_t Trace::sample()
+{
+    if(rate_ == 0)
+        return 0;
+    // Every thread counts its own requests, the shared id is only taken by the sampled ones
+    if(countdown_ > 1)
+    {
+        --countdown_;
+        return 0;
+    }
+    countdown_ = rate_;
+    return next_id_.fetch_add(1, memory_order_relaxed);
+}
+
+int64_t Trace::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief The buffer of this thread, created on the first span, it lives as long as the process
+ */
+Trace::ThreadBuffer* Trace::getBuffer()
+{
+    if(buffer_)
+        return buffer_;
+    ThreadBuffer* buffer = new ThreadBuffer;
+    buffer->tid = static_cast<pid_t>(syscall(SYS_gettid));
+    buffer->name = "worker";
+    buffer->events.resize(BUFFER_EVENTS);
+    buffer->next = 0;
+    buffer->size = 0;
+    {
+        MutexLockGuard guard(buffers_lock_);
+        buffers_.push_back(buffer);
+    }
+    buffer_ = buffer;
+    return buffer;
+}
+
+void Trace::setThreadName(const char* name)
+{
+    ThreadBuffer* buffer = getBuffer();
+    MutexLockGuard guard(buffer->lock);
+    buffer->name = name;
+}
+
+void Trace::record(uint64_t id, const char* name, int64_t begin, int64_t end, const char* detail)
+{
+    ThreadBuffer* buffer = getBuffer();
+    MutexLockGuard guard(buffer->lock);
+    Event& event = buffer->events[buffer->next];
+    event.name = name;
+    event.id = id;
+    event.begin = begin;
+    event.dur = end - begin;
+    event.detail[0] = '\0';
+    if(detail)
+    {
+        strncpy(event.detail, detail, DETAIL_LEN - 1);
+        event.detail[DETAIL_LEN - 1] = '\0';
+    }
+    buffer->next = (buffer->next + 1) % BUFFER_EVENTS;
+    if(buffer->size < BUFFER_EVENTS)
+        ++buffer->size;
+}
+
+/**
+ * @brief Write the string as a JSON string without the quotes
+ */
+static void writeJsonString(FILE* file, const char* str)
+{
+    for(const char* pos = str; *pos; pos++)
+    {
+        unsigned char ch = static_cast<unsigned char>(*pos);
+        if(ch == '"' || ch == '\\')
+            fprintf(file, "\\%c", ch);
+        else if(ch < 0x20)
+            fprintf(file, "\\u%04x", ch);
+        else
+            fputc(ch, file);
+    }
+}
+
+bool Trace::dump(const string& dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/trace-%d-%ld.json", dir.c_str(), getpid(), static_cast<long>(time(nullptr)));
+    FILE* file = fopen(path, "we");
+    if(!file)
+    {
+        ERROR("Open trace file %s failed! (%s)", path, strerror(errno));
+        return false;
+    }
+
+    vector<ThreadBuffer*> buffers;
+    {
+        MutexLockGuard guard(buffers_lock_);
+        buffers = buffers_;
+    }
+    pid_t pid = getpid();
+    size_t event_num = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"WebServer %d\"}}", pid, pid);
+    for(ThreadBuffer* buffer : buffers)
+    {
+        // Copy the spans out, so the thread is not blocked by the file writes
+        vector<Event> events;
+        const char* name;
+        pid_t tid;
+        {
+            MutexLockGuard guard(buffer->lock);
+            size_t first = (buffer->next + BUFFER_EVENTS - buffer->size) % BUFFER_EVENTS;
+            for(size_t i = 0; i < buffer->size; i++)
+                events.push_back(buffer->events[(first + i) % BUFFER_EVENTS]);
+            buffer->size = 0;
+            name = buffer->name;
+            tid = buffer->tid;
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                pid, tid, name, tid);
+        for(const Event& event : events)
+        {
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld,\"dur\":%ld,"
+                          "\"args\":{\"request\":%lu",
+                    event.name, pid, tid, static_cast<long>(event.begin), static_cast<long>(event.dur),
+                    static_cast<unsigned long>(event.id));
+            if(event.detail[0])
+            {
+                fprintf(file, ",\"detail\":\"");
+                writeJsonString(file, event.detail);
+                fputc('"', file);
+            }
+            fprintf(file, "}}");
+        }
+        event_num += events.size();
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = !ferror(file);
+    ok = (fclose(file) == 0) && ok;
+    if(!ok)
+    {
+        ERROR("Write trace file %s failed! (%s)", path, strerror(errno));
+        return false;
+    }
+    INFO("Trace of %ld spans dumped to %s", event_num, path);
+    return true;
+}
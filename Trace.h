@@ -0,0 +1,123 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_TRACE_H
+#define WEBSERVER_TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The sampled request tracing, dumped as the Chrome trace event JSON (chrome://tracing, Perfetto)
+ *
+ * One of every N requests is sampled when it starts. The thread running a sampled request sets it as the
+ * current trace of the thread, so the spans deep in the handler do not need the request. The spans are kept
+ * in a ring buffer of every thread, the old spans are overwritten. A request which is not sampled costs one
+ * thread local check per span.
+ *
+ * The buffers are written to <dir>/trace-<pid>-<time>.json and cleared on SIGUSR1.
+ */
+class Trace
+{
+public:
+    // the spans kept by every thread
+    static const size_t BUFFER_EVENTS = 8192;
+    static const size_t DETAIL_LEN = 48;
+
+    // sample one of rate requests, 0 disables the tracing
+    static void setSampleRate(unsigned rate)    { rate_ = rate; }
+    static bool isEnabled()                     { return rate_ != 0; }
+
+    /**
+     * @brief Decide whether a new request is traced
+     * @return the id of the trace, 0 if the request is not sampled
+     */
+    static uint64_t sample();
+
+    // the monotonic clock in microseconds
+    static int64_t now();
+
+    // the trace of the request run by this thread, 0 if none
+    static uint64_t current()           { return current_; }
+    static void setCurrent(uint64_t id) { current_ = id; }
+    // the name of this thread in the dump, "worker" by default
+    static void setThreadName(const char* name);
+
+    /**
+     * @brief Record a finished span of the trace into the buffer of this thread
+     * @param name   a string literal
+     * @param detail copied, truncated to DETAIL_LEN
+     */
+    static void record(uint64_t id, const char* name, int64_t begin, int64_t end, const char* detail = nullptr);
+
+    /**
+     * @brief Write the spans of all the threads of this process and clear them
+     * @return false if the file can not be written
+     */
+    static bool dump(const string& dir);
+
+private:
+    struct Event
+    {
+        const char* name;
+        uint64_t id;
+        int64_t begin;
+        int64_t dur;
+        char detail[DETAIL_LEN];
+    };
+
+    struct ThreadBuffer
+    {
+        MutexLock lock;             // only taken against dump()
+        pid_t tid;
+        const char* name;
+        vector<Event> events;
+        size_t next;
+        size_t size;
+    };
+
+    static unsigned rate_;
+    static atomic<uint64_t> next_id_;
+    static thread_local uint64_t current_;
+    static thread_local unsigned countdown_;
+    static thread_local ThreadBuffer* buffer_;
+
+    static MutexLock buffers_lock_;
+    static vector<ThreadBuffer*> buffers_;
+
+    static ThreadBuffer* getBuffer();
+};
+
+/**
+ * @brief Record the lifetime of the object as a span of the current trace of the thread
+ */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char* name)
+            : name_(name), id_(Trace::current()), begin_(id_ ? Trace::now() : 0) {}
+    ~TraceSpan()
+    {
+        if(id_)
+            Trace::record(id_, name_, begin_, Trace::now());
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name_;
+    uint64_t id_;
+    int64_t begin_;
+};
+
+#endif //WEBSERVER_TRACE_H
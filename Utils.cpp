@@ -1,16 +1,22 @@
 #include <arpa/inet.h>
 #include <cctype>
+#include <cerrno>
+#include <cstddef>
 #include <cstring>
+#include <ctime>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "Log.h"
 #include "MutexLock.h"
+#include "Scan.h"
 #include "Utils.h"
 
 /**
@@ -22,7 +28,7 @@
 
 
 // socket create
-int socket_bind_and_listen(int port)
+int socket_bind_and_listen(int port, bool reuse_port)
 {
     int listen_fd = 0;
     // AF_INET      : IPv4 Internet protocols  
@@ -40,6 +46,9 @@ int socket_bind_and_listen(int port)
     int opt = 1;
     if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
         return -1;
+    // Several sockets bind the same port, the kernel balances the connections among them
+    if(reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+        return -1;
     if(bind(listen_fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1)
         return -1;
     if(listen(listen_fd, 1024) == -1)
@@ -48,6 +57,76 @@ int socket_bind_and_listen(int port)
     return listen_fd;
 }
 
+/**
+ * @return the length of the address, 0 if the path does not fit
+ */
+static socklen_t fillUnixAddress(const string& path, sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(path.empty() || path.size() >= sizeof(addr->sun_path))
+        return 0;
+    memcpy(addr->sun_path, path.data(), path.size());
+    // The abstract names start with a null byte and are not terminated
+    if(path[0] == '@')
+    {
+        addr->sun_path[0] = '\0';
+        return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+    }
+    return sizeof(*addr);
+}
+
+int unix_bind_and_listen(const string& path)
+{
+    sockaddr_un addr;
+    socklen_t addr_len = fillUnixAddress(path, &addr);
+    if(addr_len == 0)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1)
+        return -1;
+    if(path[0] != '@')
+    {
+        // Only a file nobody accepts on is removed
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(probe != -1 && connect(probe, (sockaddr*)&addr, addr_len) == 0)
+        {
+            close(probe);
+            close(listen_fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if(probe != -1)
+            close(probe);
+        if(errno == ECONNREFUSED)
+            unlink(path.c_str());
+    }
+    if(bind(listen_fd, (sockaddr*)&addr, addr_len) == -1 || listen(listen_fd, 1024) == -1)
+    {
+        int err = errno;
+        close(listen_fd);
+        errno = err;
+        return -1;
+    }
+    return listen_fd;
+}
+
+string getSocketUnixPath(int fd)
+{
+    sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getsockname(fd, (sockaddr*)&addr, &addr_len) == -1 || addr.sun_family != AF_UNIX
+       || addr_len <= offsetof(sockaddr_un, sun_path))
+        return "";
+    size_t len = addr_len - offsetof(sockaddr_un, sun_path);
+    if(addr.sun_path[0] == '\0')
+        return "@" + string(addr.sun_path + 1, len - 1);
+    return string(addr.sun_path, strnlen(addr.sun_path, len));
+}
+
 // set the flag in fd
 bool setFdNoBlock(int fd)
 {
@@ -64,6 +143,17 @@ bool setSocketNoDelay(int fd)
 {
     int enable = 1;
     if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&enable, sizeof(enable)) == -1)
+        return errno == EOPNOTSUPP;
+    return true;
+}
+
+bool setSocketBusyPoll(int fd, int usecs)
+{
+    int prefer = 1;
+    // Above net.core.busy_read it needs CAP_NET_ADMIN
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+        return false;
+    if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1)
         return false;
     return true;
 }
@@ -141,6 +231,66 @@ ssize_t writen(int fd, const void* buf, size_t len, bool isWrite)
     return writtenNum;
 }
 
+/**
+ * @brief write all the iovec to the socket, the iovec array will be modified
+ * @param fd
+ * @param iov
+ * @param iovcnt
+ * @return the total written bytes, -1 if error
+ */
+ssize_t writevn(int fd, iovec* iov, int iovcnt)
+{
+    auto writeFdv = [](void* sink, const iovec* iov, int iovcnt)
+    {
+        return writev(static_cast<int>(reinterpret_cast<intptr_t>(sink)), iov, iovcnt);
+    };
+    return writevn(writeFdv, reinterpret_cast<void*>(static_cast<intptr_t>(fd)), iov, iovcnt);
+}
+
+/**
+ * @brief write all the iovec to the sink by func, like writevn() to a fd
+ */
+ssize_t writevn(WritevFunc func, void* sink, iovec* iov, int iovcnt)
+{
+    ssize_t writtenNum = 0;
+    while(iovcnt > 0)
+    {
+        ssize_t tmpWrite = func(sink, iov, iovcnt);
+        if(tmpWrite < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                tmpWrite = 0;
+            else
+                return -1;
+        }
+        if(tmpWrite == 0)
+            break;
+        writtenNum += tmpWrite;
+
+        // skip the written iovec
+        size_t left = static_cast<size_t>(tmpWrite);
+        while(iovcnt > 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return writtenNum;
+}
+
+int64_t monotonicMs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 void handleSigpipe()
 {
     struct sigaction sa;
@@ -153,50 +303,36 @@ void handleSigpipe()
 
 void printConnectionStatus(int client_fd_, string prefix)
 {
-    sockaddr_in serverAddr, peerAddr;
+    sockaddr_storage serverAddr, peerAddr;
     socklen_t serverAddrLen = sizeof(serverAddr);
     socklen_t peerAddrLen = sizeof(peerAddr);
 
-    if((getsockname(client_fd_, (struct sockaddr *)&serverAddr, &serverAddrLen) != -1)
-       && (getpeername(client_fd_, (struct sockaddr *)&peerAddr, &peerAddrLen) != -1))
+    if((getsockname(client_fd_, (struct sockaddr *)&serverAddr, &serverAddrLen) == -1)
+       || (getpeername(client_fd_, (struct sockaddr *)&peerAddr, &peerAddrLen) == -1))
+        ERROR("printConnectionStatus failed ! (%s)", strerror(errno));
+    else if(serverAddr.ss_family == AF_UNIX)
+        INFO("%s: (socket %d) [Server] unix:%s", prefix.c_str(), client_fd_, getSocketUnixPath(client_fd_).c_str());
+    else
+    {
+        sockaddr_in* server4 = reinterpret_cast<sockaddr_in*>(&serverAddr);
+        sockaddr_in* peer4 = reinterpret_cast<sockaddr_in*>(&peerAddr);
         INFO("%s: (socket %d) [Server] %s:%d <---> [Client] %s:%d",
              prefix.c_str(), client_fd_,
-             inet_ntoa(serverAddr.sin_addr), ntohs(serverAddr.sin_port),
-             inet_ntoa(peerAddr.sin_addr), ntohs(peerAddr.sin_port));
-    else
-        ERROR("printConnectionStatus failed ! (%s)", strerror(errno));
+             inet_ntoa(server4->sin_addr), ntohs(server4->sin_port),
+             inet_ntoa(peer4->sin_addr), ntohs(peer4->sin_port));
+    }
 }
 
-string escapeStr(const string& str, size_t MAXBUF)
+string escapeStr(const char* data, size_t len, size_t MAXBUF)
 {
-    string msg = str;
-    // Traverse the string
-    for(size_t i = 0; i < msg.length(); i++)
+    string msg;
+    // Stop escaping once the output is cut, the rest is not printed
+    if(!Scan::escape(data, len, MAXBUF, &msg))
     {
-        char ch = msg[i];
-        // the char can't print
-        if(!isprint(ch))
-        {
-            // Only process '\r', '\n'
-            string substr;
-            if(ch == '\r')
-                substr = "\\r";
-            else if(ch == '\n')
-                substr = "\\n";
-            else
-            {
-                char hex[10];
-                snprintf(hex, 10, "\\x%02x", static_cast<unsigned char>(ch));
-                substr = hex;
-            }
-            msg.replace(i, 1, substr);
-        }
+        msg.resize(MAXBUF);
+        msg += " ... ... ";
     }
-    // output the read data
-    if(msg.length() > MAXBUF)
-        return msg.substr(0, MAXBUF) + " ... ... ";
-    else
-        return msg;
+    return msg;
 }
 
 bool isNumericStr(string str)
@@ -207,6 +343,63 @@ bool isNumericStr(string str)
     return true;
 }
 
+bool hasHeaderToken(const string& value, const char* token)
+{
+    size_t token_len = strlen(token);
+    size_t pos = 0;
+    while(pos < value.size())
+    {
+        size_t end = value.find(',', pos);
+        if(end == string::npos)
+            end = value.size();
+        size_t begin = value.find_first_not_of(' ', pos);
+        size_t last = value.find_last_not_of(' ', end - 1);
+        if(begin < end && last != string::npos && last + 1 - begin == token_len
+           && strncasecmp(value.c_str() + begin, token, token_len) == 0)
+            return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief convert the unsigned number to decimal string, two digits once
+ * @param value
+ * @param buf at least UINT_STR_MAX_LEN bytes, no '\0' appended
+ * @return the length of the string
+ */
+size_t fastUintToStr(uint64_t value, char* buf)
+{
+    static const char digits[] =
+            "0001020304050607080910111213141516171819"
+            "2021222324252627282930313233343536373839"
+            "4041424344454647484950515253545556575859"
+            "6061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+
+    char tmp[UINT_STR_MAX_LEN];
+    char* pos = tmp + UINT_STR_MAX_LEN;
+    while(value >= 100)
+    {
+        size_t index = (value % 100) * 2;
+        value /= 100;
+        *--pos = digits[index + 1];
+        *--pos = digits[index];
+    }
+    if(value >= 10)
+    {
+        size_t index = value * 2;
+        *--pos = digits[index + 1];
+        *--pos = digits[index];
+    }
+    else
+        *--pos = static_cast<char>('0' + value);
+
+    size_t len = static_cast<size_t>(tmp + UINT_STR_MAX_LEN - pos);
+    memcpy(buf, pos, len);
+    return len;
+}
+
 size_t closeRemainingConnect(int listen_fd, int* idle_fd) {
     close(*idle_fd);
 
@@ -6,8 +6,10 @@
 #define WEBSERVER_UTILS_H
 
 #include <iostream>
+#include <cstdint>
 #include <cstring>
 #include <csignal>
+#include <sys/uio.h>
 
 using std::cout;
 using std::cerr;
@@ -15,18 +17,45 @@ using std::endl;
 using std::string;
 using std::ostream;
 
-int socket_bind_and_listen(int port);
+int socket_bind_and_listen(int port, bool reuse_port = false);
+/**
+ * @brief Listen on a Unix socket, "@<name>" is in the abstract namespace. A file left by a dead server
+ *        is replaced, a path a running server listens on is refused with EADDRINUSE
+ * @return the nonblocking listening fd, -1 with errno if failed
+ */
+int unix_bind_and_listen(const string& path);
+// the path of a Unix socket like unix_bind_and_listen() takes it, empty if fd is not a Unix socket
+string getSocketUnixPath(int fd);
 bool setFdNoBlock(int fd);
+// a Unix socket has no Nagle, it succeeds without doing anything
+bool setSocketNoDelay(int fd);
+// SO_BUSY_POLL and SO_PREFER_BUSY_POLL, the accepted sockets inherit them from the listening socket
+bool setSocketBusyPoll(int fd, int usecs);
 
 ssize_t readn(int fd, void* buf, size_t len);
 ssize_t writen(int fd, const void* buf, size_t len, bool isWrite = false);
+ssize_t writevn(int fd, iovec* iov, int iovcnt);
+// writev of the sinks other than a plain fd, -1 with errno if failed
+typedef ssize_t (*WritevFunc)(void* sink, const iovec* iov, int iovcnt);
+ssize_t writevn(WritevFunc func, void* sink, iovec* iov, int iovcnt);
+
+// CLOCK_MONOTONIC in milliseconds
+int64_t monotonicMs();
 
 void handleSigpipe();
 void printConnectionStatus(int client_fd_, string prefix);
 
-string escapeStr(const string& str, size_t MAXBUF);
+// "\r", "\n" and the other unprintable bytes escaped, cut to MAXBUF with " ... ... "
+string escapeStr(const char* data, size_t len, size_t MAXBUF);
+inline string escapeStr(const string& str, size_t MAXBUF)   { return escapeStr(str.data(), str.size(), MAXBUF); }
 
 bool isNumericStr(string str);
+// the comma separated header value has the token, like "upgrade" in "keep-alive, Upgrade", ignoring the case
+bool hasHeaderToken(const string& value, const char* token);
+
+// the max length of a uint64_t in decimal
+const size_t UINT_STR_MAX_LEN = 20;
+size_t fastUintToStr(uint64_t value, char* buf);
 
 size_t closeRemainingConnect(int listen_fd, int* idle_fd);
 bool is_path_parent(const string& parent_path, const string& child_path);
@@ -0,0 +1,697 @@
+/**
+ * The frames, the channels and the broadcast of the WebSocket connections (RFC 6455)
+ */
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <openssl/evp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "HttpResponse.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Utils.h"
+#include "WebSocketSession.h"
+
+static const char HANDSHAKE_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const size_t MAX_HEADER_LEN = 14;
+
+vector<string> WebSocketSession::routes_;
+size_t WebSocketSession::maxMessageSize = 1024 * 1024;
+MutexLock WebSocketSession::channels_lock_;
+unordered_map<string, WebSocketSession::Channel*> WebSocketSession::channels_;
+atomic<bool> WebSocketSession::going_away_(false);
+
+/**
+ * @brief XOR the payload with the masking key, pos is the offset of data in the payload
+ */
+static void unmask(char* data, size_t len, const uint8_t mask[4], size_t pos)
+{
+    uint8_t key[8];
+    for(size_t i = 0; i < 8; i++)
+        key[i] = mask[(pos + i) % 4];
+    uint64_t key64;
+    memcpy(&key64, key, 8);
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= key64;
+        memcpy(data + i, &word, 8);
+    }
+    for(; i < len; i++)
+        data[i] ^= static_cast<char>(key[i % 8]);
+}
+
+/**
+ * @brief Check the UTF-8 of a text message, the overlong forms and the surrogates are invalid
+ */
+static bool isValidUtf8(const char* data, size_t len)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    while(p < end)
+    {
+        // the ASCII runs are checked 8 bytes at once
+        if(end - p >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            if((word & 0x8080808080808080ULL) == 0)
+            {
+                p += 8;
+                continue;
+            }
+        }
+        unsigned char ch = *p;
+        if(ch < 0x80)
+        {
+            ++p;
+            continue;
+        }
+        size_t need;
+        unsigned char min2 = 0x80, max2 = 0xbf;
+        if(ch >= 0xc2 && ch <= 0xdf)
+            need = 1;
+        else if(ch >= 0xe0 && ch <= 0xef)
+        {
+            need = 2;
+            if(ch == 0xe0)
+                min2 = 0xa0;
+            else if(ch == 0xed)
+                max2 = 0x9f;
+        }
+        else if(ch >= 0xf0 && ch <= 0xf4)
+        {
+            need = 3;
+            if(ch == 0xf0)
+                min2 = 0x90;
+            else if(ch == 0xf4)
+                max2 = 0x8f;
+        }
+        else
+            return false;
+        if(static_cast<size_t>(end - p) <= need || p[1] < min2 || p[1] > max2)
+            return false;
+        for(size_t i = 2; i <= need; i++)
+            if((p[i] & 0xc0) != 0x80)
+                return false;
+        p += need + 1;
+    }
+    return true;
+}
+
+WebSocketSession::Frame* WebSocketSession::Frame::alloc(size_t len)
+{
+    void* mem = malloc(sizeof(Frame) + len);
+    if(!mem)
+        return nullptr;
+    return new (mem) Frame(len);
+}
+
+WebSocketSession::Frame* WebSocketSession::Frame::create(uint8_t opcode, const char* payload, size_t len)
+{
+    // the frames of the server are not masked
+    char header[MAX_HEADER_LEN];
+    size_t header_len = 2;
+    header[0] = static_cast<char>(0x80 | opcode);
+    if(len < 126)
+        header[1] = static_cast<char>(len);
+    else if(len <= 0xffff)
+    {
+        header[1] = 126;
+        header[2] = static_cast<char>(len >> 8);
+        header[3] = static_cast<char>(len);
+        header_len = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for(int i = 0; i < 8; i++)
+            header[2 + i] = static_cast<char>(static_cast<uint64_t>(len) >> (56 - 8 * i));
+        header_len = 10;
+    }
+    Frame* frame = alloc(header_len + len);
+    if(!frame)
+        return nullptr;
+    memcpy(frame->buffer(), header, header_len);
+    if(len > 0)
+        memcpy(frame->buffer() + header_len, payload, len);
+    return frame;
+}
+
+WebSocketSession::Frame* WebSocketSession::Frame::createRaw(const char* data, size_t len)
+{
+    Frame* frame = alloc(len);
+    if(frame)
+        memcpy(frame->buffer(), data, len);
+    return frame;
+}
+
+void WebSocketSession::Frame::unref()
+{
+    if(refs_.fetch_sub(1, memory_order_acq_rel) == 1)
+    {
+        this->~Frame();
+        free(this);
+    }
+}
+
+bool WebSocketSession::addRoute(const string& prefix)
+{
+    if(prefix.empty() || prefix[0] != '/')
+    {
+        ERROR("Invalid WebSocket route: %s (a path like /ws)", prefix.c_str());
+        return false;
+    }
+    // "/ws/" matches the same paths as "/ws"
+    string path = prefix;
+    while(path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    routes_.push_back(path);
+    return true;
+}
+
+bool WebSocketSession::match(const char* uri)
+{
+    for(const string& prefix : routes_)
+    {
+        if(strncmp(uri, prefix.c_str(), prefix.size()) != 0)
+            continue;
+        // the prefix ends at a path segment
+        char next = uri[prefix.size()];
+        if(prefix.size() == 1 || next == '\0' || next == '/' || next == '?')
+            return true;
+    }
+    return false;
+}
+
+int WebSocketSession::checkUpgrade(const map<string, string>& headers, string* accept)
+{
+    auto upgradeIter = headers.find("upgrade");
+    if(upgradeIter == headers.end() || !hasHeaderToken(upgradeIter->second, "websocket"))
+        return 0;
+    auto connectionIter = headers.find("connection");
+    auto versionIter = headers.find("sec-websocket-version");
+    auto keyIter = headers.find("sec-websocket-key");
+    if(connectionIter == headers.end() || !hasHeaderToken(connectionIter->second, "upgrade")
+       || versionIter == headers.end() || versionIter->second != "13" || keyIter == headers.end())
+        return -1;
+    // the key is 16 bytes in base64
+    const string& key = keyIter->second;
+    if(key.size() != 24 || key.compare(22, 2, "==") != 0)
+        return -1;
+
+    string input = key + HANDSHAKE_GUID;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    if(!EVP_Digest(input.data(), input.size(), digest, &digest_len, EVP_sha1(), nullptr))
+        return -1;
+    unsigned char encoded[64];
+    int encoded_len = EVP_EncodeBlock(encoded, digest, static_cast<int>(digest_len));
+    accept->assign(reinterpret_cast<char*>(encoded), static_cast<size_t>(encoded_len));
+    return 1;
+}
+
+size_t WebSocketSession::publish(const string& channel, OPCODE opcode, const char* data, size_t len)
+{
+    // Serialized once, out of the locks
+    Frame* frame = Frame::create(opcode, data, len);
+    if(!frame)
+    {
+        ERROR("WebSocket publish of %ld bytes failed, out of memory", len);
+        return 0;
+    }
+    size_t delivered = 0;
+    channels_lock_.lock();
+    auto iter = channels_.find(channel);
+    if(iter == channels_.end())
+        channels_lock_.unlock();
+    else
+    {
+        // The channel is only freed by the last subscriber, which takes both locks
+        Channel* ch = iter->second;
+        ch->lock.lock();
+        channels_lock_.unlock();
+        for(WebSocketSession* session : ch->subscribers)
+            if(session->deliver(frame))
+                ++delivered;
+        ch->lock.unlock();
+    }
+    frame->unref();
+    return delivered;
+}
+
+void WebSocketSession::closeAll()
+{
+    going_away_.store(true);
+    MutexLockGuard guard(channels_lock_);
+    for(auto& kv : channels_)
+    {
+        MutexLockGuard channel_guard(kv.second->lock);
+        for(WebSocketSession* session : kv.second->subscribers)
+            session->deliver(nullptr);
+    }
+}
+
+WebSocketSession::WebSocketSession(HttpHandler* conn, const string& channel, const string& accept)
+        : conn_(conn), channel_(channel), index_(0), wake_armed_(true), queued_bytes_(0), overflow_(false),
+          out_off_(0), in_frame_(false), frame_opcode_(0), frame_fin_(false), frame_left_(0), mask_(),
+          mask_pos_(0), message_opcode_(OP_CONTINUATION), close_sent_(false), ping_sent_(false),
+          last_active_(monotonicMs())
+{
+    size_t len = 0;
+    const char* line = ResponseBuilder::getStatusLine(101, &len);
+    string head(line, len);
+    head += "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+    head += accept;
+    head += "\r\n\r\n";
+    Frame* frame = Frame::createRaw(head.data(), head.size());
+    if(frame)
+        sendFrame(frame);
+    subscribe();
+    INFO("WebSocket session started on %s (socket: %d)", channel_.c_str(), conn_->client_fd_);
+}
+
+WebSocketSession::~WebSocketSession()
+{
+    unsubscribe();
+    for(Frame* frame : out_)
+        frame->unref();
+    for(Frame* frame : inbox_)
+        frame->unref();
+}
+
+void WebSocketSession::subscribe()
+{
+    MutexLockGuard guard(channels_lock_);
+    Channel*& ch = channels_[channel_];
+    if(!ch)
+        ch = new Channel;
+    MutexLockGuard channel_guard(ch->lock);
+    index_ = ch->subscribers.size();
+    ch->subscribers.push_back(this);
+}
+
+void WebSocketSession::unsubscribe()
+{
+    MutexLockGuard guard(channels_lock_);
+    auto iter = channels_.find(channel_);
+    assert(iter != channels_.end());
+    Channel* ch = iter->second;
+    bool empty;
+    {
+        MutexLockGuard channel_guard(ch->lock);
+        // The last subscriber takes the place of this one
+        vector<WebSocketSession*>& subscribers = ch->subscribers;
+        assert(index_ < subscribers.size() && subscribers[index_] == this);
+        subscribers[index_] = subscribers.back();
+        subscribers[index_]->index_ = index_;
+        subscribers.pop_back();
+        empty = subscribers.empty();
+    }
+    if(empty)
+    {
+        channels_.erase(iter);
+        delete ch;
+    }
+}
+
+/**
+ * @brief Queue a frame of a publisher and wake the session, nullptr only wakes it
+ * @return false if the subscriber is too slow and the frame is dropped
+ */
+bool WebSocketSession::deliver(Frame* frame)
+{
+    MutexLockGuard guard(inbox_lock_);
+    if(frame)
+    {
+        if(overflow_.load(memory_order_relaxed))
+            return false;
+        if(queued_bytes_.load(memory_order_relaxed) + frame->size() > MAX_QUEUE_BYTES)
+        {
+            // The socket of a stuck client never gets writable, the hangup wakes the session
+            overflow_.store(true, memory_order_relaxed);
+            shutdown(conn_->client_fd_, SHUT_RDWR);
+            return false;
+        }
+        else
+        {
+            frame->ref();
+            inbox_.push_back(frame);
+            queued_bytes_.fetch_add(frame->size(), memory_order_relaxed);
+        }
+    }
+    // A running session looks at the inbox before it waits again
+    if(!wake_armed_)
+    {
+        wake_armed_ = true;
+        conn_->epoll_->modify(conn_->client_fd_, conn_->getClientEpollEvent(), conn_->getClientTriggerCond() | EPOLLOUT);
+    }
+    return frame != nullptr;
+}
+
+bool WebSocketSession::RunEventLoop(unsigned events)
+{
+    TraceSpan span("websocket session");
+    {
+        MutexLockGuard guard(inbox_lock_);
+        wake_armed_ = true;
+    }
+    if(overflow_.load(memory_order_relaxed))
+    {
+        WARN("WebSocket socket(%d) can not follow %s, %ld bytes queued, closed.",
+             conn_->client_fd_, channel_.c_str(), queued_bytes_.load(memory_order_relaxed));
+        return false;
+    }
+    if(events & HttpHandler::EVENT_CLIENT_CLOSED)
+    {
+        INFO("Socket(%d) was closed by peer.", conn_->client_fd_);
+        return false;
+    }
+    if(events & HttpHandler::EVENT_TIMEOUT)
+    {
+        int64_t idle = monotonicMs() - last_active_;
+        if(close_sent_ || idle >= PING_INTERVAL_MS + conn_->timeoutPerRequest * 1000)
+        {
+            INFO("WebSocket socket(%d) timeout.", conn_->client_fd_);
+            return false;
+        }
+        if(idle >= PING_INTERVAL_MS && !ping_sent_)
+        {
+            Frame* ping = Frame::create(OP_PING, nullptr, 0);
+            if(ping)
+                sendFrame(ping);
+            ping_sent_ = true;
+        }
+    }
+    if(going_away_.load(memory_order_relaxed) && !close_sent_)
+        sendClose(CLOSE_GOING_AWAY);
+
+    if(!close_sent_ && !readFrames())
+        return false;
+    takeInbox();
+    if(!flush())
+        return false;
+    // The connection is closed after the close frame, whoever started the closing
+    if(close_sent_ && out_.empty())
+    {
+        INFO("WebSocket socket(%d) closed.", conn_->client_fd_);
+        return false;
+    }
+    return rearmEvents();
+}
+
+bool WebSocketSession::readFrames()
+{
+    for(;;)
+    {
+        if(!parseFrames() || close_sent_)
+            return true;
+        ssize_t len = conn_->readClient(IN_LIMIT);
+        if(len > 0)
+        {
+            last_active_ = monotonicMs();
+            ping_sent_ = false;
+            continue;
+        }
+        if(len == 0)
+        {
+            INFO("WebSocket socket(%d) was closed.", conn_->client_fd_);
+            return false;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN)
+            break;
+        ERROR("WebSocket read failed ! (%s)", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Process the frames in the input buffer, the payload of a data frame is taken as it arrives
+ * @return false if the close frame was queued
+ */
+bool WebSocketSession::parseFrames()
+{
+    InputBuffer& in = conn_->in_;
+    for(;;)
+    {
+        if(in_frame_)
+        {
+            size_t len = static_cast<size_t>(min<uint64_t>(frame_left_, in.readable()));
+            if(len > 0)
+            {
+                size_t pos = message_.size();
+                message_.append(in.peek(), len);
+                unmask(&message_[pos], len, mask_, mask_pos_);
+                in.retrieve(len);
+                mask_pos_ += len;
+                frame_left_ -= len;
+            }
+            if(frame_left_ > 0)
+                return true;
+            in_frame_ = false;
+            if(frame_fin_)
+            {
+                onMessage();
+                if(close_sent_)
+                    return false;
+            }
+            continue;
+        }
+
+        size_t avail = in.readable();
+        if(avail < 2)
+            return true;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(in.peek());
+        bool fin = (p[0] & 0x80) != 0;
+        uint8_t opcode = p[0] & 0x0f;
+        uint64_t len = p[1] & 0x7f;
+
+        // No extension is negotiated, and the frames of a client are masked
+        bool is_control = (opcode & 0x8) != 0;
+        if((p[0] & 0x70) || !(p[1] & 0x80)
+           || (is_control && (!fin || len > MAX_CONTROL_PAYLOAD || opcode > OP_PONG))
+           || (!is_control && opcode > OP_BINARY)
+           || (opcode == OP_CONTINUATION && message_opcode_ == OP_CONTINUATION)
+           || ((opcode == OP_TEXT || opcode == OP_BINARY) && message_opcode_ != OP_CONTINUATION))
+        {
+            WARN("WebSocket socket(%d): malformed frame.", conn_->client_fd_);
+            sendClose(CLOSE_PROTOCOL_ERROR);
+            return false;
+        }
+
+        size_t header_len = 2 + (len == 126 ? 2 : (len == 127 ? 8 : 0)) + 4;
+        if(avail < header_len)
+            return true;
+        if(len == 126)
+            len = (static_cast<uint64_t>(p[2]) << 8) | p[3];
+        else if(len == 127)
+        {
+            len = 0;
+            for(int i = 0; i < 8; i++)
+                len = (len << 8) | p[2 + i];
+        }
+        if(!is_control && len > maxMessageSize - message_.size())
+        {
+            WARN("WebSocket socket(%d): message over %ld bytes.", conn_->client_fd_, maxMessageSize);
+            sendClose(CLOSE_TOO_BIG);
+            return false;
+        }
+        const uint8_t* mask = p + header_len - 4;
+
+        if(is_control)
+        {
+            // The control frames may come between the fragments, they are taken whole
+            if(avail < header_len + len)
+                return true;
+            char payload[MAX_CONTROL_PAYLOAD];
+            memcpy(payload, p + header_len, static_cast<size_t>(len));
+            unmask(payload, static_cast<size_t>(len), mask, 0);
+            in.retrieve(header_len + static_cast<size_t>(len));
+            if(!onControlFrame(opcode, payload, static_cast<size_t>(len)))
+                return false;
+            continue;
+        }
+
+        if(opcode != OP_CONTINUATION)
+            message_opcode_ = opcode;
+        memcpy(mask_, mask, 4);
+        mask_pos_ = 0;
+        frame_fin_ = fin;
+        frame_left_ = len;
+        in_frame_ = true;
+        in.retrieve(header_len);
+    }
+}
+
+/**
+ * @return false if the close frame was queued
+ */
+bool WebSocketSession::onControlFrame(uint8_t opcode, const char* payload, size_t len)
+{
+    if(opcode == OP_PING)
+    {
+        Frame* pong = Frame::create(OP_PONG, payload, len);
+        if(pong)
+            sendFrame(pong);
+        return true;
+    }
+    if(opcode == OP_PONG)
+        return true;
+
+    // Answer the close with its code
+    if(len == 1 || (len > 2 && !isValidUtf8(payload + 2, len - 2)))
+    {
+        sendClose(CLOSE_PROTOCOL_ERROR);
+        return false;
+    }
+    uint16_t code = len >= 2 ? static_cast<uint16_t>((static_cast<uint8_t>(payload[0]) << 8)
+                                                     | static_cast<uint8_t>(payload[1])) : 0;
+    bool valid = (code >= 1000 && code <= 1014 && code != 1004 && code != CLOSE_NO_STATUS && code != 1006)
+                 || (code >= 3000 && code <= 4999);
+    if(len == 0)
+        sendClose(CLOSE_NORMAL);
+    else
+        sendClose(valid ? static_cast<CLOSE_CODE>(code) : CLOSE_PROTOCOL_ERROR);
+    return false;
+}
+
+void WebSocketSession::onMessage()
+{
+    uint8_t opcode = message_opcode_;
+    message_opcode_ = OP_CONTINUATION;
+    if(opcode == OP_TEXT && !isValidUtf8(message_.data(), message_.size()))
+    {
+        WARN("WebSocket socket(%d): invalid UTF-8 text.", conn_->client_fd_);
+        sendClose(CLOSE_INVALID_DATA);
+        return;
+    }
+    publish(channel_, static_cast<OPCODE>(opcode), message_.data(), message_.size());
+    message_.clear();
+    if(message_.capacity() > IN_LIMIT)
+        string().swap(message_);
+}
+
+/**
+ * @brief Queue a frame of this session, the reference of the caller is taken
+ */
+void WebSocketSession::sendFrame(Frame* frame)
+{
+    queued_bytes_.fetch_add(frame->size(), memory_order_relaxed);
+    out_.push_back(frame);
+}
+
+void WebSocketSession::sendClose(CLOSE_CODE code)
+{
+    if(close_sent_)
+        return;
+    char payload[2] = { static_cast<char>(code >> 8), static_cast<char>(code) };
+    Frame* frame = Frame::create(OP_CLOSE, payload, 2);
+    if(frame)
+        sendFrame(frame);
+    close_sent_ = true;
+}
+
+void WebSocketSession::takeInbox()
+{
+    vector<Frame*> frames;
+    {
+        MutexLockGuard guard(inbox_lock_);
+        frames.swap(inbox_);
+    }
+    for(Frame* frame : frames)
+    {
+        // Nothing follows the close frame
+        if(close_sent_)
+        {
+            queued_bytes_.fetch_sub(frame->size(), memory_order_relaxed);
+            frame->unref();
+        }
+        else
+            out_.push_back(frame);
+    }
+}
+
+bool WebSocketSession::flush()
+{
+    while(!out_.empty())
+    {
+        iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        for(auto iter = out_.begin(); iter != out_.end() && iovcnt < MAX_IOV; ++iter, ++iovcnt)
+        {
+            size_t off = (iovcnt == 0) ? out_off_ : 0;
+            iov[iovcnt].iov_base = const_cast<char*>((*iter)->data() + off);
+            iov[iovcnt].iov_len = (*iter)->size() - off;
+        }
+        ssize_t len = conn_->writevClient(iov, iovcnt);
+        if(len < 0)
+        {
+            ERROR("WebSocket send failed ! (%s)", strerror(errno));
+            return false;
+        }
+        if(len == 0)
+            break;
+
+        size_t left = static_cast<size_t>(len);
+        while(left > 0)
+        {
+            Frame* frame = out_.front();
+            size_t rest = frame->size() - out_off_;
+            if(left < rest)
+            {
+                out_off_ += left;
+                break;
+            }
+            left -= rest;
+            out_off_ = 0;
+            out_.pop_front();
+            queued_bytes_.fetch_sub(frame->size(), memory_order_relaxed);
+            frame->unref();
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Wait for the socket, and for the socket writable if there is something to send
+ *        The timer is the next ping, or the end of waiting for the pong or the closing
+ */
+bool WebSocketSession::rearmEvents()
+{
+    bool ret1 = true, ret2;
+    if(conn_->timer_)
+    {
+        int64_t deadline = last_active_ + PING_INTERVAL_MS;
+        if(ping_sent_)
+            deadline += conn_->timeoutPerRequest * 1000;
+        if(close_sent_)
+            deadline = monotonicMs() + conn_->timeoutPerRequest * 1000;
+        int64_t delay = max<int64_t>(deadline - monotonicMs(), 1);
+        conn_->timer_->setTime(delay / 1000, (delay % 1000) * 1000000L);
+        ret1 = conn_->epoll_->modify(conn_->timer_->getFd(), conn_->getTimerEpollEvent(), conn_->getTimerTriggerCond());
+    }
+    {
+        // A publisher arms EPOLLOUT by itself if the inbox was empty here. closeAll() may have passed
+        // this session while it was running, the close frame is still due then
+        MutexLockGuard guard(inbox_lock_);
+        int client_events = conn_->getClientTriggerCond();
+        if(!out_.empty() || !inbox_.empty() || (going_away_.load() && !close_sent_))
+            client_events |= EPOLLOUT;
+        wake_armed_ = (client_events & EPOLLOUT) != 0;
+        ret2 = conn_->epoll_->modify(conn_->client_fd_, conn_->getClientEpollEvent(), client_events);
+    }
+    if(!close_sent_)
+        conn_->wakeForTlsPending();
+    assert(ret1 && ret2);
+    return ret1 && ret2;
+}
@@ -0,0 +1,193 @@
+//
+// Created by kelpie on 2/3/23.
+//
+
+#ifndef WEBSERVER_WEBSOCKETSESSION_H
+#define WEBSERVER_WEBSOCKETSESSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HttpHandler.h"
+#include "MutexLock.h"
+
+using namespace std;
+
+/**
+ * @brief The WebSocket state of a connection (RFC 6455), created by HttpHandler after answering the
+ *        "Upgrade: websocket" request of a WebSocket route with 101
+ *
+ * Every request path is a channel, the connection subscribes to the channel of its path. A text or
+ * binary message of a client is published to all the subscribers of its channel, the sender included.
+ * publish() serializes the frame once, the frame is shared by reference count among the output queues
+ * of the subscribers, and freed after the last one sent it.
+ *
+ * The session runs inside the event loop of its HttpHandler like Http2Session. The publishers run on
+ * other threads, they put the frames in the inbox of the session and wake it by EPOLLOUT. A subscriber
+ * whose queue grows over MAX_QUEUE_BYTES is too slow to follow its channel, it is disconnected.
+ *
+ * The channels belong to one process, the workers do not share them.
+ */
+class WebSocketSession
+{
+public:
+    enum OPCODE
+    {
+        OP_CONTINUATION = 0x0,
+        OP_TEXT         = 0x1,
+        OP_BINARY       = 0x2,
+        OP_CLOSE        = 0x8,
+        OP_PING         = 0x9,
+        OP_PONG         = 0xa
+    };
+
+    /**
+     * @brief A frame of the server, the bytes follow the object
+     */
+    class Frame
+    {
+    public:
+        // one reference is held by the caller, nullptr if out of memory
+        static Frame* create(uint8_t opcode, const char* payload, size_t len);
+        static Frame* createRaw(const char* data, size_t len);
+
+        void ref()      { refs_.fetch_add(1, memory_order_relaxed); }
+        void unref();
+        const char* data() const    { return reinterpret_cast<const char*>(this + 1); }
+        size_t size() const         { return len_; }
+
+    private:
+        explicit Frame(size_t len) : refs_(1), len_(len) {}
+        static Frame* alloc(size_t len);
+        char* buffer()  { return reinterpret_cast<char*>(this + 1); }
+
+        atomic<int> refs_;
+        size_t len_;
+    };
+
+    /**
+     * @brief Accept the upgrade on the paths under prefix, it matches whole path segments like --proxy
+     * @return false if the prefix is not a path
+     */
+    static bool addRoute(const string& prefix);
+    static bool isEnabled()     { return !routes_.empty(); }
+    // the uri is "/" + the path
+    static bool match(const char* uri);
+    // the max size of a message of a client, a larger one is closed with 1009
+    static void setMaxMessageSize(size_t size)  { maxMessageSize = size; }
+
+    /**
+     * @brief Check the WebSocket fields of a GET request of HTTP/1.1
+     * @param accept    the Sec-WebSocket-Accept of the response
+     * @return 1 if it is an upgrade, 0 if the request does not ask for it, -1 if the fields are invalid (400)
+     */
+    static int checkUpgrade(const map<string, string>& headers, string* accept);
+
+    /**
+     * @brief Send a message to all the subscribers of the channel, from any thread
+     * @param channel   the request path of the subscribers, without the query
+     * @return the number of the subscribers the message was queued to
+     */
+    static size_t publish(const string& channel, OPCODE opcode, const char* data, size_t len);
+
+    // close all the sessions with 1001, for the graceful shutdown
+    static void closeAll();
+
+    /**
+     * @brief Start the session, the 101 response is queued and the connection subscribes to the channel
+     */
+    WebSocketSession(HttpHandler* conn, const string& channel, const string& accept);
+    ~WebSocketSession();
+
+    WebSocketSession(const WebSocketSession&) = delete;
+    WebSocketSession& operator=(const WebSocketSession&) = delete;
+
+    /**
+     * @brief Handle the events of the connection, the events are EVENT_TYPE of HttpHandler
+     * @return false if the connection should be closed
+     */
+    bool RunEventLoop(unsigned events);
+
+private:
+    enum CLOSE_CODE
+    {
+        CLOSE_NORMAL            = 1000,
+        CLOSE_GOING_AWAY        = 1001,
+        CLOSE_PROTOCOL_ERROR    = 1002,
+        CLOSE_NO_STATUS         = 1005,
+        CLOSE_INVALID_DATA      = 1007,
+        CLOSE_POLICY            = 1008,
+        CLOSE_TOO_BIG           = 1009
+    };
+
+    struct Channel
+    {
+        MutexLock lock;
+        vector<WebSocketSession*> subscribers;
+    };
+
+    // the bytes queued to a subscriber before it is disconnected
+    static const size_t MAX_QUEUE_BYTES = 8 * 1024 * 1024;
+    static const size_t IN_LIMIT = 64 * 1024;
+    static const size_t MAX_CONTROL_PAYLOAD = 125;
+    // the frames written by one writev
+    static const int MAX_IOV = 64;
+    // a ping is sent after the client is quiet for this time, it is closed without any answer
+    static const int64_t PING_INTERVAL_MS = 30 * 1000;
+
+    static vector<string> routes_;
+    static size_t maxMessageSize;
+    static MutexLock channels_lock_;
+    static unordered_map<string, Channel*> channels_;
+    static atomic<bool> going_away_;
+
+    HttpHandler* conn_;
+    string channel_;
+    size_t index_;                      // the position in subscribers of the channel, guarded by its lock
+
+    // the frames of the publishers not taken by the session yet
+    MutexLock inbox_lock_;
+    vector<Frame*> inbox_;
+    bool wake_armed_;                   // EPOLLOUT is armed or the session is running, guarded by inbox_lock_
+    atomic<size_t> queued_bytes_;       // the bytes of the inbox and the output queue
+    atomic<bool> overflow_;
+
+    deque<Frame*> out_;
+    size_t out_off_;                    // the bytes of the first frame sent
+
+    // the frame being received, the payload of a data frame is unmasked into message_ as it arrives
+    bool in_frame_;
+    uint8_t frame_opcode_;
+    bool frame_fin_;
+    uint64_t frame_left_;
+    uint8_t mask_[4];
+    size_t mask_pos_;
+    uint8_t message_opcode_;            // OP_CONTINUATION if no message is in progress
+    string message_;
+
+    bool close_sent_;
+    bool ping_sent_;
+    int64_t last_active_;
+
+    void subscribe();
+    void unsubscribe();
+    // put the frame in the inbox, the caller holds the lock of the channel
+    bool deliver(Frame* frame);
+
+    bool readFrames();
+    bool parseFrames();
+    bool onControlFrame(uint8_t opcode, const char* payload, size_t len);
+    void onMessage();
+    void sendFrame(Frame* frame);
+    void sendClose(CLOSE_CODE code);
+    void takeInbox();
+    bool flush();
+    bool rearmEvents();
+};
+
+#endif //WEBSERVER_WEBSOCKETSESSION_H
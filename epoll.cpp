@@ -1,14 +1,37 @@
 //
 // Created by kelpie on 2/3/23.
 //
+#include <algorithm>
 #include <cassert>
+#include <ctime>
 #include <iostream>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "epoll.h"
 #include "Log.h"
 
-Epoll::Epoll(int flag) : epoll_fd_(-1)
+// the busy poll parameters of an epoll instance, Linux 6.9
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+static int64_t monotonicUs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+Epoll::Epoll(int flag) : epoll_fd_(-1), max_spin_us_(0), spin_budget_us_(0), spin_us_(0),
+                         spin_hits_(0), spin_misses_(0)
 {
     create(flag);
 }
@@ -69,9 +92,57 @@ bool Epoll::del(int fd)
 // Waits for any of the events registered for with epoll_ctl
 int Epoll::wait(int timeout)
 {
-    if(isEpollValid())
+    if(!isEpollValid())
+        return -2;
+    if(max_spin_us_ == 0 || timeout == 0)
         return epoll_wait(epoll_fd_, events_, MAX_EVENTS, timeout);
-    return -2;
+
+    int64_t start = monotonicUs();
+    if(spin_budget_us_ > 0)
+    {
+        int64_t now;
+        do
+        {
+            int event_num = epoll_wait(epoll_fd_, events_, MAX_EVENTS, 0);
+            now = monotonicUs();
+            if(event_num != 0)
+            {
+                spin_us_ += now - start;
+                if(event_num > 0)
+                {
+                    ++spin_hits_;
+                    spin_budget_us_ = max_spin_us_;
+                }
+                return event_num;
+            }
+        } while(now - start < spin_budget_us_);
+        spin_us_ += now - start;
+        ++spin_misses_;
+        spin_budget_us_ /= 2;
+        start = now;
+    }
+
+    int event_num = epoll_wait(epoll_fd_, events_, MAX_EVENTS, timeout);
+    // A longer spin would have caught the event without the sleep
+    if(event_num > 0 && monotonicUs() - start < max_spin_us_)
+        spin_budget_us_ = min(max(spin_budget_us_ * 2, static_cast<int>(MIN_SPIN_US)), max_spin_us_);
+    return event_num;
+}
+
+void Epoll::setBusyPoll(int max_spin_us)
+{
+    max_spin_us_ = max(max_spin_us, 0);
+    spin_budget_us_ = max_spin_us_;
+    if(!isEpollValid() || max_spin_us_ == 0)
+        return;
+    epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = static_cast<uint32_t>(max_spin_us_);
+    params.busy_poll_budget = 8;
+    params.prefer_busy_poll = 1;
+    // Older kernels only have the user space spin, above net.core.busy_poll it needs CAP_NET_ADMIN
+    if(ioctl(epoll_fd_, EPIOCSPARAMS, &params) == -1)
+        WARN("Kernel busy poll of epoll is unavailable, spin in user space only (%s)", strerror(errno));
 }
 
 void Epoll::destroy()
@@ -33,11 +33,33 @@ public:
     void destroy();
     epoll_event getEvent(size_t index);
 
+    /**
+     * @brief Spin on the ready list up to max_spin_us before sleeping in wait(), 0 disables it
+     *
+     * The spin is adaptive: a spin finding no event halves the next one, a sleep ended by an event
+     * within max_spin_us doubles it, so an idle loop sleeps at once. The kernel busy polls the
+     * device queues of the sockets for the same time when it supports the epoll parameters.
+     */
+    void setBusyPoll(int max_spin_us);
+    int getSpinBudget() const           { return spin_budget_us_; }
+    // the time spent spinning, in microseconds
+    int64_t getSpinTime() const         { return spin_us_; }
+    uint64_t getSpinHits() const        { return spin_hits_; }
+    uint64_t getSpinMisses() const      { return spin_misses_; }
+
 private:
     static const size_t MAX_EVENTS = 4096;
+    // the spin budget grows from this after it dropped to 0
+    static const int MIN_SPIN_US = 4;
 
     int epoll_fd_;
     epoll_event events_[MAX_EVENTS];
+
+    int max_spin_us_;
+    int spin_budget_us_;
+    int64_t spin_us_;
+    uint64_t spin_hits_;
+    uint64_t spin_misses_;
 };
 
 
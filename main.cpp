@@ -1,23 +1,78 @@
+#include <algorithm>
 #include <fcntl.h>
+#include <getopt.h>
 #include <iostream>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <vector>
 
+#include "AccessLog.h"
+#include "Bundle.h"
+#include "CgiCache.h"
 #include "epoll.h"
+#include "FileCache.h"
+#include "Handoff.h"
+#include "HeavyHitters.h"
 #include "HttpHandler.h"
+#include "HttpResponse.h"
 #include "Log.h"
+#include "PerfCounters.h"
+#include "Proxy.h"
+#include "RateLimit.h"
+#include "Router.h"
+#include "Stats.h"
 #include "ThreadPool.h"
+#include "Tls.h"
+#include "Trace.h"
 #include "Utils.h"
+#include "WebSocketSession.h"
 
 using namespace std;
 
-void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd)
+// the idle connections closed once when the fds or memory run short
+const size_t EVICT_BATCH = 16;
+
+/**
+ * @brief Make room for new connections by closing the oldest idle keep-alive connections
+ *        If there is no idle connection, refuse all the pending connections
+ * @return true if some idle connections were closed, and the new connection should be tried again
+ */
+bool relieveResourcePressure(int listen_fd, int* idle_fd)
+{
+    size_t evicted_num = HttpHandler::evictIdle(EVICT_BATCH);
+    if(evicted_num > 0)
+    {
+        WARN("No reliable resources in new connection, evict %zu idle conns", evicted_num);
+        return true;
+    }
+    int closed_conn_num = closeRemainingConnect(listen_fd, idle_fd);
+    WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
+    return false;
+}
+
+/**
+ * @brief Close with a RST, the client learns at once and no TIME_WAIT is left on this side
+ */
+void resetConnection(int client_fd)
+{
+    linger lin = { 1, 0 };
+    setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    close(client_fd);
+}
+
+void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd, bool tls)
 {
-    sockaddr_in client_addr;
-    socklen_t client_addr_len = 0;
+    sockaddr_storage client_addr;
+    socklen_t client_addr_len;
 
     for(;;) {
+        client_addr_len = sizeof(client_addr);
         int client_fd = accept4(listen_fd, (sockaddr*)&client_addr, &client_addr_len,
                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
         if(client_fd == -1) {
@@ -25,17 +80,32 @@ void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd)
                 continue;
             else if (errno == EAGAIN)
                 break;
-            else if(errno == EMFILE) {
-                int closed_conn_num = closeRemainingConnect(listen_fd, idle_fd);
-                WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
+            else if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if(relieveResourcePressure(listen_fd, idle_fd))
+                    continue;
                 break;
             }
-            else
+            else {
                 ERROR("Accept Error! (%s)", strerror(errno));
+                break;
+            }
         }
         else {
+            // A client over its connection rate is reset before anything is allocated for it
+            RateLimit::ClientKey client_key = { 0, 0 };
+            if(RateLimit::isEnabled())
+            {
+                client_key = RateLimit::keyOf(reinterpret_cast<sockaddr*>(&client_addr));
+                if(!RateLimit::allowConnection(client_key))
+                {
+                    resetConnection(client_fd);
+                    continue;
+                }
+            }
 
             Timer* timer = new Timer(TFD_NONBLOCK | TFD_CLOEXEC);
+            if(!timer->isValid() && HttpHandler::evictIdle(EVICT_BATCH) > 0)
+                timer->create(TFD_NONBLOCK | TFD_CLOEXEC);
             if(!timer->isValid())
             {
                 delete timer;
@@ -45,7 +115,25 @@ void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd)
                 WARN("No reliable pipes in new connection, close %d conns", closed_conn_num);
                 break;
             }
-            HttpHandler* client_handler = new HttpHandler(epoll, client_fd, timer);
+            HttpHandler* client_handler = new (nothrow) HttpHandler(epoll, client_fd, timer, tls);
+            if(!client_handler)
+            {
+                delete timer;
+                close(client_fd);
+                if(relieveResourcePressure(listen_fd, idle_fd))
+                    continue;
+                break;
+            }
+            client_handler->setClientKey(client_key);
+            if(client_addr.ss_family == AF_UNIX)
+            {
+                ucred cred;
+                socklen_t cred_len = sizeof(cred);
+                if(getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0)
+                    client_handler->setPeerCred(cred);
+            }
+            if(AccessLog::isEnabled() || HeavyHitters::isEnabled())
+                client_handler->setPeer(reinterpret_cast<sockaddr*>(&client_addr));
             bool ret1 = epoll->add(client_fd, client_handler->getClientEpollEvent(), client_handler->getClientTriggerCond());
             bool ret2 = epoll->add(timer->getFd(), client_handler->getTimerEpollEvent(), client_handler->getTimerTriggerCond());
             assert(ret1 && ret2);
@@ -55,80 +143,298 @@ void handleNewConnections(Epoll* epoll, int listen_fd, int* idle_fd)
     }
 }
 
-
-void handleOldConnection(Epoll* epoll, int fd, ThreadPool* thread_pool, epoll_event* event)
+/**
+ * @param woke_at the time the epoll wait returned, 0 if the tracing is disabled
+ */
+void handleOldConnection(epoll_event* event, ThreadPool* thread_pool, int64_t woke_at)
 {
     EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event->data.ptr);
     HttpHandler* handler = static_cast<HttpHandler*>(curr_epoll_event->ptr);
-    int events_ = event->events;
-    if ((events_ & EPOLLHUP) || (events_ & EPOLLRDHUP)) {
-        INFO("Socket(%d) was closed by peer.", handler->getClientFd());
-        delete handler;
-        return;
-    }
 
-    else if ((events_ & EPOLLERR) || !(events_ & EPOLLIN)) {
-        ERROR("Socket(%d) error.", handler->getClientFd());
-        delete handler;
+    unsigned events = handler->translateEvent(curr_epoll_event, event->events);
+    // Another thread is running this connection, it will handle the events
+    if(!handler->notify(events))
         return;
-    }
-    // 1. Time out
-    if(fd == handler->getTimer()->getFd())
+    if(woke_at)
+        handler->traceDispatch(woke_at);
+
+    auto runTask = [](void* arg)
     {
-        INFO("-------->>>>> "
-             "New Message: socket(%d) - timerfd(%d) timeout."
-             " <<<<<--------",
-             handler->getClientFd(), handler->getTimer()->getFd());
-        delete handler;
-    }
-    // 2. other error
-    else
+        HttpHandler* handler = static_cast<HttpHandler*>(arg);
+
+        printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
+        handler->runPendingEvents();
+    };
+    // The client has given up the request when its deadline passed in the queue
+    auto dropTask = [](void* arg)
     {
-        epoll->modify(handler->getTimer()->getFd(), nullptr, 0);
-        thread_pool->appendTask(
-                [](void* arg)
-                {
-                    HttpHandler* handler = static_cast<HttpHandler*>(arg);
+        static_cast<HttpHandler*>(arg)->dropExpired();
+    };
+    int64_t deadline = handler->taskDeadline(monotonicMs());
+    if(!thread_pool->appendTask(runTask, handler, deadline, dropTask))
+        runTask(handler);
+}
+
+// the options of the graceful shutdown and the hot upgrade
+static string handoff_path;
+static time_t drain_timeout = 30;
+// the directory of the trace files dumped on SIGUSR1
+static string trace_dir = ".";
+// the binary access log of this process, empty if disabled
+static string access_log_path;
+// the Unix sockets listened on besides the TCP port, "@<name>" is abstract
+static vector<string> unix_paths;
+// the max spin of the event loop before it sleeps, 0 disables the busy poll
+static int busy_poll_us = 0;
+// the seconds between the busy poll reports
+const time_t BUSY_POLL_REPORT_INTERVAL = 10;
+
+struct BusyPollReport
+{
+    time_t at;
+    uint64_t requests;
+    int64_t cpu_us;             // the user and system time of the process
+    int64_t spin_us;
+    uint64_t spin_hits;
+    uint64_t spin_misses;
+};
+
+BusyPollReport sampleBusyPoll(const Epoll& epoll)
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    BusyPollReport report;
+    report.at = time(nullptr);
+    report.requests = HttpHandler::getRequestTotal();
+    report.cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL
+                    + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    report.spin_us = epoll.getSpinTime();
+    report.spin_hits = epoll.getSpinHits();
+    report.spin_misses = epoll.getSpinMisses();
+    return report;
+}
 
-                    printConnectionStatus(handler->getClientFd(), "-------->>>>> New Message");
-                    if(!(handler->RunEventLoop()))
-                        delete handler;
-                },
-                handler);
+/**
+ * @brief Log the CPU time per request since the last report, so the latency gained can be weighed
+ */
+void reportBusyPoll(const Epoll& epoll, BusyPollReport* last)
+{
+    BusyPollReport curr = sampleBusyPoll(epoll);
+    uint64_t requests = curr.requests - last->requests;
+    uint64_t spins = (curr.spin_hits - last->spin_hits) + (curr.spin_misses - last->spin_misses);
+    if(requests > 0 || spins > 0)
+    {
+        double divisor = requests ? static_cast<double>(requests) : 1.0;
+        INFO("Busy poll: %lu requests in %ld s, %.1f us CPU per request (%.1f us spinning), "
+             "%lu of %lu spins found events, spin budget %d us",
+             requests, curr.at - last->at, (curr.cpu_us - last->cpu_us) / divisor,
+             (curr.spin_us - last->spin_us) / divisor, curr.spin_hits - last->spin_hits, spins,
+             epoll.getSpinBudget());
     }
+    *last = curr;
 }
 
-int main(int argc, char* argv[])
+/**
+ * @brief The signals handled by the event loops with signalfd, blocked before any thread or worker is created
+ *        SIGTERM/SIGINT drain the connections, the second one quits at once
+ *        SIGUSR1 dumps the traces of the requests
+ */
+void blockServerSignals()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+}
+
+int createSignalFd(bool withChild)
 {
-    if (argc < 2 || !isNumericStr(argv[1]))
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    if(withChild)
+        sigaddset(&mask, SIGCHLD);
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(fd == -1)
+        FATAL("signalfd fail! (%s)", strerror(errno));
+    return fd;
+}
+
+/**
+ * @brief Read all the pending signals, SIGCHLD is only a wakeup of the master
+ * @param dump_trace set to true if SIGUSR1 came
+ * @return true if SIGTERM or SIGINT came
+ */
+bool readQuitSignals(int signal_fd, bool* dump_trace)
+{
+    bool quit = false;
+    signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info))
     {
-        ERROR("usage: %s <port> [<www_dir>]", argv[0]);
-        exit(EXIT_FAILURE);
+        if(info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT)
+            quit = true;
+        else if(info.ssi_signo == SIGUSR1)
+            *dump_trace = true;
     }
-    int port = atoi(argv[1]);
-    if(argc > 2)
-        HttpHandler::setWWWPath(argv[2]);
+    return quit;
+}
 
-    INFO("PID: %d", getpid());
-    handleSigpipe();
-    ThreadPool thread_pool(8);
+/**
+ * @brief The state of the handoff socket, owned by the single process server or the master
+ */
+struct HandoffState
+{
+    int listen_fd;
+    int conn;               // the new server waiting to be ready
+    bool published;         // listen_fd took the path over from the old server
+    bool handed_over;       // the path belongs to the new server now
 
-    int idle_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
-    int listen_fd = -1;
-    if((listen_fd = socket_bind_and_listen(port)) == -1)
+    HandoffState() : listen_fd(-1), conn(-1), published(false), handed_over(false) {}
+
+    // take the path once this server accepts, before the old one is told to drain
+    void publish()
     {
-        ERROR("Bind %d port failed ! (%s)", port, strerror(errno));
-        exit(EXIT_FAILURE);
+        if(listen_fd != -1 && !published)
+            published = Handoff::publish(handoff_path);
     }
 
+    /**
+     * @brief Close the handoff socket, the path is only removed if no new server took it over
+     */
+    void shutdown()
+    {
+        if(conn != -1)
+            close(conn);
+        if(listen_fd != -1)
+        {
+            close(listen_fd);
+            if(!published)
+                unlink(Handoff::tempPath(handoff_path).c_str());
+            else if(!handed_over)
+                unlink(handoff_path.c_str());
+        }
+        conn = listen_fd = -1;
+    }
+};
+
+/**
+ * @brief The event loop of a process serving the connections
+ *        It returns after SIGTERM/SIGINT when the connections are drained, or the drain timeout passed
+ * @param tls_listen_fds the HTTPS listening sockets
+ * @param unix_listen_fds the Unix sockets, shared by all the workers
+ * @param handoff  the handoff socket in the single process mode, nullptr in the workers
+ * @param old_conn the old server which passed the listening sockets, -1 if none
+ */
+void runWorker(const vector<int>& listen_fds, const vector<int>& tls_listen_fds,
+               const vector<int>& unix_listen_fds, size_t threadNum, HandoffState* handoff, int old_conn)
+{
+    vector<int> all_listen_fds(listen_fds);
+    all_listen_fds.insert(all_listen_fds.end(), tls_listen_fds.begin(), tls_listen_fds.end());
+    all_listen_fds.insert(all_listen_fds.end(), unix_listen_fds.begin(), unix_listen_fds.end());
+
+    // The pool is stopped before the epoll is destroyed, the tasks left at the drain timeout still use it
     Epoll epoll(EPOLL_CLOEXEC);
     assert(epoll.isEpollValid());
-    EpollEvent* listen_epollevent = new EpollEvent{listen_fd, nullptr};
-    epoll.add(listen_fd, listen_epollevent, EPOLLET | EPOLLIN);
+    unique_ptr<ThreadPool> thread_pool(new ThreadPool(threadNum));
+    Trace::setThreadName("event loop");
+    if(!access_log_path.empty() && !AccessLog::open(access_log_path))
+        WARN("Access log is disabled");
+    time_t access_flushed_at = time(nullptr);
+    time_t parked_at = time(nullptr);
+
+    int idle_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // The server fds are registered with a null ptr, the connections with their handler
+    vector<EpollEvent*> listen_epollevents;
+    for(int listen_fd : all_listen_fds)
+    {
+        listen_epollevents.push_back(new EpollEvent{listen_fd, nullptr});
+        // Only one of the workers sharing a Unix socket is woken for a new connection
+        bool shared = !handoff && find(unix_listen_fds.begin(), unix_listen_fds.end(), listen_fd) != unix_listen_fds.end();
+        epoll.add(listen_fd, listen_epollevents.back(), EPOLLET | EPOLLIN | (shared ? static_cast<int>(EPOLLEXCLUSIVE) : 0));
+    }
+    int signal_fd = createSignalFd(false);
+    EpollEvent signal_epollevent{signal_fd, nullptr};
+    epoll.add(signal_fd, &signal_epollevent, EPOLLIN);
+    EpollEvent handoff_epollevent{handoff ? handoff->listen_fd : -1, nullptr};
+    EpollEvent handoff_conn_epollevent{-1, nullptr};
+    if(handoff && handoff->listen_fd != -1)
+        epoll.add(handoff->listen_fd, &handoff_epollevent, EPOLLIN);
+
+    // The sockets are accepted by this process now, the old server can drain
+    if(handoff)
+        handoff->publish();
+    if(old_conn != -1)
+        Handoff::ready(old_conn);
+
+    BusyPollReport busy_poll_report;
+    if(busy_poll_us > 0)
+    {
+        epoll.setBusyPoll(busy_poll_us);
+        for(int listen_fd : all_listen_fds)
+            if(!setSocketBusyPoll(listen_fd, busy_poll_us))
+            {
+                WARN("Socket busy poll is unavailable (%s)", strerror(errno));
+                break;
+            }
+        busy_poll_report = sampleBusyPoll(epoll);
+        INFO("Busy poll: spin up to %d us before sleeping", busy_poll_us);
+    }
+
+    bool draining = false;
+    time_t drain_deadline = 0;
+    auto startDrain = [&]()
+    {
+        draining = true;
+        drain_deadline = time(nullptr) + drain_timeout;
+        // Stop accepting, the pending connections stay in the queue if the sockets are handed over
+        for(size_t i = 0; i < all_listen_fds.size(); i++)
+        {
+            epoll.del(all_listen_fds[i]);
+            close(all_listen_fds[i]);
+        }
+        if(handoff && handoff->listen_fd != -1)
+        {
+            epoll.del(handoff->listen_fd);
+            if(handoff->conn != -1)
+                epoll.del(handoff->conn);
+            handoff->shutdown();
+        }
+        size_t closed_num = HttpHandler::startDraining();
+        INFO("Draining, %ld idle connections closed, %ld left",
+             closed_num, HttpHandler::getConnectionCount() - closed_num);
+    };
 
     for(;;)
     {
-        int event_num = epoll.wait(-1);
+        // No event of the current wait refers to the retired connections now
+        HttpHandler::reclaimRetired();
+        HttpHandler::reapChildren();
+
+        if(draining && (HttpHandler::getConnectionCount() == 0 || time(nullptr) >= drain_deadline))
+            break;
+
+        // Wake up at least once per second to refresh the cached Date header
+        int event_num = epoll.wait(1000);
+        HttpDate::update();
+        if(AccessLog::isEnabled() && time(nullptr) != access_flushed_at)
+        {
+            access_flushed_at = time(nullptr);
+            AccessLog::flush();
+        }
+        if(time(nullptr) != parked_at)
+        {
+            parked_at = time(nullptr);
+            HttpHandler::parkIdle(monotonicMs());
+        }
+        if(busy_poll_us > 0 && time(nullptr) - busy_poll_report.at >= BUSY_POLL_REPORT_INTERVAL)
+            reportBusyPoll(epoll, &busy_poll_report);
+        int64_t woke_at = Trace::isEnabled() ? Trace::now() : 0;
 
         if(event_num < 0)
         {
@@ -146,14 +452,700 @@ int main(int argc, char* argv[])
         {
             epoll_event&& event = epoll.getEvent(static_cast<size_t>(i));
             EpollEvent* curr_epoll_event = static_cast<EpollEvent*>(event.data.ptr);
-            int fd = curr_epoll_event->fd;
-            if(fd == listen_fd)
-                handleNewConnections(&epoll, listen_fd, &idle_fd);
+            if(curr_epoll_event->ptr)
+                handleOldConnection(&event, thread_pool.get(), woke_at);
+            else if(curr_epoll_event == &signal_epollevent)
+            {
+                bool dump_trace = false;
+                bool quit = readQuitSignals(signal_fd, &dump_trace);
+                if(dump_trace)
+                    Trace::dump(trace_dir);
+                if(!quit)
+                    continue;
+                if(draining)
+                {
+                    WARN("Quit without draining, %ld connections left", HttpHandler::getConnectionCount());
+                    _exit(EXIT_SUCCESS);
+                }
+                startDrain();
+            }
+            else if(curr_epoll_event == &handoff_epollevent)
+            {
+                // Only one new server at the same time
+                if(handoff->conn != -1 || (handoff->conn = Handoff::accept(handoff->listen_fd, all_listen_fds)) == -1)
+                    continue;
+                handoff_conn_epollevent.fd = handoff->conn;
+                epoll.add(handoff->conn, &handoff_conn_epollevent, EPOLLIN);
+            }
+            else if(curr_epoll_event == &handoff_conn_epollevent)
+            {
+                int ready = Handoff::readReady(handoff->conn);
+                if(ready == 0)
+                    continue;
+                epoll.del(handoff->conn);
+                close(handoff->conn);
+                handoff->conn = -1;
+                if(ready == -1)
+                {
+                    WARN("The new server failed before ready, keep serving");
+                    continue;
+                }
+                INFO("The new server is ready");
+                handoff->handed_over = true;
+                startDrain();
+            }
+            else if(!draining)
+            {
+                int listen_fd = curr_epoll_event->fd;
+                bool tls = find(tls_listen_fds.begin(), tls_listen_fds.end(), listen_fd) != tls_listen_fds.end();
+                handleNewConnections(&epoll, listen_fd, &idle_fd, tls);
+            }
+        }
+    }
+    INFO("Drained, %ld connections left", HttpHandler::getConnectionCount());
+    if(busy_poll_us > 0)
+        reportBusyPoll(epoll, &busy_poll_report);
+    // Join the tasks still running, so their requests are logged
+    thread_pool.reset();
+    HttpHandler::reclaimRetired();
+    AccessLog::close();
+
+    close(signal_fd);
+    for(EpollEvent* listen_epollevent : listen_epollevents)
+        delete listen_epollevent;
+}
+
+// a worker restarted within this seconds after it started is treated as crashing on startup
+const time_t WORKER_MIN_LIFETIME = 1;
+
+struct WorkerSlot
+{
+    int listen_fd;
+    int tls_listen_fd;          // -1 without HTTPS
+    pid_t pid;
+    time_t started_at;
+};
+
+/**
+ * @brief Fork the worker of the slot
+ * @param unix_listen_fds the Unix sockets, every worker accepts on all of them
+ * @param master_fds the fds of the master closed in the worker
+ */
+pid_t spawnWorker(vector<WorkerSlot>& slots, size_t slot, const vector<int>& unix_listen_fds, size_t threadNum,
+                  const vector<int>& master_fds)
+{
+    pid_t master_pid = getpid();
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        ERROR("Fork worker %ld failed! (%s)", slot, strerror(errno));
+        return -1;
+    }
+    else if(pid > 0)
+    {
+        slots[slot].pid = pid;
+        slots[slot].started_at = time(nullptr);
+        INFO("Worker %ld started, PID: %d", slot, pid);
+        return pid;
+    }
+
+    // The worker drains with the master, and the master may die before prctl
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != master_pid)
+        _exit(EXIT_SUCCESS);
+
+    // Every worker only accepts on its own sockets
+    for(size_t i = 0; i < slots.size(); i++)
+    {
+        if(i == slot)
+            continue;
+        close(slots[i].listen_fd);
+        if(slots[i].tls_listen_fd != -1)
+            close(slots[i].tls_listen_fd);
+    }
+    for(int fd : master_fds)
+        if(fd != -1)
+            close(fd);
+    FileCache::setSlot(static_cast<int>(slot));
+    // Every worker writes its own access log
+    if(!access_log_path.empty())
+        access_log_path += ".w" + to_string(slot);
+    vector<int> tls_listen_fds;
+    if(slots[slot].tls_listen_fd != -1)
+        tls_listen_fds.push_back(slots[slot].tls_listen_fd);
+    runWorker(vector<int>(1, slots[slot].listen_fd), tls_listen_fds, unix_listen_fds, threadNum, nullptr, -1);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief The master only supervises the workers, a dead worker is restarted on the same socket,
+ *        so the connections queued on the socket are not lost
+ *        SIGTERM/SIGINT and the hot upgrade are passed to the workers as SIGTERM, the master quits after them
+ */
+void runMaster(const vector<int>& listen_fds, const vector<int>& tls_listen_fds,
+               const vector<int>& unix_listen_fds, size_t threadNum, HandoffState* handoff, int old_conn)
+{
+    size_t workerNum = listen_fds.size();
+    vector<WorkerSlot> slots(workerNum);
+    for(size_t i = 0; i < workerNum; i++)
+    {
+        slots[i].listen_fd = listen_fds[i];
+        slots[i].tls_listen_fd = tls_listen_fds.empty() ? -1 : tls_listen_fds[i];
+        slots[i].pid = -1;
+    }
+    vector<int> all_listen_fds(listen_fds);
+    all_listen_fds.insert(all_listen_fds.end(), tls_listen_fds.begin(), tls_listen_fds.end());
+    all_listen_fds.insert(all_listen_fds.end(), unix_listen_fds.begin(), unix_listen_fds.end());
+
+    int signal_fd = createSignalFd(true);
+    for(size_t i = 0; i < workerNum; i++)
+        spawnWorker(slots, i, unix_listen_fds, threadNum, { signal_fd, handoff->listen_fd, old_conn });
+    handoff->publish();
+    if(old_conn != -1)
+        Handoff::ready(old_conn);
+
+    bool draining = false;
+    time_t kill_deadline = 0;
+    auto startDrain = [&]()
+    {
+        draining = true;
+        // The workers quit by themselves after their drain timeout, this is the last resort
+        kill_deadline = time(nullptr) + drain_timeout + 1;
+        for(size_t i = 0; i < workerNum; i++)
+        {
+            if(slots[i].pid > 0)
+                kill(slots[i].pid, SIGTERM);
+            close(slots[i].listen_fd);
+            if(slots[i].tls_listen_fd != -1)
+                close(slots[i].tls_listen_fd);
+        }
+        for(int fd : unix_listen_fds)
+            close(fd);
+        handoff->shutdown();
+        INFO("Master draining, wait for the workers");
+    };
+
+    for(;;)
+    {
+        size_t alive = 0;
+        for(size_t i = 0; i < workerNum; i++)
+            alive += (slots[i].pid > 0);
+        if(draining && alive == 0)
+            break;
+        if(draining && time(nullptr) >= kill_deadline)
+        {
+            for(size_t i = 0; i < workerNum; i++)
+                if(slots[i].pid > 0)
+                    kill(slots[i].pid, SIGKILL);
+        }
+
+        pollfd fds[3] = {
+                { signal_fd, POLLIN, 0 },
+                { handoff->listen_fd, POLLIN, 0 },
+                { handoff->conn, POLLIN, 0 }
+        };
+        if(poll(fds, 3, 1000) == -1 && errno != EINTR)
+            FATAL("poll fail! (%s)", strerror(errno));
+
+        if(fds[0].revents & POLLIN)
+        {
+            bool dump_trace = false;
+            bool quit = readQuitSignals(signal_fd, &dump_trace);
+            // Every worker dumps its own file
+            for(size_t i = 0; i < workerNum && dump_trace; i++)
+                if(slots[i].pid > 0)
+                    kill(slots[i].pid, SIGUSR1);
+            if(quit && draining)
+            {
+                WARN("Master quit without draining");
+                for(size_t i = 0; i < workerNum; i++)
+                    if(slots[i].pid > 0)
+                        kill(slots[i].pid, SIGKILL);
+                break;
+            }
+            if(quit)
+                startDrain();
+        }
+        if(fds[1].revents & POLLIN && handoff->conn == -1)
+            handoff->conn = Handoff::accept(handoff->listen_fd, all_listen_fds);
+        if(fds[2].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int ready = Handoff::readReady(handoff->conn);
+            if(ready != 0)
+            {
+                close(handoff->conn);
+                handoff->conn = -1;
+            }
+            if(ready == -1)
+                WARN("The new server failed before ready, keep serving");
+            else if(ready == 1)
+            {
+                INFO("The new server is ready");
+                handoff->handed_over = true;
+                startDrain();
+            }
+        }
+
+        // Reap the workers, SIGCHLD is only a wakeup
+        int status;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for(size_t i = 0; i < workerNum; i++)
+            {
+                if(slots[i].pid != pid)
+                    continue;
+                slots[i].pid = -1;
+                if(draining)
+                {
+                    INFO("Worker %ld (PID: %d) quit", i, pid);
+                    break;
+                }
+                if(WIFSIGNALED(status))
+                    ERROR("Worker %ld (PID: %d) killed by signal %d", i, pid, WTERMSIG(status));
+                else
+                    ERROR("Worker %ld (PID: %d) exited with %d", i, pid, WEXITSTATUS(status));
+                FileCache::recover(pid, static_cast<int>(i));
+                // Do not restart a worker crashing on startup in a tight loop
+                if(time(nullptr) - slots[i].started_at < WORKER_MIN_LIFETIME)
+                    sleep(WORKER_MIN_LIFETIME);
+                break;
+            }
+        }
+        // Restart the dead workers, and retry the failed forks
+        for(size_t i = 0; i < workerNum && !draining; i++)
+            if(slots[i].pid == -1)
+                spawnWorker(slots, i, unix_listen_fds, threadNum, { signal_fd, handoff->listen_fd, handoff->conn });
+    }
+
+    INFO("Master quit");
+    close(signal_fd);
+}
+
+/**
+ * @brief Bind num listening sockets of the port, exit if failed
+ */
+void bindListeners(int port, size_t num, bool reuse_port, vector<int>* fds)
+{
+    for(size_t i = 0; i < num; i++)
+    {
+        int listen_fd = socket_bind_and_listen(port, reuse_port);
+        if(listen_fd == -1)
+        {
+            ERROR("Bind %d port failed ! (%s)", port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fds->push_back(listen_fd);
+    }
+}
+
+int getSocketPort(int fd)
+{
+    sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) == -1 || addr.sin_family != AF_INET)
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+void usage(const char* prog)
+{
+    ERROR("usage: %s [options] <port> [<www_dir>]\n"
+          "    --max-header-size <bytes>    the max size of request line and headers (431)\n"
+          "    --max-body-size <bytes>      the max size of request body (413)\n"
+          "    --max-idle-conns <num>       the max idle keep-alive connections, the oldest are closed first\n"
+          "    --max-keepalive-requests <num>  the max requests served by one connection\n"
+          "    --workers <num>              fork the worker processes, 0 runs in a single process (default)\n"
+          "    --threads <num>              the threads of every process (default 8)\n"
+          "    --file-cache-size <MB>       the shared static file cache, 0 disables it\n"
+          "                                 (default 32 with --workers, otherwise 0)\n"
+          "    --drain-timeout <seconds>    the max time to finish the requests after SIGTERM/SIGINT (default 30)\n"
+          "    --handoff-socket <path>      take the listening sockets from the server running on the path,\n"
+          "                                 and pass them to the next binary started with the same path\n"
+          "    --bundle <file>              serve the static files packed by BundlePack, the misses fall back to www_dir\n"
+          "    --bundle-no-populate         do not prefault the bundle at startup\n"
+          "    --bundle-hugepages           copy the bundle into huge pages and send the bodies from the memory\n"
+          "    --tls-port <port>            listen for HTTPS on the port, needs --tls-cert and --tls-key\n"
+          "    --tls-cert <file>            the PEM certificate chain, tools/gen_cert.sh makes a self-signed one\n"
+          "    --tls-key <file>             the PEM private key\n"
+          "    --tls-ticket-key <file>      the session ticket key of 48 or 80 bytes, may be repeated,\n"
+          "                                 the first one encrypts the new tickets (default a random key)\n"
+          "    --trace-sample <num>         trace one of num requests, SIGUSR1 dumps the traces (default 0, off)\n"
+          "    --trace-dir <dir>            the directory of the Chrome trace JSON files (default .)\n"
+          "    --proxy <prefix>=<upstream>[,<upstream>...]\n"
+          "                                 forward the paths under prefix to the upstreams, may be repeated,\n"
+          "                                 an upstream is unix:<path> or <host>:<port>\n"
+          "    --proxy-idle <num>           the max idle keep-alive connections of every upstream (default 32)\n"
+          "    --conn-rate <rate>[:<burst>] the new connections per second of a client address, over it the\n"
+          "                                 connection is reset (default 0, unlimited)\n"
+          "    --req-rate <rate>[:<burst>]  the requests per second of a client address, over it 429 is answered\n"
+          "                                 (default 0, unlimited)\n"
+          "    --rate-subnet-scale <num>    the /24 or /64 network of a client gets num times the rates,\n"
+          "                                 0 limits the addresses only (default 8)\n"
+          "    --rate-table-size <num>      the client buckets shared by the workers (default 65536)\n"
+          "    --access-log <file>          write the binary access records, decoded by tools/AccessLogDump,\n"
+          "                                 the workers write <file>.w<slot>\n"
+          "    --access-log-size <MB>       the size of a log file before it is rotated (default 64)\n"
+          "    --access-log-keep <num>      the rotated files kept as <file>.1 ... <file>.num (default 4)\n"
+          "    --busy-poll <us>             spin up to us microseconds on the events before sleeping, and busy poll\n"
+          "                                 the sockets, the CPU per request is logged every 10 s (default 0, off)\n"
+          "    --websocket <prefix>         accept the WebSocket upgrade on the paths under prefix, may be repeated,\n"
+          "                                 a message is broadcast to all the connections of the same path\n"
+          "    --websocket-max-message <bytes>  the max size of a message of a client (default 1048576)\n"
+          "    --stats-path <path>          answer the counters and the memory of the connections as text on the path\n"
+          "    --health-path <path>         answer {\"status\":\"ok\"} on the path, 503 with \"draining\" after SIGTERM\n"
+          "    --idle-park-delay <ms>       park a keep-alive connection idle for ms, its buffers and timerfd are\n"
+          "                                 given back until the next request (default 1000)\n"
+          "    --unix <path>                also listen on the Unix socket, @<name> is abstract, may be repeated,\n"
+          "                                 the CGI gets the client process as REMOTE_PID, REMOTE_UID and REMOTE_GID\n"
+          "    --perf-counters              count the cycles, instructions, cache misses and context switches of\n"
+          "                                 every request class and status on the stats path, by perf_event_open\n"
+          "    --cgi-cache <path>=<seconds> cache the outputs of the CGI script by the request body for seconds,\n"
+          "                                 the same requests running at once share one process, may be repeated\n"
+          "    --cgi-cache-size <MB>        the max size of the CGI outputs cached (default 16)\n"
+          "    --heavy-hitters <k>          show the top k paths and clients by requests and by bytes on the stats\n"
+          "                                 path, counted by streaming sketches in a fixed memory (1 to 32)",
+          prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    enum { OPT_MAX_HEADER_SIZE = 256, OPT_MAX_BODY_SIZE, OPT_MAX_IDLE_CONNS, OPT_MAX_KEEPALIVE_REQUESTS,
+           OPT_WORKERS, OPT_THREADS, OPT_FILE_CACHE_SIZE, OPT_DRAIN_TIMEOUT, OPT_HANDOFF_SOCKET,
+           OPT_BUNDLE, OPT_BUNDLE_NO_POPULATE, OPT_BUNDLE_HUGEPAGES,
+           OPT_TLS_PORT, OPT_TLS_CERT, OPT_TLS_KEY, OPT_TLS_TICKET_KEY, OPT_TRACE_SAMPLE, OPT_TRACE_DIR,
+           OPT_PROXY, OPT_PROXY_IDLE, OPT_CONN_RATE, OPT_REQ_RATE, OPT_RATE_SUBNET_SCALE, OPT_RATE_TABLE_SIZE,
+           OPT_ACCESS_LOG, OPT_ACCESS_LOG_SIZE, OPT_ACCESS_LOG_KEEP, OPT_BUSY_POLL,
+           OPT_WEBSOCKET, OPT_WEBSOCKET_MAX_MESSAGE, OPT_STATS_PATH, OPT_IDLE_PARK_DELAY,
+           OPT_UNIX, OPT_HEALTH_PATH, OPT_PERF_COUNTERS, OPT_CGI_CACHE, OPT_CGI_CACHE_SIZE,
+           OPT_HEAVY_HITTERS };
+    static const option long_options[] = {
+            { "max-header-size",    required_argument, nullptr, OPT_MAX_HEADER_SIZE },
+            { "max-body-size",      required_argument, nullptr, OPT_MAX_BODY_SIZE },
+            { "max-idle-conns",     required_argument, nullptr, OPT_MAX_IDLE_CONNS },
+            { "max-keepalive-requests", required_argument, nullptr, OPT_MAX_KEEPALIVE_REQUESTS },
+            { "workers",            required_argument, nullptr, OPT_WORKERS },
+            { "threads",            required_argument, nullptr, OPT_THREADS },
+            { "file-cache-size",    required_argument, nullptr, OPT_FILE_CACHE_SIZE },
+            { "drain-timeout",      required_argument, nullptr, OPT_DRAIN_TIMEOUT },
+            { "handoff-socket",     required_argument, nullptr, OPT_HANDOFF_SOCKET },
+            { "bundle",             required_argument, nullptr, OPT_BUNDLE },
+            { "bundle-no-populate", no_argument,       nullptr, OPT_BUNDLE_NO_POPULATE },
+            { "bundle-hugepages",   no_argument,       nullptr, OPT_BUNDLE_HUGEPAGES },
+            { "tls-port",           required_argument, nullptr, OPT_TLS_PORT },
+            { "tls-cert",           required_argument, nullptr, OPT_TLS_CERT },
+            { "tls-key",            required_argument, nullptr, OPT_TLS_KEY },
+            { "tls-ticket-key",     required_argument, nullptr, OPT_TLS_TICKET_KEY },
+            { "trace-sample",       required_argument, nullptr, OPT_TRACE_SAMPLE },
+            { "trace-dir",          required_argument, nullptr, OPT_TRACE_DIR },
+            { "proxy",              required_argument, nullptr, OPT_PROXY },
+            { "proxy-idle",         required_argument, nullptr, OPT_PROXY_IDLE },
+            { "conn-rate",          required_argument, nullptr, OPT_CONN_RATE },
+            { "req-rate",           required_argument, nullptr, OPT_REQ_RATE },
+            { "rate-subnet-scale",  required_argument, nullptr, OPT_RATE_SUBNET_SCALE },
+            { "rate-table-size",    required_argument, nullptr, OPT_RATE_TABLE_SIZE },
+            { "access-log",         required_argument, nullptr, OPT_ACCESS_LOG },
+            { "access-log-size",    required_argument, nullptr, OPT_ACCESS_LOG_SIZE },
+            { "access-log-keep",    required_argument, nullptr, OPT_ACCESS_LOG_KEEP },
+            { "busy-poll",          required_argument, nullptr, OPT_BUSY_POLL },
+            { "websocket",          required_argument, nullptr, OPT_WEBSOCKET },
+            { "websocket-max-message", required_argument, nullptr, OPT_WEBSOCKET_MAX_MESSAGE },
+            { "stats-path",         required_argument, nullptr, OPT_STATS_PATH },
+            { "idle-park-delay",    required_argument, nullptr, OPT_IDLE_PARK_DELAY },
+            { "unix",               required_argument, nullptr, OPT_UNIX },
+            { "health-path",        required_argument, nullptr, OPT_HEALTH_PATH },
+            { "perf-counters",      no_argument,       nullptr, OPT_PERF_COUNTERS },
+            { "cgi-cache",          required_argument, nullptr, OPT_CGI_CACHE },
+            { "cgi-cache-size",     required_argument, nullptr, OPT_CGI_CACHE_SIZE },
+            { "heavy-hitters",      required_argument, nullptr, OPT_HEAVY_HITTERS },
+            { nullptr,              0,                 nullptr, 0 }
+    };
+    size_t workerNum = 0;
+    size_t threadNum = 8;
+    long fileCacheSize = -1;
+    string bundlePath;
+    bool bundlePopulate = true;
+    bool bundleHugepages = false;
+    int tlsPort = 0;
+    string tlsCert, tlsKey;
+    vector<string> tlsTicketKeys;
+    size_t rateTableSize = 65536;
+    int opt;
+    while((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        bool isStrOpt = opt == OPT_HANDOFF_SOCKET || opt == OPT_BUNDLE || opt == OPT_TLS_CERT
+                        || opt == OPT_TLS_KEY || opt == OPT_TLS_TICKET_KEY || opt == OPT_TRACE_DIR
+                        || opt == OPT_PROXY || opt == OPT_CONN_RATE || opt == OPT_REQ_RATE
+                        || opt == OPT_ACCESS_LOG || opt == OPT_WEBSOCKET || opt == OPT_STATS_PATH
+                        || opt == OPT_UNIX || opt == OPT_HEALTH_PATH || opt == OPT_CGI_CACHE;
+        if(optarg && !isStrOpt && (!isNumericStr(optarg) || !*optarg))
+            usage(argv[0]);
+        switch(opt)
+        {
+            case OPT_MAX_HEADER_SIZE:
+                HttpHandler::setMaxHeaderSize(strtoull(optarg, nullptr, 10));
+                break;
+            case OPT_MAX_BODY_SIZE:
+                HttpHandler::setMaxBodySize(strtoull(optarg, nullptr, 10));
+                break;
+            case OPT_MAX_IDLE_CONNS:
+                HttpHandler::setMaxIdleConnections(strtoull(optarg, nullptr, 10));
+                break;
+            case OPT_MAX_KEEPALIVE_REQUESTS:
+                HttpHandler::setMaxRequestsPerConnection(atoi(optarg));
+                break;
+            case OPT_WORKERS:
+                workerNum = strtoull(optarg, nullptr, 10);
+                if(workerNum > static_cast<size_t>(FileCache::MAX_SLOTS))
+                    usage(argv[0]);
+                break;
+            case OPT_THREADS:
+                threadNum = strtoull(optarg, nullptr, 10);
+                if(threadNum == 0)
+                    usage(argv[0]);
+                break;
+            case OPT_FILE_CACHE_SIZE:
+                fileCacheSize = atol(optarg);
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                drain_timeout = atol(optarg);
+                break;
+            case OPT_HANDOFF_SOCKET:
+                handoff_path = optarg;
+                break;
+            case OPT_BUNDLE:
+                bundlePath = optarg;
+                break;
+            case OPT_BUNDLE_NO_POPULATE:
+                bundlePopulate = false;
+                break;
+            case OPT_BUNDLE_HUGEPAGES:
+                bundleHugepages = true;
+                break;
+            case OPT_TLS_PORT:
+                tlsPort = atoi(optarg);
+                break;
+            case OPT_TLS_CERT:
+                tlsCert = optarg;
+                break;
+            case OPT_TLS_KEY:
+                tlsKey = optarg;
+                break;
+            case OPT_TLS_TICKET_KEY:
+                tlsTicketKeys.push_back(optarg);
+                break;
+            case OPT_TRACE_SAMPLE:
+                Trace::setSampleRate(static_cast<unsigned>(strtoul(optarg, nullptr, 10)));
+                break;
+            case OPT_TRACE_DIR:
+                trace_dir = optarg;
+                break;
+            case OPT_PROXY:
+                if(!Proxy::addRoute(optarg))
+                    usage(argv[0]);
+                break;
+            case OPT_PROXY_IDLE:
+                Upstream::setMaxIdle(strtoull(optarg, nullptr, 10));
+                break;
+            case OPT_CONN_RATE:
+            case OPT_REQ_RATE:
+            {
+                RateLimit::Limit limit;
+                if(!RateLimit::parseLimit(optarg, &limit))
+                    usage(argv[0]);
+                if(opt == OPT_CONN_RATE)
+                    RateLimit::setConnectionLimit(limit);
+                else
+                    RateLimit::setRequestLimit(limit);
+                break;
+            }
+            case OPT_RATE_SUBNET_SCALE:
+                RateLimit::setSubnetScale(static_cast<uint32_t>(strtoul(optarg, nullptr, 10)));
+                break;
+            case OPT_RATE_TABLE_SIZE:
+                rateTableSize = strtoull(optarg, nullptr, 10);
+                if(rateTableSize == 0)
+                    usage(argv[0]);
+                break;
+            case OPT_ACCESS_LOG:
+                access_log_path = optarg;
+                break;
+            case OPT_ACCESS_LOG_SIZE:
+            {
+                size_t size = strtoull(optarg, nullptr, 10);
+                if(size == 0 || size > 4096)
+                    usage(argv[0]);
+                AccessLog::setFileSize(size << 20);
+                break;
+            }
+            case OPT_ACCESS_LOG_KEEP:
+                AccessLog::setKeepFiles(static_cast<unsigned>(strtoul(optarg, nullptr, 10)));
+                break;
+            case OPT_BUSY_POLL:
+            {
+                unsigned long spin_us = strtoul(optarg, nullptr, 10);
+                if(spin_us > 1000000)
+                    usage(argv[0]);
+                busy_poll_us = static_cast<int>(spin_us);
+                break;
+            }
+            case OPT_WEBSOCKET:
+                if(!WebSocketSession::addRoute(optarg))
+                    usage(argv[0]);
+                break;
+            case OPT_WEBSOCKET_MAX_MESSAGE:
+            {
+                size_t size = strtoull(optarg, nullptr, 10);
+                if(size == 0)
+                    usage(argv[0]);
+                WebSocketSession::setMaxMessageSize(size);
+                break;
+            }
+            case OPT_STATS_PATH:
+                if(!Router::addHandler(Router::MASK_GET, optarg, Stats::serve))
+                    usage(argv[0]);
+                break;
+            case OPT_HEALTH_PATH:
+                if(!Router::addHandler(Router::MASK_GET, optarg, Stats::serveHealth))
+                    usage(argv[0]);
+                break;
+            case OPT_IDLE_PARK_DELAY:
+                HttpHandler::setIdleParkDelay(static_cast<int64_t>(strtoull(optarg, nullptr, 10)));
+                break;
+            case OPT_UNIX:
+                if(!*optarg || find(unix_paths.begin(), unix_paths.end(), optarg) != unix_paths.end())
+                    usage(argv[0]);
+                unix_paths.push_back(optarg);
+                break;
+            case OPT_PERF_COUNTERS:
+                PerfCounters::enable();
+                break;
+            case OPT_CGI_CACHE:
+                if(!CgiCache::addScript(optarg))
+                    usage(argv[0]);
+                break;
+            case OPT_CGI_CACHE_SIZE:
+                CgiCache::setMaxSize(strtoull(optarg, nullptr, 10) * 1024 * 1024);
+                break;
+            case OPT_HEAVY_HITTERS:
+            {
+                size_t top = strtoull(optarg, nullptr, 10);
+                if(top == 0 || top > HeavyHitters::MAX_TOP)
+                    usage(argv[0]);
+                HeavyHitters::setTop(top);
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 1 || !isNumericStr(argv[optind]))
+        usage(argv[0]);
+    int port = atoi(argv[optind]);
+    if(argc - optind > 1)
+        HttpHandler::setWWWPath(argv[optind + 1]);
+    if((tlsPort != 0) != (!tlsCert.empty() && !tlsKey.empty()) || tlsPort == port)
+        usage(argv[0]);
+    // The native routes and the proxy routes are added by the options, the files take the rest
+    Router::compile();
+
+    INFO("PID: %d", getpid());
+    handleSigpipe();
+    // Before any thread or worker, so that only signalfd receives them
+    blockServerSignals();
+    ErrorPages::init();
+    HttpDate::update();
+
+    // The cache is mapped before fork, so all the workers share it
+    if(fileCacheSize == -1)
+        fileCacheSize = (workerNum > 0) ? 32 : 0;
+    if(!FileCache::create(static_cast<size_t>(fileCacheSize) << 20))
+        WARN("File cache is disabled");
+    if(!bundlePath.empty() && !Bundle::open(bundlePath, bundlePopulate, bundleHugepages))
+        exit(EXIT_FAILURE);
+    // The workers share the certificate and the ticket keys
+    if(tlsPort != 0 && !TlsContext::init(tlsCert, tlsKey, tlsTicketKeys))
+        exit(EXIT_FAILURE);
+    // The workers count the clients in the same buckets
+    if(!RateLimit::create(rateTableSize))
+        exit(EXIT_FAILURE);
+
+    // Take over the sockets of the running server, or bind new ones
+    vector<int> listen_fds, tls_listen_fds;
+    vector<int> unix_listen_fds(unix_paths.size(), -1);
+    vector<int> received_fds;
+    int old_conn = -1;
+    if(!handoff_path.empty() && Handoff::receive(handoff_path, &received_fds, &old_conn))
+    {
+        // The HTTPS sockets are told by their port, the Unix sockets by their path
+        for(int fd : received_fds)
+        {
+            string unix_path = getSocketUnixPath(fd);
+            if(!unix_path.empty())
+            {
+                auto iter = find(unix_paths.begin(), unix_paths.end(), unix_path);
+                if(iter != unix_paths.end() && unix_listen_fds[iter - unix_paths.begin()] == -1)
+                    unix_listen_fds[iter - unix_paths.begin()] = fd;
+                else
+                {
+                    WARN("Close the received socket of unix:%s", unix_path.c_str());
+                    close(fd);
+                }
+                continue;
+            }
+            int fd_port = getSocketPort(fd);
+            if(fd_port == port)
+                listen_fds.push_back(fd);
+            else if(tlsPort != 0 && fd_port == tlsPort)
+                tls_listen_fds.push_back(fd);
             else
-                handleOldConnection(&epoll, fd, &thread_pool, &event);
+            {
+                WARN("Close the received socket of port %d", fd_port);
+                close(fd);
+            }
+        }
+        if(listen_fds.empty() || (!tls_listen_fds.empty() && tls_listen_fds.size() != listen_fds.size()))
+        {
+            ERROR("The received sockets do not match the ports");
+            exit(EXIT_FAILURE);
         }
+        if(workerNum > 0 && workerNum != listen_fds.size())
+            WARN("Run %ld workers as the received sockets, not %ld", listen_fds.size(), workerNum);
     }
-    delete listen_epollevent;
+    else
+        bindListeners(port, max(workerNum, static_cast<size_t>(1)), workerNum > 0, &listen_fds);
+    // The old server did not listen for HTTPS
+    if(tlsPort != 0 && tls_listen_fds.empty())
+        bindListeners(tlsPort, listen_fds.size(), workerNum > 0, &tls_listen_fds);
+    for(size_t i = 0; i < unix_paths.size(); i++)
+    {
+        if(unix_listen_fds[i] != -1)
+            continue;
+        unix_listen_fds[i] = unix_bind_and_listen(unix_paths[i]);
+        if(unix_listen_fds[i] == -1)
+        {
+            ERROR("Listen on unix:%s failed ! (%s)", unix_paths[i].c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        INFO("Listen on unix:%s", unix_paths[i].c_str());
+    }
+
+    HandoffState handoff;
+    if(!handoff_path.empty())
+        handoff.listen_fd = Handoff::listen(handoff_path);
+
+    if(workerNum > 0)
+        runMaster(listen_fds, tls_listen_fds, unix_listen_fds, threadNum, &handoff, old_conn);
+    else
+        runWorker(listen_fds, tls_listen_fds, unix_listen_fds, threadNum, &handoff, old_conn);
+    // The files of the Unix sockets belong to the new server after the handoff
+    if(!handoff.handed_over)
+        for(const string& path : unix_paths)
+            if(path[0] != '@')
+                unlink(path.c_str());
+    handoff.shutdown();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,291 @@
+/**
+ * Decode the binary access log written by "WebServer --access-log"
+ *
+ * usage: AccessLogDump [--clf | --json | --stats] <file>...
+ *
+ *   --clf    the Common Log Format, one line per request (default)
+ *   --json   one JSON object per request, with the stage durations
+ *   --stats  the status classes, the latency percentiles and the top paths of all the files
+ *
+ * Every file defines the paths it uses, so the rotated files and the files of the workers can be
+ * decoded in any order.
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "AccessLog.h"
+
+using namespace std;
+
+enum OUTPUT_MODE { OUTPUT_CLF, OUTPUT_JSON, OUTPUT_STATS };
+
+struct PathStats
+{
+    uint64_t count;
+    uint64_t bytes_out;
+    vector<uint32_t> total_us;
+};
+
+struct Stats
+{
+    uint64_t requests;
+    uint64_t aborted;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t status_classes[6];     // 0 for no status, 1xx ... 5xx
+    int64_t first_us;
+    int64_t last_us;
+    vector<uint32_t> total_us;
+    map<string, PathStats> paths;
+};
+
+static const char* methodName(uint8_t method)
+{
+    static const char* names[] = { "GET", "POST", "HEAD" };
+    return method < 3 ? names[method] : "-";
+}
+
+static const char* protocolName(uint8_t flags)
+{
+    if(flags & AccessLog::FLAG_HTTP2)
+        return "HTTP/2.0";
+    return (flags & AccessLog::FLAG_HTTP10) ? "HTTP/1.0" : "HTTP/1.1";
+}
+
+static string addressOf(const AccessLog::Record& record)
+{
+    char buf[INET6_ADDRSTRLEN];
+    if(record.flags & AccessLog::FLAG_IPV6)
+        inet_ntop(AF_INET6, record.addr, buf, sizeof(buf));
+    else
+        inet_ntop(AF_INET, record.addr, buf, sizeof(buf));
+    return buf;
+}
+
+static void writeJsonString(const string& str)
+{
+    putchar('"');
+    for(unsigned char ch : str)
+    {
+        if(ch == '"' || ch == '\\')
+            printf("\\%c", ch);
+        else if(ch < 0x20)
+            printf("\\u%04x", ch);
+        else
+            putchar(ch);
+    }
+    putchar('"');
+}
+
+static void printClf(const AccessLog::Record& record, const string& path)
+{
+    time_t sec = static_cast<time_t>(record.time_us / 1000000);
+    tm tm_time;
+    gmtime_r(&sec, &tm_time);
+    char date[64];
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm_time);
+    printf("%s - - [%s] \"%s %s %s\" ", addressOf(record).c_str(), date, methodName(record.method),
+           path.c_str(), protocolName(record.flags));
+    if(record.status)
+        printf("%u ", record.status);
+    else
+        printf("- ");
+    if(record.bytes_out)
+        printf("%" PRIu64 "\n", record.bytes_out);
+    else
+        printf("-\n");
+}
+
+static void printJson(const AccessLog::Record& record, const string& path)
+{
+    time_t sec = static_cast<time_t>(record.time_us / 1000000);
+    tm tm_time;
+    gmtime_r(&sec, &tm_time);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm_time);
+    uint32_t send_us = record.total_us - min(record.total_us, record.read_us + record.handle_us);
+    printf("{\"time\":\"%s.%06dZ\",\"addr\":\"%s\",\"port\":%u,\"method\":\"%s\",\"path\":",
+           date, static_cast<int>(record.time_us % 1000000), addressOf(record).c_str(), record.port,
+           methodName(record.method));
+    writeJsonString(path);
+    printf(",\"protocol\":\"%s\",\"status\":%u,\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ","
+           "\"read_us\":%u,\"handle_us\":%u,\"send_us\":%u,\"total_us\":%u,"
+           "\"tls\":%s,\"keep_alive\":%s,\"aborted\":%s}\n",
+           protocolName(record.flags), record.status, record.bytes_in, record.bytes_out,
+           record.read_us, record.handle_us, send_us, record.total_us,
+           (record.flags & AccessLog::FLAG_TLS) ? "true" : "false",
+           (record.flags & AccessLog::FLAG_KEEPALIVE) ? "true" : "false",
+           (record.flags & AccessLog::FLAG_ABORTED) ? "true" : "false");
+}
+
+static void addStats(const AccessLog::Record& record, const string& path, Stats* stats)
+{
+    if(stats->requests == 0 || record.time_us < stats->first_us)
+        stats->first_us = record.time_us;
+    if(stats->requests == 0 || record.time_us > stats->last_us)
+        stats->last_us = record.time_us;
+    ++stats->requests;
+    if(record.flags & AccessLog::FLAG_ABORTED)
+        ++stats->aborted;
+    stats->bytes_in += record.bytes_in;
+    stats->bytes_out += record.bytes_out;
+    ++stats->status_classes[(record.status >= 100 && record.status < 600) ? record.status / 100 : 0];
+    stats->total_us.push_back(record.total_us);
+
+    PathStats& path_stats = stats->paths[path];
+    ++path_stats.count;
+    path_stats.bytes_out += record.bytes_out;
+    path_stats.total_us.push_back(record.total_us);
+}
+
+static uint32_t percentile(vector<uint32_t>& values, double ratio)
+{
+    if(values.empty())
+        return 0;
+    size_t pos = min(values.size() - 1, static_cast<size_t>(ratio * values.size()));
+    nth_element(values.begin(), values.begin() + pos, values.end());
+    return values[pos];
+}
+
+static void printStats(Stats* stats)
+{
+    printf("requests       %" PRIu64 " (%" PRIu64 " aborted)\n", stats->requests, stats->aborted);
+    if(stats->requests == 0)
+        return;
+    double seconds = (stats->last_us - stats->first_us) / 1e6;
+    printf("span           %.1f s, %.1f requests/s\n", seconds, seconds > 0 ? stats->requests / seconds : 0.0);
+    printf("bytes          %" PRIu64 " in, %" PRIu64 " out\n", stats->bytes_in, stats->bytes_out);
+    printf("status         ");
+    for(int i = 1; i < 6; i++)
+        printf("%dxx %" PRIu64 "  ", i, stats->status_classes[i]);
+    printf("none %" PRIu64 "\n", stats->status_classes[0]);
+    printf("latency (us)   p50 %u  p90 %u  p99 %u  max %u\n", percentile(stats->total_us, 0.5),
+           percentile(stats->total_us, 0.9), percentile(stats->total_us, 0.99),
+           *max_element(stats->total_us.begin(), stats->total_us.end()));
+
+    vector<pair<uint64_t, string>> top;
+    for(auto& iter : stats->paths)
+        top.emplace_back(iter.second.count, iter.first);
+    sort(top.begin(), top.end(), [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b)
+    {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    printf("\n%10s %10s %10s %14s  %s\n", "count", "p50 us", "p99 us", "bytes out", "path");
+    for(size_t i = 0; i < top.size() && i < 20; i++)
+    {
+        PathStats& path_stats = stats->paths[top[i].second];
+        printf("%10" PRIu64 " %10u %10u %14" PRIu64 "  %s\n", path_stats.count, percentile(path_stats.total_us, 0.5),
+               percentile(path_stats.total_us, 0.99), path_stats.bytes_out, top[i].second.c_str());
+    }
+}
+
+/**
+ * @brief Decode the records of a file
+ * @return false if it is not an access log
+ */
+static bool decodeFile(const char* file, OUTPUT_MODE mode, Stats* stats)
+{
+    FILE* input = fopen(file, "rb");
+    if(!input)
+    {
+        fprintf(stderr, "open %s failed: %s\n", file, strerror(errno));
+        return false;
+    }
+    string data;
+    char buf[65536];
+    size_t len;
+    while((len = fread(buf, 1, sizeof(buf), input)) > 0)
+        data.append(buf, len);
+    fclose(input);
+
+    AccessLog::FileHeader header;
+    if(data.size() < sizeof(header))
+    {
+        fprintf(stderr, "%s: not an access log\n", file);
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if(memcmp(header.magic, AccessLog::magic(), sizeof(header.magic)) != 0
+       || header.version != AccessLog::VERSION || header.record_size != AccessLog::RECORD_SIZE)
+    {
+        fprintf(stderr, "%s: not an access log of version %u\n", file, AccessLog::VERSION);
+        return false;
+    }
+
+    // A file of a killed server is not truncated, its records end at the first empty one
+    size_t end = min(data.size(), sizeof(header) + header.used);
+    map<uint32_t, string> paths;
+    paths[static_cast<uint32_t>(AccessLog::PATH_NONE)] = "-";
+    paths[static_cast<uint32_t>(AccessLog::PATH_OTHER)] = "(other)";
+    for(size_t pos = sizeof(header); pos + AccessLog::RECORD_SIZE <= end; pos += AccessLog::RECORD_SIZE)
+    {
+        uint8_t type = static_cast<uint8_t>(data[pos]);
+        if(type == AccessLog::RECORD_PATH)
+        {
+            AccessLog::PathRecord def;
+            memcpy(&def, data.data() + pos, sizeof(def));
+            if(pos + AccessLog::RECORD_SIZE + def.len > end)
+                break;
+            paths[def.path_id].assign(data, pos + AccessLog::RECORD_SIZE, def.len);
+            pos += (def.len + AccessLog::RECORD_SIZE - 1) / AccessLog::RECORD_SIZE * AccessLog::RECORD_SIZE;
+            continue;
+        }
+        if(type != AccessLog::RECORD_REQUEST)
+            break;
+
+        AccessLog::Record record;
+        memcpy(&record, data.data() + pos, sizeof(record));
+        auto iter = paths.find(record.path_id);
+        string path = (iter != paths.end()) ? iter->second : "#" + to_string(record.path_id);
+        if(mode == OUTPUT_CLF)
+            printClf(record, path);
+        else if(mode == OUTPUT_JSON)
+            printJson(record, path);
+        else
+            addStats(record, path, stats);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    OUTPUT_MODE mode = OUTPUT_CLF;
+    int first = 1;
+    if(argc > 1 && strcmp(argv[1], "--clf") == 0)
+        first = 2;
+    else if(argc > 1 && strcmp(argv[1], "--json") == 0)
+    {
+        mode = OUTPUT_JSON;
+        first = 2;
+    }
+    else if(argc > 1 && strcmp(argv[1], "--stats") == 0)
+    {
+        mode = OUTPUT_STATS;
+        first = 2;
+    }
+    if(first >= argc)
+    {
+        fprintf(stderr, "usage: %s [--clf | --json | --stats] <file>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Stats stats;
+    stats.requests = stats.aborted = stats.bytes_in = stats.bytes_out = 0;
+    memset(stats.status_classes, 0, sizeof(stats.status_classes));
+    stats.first_us = stats.last_us = 0;
+    bool ok = true;
+    for(int i = first; i < argc; i++)
+        ok = decodeFile(argv[i], mode, &stats) && ok;
+    if(mode == OUTPUT_STATS)
+        printStats(&stats);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
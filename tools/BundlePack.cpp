@@ -0,0 +1,226 @@
+/**
+ * Pack a www directory into a bundle served by "WebServer --bundle"
+ *
+ * usage: BundlePack <www_dir> <output>
+ *
+ * Every regular file is indexed by its request path, "/dir/index.html" is also indexed as "/dir/" and "/dir".
+ * If "name.gz" is next to "name", it is packed as the gzip variant of "name" instead of a file of its own.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Bundle.h"
+#include "HttpHandler.h"
+
+using namespace std;
+
+struct SourceFile
+{
+    string path;                // the request path
+    string file;                // the file on the disk
+    string gzip_file;           // the precompressed variant, empty if none
+};
+
+static bool readFile(const string& file, string* data)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return false;
+    char buf[65536];
+    ssize_t len;
+    data->clear();
+    while((len = read(fd, buf, sizeof(buf))) > 0)
+        data->append(buf, static_cast<size_t>(len));
+    close(fd);
+    return len == 0;
+}
+
+static void walk(const string& dir, const string& prefix, vector<SourceFile>* files)
+{
+    DIR* dp = opendir(dir.c_str());
+    if(!dp)
+    {
+        fprintf(stderr, "open %s failed: %s\n", dir.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    vector<string> names;
+    while(dirent* ent = readdir(dp))
+        if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+            names.push_back(ent->d_name);
+    closedir(dp);
+    sort(names.begin(), names.end());
+
+    for(const string& name : names)
+    {
+        string file = dir + "/" + name;
+        struct stat st;
+        if(stat(file.c_str(), &st) == -1)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            walk(file, prefix + "/" + name, files);
+        else if(S_ISREG(st.st_mode))
+        {
+            // "name.gz" is the variant of "name"
+            if(name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0
+               && binary_search(names.begin(), names.end(), name.substr(0, name.size() - 3)))
+                continue;
+            SourceFile source = { prefix + "/" + name, file, "" };
+            if(binary_search(names.begin(), names.end(), name + ".gz"))
+                source.gzip_file = file + ".gz";
+            files->push_back(source);
+        }
+    }
+}
+
+static string contentTypeOf(const string& path)
+{
+    // the same rule as HttpHandler::getContentType()
+    string suffix = path;
+    size_t dot_pos;
+    while((dot_pos = suffix.find('.')) != string::npos)
+        suffix = suffix.substr(dot_pos + 1);
+    return MimeType::getMineType(suffix);
+}
+
+static string etagOf(const string& data, const char* tag)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%016llx%s\"",
+             static_cast<unsigned long long>(Bundle::hashPath(data.data(), data.size())), tag);
+    return buf;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 3)
+    {
+        fprintf(stderr, "usage: %s <www_dir> <output>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    string root = argv[1];
+    while(root.size() > 1 && root.back() == '/')
+        root.pop_back();
+
+    vector<SourceFile> files;
+    walk(root, "", &files);
+
+    // The index pages are also reached by their directories
+    size_t file_num = files.size();
+    for(size_t i = 0; i < file_num; i++)
+    {
+        const string& path = files[i].path;
+        static const string index = "/index.html";
+        if(path.size() >= index.size() && path.compare(path.size() - index.size(), index.size(), index) == 0)
+        {
+            string dir = path.substr(0, path.size() - index.size());
+            files.push_back({ dir + "/", files[i].file, files[i].gzip_file });
+            if(!dir.empty())
+                files.push_back({ dir, files[i].file, files[i].gzip_file });
+        }
+    }
+
+    uint32_t slot_num = 16;
+    while(slot_num < files.size() * 2)
+        slot_num <<= 1;
+
+    vector<Bundle::Entry> slots(slot_num);
+    memset(slots.data(), 0, sizeof(Bundle::Entry) * slot_num);
+    string strings;
+    string bodies;              // the bodies, the offsets are relative to the body area
+    map<string, uint64_t> body_offsets;
+    size_t strings_base = sizeof(Bundle::FileHeader) + sizeof(Bundle::Entry) * slot_num;
+
+    for(const SourceFile& source : files)
+    {
+        uint64_t hash = Bundle::hashPath(source.path.data(), source.path.size());
+        uint32_t pos = hash & (slot_num - 1);
+        while(slots[pos].path_len != 0)
+            pos = (pos + 1) & (slot_num - 1);
+        Bundle::Entry& entry = slots[pos];
+        entry.hash = hash;
+        entry.path_off = static_cast<uint32_t>(strings_base + strings.size());
+        entry.path_len = static_cast<uint32_t>(source.path.size());
+        strings += source.path;
+
+        string type = contentTypeOf(source.file);
+        for(int v = 0; v < Bundle::VARIANT_NUM; v++)
+        {
+            const string& file = (v == Bundle::VARIANT_IDENTITY) ? source.file : source.gzip_file;
+            string data;
+            if(file.empty())
+                continue;
+            if(!readFile(file, &data))
+            {
+                fprintf(stderr, "read %s failed: %s\n", file.c_str(), strerror(errno));
+                return EXIT_FAILURE;
+            }
+            Bundle::Variant& variant = entry.variants[v];
+            string etag = etagOf(data, v == Bundle::VARIANT_GZIP ? "-gz" : "");
+            string fields = "Content-Length: " + to_string(data.size()) + "\r\n"
+                            "Content-Type: " + type + "\r\n"
+                            "ETag: " + etag + "\r\n";
+            if(v == Bundle::VARIANT_GZIP)
+                fields += "Content-Encoding: gzip\r\n";
+            if(!source.gzip_file.empty())
+                fields += "Vary: Accept-Encoding\r\n";
+
+            variant.fields_off = static_cast<uint32_t>(strings_base + strings.size());
+            variant.fields_len = static_cast<uint32_t>(fields.size());
+            strings += fields;
+            variant.etag_off = static_cast<uint32_t>(strings_base + strings.size());
+            variant.etag_len = static_cast<uint32_t>(etag.size());
+            strings += etag;
+
+            // Every body starts at a page boundary, the aliases of a file share its body
+            auto packed = body_offsets.find(file);
+            if(packed == body_offsets.end())
+            {
+                bodies.resize((bodies.size() + Bundle::PAGE_SIZE - 1) & ~(Bundle::PAGE_SIZE - 1), '\0');
+                packed = body_offsets.insert(make_pair(file, bodies.size())).first;
+                bodies += data;
+            }
+            variant.body_off = packed->second;
+            variant.body_len = data.size();
+        }
+    }
+
+    size_t body_base = (strings_base + strings.size() + Bundle::PAGE_SIZE - 1) & ~(Bundle::PAGE_SIZE - 1);
+    for(Bundle::Entry& entry : slots)
+        for(int v = 0; entry.path_len != 0 && v < Bundle::VARIANT_NUM; v++)
+            if(entry.variants[v].fields_len != 0)
+                entry.variants[v].body_off += body_base;
+
+    Bundle::FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, Bundle::magic(), sizeof(header.magic));
+    header.version = Bundle::VERSION;
+    header.slot_num = slot_num;
+    header.file_size = body_base + bodies.size();
+
+    string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(slots.data()), sizeof(Bundle::Entry) * slot_num);
+    out += strings;
+    out.resize(body_base, '\0');
+    out += bodies;
+
+    // Write a temporary file and rename it, the running servers keep the old one mapped
+    string tmp = string(argv[2]) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(!fp || fwrite(out.data(), 1, out.size(), fp) != out.size() || fclose(fp) != 0
+       || rename(tmp.c_str(), argv[2]) == -1)
+    {
+        fprintf(stderr, "write %s failed: %s\n", argv[2], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    printf("%ld paths, %ld bytes -> %s\n", files.size(), out.size(), argv[2]);
+    return EXIT_SUCCESS;
+}
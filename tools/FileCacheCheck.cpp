@@ -0,0 +1,159 @@
+/**
+ * Check that FileCache::recover() drops only the files being copied by the dead worker
+ *
+ * usage: FileCacheCheck
+ *
+ * Two forked workers insert a file each into one shared cache, and both are stopped in the middle of
+ * the copy. The first one is killed and recovered like the master does, then the second one finishes:
+ * its file must be served from the cache with its content, and the file of the dead one must not be.
+ * The exit status is 0 if all the checks pass.
+ */
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "FileCache.h"
+
+using namespace std;
+
+// A worker stops in its first pread: it writes a byte to ready_fd, then waits for a byte on go_fd
+static int ready_fd = -1;
+static int go_fd = -1;
+
+/**
+ * Replaces the pread of libc, FileCache::insert() copies the file with it
+ */
+extern "C" ssize_t pread(int fd, void* buf, size_t count, off_t offset)
+{
+    if(go_fd != -1)
+    {
+        char byte = 0;
+        if(write(ready_fd, &byte, 1) != 1 || read(go_fd, &byte, 1) < 0)
+            _exit(EXIT_FAILURE);
+        go_fd = -1;
+    }
+    return syscall(SYS_pread64, fd, buf, count, offset);
+}
+
+static bool writeFile(const string& path, char fill, size_t size)
+{
+    string data(size, fill);
+    FILE* file = fopen(path.c_str(), "w");
+    if(!file)
+        return false;
+    bool ok = fwrite(data.data(), 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+static void insertFile(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+        _exit(EXIT_FAILURE);
+    FileCache::insert(path, st, fd);
+    close(fd);
+}
+
+/**
+ * @brief Fork a worker of the slot inserting the file, it is stopped in the copy once *ready is readable
+ */
+static pid_t startFill(int slot, const string& path, int* ready, int* go)
+{
+    int ready_pipe[2], go_pipe[2];
+    if(pipe(ready_pipe) == -1 || pipe(go_pipe) == -1)
+        return -1;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        close(ready_pipe[0]);
+        close(go_pipe[1]);
+        FileCache::setSlot(slot);
+        ready_fd = ready_pipe[1];
+        go_fd = go_pipe[0];
+        insertFile(path);
+        _exit(EXIT_SUCCESS);
+    }
+    close(ready_pipe[1]);
+    close(go_pipe[0]);
+    *ready = ready_pipe[0];
+    *go = go_pipe[1];
+    return pid;
+}
+
+static bool isCached(const string& path, char fill, size_t size)
+{
+    FileCache::Ref ref;
+    if(!FileCache::lookup(path, &ref))
+        return false;
+    bool same = ref.size == size && string(ref.data, ref.size) == string(size, fill);
+    FileCache::release(ref);
+    return same;
+}
+
+static int fail(const char* check)
+{
+    fprintf(stderr, "FAILED: %s\n", check);
+    return EXIT_FAILURE;
+}
+
+int main()
+{
+    // The workers are stopped on pipes, a lost one must not hang the check
+    alarm(30);
+
+    char dir[] = "/tmp/FileCacheCheck.XXXXXX";
+    if(!mkdtemp(dir))
+        return fail("create the temporary directory");
+    const size_t size = 64 * 1024;
+    string dead_path = string(dir) + "/dead.bin", live_path = string(dir) + "/live.bin";
+    if(!writeFile(dead_path, 'd', size) || !writeFile(live_path, 'l', size))
+        return fail("write the files");
+    if(!FileCache::create(4 * 1024 * 1024))
+        return fail("create the cache");
+
+    int dead_ready, dead_go, live_ready, live_go;
+    pid_t dead = startFill(1, dead_path, &dead_ready, &dead_go);
+    pid_t live = startFill(2, live_path, &live_ready, &live_go);
+    if(dead <= 0 || live <= 0)
+        return fail("fork the workers");
+    char byte;
+    if(read(dead_ready, &byte, 1) != 1 || read(live_ready, &byte, 1) != 1)
+        return fail("both workers copying");
+
+    // The first worker dies in the middle of its copy
+    kill(dead, SIGKILL);
+    waitpid(dead, nullptr, 0);
+    FileCache::recover(dead, 1);
+
+    // The other one finishes its copy after the recovery
+    int status;
+    if(write(live_go, &byte, 1) != 1 || waitpid(live, &status, 0) != live || !WIFEXITED(status)
+       || WEXITSTATUS(status) != EXIT_SUCCESS)
+        return fail("the live worker finishes");
+
+    int result = EXIT_SUCCESS;
+    if(!isCached(live_path, 'l', size))
+        result = fail("the file of the live worker is cached");
+    if(isCached(dead_path, 'd', size))
+        result = fail("the file of the dead worker is not cached");
+    // The entry of the dead worker does not block the file
+    insertFile(dead_path);
+    if(!isCached(dead_path, 'd', size))
+        result = fail("the file of the dead worker is cached again");
+
+    unlink(dead_path.c_str());
+    unlink(live_path.c_str());
+    rmdir(dir);
+    if(result == EXIT_SUCCESS)
+        printf("ok\n");
+    return result;
+}
@@ -0,0 +1,268 @@
+/**
+ * Compare the scanning kernels of Scan with the code they replaced, at every level the CPU supports
+ *
+ * usage: ScanBench [--iterations <num>] [--body <bytes>]
+ *
+ *   --iterations  the runs of every case (default 200000, the escape cases run 1/100 of them)
+ *   --body        the size of the random POST body escaped for the log (default 16384)
+ *
+ * A line is printed for every case and implementation, with the ns per run. The results of all the
+ * implementations are checked against the legacy one first.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Scan.h"
+
+using namespace std;
+
+// the header section of a browser request
+static const char* const sampleRequest =
+    "GET /assets/app/main.3f9c2d.js?v=20230203 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"110\", \"Not A(Brand\";v=\"24\", \"Google Chrome\";v=\"110\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/110.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8b1f0c1e4a7d4e2f9a3b6c5d7e8f9012; theme=dark; consent=1\r\n"
+    "\r\n";
+
+static volatile size_t sink;
+
+// InputBuffer::findCRLF before Scan
+static size_t legacyFindCRLF(const char* begin, const char* end, size_t from)
+{
+    for(const char* pos = begin + from; pos < end; pos++)
+    {
+        pos = static_cast<const char*>(memchr(pos, '\r', static_cast<size_t>(end - pos)));
+        if(!pos || pos + 1 >= end)
+            break;
+        if(pos[1] == '\n')
+            return static_cast<size_t>(pos - begin);
+    }
+    return string::npos;
+}
+
+// parseHttpHeader before Scan, the request line is skipped
+static bool legacyParse(const string& buf, map<string, string>* headers)
+{
+    const char* begin = buf.data();
+    const char* end = begin + buf.size();
+    size_t pos1 = legacyFindCRLF(begin, end, 0) + 2, pos2;
+    for(; (pos2 = legacyFindCRLF(begin, end, pos1)) != string::npos; pos1 = pos2 + 2)
+    {
+        string header(begin + pos1, pos2 - pos1);
+        if(header.empty())
+            return true;
+        pos1 = header.find(' ');
+        if(pos1 == string::npos)
+            return false;
+        string&& key = header.substr(0, pos1);
+        if(key.size() < 2 || key.back() != ':')
+            return false;
+        key.pop_back();
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+        (*headers)[key] = header.substr(pos1 + 1);
+    }
+    return false;
+}
+
+// parseHttpHeader with Scan
+static bool scanParse(const string& buf, map<string, string>* headers)
+{
+    const char* begin = buf.data();
+    const char* end = begin + buf.size();
+    const char* line = Scan::findCRLF(begin, end) + 2;
+    for(const char* line_end; (line_end = Scan::findCRLF(line, end)) != nullptr; line = line_end + 2)
+    {
+        if(line == line_end)
+            return true;
+        const char* colon = Scan::findNonToken(line, line_end);
+        if(colon == line || colon == line_end || *colon != ':')
+            return false;
+        string key(line, static_cast<size_t>(colon - line));
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+        const char* value = colon + 1;
+        while(value < line_end && (*value == ' ' || *value == '\t'))
+            value++;
+        (*headers)[key].assign(value, static_cast<size_t>(line_end - value));
+    }
+    return false;
+}
+
+// escapeStr before Scan
+static string legacyEscape(const string& str, size_t MAXBUF)
+{
+    string msg = str;
+    for(size_t i = 0; i < msg.length(); i++)
+    {
+        char ch = msg[i];
+        if(!isprint(ch))
+        {
+            string substr;
+            if(ch == '\r')
+                substr = "\\r";
+            else if(ch == '\n')
+                substr = "\\n";
+            else
+            {
+                char hex[10];
+                snprintf(hex, 10, "\\x%02x", static_cast<unsigned char>(ch));
+                substr = hex;
+            }
+            msg.replace(i, 1, substr);
+        }
+    }
+    if(msg.length() > MAXBUF)
+        return msg.substr(0, MAXBUF) + " ... ... ";
+    else
+        return msg;
+}
+
+static string scanEscape(const string& str, size_t MAXBUF)
+{
+    string msg;
+    if(!Scan::escape(str.data(), str.size(), MAXBUF, &msg))
+    {
+        msg.resize(MAXBUF);
+        msg += " ... ... ";
+    }
+    return msg;
+}
+
+template<typename Func>
+static void run(const char* name, const char* impl, long iterations, Func func)
+{
+    auto start = chrono::steady_clock::now();
+    for(long i = 0; i < iterations; i++)
+        sink = sink + func();
+    double ns = static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    printf("%-28s %-8s %12.1f ns\n", name, impl, ns / static_cast<double>(iterations));
+}
+
+int main(int argc, char* argv[])
+{
+    long iterations = 200000;
+    size_t body_size = 16384;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = atol(argv[++i]);
+        else if(strcmp(argv[i], "--body") == 0 && i + 1 < argc)
+            body_size = strtoull(argv[++i], nullptr, 10);
+        else
+        {
+            fprintf(stderr, "usage: %s [--iterations <num>] [--body <bytes>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(iterations <= 0)
+        iterations = 1;
+
+    string request = sampleRequest;
+    // a binary body, and a text one with a line break every 64 bytes
+    mt19937 rng(2023);
+    string binary(body_size, '\0'), text(body_size, '\0');
+    for(size_t i = 0; i < body_size; i++)
+    {
+        binary[i] = static_cast<char>(rng());
+        text[i] = (i % 64 == 63) ? '\n' : static_cast<char>(' ' + rng() % 95);
+    }
+    const size_t log_limit = 4096;
+
+    Scan::LEVEL best = Scan::getLevel();
+    vector<Scan::LEVEL> levels;
+    for(int level = Scan::LEVEL_SCALAR; level <= best; level++)
+        levels.push_back(static_cast<Scan::LEVEL>(level));
+
+    // The kernels must agree with the legacy code
+    map<string, string> expected;
+    legacyParse(request, &expected);
+    for(Scan::LEVEL level : levels)
+    {
+        Scan::setLevel(level);
+        map<string, string> headers;
+        if(!scanParse(request, &headers) || headers != expected
+           || scanEscape(binary, SIZE_MAX) != legacyEscape(binary, SIZE_MAX)
+           || scanEscape(binary, log_limit) != legacyEscape(binary, log_limit)
+           || scanEscape(text, log_limit) != legacyEscape(text, log_limit))
+        {
+            fprintf(stderr, "the %s kernels differ from the legacy code\n", Scan::levelName(level));
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("best level: %s\n", Scan::levelName(best));
+    run("find CRLF (request)", "legacy", iterations, [&request]()
+    {
+        size_t count = 0;
+        const char* begin = request.data();
+        for(size_t pos = 0; (pos = legacyFindCRLF(begin, begin + request.size(), pos)) != string::npos; pos += 2)
+            count++;
+        return count;
+    });
+    for(Scan::LEVEL level : levels)
+    {
+        Scan::setLevel(level);
+        run("find CRLF (request)", Scan::levelName(level), iterations, [&request]()
+        {
+            size_t count = 0;
+            const char* end = request.data() + request.size();
+            for(const char* pos = request.data(); (pos = Scan::findCRLF(pos, end)) != nullptr; pos += 2)
+                count++;
+            return count;
+        });
+    }
+
+    run("parse headers", "legacy", iterations, [&request]()
+    {
+        map<string, string> headers;
+        legacyParse(request, &headers);
+        return headers.size();
+    });
+    for(Scan::LEVEL level : levels)
+    {
+        Scan::setLevel(level);
+        run("parse headers", Scan::levelName(level), iterations, [&request]()
+        {
+            map<string, string> headers;
+            scanParse(request, &headers);
+            return headers.size();
+        });
+    }
+
+    // The log escapes a whole read, the legacy code escapes all of it before cutting
+    long escape_iterations = max(1L, iterations / 100);
+    const pair<const char*, const string*> bodies[] = { { "escape binary body", &binary }, { "escape text body", &text } };
+    for(const auto& body : bodies)
+    {
+        run(body.first, "legacy", escape_iterations, [&body, log_limit]()
+        {
+            return legacyEscape(*body.second, log_limit).size();
+        });
+        for(Scan::LEVEL level : levels)
+        {
+            Scan::setLevel(level);
+            run(body.first, Scan::levelName(level), escape_iterations, [&body, log_limit]()
+            {
+                return scanEscape(*body.second, log_limit).size();
+            });
+        }
+    }
+    return EXIT_SUCCESS;
+}
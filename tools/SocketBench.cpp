@@ -0,0 +1,261 @@
+/**
+ * Compare the request rate and the latency of the listeners of a running server
+ *
+ * usage: SocketBench [--conns <num>] [--seconds <num>] [--path <path>] <target>...
+ *
+ *   <target>     <host>:<port> for TCP, unix:<path> or unix:@<name> for a Unix socket
+ *   --conns      the keep-alive connections, one thread each (default 16)
+ *   --seconds    the time of every target (default 5)
+ *   --path       the path of the GET requests (default /)
+ *
+ *   ./WebServer --unix /tmp/ws.sock 8080 www
+ *   SocketBench 127.0.0.1:8080 unix:/tmp/ws.sock
+ *
+ * The targets run one after another with the same load, a line is printed for every one.
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+struct Target
+{
+    string name;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+struct Result
+{
+    uint64_t requests;
+    uint64_t errors;
+    vector<uint32_t> latency_us;
+};
+
+static bool parseTarget(const string& spec, Target* target)
+{
+    target->name = spec;
+    memset(&target->addr, 0, sizeof(target->addr));
+    if(spec.compare(0, 5, "unix:") == 0)
+    {
+        string path = spec.substr(5);
+        sockaddr_un* addr = reinterpret_cast<sockaddr_un*>(&target->addr);
+        addr->sun_family = AF_UNIX;
+        if(path.empty() || path.size() >= sizeof(addr->sun_path))
+            return false;
+        memcpy(addr->sun_path, path.data(), path.size());
+        target->addr_len = sizeof(*addr);
+        // the abstract names are not terminated
+        if(path[0] == '@')
+        {
+            addr->sun_path[0] = '\0';
+            target->addr_len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+        }
+        return true;
+    }
+    size_t colon = spec.rfind(':');
+    if(colon == string::npos)
+        return false;
+    sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&target->addr);
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(static_cast<uint16_t>(atoi(spec.c_str() + colon + 1)));
+    if(inet_pton(AF_INET, spec.substr(0, colon).c_str(), &addr->sin_addr) != 1)
+        return false;
+    target->addr_len = sizeof(*addr);
+    return true;
+}
+
+static int connectTarget(const Target& target)
+{
+    int fd = socket(target.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return -1;
+    if(connect(fd, reinterpret_cast<const sockaddr*>(&target.addr), target.addr_len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if(target.addr.ss_family == AF_INET)
+    {
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    return fd;
+}
+
+/**
+ * @return the value of the header field in the head, nullptr if not found
+ */
+static const char* findField(const string& buf, size_t head_end, const char* name)
+{
+    size_t name_len = strlen(name);
+    for(size_t pos = buf.find("\r\n"); pos != string::npos && pos < head_end; pos = buf.find("\r\n", pos + 2))
+    {
+        if(strncasecmp(buf.c_str() + pos + 2, name, name_len) == 0)
+            return buf.c_str() + pos + 2 + name_len;
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Read one response with Content-Length, the bytes after it are kept in buf
+ * @param closing   set to true if the server closes the connection after the response
+ * @return false if the connection failed or the response has no length
+ */
+static bool readResponse(int fd, string* buf, bool* closing)
+{
+    size_t head_end;
+    char chunk[65536];
+    while((head_end = buf->find("\r\n\r\n")) == string::npos)
+    {
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if(len <= 0)
+            return false;
+        buf->append(chunk, static_cast<size_t>(len));
+    }
+    const char* length = findField(*buf, head_end, "Content-Length:");
+    if(!length)
+        return false;
+    size_t total = head_end + 4 + strtoull(length, nullptr, 10);
+    const char* connection = findField(*buf, head_end, "Connection: ");
+    *closing = connection && strncasecmp(connection, "close", 5) == 0;
+    while(buf->size() < total)
+    {
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if(len <= 0)
+            return false;
+        buf->append(chunk, static_cast<size_t>(len));
+    }
+    buf->erase(0, total);
+    return true;
+}
+
+static void runConnection(const Target& target, const string& request, const atomic<bool>& stop, Result* result)
+{
+    int fd = -1;
+    string buf;
+    while(!stop.load(memory_order_relaxed))
+    {
+        if(fd == -1 && (fd = connectTarget(target)) == -1)
+        {
+            ++result->errors;
+            this_thread::sleep_for(chrono::milliseconds(10));
+            continue;
+        }
+        auto start = chrono::steady_clock::now();
+        bool closing = false;
+        if(write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size())
+           || !readResponse(fd, &buf, &closing))
+        {
+            ++result->errors;
+            close(fd);
+            fd = -1;
+            buf.clear();
+            continue;
+        }
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        ++result->requests;
+        result->latency_us.push_back(static_cast<uint32_t>(us));
+        // The server ends the connection after --max-keepalive-requests
+        if(closing)
+        {
+            close(fd);
+            fd = -1;
+            buf.clear();
+        }
+    }
+    if(fd != -1)
+        close(fd);
+}
+
+static uint32_t percentile(vector<uint32_t>& values, double ratio)
+{
+    if(values.empty())
+        return 0;
+    size_t pos = min(values.size() - 1, static_cast<size_t>(ratio * values.size()));
+    nth_element(values.begin(), values.begin() + pos, values.end());
+    return values[pos];
+}
+
+int main(int argc, char* argv[])
+{
+    int conns = 16;
+    int seconds = 5;
+    string path = "/";
+    vector<Target> targets;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--conns") == 0 && i + 1 < argc)
+            conns = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--path") == 0 && i + 1 < argc)
+            path = argv[++i];
+        else
+        {
+            Target target;
+            if(!parseTarget(argv[i], &target))
+            {
+                fprintf(stderr, "invalid target: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            targets.push_back(target);
+        }
+    }
+    if(targets.empty() || conns <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [--conns <num>] [--seconds <num>] [--path <path>] <target>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    printf("%-32s %12s %10s %10s %10s %8s\n", "target", "requests/s", "p50 us", "p99 us", "max us", "errors");
+    for(const Target& target : targets)
+    {
+        atomic<bool> stop(false);
+        vector<Result> results(static_cast<size_t>(conns));
+        vector<thread> threads;
+        for(int i = 0; i < conns; i++)
+        {
+            results[i].requests = results[i].errors = 0;
+            threads.emplace_back(runConnection, cref(target), cref(request), cref(stop), &results[i]);
+        }
+        this_thread::sleep_for(chrono::seconds(seconds));
+        stop.store(true);
+        for(thread& worker : threads)
+            worker.join();
+
+        Result total;
+        total.requests = total.errors = 0;
+        for(Result& result : results)
+        {
+            total.requests += result.requests;
+            total.errors += result.errors;
+            total.latency_us.insert(total.latency_us.end(), result.latency_us.begin(), result.latency_us.end());
+        }
+        uint32_t max_us = total.latency_us.empty() ? 0 : *max_element(total.latency_us.begin(), total.latency_us.end());
+        printf("%-32s %12.0f %10u %10u %10u %8" PRIu64 "\n", target.name.c_str(),
+               static_cast<double>(total.requests) / seconds, percentile(total.latency_us, 0.5),
+               percentile(total.latency_us, 0.99), max_us, total.errors);
+    }
+    return EXIT_SUCCESS;
+}
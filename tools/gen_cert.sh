@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Make a self-signed certificate and a session ticket key for testing the HTTPS listener
+#
+#   tools/gen_cert.sh [<out_dir>] [<host>]
+#   ./WebServer --tls-port 8443 --tls-cert <out_dir>/cert.pem --tls-key <out_dir>/key.pem \
+#               --tls-ticket-key <out_dir>/ticket.key 8080 www
+#   curl --cacert <out_dir>/cert.pem https://localhost:8443/
+#
+
+set -e
+
+OUT_DIR=${1:-.}
+HOST=${2:-localhost}
+
+mkdir -p "$OUT_DIR"
+
+# ECDSA P-256, valid for localhost and 127.0.0.1
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -keyout "$OUT_DIR/key.pem" -out "$OUT_DIR/cert.pem" -days 365 \
+    -subj "/CN=$HOST" -addext "subjectAltName=DNS:$HOST,DNS:localhost,IP:127.0.0.1" 2>/dev/null
+
+# name 16 | HMAC key 32 | AES-256 key 32, keep it to resume the sessions after a restart
+openssl rand 80 > "$OUT_DIR/ticket.key"
+chmod 600 "$OUT_DIR/key.pem" "$OUT_DIR/ticket.key"
+
+echo "$OUT_DIR/cert.pem $OUT_DIR/key.pem $OUT_DIR/ticket.key"
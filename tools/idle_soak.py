@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Measure the memory of the idle keep-alive connections of a running server
+#
+#   ./WebServer --stats-path /stats 8080 www
+#   tools/idle_soak.py 127.0.0.1:8080 --conns 10000
+#
+# It opens the connections, sends one request on each and keeps them idle, then reports the growth of
+# the resident memory of the server per connection, by /proc/<pid>/status, and the accounting of the
+# stats page. The server must run on this host, the pid is read from the stats page.
+#
+#   --conns <num>       the idle connections (default 10000)
+#   --batch <num>       the connections opened at the same time (default 500)
+#   --hold <seconds>    the idle time before measuring, under the keep-alive timeout (default 3)
+#   --path <path>       the request of every connection (default /)
+#   --stats <path>      the stats path of the server (default /stats)
+#
+# Every connection takes a local fd, raise "ulimit -n" for a large run.
+#
+
+import argparse
+import resource
+import selectors
+import socket
+import sys
+import time
+
+
+def fetch_stats(host, port, path):
+    sock = socket.create_connection((host, port))
+    sock.sendall(("GET %s HTTP/1.1\r\nHost: soak\r\nConnection: close\r\n\r\n" % path).encode())
+    data = b""
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    sock.close()
+    head, _, body = data.partition(b"\r\n\r\n")
+    if not head.startswith(b"HTTP/1.1 200"):
+        sys.exit("stats %s: %s" % (path, head.split(b"\r\n")[0].decode(errors="replace")))
+    stats = {}
+    for line in body.decode().splitlines():
+        name, _, value = line.partition(" ")
+        if value.isdigit():
+            stats[name] = int(value)
+    return stats
+
+
+def read_rss_kb(pid):
+    with open("/proc/%d/status" % pid) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    return 0
+
+
+def open_batch(host, port, num, request):
+    """Connect num sockets and read the response of one request on each, the sockets are returned idle"""
+    sel = selectors.DefaultSelector()
+    socks = []
+    for _ in range(num):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setblocking(False)
+        sock.connect_ex((host, port))
+        sel.register(sock, selectors.EVENT_WRITE, b"")
+        socks.append(sock)
+    pending = num
+    deadline = time.time() + 30
+    while pending and time.time() < deadline:
+        for key, events in sel.select(1):
+            sock = key.fileobj
+            if events & selectors.EVENT_WRITE:
+                if sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+                    sys.exit("connect failed")
+                sock.send(request)
+                sel.modify(sock, selectors.EVENT_READ, b"")
+                continue
+            chunk = sock.recv(65536)
+            if not chunk:
+                sys.exit("a connection was closed by the server")
+            data = key.data + chunk
+            head, sep, body = data.partition(b"\r\n\r\n")
+            length = 0
+            for line in head.split(b"\r\n"):
+                if line.lower().startswith(b"content-length:"):
+                    length = int(line.split(b":")[1])
+            if sep and len(body) >= length:
+                sel.unregister(sock)
+                pending -= 1
+            else:
+                sel.modify(sock, selectors.EVENT_READ, data)
+    sel.close()
+    if pending:
+        sys.exit("%d responses timed out" % pending)
+    return socks
+
+
+def main():
+    parser = argparse.ArgumentParser(description="RSS per idle keep-alive connection")
+    parser.add_argument("server", help="<host>:<port>")
+    parser.add_argument("--conns", type=int, default=10000)
+    parser.add_argument("--batch", type=int, default=500)
+    parser.add_argument("--hold", type=float, default=3)
+    parser.add_argument("--path", default="/")
+    parser.add_argument("--stats", default="/stats")
+    args = parser.parse_args()
+    host, _, port = args.server.rpartition(":")
+    port = int(port)
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < args.conns + 64:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, args.conns + 64), hard))
+
+    before = fetch_stats(host, port, args.stats)
+    pid = before["pid"]
+    rss_before = read_rss_kb(pid)
+    request = ("GET %s HTTP/1.1\r\nHost: soak\r\n\r\n" % args.path).encode()
+
+    socks = []
+    start = time.time()
+    while len(socks) < args.conns:
+        socks += open_batch(host, port, min(args.batch, args.conns - len(socks)), request)
+    print("opened %d connections in %.1f s" % (len(socks), time.time() - start))
+    time.sleep(args.hold)
+
+    after = fetch_stats(host, port, args.stats)
+    rss_after = read_rss_kb(pid)
+    growth = (rss_after - rss_before) * 1024
+    print("server RSS       %d KB -> %d KB, %.0f bytes per idle connection"
+          % (rss_before, rss_after, growth / float(len(socks))))
+    for name in ("connections", "connections_idle", "connections_parked", "timer_fds",
+                 "memory_handler_size", "memory_buffers_bytes", "memory_buffer_pool_bytes",
+                 "memory_bytes_per_connection"):
+        print("%-24s %d" % (name, after.get(name, 0)))
+    for sock in socks:
+        sock.close()
+
+
+if __name__ == "__main__":
+    main()
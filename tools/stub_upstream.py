@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# A stub upstream for testing the proxy routes, an HTTP/1.1 keep-alive server on TCP or a Unix socket
+#
+#   tools/stub_upstream.py 9000                 # 127.0.0.1:9000
+#   tools/stub_upstream.py unix:/tmp/app.sock
+#   ./WebServer --proxy /api=127.0.0.1:9000,unix:/tmp/app.sock 8080 www
+#
+#   GET  /<any>             the request line, the headers and the stub name, Content-Length
+#   GET  /bytes/<n>         n bytes, Content-Length
+#   GET  /chunked/<n>       n bytes, chunked in 1000 bytes
+#   GET  /close/<n>         n bytes, no length, the connection is closed after the body
+#   GET  /slow/<ms>         answer after ms milliseconds
+#   GET  /status/<code>     an empty response of the status code
+#   POST /<any>             echo the request body
+#
+
+import os
+import socket
+import socketserver
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class StubHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "StubUpstream"
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def reply(self, body, code=200, content_type="text/plain"):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def do_HEAD(self):
+        self.do_GET()
+
+    def do_GET(self):
+        parts = self.path.split("?")[0].strip("/").split("/")
+        kind = parts[-2] if len(parts) >= 2 else ""
+        arg = parts[-1]
+        if kind == "bytes" and arg.isdigit():
+            self.reply(b"x" * int(arg), content_type="application/octet-stream")
+        elif kind == "chunked" and arg.isdigit():
+            self.send_response(200)
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            left = int(arg)
+            while left > 0 and self.command != "HEAD":
+                size = min(left, 1000)
+                self.wfile.write(b"%x\r\n%s\r\n" % (size, b"c" * size))
+                left -= size
+            if self.command != "HEAD":
+                self.wfile.write(b"0\r\n\r\n")
+        elif kind == "close" and arg.isdigit():
+            self.send_response(200)
+            self.send_header("Connection", "close")
+            self.end_headers()
+            if self.command != "HEAD":
+                self.wfile.write(b"e" * int(arg))
+            self.close_connection = True
+        elif kind == "slow" and arg.isdigit():
+            time.sleep(int(arg) / 1000)
+            self.reply(b"slow\n")
+        elif kind == "status" and arg.isdigit():
+            self.send_response(int(arg))
+            if int(arg) not in (204, 304):
+                self.send_header("Content-Length", "0")
+            self.end_headers()
+        else:
+            lines = ["%s %s %s" % (self.command, self.path, self.request_version)]
+            lines += ["%s: %s" % (k, v) for k, v in self.headers.items()]
+            lines.append("stub: %s pid %d" % (self.server.name, os.getpid()))
+            self.reply(("\n".join(lines) + "\n").encode())
+
+    def do_POST(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            body = b""
+            while True:
+                size = int(self.rfile.readline().split(b";")[0], 16)
+                if size == 0:
+                    while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+                        pass
+                    break
+                body += self.rfile.read(size)
+                self.rfile.readline()
+        else:
+            body = self.rfile.read(int(self.headers.get("Content-Length", "0")))
+        self.reply(body, content_type="application/octet-stream")
+
+
+class UnixHTTPServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+    def get_request(self):
+        conn, _ = self.socket.accept()
+        # BaseHTTPRequestHandler wants a client address
+        return conn, ("unix", 0)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s <port> | unix:<path>" % sys.argv[0])
+    spec = sys.argv[1]
+    if spec.startswith("unix:"):
+        path = spec[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        server = UnixHTTPServer(path, StubHandler)
+    else:
+        ThreadingHTTPServer.allow_reuse_address = True
+        ThreadingHTTPServer.daemon_threads = True
+        server = ThreadingHTTPServer(("127.0.0.1", int(spec)), StubHandler)
+    server.name = spec
+    print("stub upstream on %s" % spec, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()